@@ -0,0 +1,97 @@
+///
+/// @file
+/// A small collection of latency samples with percentile summaries.
+///
+
+#ifndef ASIOTUTORIAL_LATENCY_STATS_H
+#define ASIOTUTORIAL_LATENCY_STATS_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+using namespace std;
+
+/// Collects latency samples, in whatever unit the caller likes, and reports order statistics.
+///
+/// Samples are kept in full and sorted on demand, which is fine for the few thousand samples a
+/// command line probe or benchmark produces.
+class LatencySamples {
+private:
+    mutable vector< double >    m_samples;
+    mutable bool                m_sorted;
+
+    void _sort( void ) const {
+        if( !m_sorted ){
+            std::sort( m_samples.begin(), m_samples.end() );
+            m_sorted = true;
+        }
+    }
+
+public:
+    LatencySamples( void ) : m_sorted( true ){}
+
+    void add( const double sample ){
+        m_samples.push_back( sample );
+        m_sorted = false;
+    }
+
+    /// Merge another set of samples into this one.
+    void add( const LatencySamples& other ){
+        m_samples.insert( m_samples.end(), other.m_samples.begin(), other.m_samples.end() );
+        m_sorted = false;
+    }
+
+    void clear( void ){
+        m_samples.clear();
+        m_sorted = true;
+    }
+
+    size_t size( void ) const {
+        return m_samples.size();
+    }
+
+    bool empty( void ) const {
+        return m_samples.empty();
+    }
+
+    /// The nearest-rank percentile of the samples.
+    ///
+    /// @param percent  Percentile to compute, between 0 and 100.
+    ///
+    /// @return The percentile, or 0 if there are no samples.
+    double percentile( const double percent ) const {
+        if( m_samples.empty() ){
+            return 0;
+        }
+        _sort();
+        const double rank = ceil( (percent / 100.0) * m_samples.size() );
+        const size_t index = rank < 1 ? 0 : std::min( (size_t)rank - 1, m_samples.size() - 1 );
+        return m_samples[ index ];
+    }
+
+    double min( void ) const {
+        return percentile( 0 );
+    }
+
+    double median( void ) const {
+        return percentile( 50 );
+    }
+
+    double max( void ) const {
+        return percentile( 100 );
+    }
+
+    double mean( void ) const {
+        if( m_samples.empty() ){
+            return 0;
+        }
+        double total = 0;
+        for( size_t i = 0; i < m_samples.size(); ++i ){
+            total += m_samples[ i ];
+        }
+        return total / m_samples.size();
+    }
+}; // end class LatencySamples
+
+#endif // ASIOTUTORIAL_LATENCY_STATS_H
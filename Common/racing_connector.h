@@ -0,0 +1,270 @@
+///
+/// @file
+/// A "happy eyeballs" style connector (RFC 8305). Rather than trying resolved endpoints strictly one
+/// after another, connection attempts are started in a staggered race across the address families
+/// and the first one to connect wins.
+///
+
+#ifndef ASIOTUTORIAL_RACING_CONNECTOR_H
+#define ASIOTUTORIAL_RACING_CONNECTOR_H
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/smart_ptr.hpp>
+#include <ostream>
+#include <vector>
+
+using namespace std;
+using boost::asio::ip::tcp;
+
+/// Races connection attempts across a list of endpoints.
+///
+/// The endpoints are reordered so that the address families alternate, starting with the family of
+/// the first endpoint the resolver returned. One attempt is started every attempt delay, or right
+/// away when the previous attempt fails, until one connects. Every other attempt is then cancelled.
+/// A dead first address therefore costs one attempt delay rather than a full connect timeout.
+class RacingConnector : public boost::enable_shared_from_this< RacingConnector > {
+public:
+    typedef boost::shared_ptr< RacingConnector >    Pointer;
+    typedef boost::shared_ptr< tcp::socket >        SocketPointer;
+    typedef boost::system::error_code               Error;
+    typedef boost::asio::steady_timer::clock_type   Clock;
+    typedef Clock::duration                         Duration;
+
+    /// What happened to a single connection attempt.
+    enum Outcome {
+        PENDING = 0,
+        CONNECTED,
+        FAILED,
+        CANCELLED
+    };
+
+    /// Timing and result of a single connection attempt.
+    struct AttemptStats {
+        tcp::endpoint   endpoint;
+        Outcome         outcome;
+        Error           error;      ///< Why the attempt failed, if it did.
+        Duration        elapsed;    ///< Time from starting the attempt to its outcome.
+
+        AttemptStats( const tcp::endpoint& endpoint_ )
+            : endpoint( endpoint_ ), outcome( PENDING ), elapsed( Duration::zero() ){}
+    }; // end struct AttemptStats
+
+    typedef vector< AttemptStats > StatsList;
+
+    /// Function prototype for the connect handler. The socket is null unless the error is clear.
+    typedef boost::function< void( const Error&, SocketPointer, const StatsList& ) > ConnectCallback;
+
+private:
+    boost::asio::io_service&        m_ioService;
+    vector< tcp::endpoint >         m_endpoints;    ///< Endpoints in the order they are attempted.
+    const Duration                  m_attemptDelay;
+    boost::asio::steady_timer       m_delayTimer;
+    ConnectCallback                 m_callback;
+
+    size_t                          m_next;         ///< Next endpoint to attempt.
+    size_t                          m_inFlight;     ///< Attempts started but not finished.
+    bool                            m_done;
+    Error                           m_lastError;
+    vector< SocketPointer >         m_sockets;      ///< One per attempt, matching `m_stats`.
+    vector< Clock::time_point >     m_started;
+    StatsList                       m_stats;
+
+    /// Interleave the address families, keeping each family's own order.
+    template< typename Iterator >
+    static vector< tcp::endpoint > _interleave( Iterator begin, Iterator end ){
+        vector< tcp::endpoint > first;
+        vector< tcp::endpoint > second;
+        for( Iterator it = begin; it != end; ++it ){
+            if( first.empty() || tcp::endpoint( *it ).protocol() == first.front().protocol() ){
+                first.push_back( *it );
+            }
+            else {
+                second.push_back( *it );
+            }
+        }
+
+        vector< tcp::endpoint > ordered;
+        for( size_t i = 0; i < first.size() || i < second.size(); ++i ){
+            if( i < first.size() ){
+                ordered.push_back( first[ i ] );
+            }
+            if( i < second.size() ){
+                ordered.push_back( second[ i ] );
+            }
+        }
+        return ordered;
+    }
+
+    void _startNext( void ){
+        if( m_done || m_next >= m_endpoints.size() ){
+            return;
+        }
+
+        const size_t index = m_stats.size();
+        const tcp::endpoint& endpoint = m_endpoints[ m_next++ ];
+        m_stats.push_back( AttemptStats( endpoint ) );
+        m_started.push_back( Clock::now() );
+        m_sockets.push_back( SocketPointer( new tcp::socket( m_ioService ) ) );
+        ++m_inFlight;
+
+        m_sockets[ index ]->async_connect(
+            endpoint,
+            boost::bind(
+                &RacingConnector::_connectHandler,
+                shared_from_this(),
+                boost::asio::placeholders::error,
+                index
+            )
+        );
+
+        // Give this attempt a head start before racing the next one against it.
+        if( m_next < m_endpoints.size() ){
+            m_delayTimer.expires_after( m_attemptDelay );
+            m_delayTimer.async_wait(
+                boost::bind(
+                    &RacingConnector::_delayHandler,
+                    shared_from_this(),
+                    boost::asio::placeholders::error
+                )
+            );
+        }
+    }
+
+    void _delayHandler( const Error& error ){
+        if( !error ){
+            _startNext();
+        }
+    }
+
+    void _connectHandler( const Error& error, const size_t index ){
+        if( m_done ){
+            return;
+        }
+
+        --m_inFlight;
+        AttemptStats& stats = m_stats[ index ];
+        stats.elapsed = Clock::now() - m_started[ index ];
+        if( !error ){
+            stats.outcome = CONNECTED;
+            _finish( Error(), m_sockets[ index ] );
+            return;
+        }
+
+        stats.outcome   = FAILED;
+        stats.error     = error;
+        m_lastError     = error;
+        m_sockets[ index ].reset();
+
+        // No point waiting out the delay when the attempt has already failed.
+        if( m_next < m_endpoints.size() ){
+            m_delayTimer.cancel();
+            _startNext();
+        }
+        else if( m_inFlight == 0 ){
+            _finish( m_lastError, SocketPointer() );
+        }
+    }
+
+    void _finish( const Error& error, SocketPointer winner ){
+        m_done = true;
+        m_delayTimer.cancel();
+
+        // Cancel every attempt still in flight.
+        for( size_t i = 0; i < m_sockets.size(); ++i ){
+            if( m_sockets[ i ] && m_sockets[ i ] != winner && m_stats[ i ].outcome == PENDING ){
+                Error ignored;
+                m_stats[ i ].outcome = CANCELLED;
+                m_stats[ i ].elapsed = Clock::now() - m_started[ i ];
+                m_sockets[ i ]->close( ignored );
+            }
+        }
+        m_sockets.clear();
+
+        ConnectCallback callback;
+        callback.swap( m_callback );
+        if( callback ){
+            callback( error, winner, m_stats );
+        }
+    }
+
+public:
+    /// Constructor.
+    ///
+    /// @param io_service
+    /// @param begin        First resolved endpoint, in the resolver's order of preference.
+    /// @param end
+    /// @param attemptDelay How long each attempt gets before the next is started alongside it.
+    template< typename Iterator >
+    RacingConnector(
+        boost::asio::io_service&    io_service,
+        Iterator                    begin,
+        Iterator                    end,
+        const Duration&             attemptDelay = boost::asio::chrono::milliseconds( 250 )
+    )
+        : m_ioService( io_service ),
+          m_endpoints( _interleave( begin, end ) ),
+          m_attemptDelay( attemptDelay ),
+          m_delayTimer( io_service ),
+          m_next( 0 ),
+          m_inFlight( 0 ),
+          m_done( false ){}
+
+    /// Start racing.
+    ///
+    /// @param callback Called once with the winning socket, or with the last error if every
+    ///                 attempt failed.
+    void start( ConnectCallback callback ){
+        m_callback = callback;
+        if( m_endpoints.empty() ){
+            m_ioService.post(
+                boost::bind(
+                    &RacingConnector::_finish,
+                    shared_from_this(),
+                    Error( boost::asio::error::host_not_found ),
+                    SocketPointer()
+                )
+            );
+            return;
+        }
+        _startNext();
+    }
+
+    /// Give up on every attempt. The callback receives `operation_aborted`, and like every other
+    /// completion it is posted rather than called from inside `cancel`.
+    void cancel( void ){
+        if( m_done ){
+            return;
+        }
+        m_done = true;
+        m_delayTimer.cancel();
+        m_ioService.post(
+            boost::bind(
+                &RacingConnector::_finish,
+                shared_from_this(),
+                Error( boost::asio::error::operation_aborted ),
+                SocketPointer()
+            )
+        );
+    }
+}; // end class RacingConnector
+
+/// Print one line per connection attempt: endpoint, outcome, and how long it took.
+inline ostream& operator<<( ostream& out, const RacingConnector::StatsList& stats ){
+    static const char* outcomes[] = { "pending", "connected", "failed", "cancelled" };
+    for( size_t i = 0; i < stats.size(); ++i ){
+        const double ms = boost::asio::chrono::duration_cast< boost::asio::chrono::microseconds >(
+            stats[ i ].elapsed
+        ).count() / 1000.0;
+        out << "  " << stats[ i ].endpoint << " " << outcomes[ stats[ i ].outcome ] << " after " << ms << " ms";
+        if( stats[ i ].outcome == RacingConnector::FAILED ){
+            out << " (" << stats[ i ].error.message() << ")";
+        }
+        out << "\n";
+    }
+    return out;
+}
+
+#endif // ASIOTUTORIAL_RACING_CONNECTOR_H
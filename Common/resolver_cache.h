@@ -0,0 +1,198 @@
+///
+/// @file
+/// A shared, caching front end for `boost::asio::ip::tcp::resolver`. Results are kept for a fixed
+/// time to live, failures are remembered for a shorter negative time to live, and concurrent lookups
+/// for the same host and service are coalesced into a single query.
+///
+
+#ifndef ASIOTUTORIAL_RESOLVER_CACHE_H
+#define ASIOTUTORIAL_RESOLVER_CACHE_H
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/smart_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+using boost::asio::ip::tcp;
+
+/// Caches resolved endpoint lists keyed by host and service.
+///
+/// `getaddrinfo` does not tell us the record's real TTL, so every entry lives for the configured
+/// duration instead. All methods are safe to call from any thread; callbacks are always posted to
+/// the `io_service` and never called from inside `resolve`.
+class ResolverCache {
+public:
+    /// Resolver error type.
+    typedef boost::system::error_code Error;
+
+    /// A resolved list of endpoints. The list is immutable and shared by every user of the entry.
+    typedef vector< tcp::endpoint >                 EndpointList;
+    typedef boost::shared_ptr< const EndpointList > Endpoints;
+
+    /// Function prototype for resolve handlers.
+    typedef boost::function< void( const Error&, Endpoints ) > ResolveCallback;
+
+    /// Clock used for expiring entries.
+    typedef boost::asio::steady_timer::clock_type   Clock;
+    typedef Clock::duration                         Duration;
+
+    /// Lookup counters, mainly useful for checking the cache behaves as expected.
+    struct Stats {
+        size_t hits;            ///< Lookups answered from a live positive entry.
+        size_t negativeHits;    ///< Lookups answered from a live negative entry.
+        size_t misses;          ///< Lookups which started a new query.
+        size_t coalesced;       ///< Lookups which joined a query already in flight.
+
+        Stats( void ) : hits( 0 ), negativeHits( 0 ), misses( 0 ), coalesced( 0 ){}
+    }; // end struct Stats
+
+    struct placeholders {
+        static boost::arg< 1 > error;
+        static boost::arg< 2 > endpoints;
+    }; // end struct placeholders
+
+private:
+    typedef pair< string, string >      Key;
+    typedef vector< ResolveCallback >   CallbackList;
+
+    struct Entry {
+        Endpoints           endpoints;  ///< Last successful result, if any.
+        Error               error;      ///< Last failure, if the entry is negative.
+        Clock::time_point   expires;    ///< When the entry must be resolved again.
+        bool                resolving;  ///< True while a query is in flight.
+        CallbackList        waiting;    ///< Callbacks waiting on the in-flight query.
+
+        Entry( void ) : resolving( false ){}
+    }; // end struct Entry
+
+    typedef map< Key, Entry > EntryMap;
+
+    boost::asio::io_service&    m_ioService;
+    tcp::resolver               m_resolver;
+    const Duration              m_ttl;
+    const Duration              m_negativeTtl;
+    EntryMap                    m_entries;
+    Stats                       m_stats;
+    boost::mutex                m_mutex;
+
+    /// Internal resolve complete handler. Stores the result and releases every waiting callback.
+    ///
+    /// @param error
+    /// @param iterator
+    /// @param key
+    void _resolveHandler( const Error& error, tcp::resolver::iterator iterator, const Key& key ){
+        CallbackList waiting;
+        Endpoints endpoints;
+        {
+            boost::mutex::scoped_lock lock( m_mutex );
+            Entry& entry = m_entries[ key ];
+            entry.resolving = false;
+            entry.error     = error;
+            if( error ){
+                entry.endpoints.reset();
+                entry.expires = Clock::now() + m_negativeTtl;
+            }
+            else {
+                entry.endpoints.reset(
+                    new EndpointList( iterator, tcp::resolver::iterator() )
+                );
+                entry.expires = Clock::now() + m_ttl;
+            }
+            endpoints = entry.endpoints;
+            waiting.swap( entry.waiting );
+        }
+
+        for( CallbackList::iterator it = waiting.begin(); it != waiting.end(); ++it ){
+            (*it)( error, endpoints );
+        }
+    }
+
+public:
+    /// Constructor.
+    ///
+    /// @param io_service   The service used for queries and for delivering callbacks.
+    /// @param ttl          How long a successful lookup is reused for.
+    /// @param negativeTtl  How long a failed lookup is remembered for.
+    ResolverCache(
+        boost::asio::io_service&    io_service,
+        const Duration&             ttl         = boost::asio::chrono::seconds( 60 ),
+        const Duration&             negativeTtl = boost::asio::chrono::seconds( 5 )
+    )
+        : m_ioService( io_service ),
+          m_resolver( io_service ),
+          m_ttl( ttl ),
+          m_negativeTtl( negativeTtl ){}
+
+    /// Resolve the host and service, reusing a cached result when one is still live.
+    ///
+    /// @param host
+    /// @param service
+    /// @param callback
+    void resolve( const string& host, const string& service, ResolveCallback callback ){
+        const Key key( host, service );
+        boost::mutex::scoped_lock lock( m_mutex );
+        Entry& entry = m_entries[ key ];
+
+        // Someone is already asking for this name, so just wait on their answer.
+        if( entry.resolving ){
+            ++m_stats.coalesced;
+            entry.waiting.push_back( callback );
+            return;
+        }
+
+        // A live entry, positive or negative, can be answered right away.
+        if( (entry.endpoints || entry.error) && Clock::now() < entry.expires ){
+            if( entry.error ){
+                ++m_stats.negativeHits;
+            }
+            else {
+                ++m_stats.hits;
+            }
+            m_ioService.post( boost::bind( callback, entry.error, entry.endpoints ) );
+            return;
+        }
+
+        // Otherwise start a new query and make everyone else wait on it.
+        ++m_stats.misses;
+        entry.resolving = true;
+        entry.waiting.push_back( callback );
+        tcp::resolver::query query( host, service );
+        m_resolver.async_resolve(
+            query,
+            boost::bind(
+                &ResolverCache::_resolveHandler,
+                this,
+                boost::asio::placeholders::error,
+                boost::asio::placeholders::iterator,
+                key
+            )
+        );
+    }
+
+    /// Forget every entry which does not have a query in flight.
+    void clear( void ){
+        boost::mutex::scoped_lock lock( m_mutex );
+        for( EntryMap::iterator it = m_entries.begin(); it != m_entries.end(); ){
+            if( it->second.resolving ){
+                ++it;
+            }
+            else {
+                m_entries.erase( it++ );
+            }
+        }
+    }
+
+    Stats getStats( void ){
+        boost::mutex::scoped_lock lock( m_mutex );
+        return m_stats;
+    }
+}; // end class ResolverCache
+
+#endif // ASIOTUTORIAL_RESOLVER_CACHE_H
@@ -0,0 +1,290 @@
+///
+/// @file
+/// Scoped trace points which record when handlers begin and end, and a dump of them in the Chrome
+/// `trace_event` format, for loading into `chrome://tracing` or Perfetto.
+///
+/// Trace points are compiled in when `ASIOTUTORIAL_TRACE` is defined, which the build does unless
+/// configured with `-DASIOTUTORIAL_TRACE=OFF`, and otherwise `TRACE_SCOPE` expands to nothing.
+/// Compiled in, they record nothing until `Trace::enable` is called, and until then cost a single
+/// branch on a flag.
+///
+
+#ifndef ASIOTUTORIAL_TRACE_H
+#define ASIOTUTORIAL_TRACE_H
+
+#include <boost/asio.hpp>
+#include <boost/asio/signal_set.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/smart_ptr.hpp>
+#include <boost/thread.hpp>
+#include <csignal>
+#include <cstddef>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+using namespace std;
+
+/// One trace point beginning or ending.
+struct TraceEvent {
+    const char*     name;       ///< Must be a string literal, or otherwise live forever.
+    boost::uint64_t time;       ///< Microseconds since tracing was first enabled.
+    size_t          connection;
+    char            phase;      ///< 'B' for begin, 'E' for end.
+}; // end struct TraceEvent
+
+// ************************************************************************** //
+
+/// Keeps the most recent trace events of every thread.
+///
+/// Like `ThreadCounters`, each thread records into a buffer of its own, found through a thread
+/// local pointer, so recording an event takes no lock and touches no memory another thread writes.
+/// A buffer is a ring of the thread's latest `EVENTS_PER_THREAD` events. Dumping copies each ring
+/// and then checks how far its thread got in the meantime, throwing away anything which may have
+/// been overwritten while it was being copied.
+class Trace : private boost::noncopyable {
+public:
+    static const size_t EVENTS_PER_THREAD = 1 << 16;
+
+private:
+    typedef boost::asio::chrono::steady_clock Clock;
+
+    struct Buffer {
+        const size_t                        thread;
+        boost::scoped_array< TraceEvent >   events;
+        boost::atomic< size_t >             recorded;   ///< Events ever recorded by its thread.
+
+        Buffer( const size_t thread_ )
+            : thread( thread_ ), events( new TraceEvent[ EVENTS_PER_THREAD ] ), recorded( 0 ){}
+    }; // end struct Buffer
+
+    boost::atomic< bool >                   m_enabled;
+    Clock::time_point                       m_start;
+    boost::thread_specific_ptr< Buffer >    m_local;    ///< Each thread's own buffer.
+    vector< boost::shared_ptr< Buffer > >   m_buffers;  ///< Every buffer, which owns them.
+    mutable boost::mutex                    m_mutex;
+
+    Trace( void ) : m_enabled( false ), m_local( &Trace::_keep ){}
+
+    /// The buffers belong to `m_buffers`, so a thread exiting leaves its buffer alone.
+    static void _keep( Buffer* ){}
+
+    Buffer& _local( void ){
+        Buffer* buffer = m_local.get();
+        if( !buffer ){
+            boost::mutex::scoped_lock lock( m_mutex );
+            buffer = new Buffer( m_buffers.size() + 1 );
+            m_buffers.push_back( boost::shared_ptr< Buffer >( buffer ) );
+            m_local.reset( buffer );
+        }
+        return *buffer;
+    }
+
+    static void _writeEvent( ostream& out, const TraceEvent& event, const size_t thread ){
+        out << "{\"name\":\"" << event.name << "\",\"ph\":\"" << event.phase
+            << "\",\"ts\":" << event.time << ",\"pid\":" << getpid() << ",\"tid\":" << thread
+            << ",\"args\":{\"connection\":" << event.connection << "}}";
+    }
+
+public:
+    static Trace& instance( void ){
+        static Trace trace;
+        return trace;
+    }
+
+    /// @return False if the trace points were compiled out, in which case there will never be
+    ///         anything to dump.
+    static bool compiledIn( void ){
+#ifdef ASIOTUTORIAL_TRACE
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    /// Start recording. Times count from the first call.
+    void enable( void ){
+        if( !m_enabled.load() ){
+            m_start = Clock::now();
+            m_enabled.store( true );
+        }
+    }
+
+    bool enabled( void ) const {
+        return m_enabled.load( boost::memory_order_acquire );
+    }
+
+    /// Record an event on the calling thread.
+    ///
+    /// @param name
+    /// @param connection
+    /// @param phase
+    void record( const char* name, const size_t connection, const char phase ){
+        Buffer& buffer = _local();
+        const size_t recorded = buffer.recorded.load( boost::memory_order_relaxed );
+        TraceEvent& event = buffer.events[ recorded % EVENTS_PER_THREAD ];
+        event.name          = name;
+        event.time          = boost::asio::chrono::duration_cast<
+            boost::asio::chrono::microseconds
+        >( Clock::now() - m_start ).count();
+        event.connection    = connection;
+        event.phase         = phase;
+        buffer.recorded.store( recorded + 1, boost::memory_order_release );
+    }
+
+    /// Write every thread's events as a Chrome trace. Safe to call while events are being recorded.
+    ///
+    /// @param out
+    void writeJson( ostream& out ) const {
+        vector< boost::shared_ptr< Buffer > > buffers;
+        {
+            boost::mutex::scoped_lock lock( m_mutex );
+            buffers = m_buffers;
+        }
+
+        out << "{\"traceEvents\":[";
+        bool first = true;
+        vector< TraceEvent > events;
+        for( size_t i = 0; i < buffers.size(); ++i ){
+            const Buffer& buffer = *buffers[ i ];
+            const size_t end = buffer.recorded.load( boost::memory_order_acquire );
+            const size_t begin = end > EVENTS_PER_THREAD ? end - EVENTS_PER_THREAD : 0;
+            events.clear();
+            for( size_t n = begin; n < end; ++n ){
+                events.push_back( buffer.events[ n % EVENTS_PER_THREAD ] );
+            }
+
+            // Whatever the thread recorded while we copied, and the event it may be halfway through
+            // recording, went over the oldest of the events we copied.
+            const size_t after = buffer.recorded.load( boost::memory_order_acquire );
+            const size_t reused = begin + EVENTS_PER_THREAD;
+            const size_t skip = after + 1 > reused ? after + 1 - reused : 0;
+            size_t depth = 0;
+            for( size_t n = skip; n < events.size(); ++n ){
+                // An end whose begin has already been overwritten would confuse the viewer.
+                const TraceEvent& event = events[ n ];
+                if( event.phase == 'B' ){
+                    ++depth;
+                }
+                else if( depth ){
+                    --depth;
+                }
+                else {
+                    continue;
+                }
+
+                out << (first ? "\n" : ",\n");
+                _writeEvent( out, event, buffer.thread );
+                first = false;
+            }
+        }
+        out << "\n]}\n";
+    }
+}; // end class Trace
+
+// ************************************************************************** //
+
+/// Records a begin event when constructed and the matching end event when destroyed, if tracing is
+/// enabled. Use it through `TRACE_SCOPE`.
+class ScopedTrace : private boost::noncopyable {
+private:
+    const char*     m_name;     ///< Null if tracing was disabled when the scope began.
+    const size_t    m_connection;
+
+public:
+    ScopedTrace( const char* name, const size_t connection )
+        : m_name( NULL ), m_connection( connection )
+    {
+        Trace& trace = Trace::instance();
+        if( trace.enabled() ){
+            m_name = name;
+            trace.record( name, connection, 'B' );
+        }
+    }
+
+    ~ScopedTrace( void ){
+        if( m_name ){
+            Trace::instance().record( m_name, m_connection, 'E' );
+        }
+    }
+}; // end class ScopedTrace
+
+// ************************************************************************** //
+
+/// Writes the trace to a file every time the process gets a signal.
+class TraceDumper : private boost::noncopyable {
+private:
+    boost::asio::signal_set m_signals;
+    const string            m_path;
+
+    void _wait( void ){
+        m_signals.async_wait(
+            boost::bind(
+                &TraceDumper::_signalHandler,
+                this,
+                boost::asio::placeholders::error,
+                boost::asio::placeholders::signal_number
+            )
+        );
+    }
+
+    void _signalHandler( const boost::system::error_code& error, const int ){
+        if( error ){
+            return;
+        }
+
+        ofstream file( m_path.c_str(), ios::trunc );
+        Trace::instance().writeJson( file );
+        if( file ){
+            cerr << "Trace written to " << m_path << endl;
+        }
+        else {
+            cerr << "Failed to write trace to " << m_path << endl;
+        }
+        _wait();
+    }
+
+public:
+    /// Enable tracing and start waiting for the signal.
+    ///
+    /// @param io_service
+    /// @param path         Where to write the trace, replacing the last one.
+    /// @param signal
+    TraceDumper(
+        boost::asio::io_service& io_service,
+        const string& path,
+        const int signal = SIGUSR1
+    )
+        : m_signals( io_service, signal ),
+          m_path( path )
+    {
+        if( !Trace::compiledIn() ){
+            cerr << "Trace points were compiled out, so the trace will be empty" << endl;
+        }
+        Trace::instance().enable();
+        _wait();
+    }
+}; // end class TraceDumper
+
+// ************************************************************************** //
+
+#ifdef ASIOTUTORIAL_TRACE
+#define TRACE_SCOPE_JOIN2( a, b ) a##b
+#define TRACE_SCOPE_JOIN( a, b ) TRACE_SCOPE_JOIN2( a, b )
+
+/// Trace the rest of the enclosing scope.
+///
+/// @param name         A string literal.
+/// @param connection   Which connection the work is for.
+#define TRACE_SCOPE( name, connection ) \
+    ScopedTrace TRACE_SCOPE_JOIN( _traceScope, __LINE__ )( name, connection )
+#else
+#define TRACE_SCOPE( name, connection )
+#endif
+
+#endif // ASIOTUTORIAL_TRACE_H
@@ -3,6 +3,9 @@
 /// This is a simple, sychronous wget implementation. It accepts a URL as its one parameter,
 /// connects to it, downloads the page via synchronous HTTP, and prints it to stdout.
 ///
+/// With `--timing` it instead fetches the page a number of times and prints how long each phase of
+/// the request took as JSON, which makes it handy as a latency probe.
+///
 /// @note   The meat of this tutorial is in the requestPage method.
 ///
 /// @note   I use small try-catch blocks throughout the code in order to better illustrate where
@@ -15,10 +18,14 @@
 #include <boost/array.hpp>
 #include <boost/asio.hpp>
 #include <boost/system/system_error.hpp>
+#include <cstdlib>
 #include <exception>
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <vector>
+
+#include "latency_stats.h"
 
 using namespace std;
 
@@ -34,7 +41,32 @@ enum ErrorCodes {
 void parseURL( const string& url, string& service, string& hostname, string& path );
 string generateRequest( const string& hostname, const string& path );
 
-void requestPage( const string& url, ostream& out ){
+/// How long each phase of a request took, in milliseconds. Every phase is timed with a monotonic
+/// clock so wall clock adjustments can't skew the results.
+struct PhaseTimings {
+    double  dns;        ///< Resolving the host name.
+    double  connect;    ///< Connecting the socket.
+    double  write;      ///< Sending the request.
+    double  firstByte;  ///< From the request being sent to the first byte of the response.
+    double  transfer;   ///< From the first byte to the end of the response.
+    double  total;
+    size_t  bytes;      ///< Size of the response, headers included.
+
+    PhaseTimings( void )
+        : dns( 0 ), connect( 0 ), write( 0 ), firstByte( 0 ), transfer( 0 ), total( 0 ), bytes( 0 ){}
+}; // end struct PhaseTimings
+
+typedef boost::asio::chrono::steady_clock steady_clock;
+
+/// Milliseconds between two points in time.
+double elapsed( const steady_clock::time_point& from, const steady_clock::time_point& to ){
+    return boost::asio::chrono::duration_cast< boost::asio::chrono::microseconds >( to - from ).count() / 1000.0;
+}
+
+void requestPage( const string& url, ostream& out, PhaseTimings* timings = NULL ){
+    const steady_clock::time_point start = steady_clock::now();
+    steady_clock::time_point resolved, connected, sent, firstByte;
+
     // Split the URL into parts.
     string service, hostname, path;
     parseURL( url, service, hostname, path );
@@ -61,6 +93,7 @@ void requestPage( const string& url, ostream& out ){
         cerr << "Resolver error: " << error.what() << endl;
         exit( RESOLVER_FAILURE );
     }
+    resolved = steady_clock::now();
 
     // Now we can create a socket and connect it using the endpoints provided by the resolver. If
     // the connection works then the socket is automatically opened and ready to send or receive
@@ -75,6 +108,7 @@ void requestPage( const string& url, ostream& out ){
         cerr << "Connection error: " << error.what() << endl;
         exit( CONNECTION_FAILURE );
     }
+    connected = steady_clock::now();
 
     // We are connected to the server, so we can send our HTTP request now. All reading and writing
     // in Boost::ASIO is done through the boost::asio::mutable_buffer and boost::asio::const_buffer
@@ -90,13 +124,19 @@ void requestPage( const string& url, ostream& out ){
         cerr << "Write error: " << error.what() << endl;
         exit( WRITE_FAILURE );
     }
+    sent = steady_clock::now();
 
     // Now that we've sent our request, lets read our response. Note that Boost::ASIO reports EOF
     // by either throwing or passing back a boost::asio::error::eof error code.
     boost::system::error_code error;
+    size_t totalBytes = 0;
     do {
         boost::array< char, 1024 > buffer;
         size_t bytesRead = socket.read_some( boost::asio::buffer( buffer ), error );
+        if( totalBytes == 0 && bytesRead ){
+            firstByte = steady_clock::now();
+        }
+        totalBytes += bytesRead;
         out.write( buffer.data(), bytesRead );
     } while( !error );
 
@@ -105,6 +145,75 @@ void requestPage( const string& url, ostream& out ){
         cerr << "Read error: " << error << endl;
         exit( READ_FAILURE );
     }
+
+    if( timings ){
+        const steady_clock::time_point done = steady_clock::now();
+        if( !totalBytes ){
+            firstByte = done;
+        }
+        timings->dns        = elapsed( start, resolved );
+        timings->connect    = elapsed( resolved, connected );
+        timings->write      = elapsed( connected, sent );
+        timings->firstByte  = elapsed( sent, firstByte );
+        timings->transfer   = elapsed( firstByte, done );
+        timings->total      = elapsed( start, done );
+        timings->bytes      = totalBytes;
+    }
+}
+
+/// Fetch the page repeatedly and print the phase timings as JSON. The page itself is thrown away.
+///
+/// @param url
+/// @param iterations
+/// @param out
+void timeRequests( const string& url, const size_t iterations, ostream& out ){
+    static const char* names[] = { "dns", "connect", "write", "ttfb", "transfer", "total" };
+    static const size_t PHASE_COUNT = sizeof( names ) / sizeof( names[0] );
+
+    vector< PhaseTimings > runs;
+    LatencySamples samples[ PHASE_COUNT ];
+    for( size_t i = 0; i < iterations; ++i ){
+        ostream discard( NULL );
+        PhaseTimings timings;
+        requestPage( url, discard, &timings );
+        runs.push_back( timings );
+
+        const double phases[] = {
+            timings.dns, timings.connect, timings.write, timings.firstByte, timings.transfer, timings.total
+        };
+        for( size_t p = 0; p < PHASE_COUNT; ++p ){
+            samples[ p ].add( phases[ p ] );
+        }
+    }
+
+    out << "{\n"
+        << "  \"url\": \"" << url << "\",\n"
+        << "  \"iterations\": " << iterations << ",\n"
+        << "  \"unit\": \"ms\",\n"
+        << "  \"summary\": {\n";
+    for( size_t p = 0; p < PHASE_COUNT; ++p ){
+        out << "    \"" << names[ p ] << "\": { "
+            << "\"min\": "      << samples[ p ].min()           << ", "
+            << "\"median\": "   << samples[ p ].median()        << ", "
+            << "\"p99\": "      << samples[ p ].percentile( 99 ) << ", "
+            << "\"max\": "      << samples[ p ].max()           << " }"
+            << (p + 1 < PHASE_COUNT ? "," : "") << "\n";
+    }
+    out << "  },\n"
+        << "  \"runs\": [\n";
+    for( size_t i = 0; i < runs.size(); ++i ){
+        out << "    { "
+            << "\"dns\": "      << runs[ i ].dns        << ", "
+            << "\"connect\": "  << runs[ i ].connect    << ", "
+            << "\"write\": "    << runs[ i ].write      << ", "
+            << "\"ttfb\": "     << runs[ i ].firstByte  << ", "
+            << "\"transfer\": " << runs[ i ].transfer   << ", "
+            << "\"total\": "    << runs[ i ].total      << ", "
+            << "\"bytes\": "    << runs[ i ].bytes      << " }"
+            << (i + 1 < runs.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n"
+        << "}" << endl;
 }
 
 // -------------------------------------------------------------------------- //
@@ -126,6 +235,13 @@ void parseURL( const string& url, string& service, string& hostname, string& pat
         }
         hostname = url.substr( serviceEnd, hostEnd - serviceEnd );
 
+        // An explicit port takes the place of the service name when resolving.
+        size_t portStart = hostname.find( ":" );
+        if( portStart != string::npos ){
+            service  = hostname.substr( portStart + 1 );
+            hostname = hostname.substr( 0, portStart );
+        }
+
         // Path is everything else.
         path = url.substr( hostEnd );
     }
@@ -147,24 +263,55 @@ string generateRequest( const string& hostname, const string& path ){
     return stream.str();
 }
 
-/// Check that the application arguments are correct and return the only argument this application
-/// accepts.
+/// Application options parsed from the command line.
+struct Options {
+    string  url;
+    bool    timing;     ///< Print phase timings instead of the page.
+    size_t  iterations; ///< How many times to fetch the page in timing mode.
+
+    Options( void ) : timing( false ), iterations( 1 ){}
+}; // end struct Options
+
+/// Check that the application arguments are correct and return the options they describe.
 ///
 /// @param argc The number of arguments the application received.
 /// @param argv The command line arguments.
 ///
-/// @return The first (and only) application argument.
-string checkArgs( const int argc, char* argv[] ){
-    if( argc != 2 ){
-        cerr << "Usage: " << argv[0] << " <url>" << endl;
+/// @return The parsed application options.
+Options checkArgs( const int argc, char* argv[] ){
+    Options options;
+    for( int i = 1; i < argc; ++i ){
+        const string arg = argv[i];
+        if( arg == "--timing" ){
+            options.timing = true;
+        }
+        else if( arg == "-n" && i + 1 < argc ){
+            options.iterations = strtoul( argv[ ++i ], NULL, 10 );
+        }
+        else if( options.url.empty() ){
+            options.url = arg;
+        }
+        else {
+            options.url.clear();
+            break;
+        }
+    }
+
+    if( options.url.empty() || options.iterations == 0 ){
+        cerr << "Usage: " << argv[0] << " [--timing [-n <iterations>]] <url>" << endl;
         exit( BAD_ARGUMENTS );
     }
-    return argv[1];
+    return options;
 }
 
 int main( int argc, char* argv[] ){
-    const string& url = checkArgs( argc, argv );
-    requestPage( url, cout );
+    const Options& options = checkArgs( argc, argv );
+    if( options.timing ){
+        timeRequests( options.url, options.iterations, cout );
+    }
+    else {
+        requestPage( options.url, cout );
+    }
     return SUCCESS;
 }
 
@@ -0,0 +1,290 @@
+///
+/// @file
+/// Streams an HTTP response body from a socket straight into a file. Reads and disk writes are
+/// double buffered so the network and the disk work at the same time, and the read size adapts to
+/// how quickly the connection is filling the buffers.
+///
+
+#ifndef TUTORIAL3_FILE_DOWNLOAD_H
+#define TUTORIAL3_FILE_DOWNLOAD_H
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/smart_ptr.hpp>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+using namespace std;
+using boost::asio::ip::tcp;
+
+/// Downloads the remainder of a response from a connected socket into a file descriptor.
+///
+/// All of the bookkeeping happens on the network `io_service`. The `write` system calls happen on a
+/// separate disk `io_service`, which should be run by its own thread, so a slow disk never stalls
+/// the socket. Each disk write completion is posted back to the network `io_service`.
+class FileDownload : public boost::enable_shared_from_this< FileDownload > {
+public:
+    typedef boost::shared_ptr< FileDownload >   Pointer;
+    typedef boost::shared_ptr< tcp::socket >    SocketPointer;
+    typedef boost::system::error_code           Error;
+    typedef boost::asio::chrono::milliseconds   Timeout;
+
+    /// Function prototype for the completion handler.
+    typedef boost::function< void( const Error&, const size_t ) > CompleteCallback;
+
+    static const size_t MIN_BUFFER_SIZE = 4 * 1024;
+    static const size_t MAX_BUFFER_SIZE = 1024 * 1024;
+
+private:
+    typedef boost::shared_ptr< boost::asio::io_service::work > WorkPointer;
+
+    static const size_t NO_PENDING = (size_t)-1;
+
+    boost::asio::io_service&            m_netService;
+    boost::asio::io_service&            m_diskService;
+    SocketPointer                       m_socket;
+    boost::asio::posix::stream_descriptor m_file;
+    CompleteCallback                    m_callback;
+    boost::asio::steady_timer           m_readTimer;
+    const Timeout                       m_readTimeout;  ///< Limit on each read, zero for none.
+    bool                                m_timedOut;
+
+    vector< char >  m_buffers[ 2 ];     ///< The two halves of the double buffer.
+    size_t          m_readIndex;        ///< Buffer the next read goes into.
+    size_t          m_readSize;         ///< Size of the next read.
+    size_t          m_pendingIndex;     ///< Buffer waiting for the disk, or NO_PENDING.
+    size_t          m_pendingOffset;
+    size_t          m_pendingSize;
+    bool            m_writing;          ///< True while a disk write is in flight.
+    bool            m_readDone;         ///< True once the socket has reached EOF.
+    bool            m_inBody;           ///< True once the response headers have been skipped.
+    string          m_headerTail;       ///< Last few header bytes, for spotting a split "\r\n\r\n".
+    size_t          m_bytesWritten;
+
+    /// Skips over the response headers in a freshly read chunk.
+    ///
+    /// @param data
+    /// @param size
+    ///
+    /// @return The offset of the first body byte in the chunk, which is `size` if there is none.
+    size_t _skipHeaders( const char* data, const size_t size ){
+        if( m_inBody ){
+            return 0;
+        }
+
+        // Search the tail of the previous chunk along with this one in case the terminator was
+        // split between the two reads.
+        const string window = m_headerTail + string( data, size );
+        const size_t end = window.find( "\r\n\r\n" );
+        if( end == string::npos ){
+            m_headerTail = window.substr( window.size() > 3 ? window.size() - 3 : 0 );
+            return size;
+        }
+
+        m_inBody = true;
+        return end + 4 - m_headerTail.size();
+    }
+
+    void _read( void ){
+        vector< char >& buffer = m_buffers[ m_readIndex ];
+        if( buffer.size() < m_readSize ){
+            buffer.resize( m_readSize );
+        }
+
+        if( m_readTimeout.count() ){
+            m_readTimer.expires_after( m_readTimeout );
+            m_readTimer.async_wait(
+                boost::bind(
+                    &FileDownload::_readTimeoutHandler,
+                    shared_from_this(),
+                    boost::asio::placeholders::error
+                )
+            );
+        }
+
+        m_socket->async_read_some(
+            boost::asio::buffer( &buffer[ 0 ], m_readSize ),
+            boost::bind(
+                &FileDownload::_readHandler,
+                shared_from_this(),
+                boost::asio::placeholders::error,
+                boost::asio::placeholders::bytes_transferred
+            )
+        );
+    }
+
+    /// Closing the socket makes the read in progress fail, which then reports the timeout.
+    void _readTimeoutHandler( const Error& error ){
+        if( !error && m_readTimer.expiry() <= boost::asio::steady_timer::clock_type::now() ){
+            m_timedOut = true;
+            Error ignored;
+            m_socket->close( ignored );
+        }
+    }
+
+    void _readHandler( const Error& error, const size_t bytesRead ){
+        m_readTimer.cancel();
+        if( error && error != boost::asio::error::eof ){
+            _finish( m_timedOut ? Error( boost::asio::error::timed_out ) : error );
+            return;
+        }
+
+        // A read that fills the whole buffer means the connection has more waiting for us, so ask
+        // for more next time. This keeps the number of reads down on fast links without wasting
+        // memory on slow ones.
+        if( bytesRead == m_readSize && m_readSize < MAX_BUFFER_SIZE ){
+            m_readSize *= 2;
+        }
+
+        const size_t index  = m_readIndex;
+        const size_t offset = _skipHeaders( &m_buffers[ index ][ 0 ], bytesRead );
+        m_readDone = (error == boost::asio::error::eof);
+
+        if( offset < bytesRead ){
+            m_pendingIndex  = index;
+            m_pendingOffset = offset;
+            m_pendingSize   = bytesRead - offset;
+            m_readIndex     = 1 - index;
+
+            // If the disk is still busy with the other buffer then both halves are in use, so
+            // reading resumes once that write completes.
+            if( m_writing ){
+                return;
+            }
+            _writePending();
+        }
+
+        if( !m_readDone ){
+            _read();
+        }
+        else if( !m_writing ){
+            _finish( Error() );
+        }
+    }
+
+    void _writePending( void ){
+        const size_t index  = m_pendingIndex;
+        const size_t offset = m_pendingOffset;
+        const size_t size   = m_pendingSize;
+        m_pendingIndex  = NO_PENDING;
+        m_writing       = true;
+
+        // The network `io_service` would run out of work while the disk is busy, so hold some work
+        // on it until the completion has been posted back.
+        WorkPointer work( new boost::asio::io_service::work( m_netService ) );
+        m_diskService.post(
+            boost::bind(
+                &FileDownload::_startWrite,
+                shared_from_this(),
+                index,
+                offset,
+                size,
+                work
+            )
+        );
+    }
+
+    /// Runs on the disk thread.
+    void _startWrite( const size_t index, const size_t offset, const size_t size, WorkPointer work ){
+        boost::asio::async_write(
+            m_file,
+            boost::asio::buffer( &m_buffers[ index ][ offset ], size ),
+            boost::bind(
+                &FileDownload::_postWriteHandler,
+                shared_from_this(),
+                boost::asio::placeholders::error,
+                boost::asio::placeholders::bytes_transferred,
+                work
+            )
+        );
+    }
+
+    /// Runs on the disk thread.
+    void _postWriteHandler( const Error& error, const size_t bytesWritten, WorkPointer work ){
+        m_netService.post(
+            boost::bind(
+                &FileDownload::_writeHandler,
+                shared_from_this(),
+                error,
+                bytesWritten
+            )
+        );
+    }
+
+    void _writeHandler( const Error& error, const size_t bytesWritten ){
+        m_writing = false;
+        m_bytesWritten += bytesWritten;
+        if( error ){
+            _finish( error );
+            return;
+        }
+
+        if( m_pendingIndex != NO_PENDING ){
+            _writePending();
+            if( !m_readDone ){
+                _read();
+            }
+        }
+        else if( m_readDone ){
+            _finish( Error() );
+        }
+    }
+
+    void _finish( const Error& error ){
+        m_readDone = true;
+        m_readTimer.cancel();
+        if( m_callback ){
+            CompleteCallback callback;
+            callback.swap( m_callback );
+            callback( error, m_bytesWritten );
+        }
+    }
+
+public:
+    /// Constructor.
+    ///
+    /// @param netService   The service the socket belongs to.
+    /// @param diskService  The service which performs the file writes.
+    /// @param socket       A connected socket whose request has already been sent.
+    /// @param fd           File to write to. A duplicate is taken, the caller keeps its own.
+    /// @param readTimeout  How long any one read may take, zero for no limit.
+    /// @param skipHeaders  True to drop the HTTP response headers from the output.
+    FileDownload(
+        boost::asio::io_service&    netService,
+        boost::asio::io_service&    diskService,
+        SocketPointer               socket,
+        const int                   fd,
+        const Timeout&              readTimeout = Timeout( 0 ),
+        const bool                  skipHeaders = true
+    )
+        : m_netService( netService ),
+          m_diskService( diskService ),
+          m_socket( socket ),
+          m_file( diskService, ::dup( fd ) ),
+          m_readTimer( netService ),
+          m_readTimeout( readTimeout ),
+          m_timedOut( false ),
+          m_readIndex( 0 ),
+          m_readSize( MIN_BUFFER_SIZE ),
+          m_pendingIndex( NO_PENDING ),
+          m_pendingOffset( 0 ),
+          m_pendingSize( 0 ),
+          m_writing( false ),
+          m_readDone( false ),
+          m_inBody( !skipHeaders ),
+          m_bytesWritten( 0 ){}
+
+    /// Start streaming. The callback is called once everything has reached the file or on the
+    /// first error.
+    ///
+    /// @param callback
+    void start( CompleteCallback callback ){
+        m_callback = callback;
+        _read();
+    }
+}; // end class FileDownload
+
+#endif // TUTORIAL3_FILE_DOWNLOAD_H
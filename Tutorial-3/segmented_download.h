@@ -0,0 +1,809 @@
+///
+/// @file
+/// Downloads a single large file over several parallel connections. The file is split into byte
+/// ranges which are fetched with HTTP Range requests and written into place with `pwrite`. Progress
+/// is kept in a sidecar state file so an interrupted download can pick up where it left off, as
+/// long as the file on the server hasn't changed since.
+///
+
+#ifndef TUTORIAL3_SEGMENTED_DOWNLOAD_H
+#define TUTORIAL3_SEGMENTED_DOWNLOAD_H
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/smart_ptr.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <istream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "racing_connector.h"
+#include "resolver_cache.h"
+
+using namespace std;
+using boost::asio::ip::tcp;
+
+/// Fetches a URL as a set of byte ranges over parallel connections into a preallocated file.
+///
+/// The download starts with a HEAD request to learn the size of the file and whether the server
+/// accepts ranges. A server which does not is fetched with a single plain GET instead. Each segment
+/// is retried, from the last byte it wrote, up to `MAX_ATTEMPTS` times. Every connection, the HEAD
+/// request's and each segment's, is made with a `RacingConnector`.
+///
+/// Each phase of each connection, resolving, connecting, writing the request, and every read, has
+/// its own deadline, just like the single connection download. A segment which misses one is
+/// retried, while a HEAD request which misses one ends the download.
+///
+/// The file's validator, its strong `ETag` or else its `Last-Modified` date, is saved with the
+/// progress. A resumed download only trusts the bytes already on disk if the server still reports
+/// the same validator, and every range request carries it in an `If-Range` header, so a file which
+/// changes partway through is never stitched together from two versions.
+class SegmentedDownload : public boost::enable_shared_from_this< SegmentedDownload > {
+public:
+    typedef boost::shared_ptr< SegmentedDownload >  Pointer;
+    typedef boost::system::error_code               Error;
+    typedef boost::asio::chrono::milliseconds       Timeout;
+
+    /// How long each phase may take, zero for no limit. The read timeout applies to each read.
+    struct Timeouts {
+        Timeout resolve;
+        Timeout connect;
+        Timeout write;
+        Timeout read;
+
+        Timeouts( void ) : resolve( 0 ), connect( 0 ), write( 0 ), read( 0 ){}
+    }; // end struct Timeouts
+
+    /// Function prototype for the completion handler. The string describes what failed, if anything.
+    typedef boost::function< void( const Error&, const string& ) > CompleteCallback;
+
+    static const size_t     MAX_ATTEMPTS        = 5;
+    static const size_t     READ_BUFFER_SIZE    = 64 * 1024;
+    static const off_t      STATE_SAVE_INTERVAL = 4 * 1024 * 1024;
+
+private:
+    typedef boost::shared_ptr< tcp::socket >            SocketPointer;
+    typedef boost::shared_ptr< boost::asio::streambuf > StreambufPointer;
+    typedef boost::shared_ptr< boost::asio::steady_timer > TimerPointer;
+    typedef boost::asio::steady_timer::clock_type       Clock;
+    typedef map< string, string >                       HeaderMap;
+
+    /// One byte range of the file and the connection currently fetching it.
+    struct Segment {
+        off_t               start;      ///< First byte of the range.
+        off_t               end;        ///< One past the last byte of the range.
+        off_t               done;       ///< Bytes of the range already on disk.
+        off_t               unsaved;    ///< Bytes written since the state file was last saved.
+        size_t              attempts;
+        RacingConnector::Pointer connector; ///< Set while connecting.
+        SocketPointer       socket;
+        StreambufPointer    headers;
+        TimerPointer        retryTimer;
+        TimerPointer        deadline;
+        const char*         phase;      ///< The phase the deadline guards, null when none.
+        bool                timedOut;   ///< True if the deadline ended the current attempt.
+        vector< char >      buffer;
+
+        Segment( const off_t start_, const off_t end_, const off_t done_ = 0 )
+            : start( start_ ),
+              end( end_ ),
+              done( done_ ),
+              unsaved( 0 ),
+              attempts( 0 ),
+              phase( NULL ),
+              timedOut( false ){}
+
+        bool complete( void ) const {
+            return start + done >= end;
+        }
+    }; // end struct Segment
+
+    typedef boost::shared_ptr< Segment > SegmentPointer;
+    typedef vector< SegmentPointer >     SegmentList;
+
+    boost::asio::io_service&    m_ioService;
+    ResolverCache&              m_resolver;
+    const string                m_hostname;
+    const string                m_service;
+    const string                m_path;
+    const string                m_outputPath;
+    const string                m_statePath;
+    const size_t                m_segmentCount;
+    const RacingConnector::Duration m_attemptDelay;
+    const Timeouts              m_timeouts;
+    CompleteCallback            m_callback;
+
+    off_t                       m_length;
+    string                      m_validator;    ///< The file's strong `ETag` or `Last-Modified`.
+    bool                        m_useRanges;
+    int                         m_file;
+    SegmentList                 m_segments;
+    size_t                      m_remaining;    ///< Segments not yet complete.
+    RacingConnector::Pointer    m_headConnector;
+    SocketPointer               m_headSocket;
+    StreambufPointer            m_headBuffer;
+    boost::asio::steady_timer   m_headDeadline;
+    const char*                 m_headPhase;    ///< The phase the HEAD deadline guards.
+
+    // ---------------------------------------------------------------------- //
+    // HTTP helpers.
+
+    string _generateRequest( const string& method, const Segment* segment ) const {
+        stringstream stream;
+        stream
+            << method << " " << m_path << " HTTP/1.1\r\n"
+            << "Host: " << m_hostname << "\r\n";
+        if( segment && m_useRanges ){
+            stream << "Range: bytes=" << (segment->start + segment->done) << "-" << (segment->end - 1) << "\r\n";
+            if( !m_validator.empty() ){
+                stream << "If-Range: " << m_validator << "\r\n";
+            }
+        }
+        stream
+            << "Connection: close" << "\r\n"
+            << "\r\n";
+        return stream.str();
+    }
+
+    /// Parses the status line and headers out of the buffer. Header names are lower cased.
+    ///
+    /// @return The HTTP status code, or 0 if the status line could not be parsed.
+    static int _parseHeaders( boost::asio::streambuf& buffer, HeaderMap& headers ){
+        istream stream( &buffer );
+        string line;
+        int status = 0;
+        string version;
+        getline( stream, line );
+        stringstream( line ) >> version >> status;
+
+        while( getline( stream, line ) && line != "\r" && !line.empty() ){
+            const size_t colon = line.find( ':' );
+            if( colon == string::npos ){
+                continue;
+            }
+            string name = line.substr( 0, colon );
+            transform( name.begin(), name.end(), name.begin(), ::tolower );
+            size_t valueStart = line.find_first_not_of( " \t", colon + 1 );
+            size_t valueEnd = line.find_last_not_of( " \t\r" );
+            headers[ name ] = valueStart == string::npos ? "" : line.substr( valueStart, valueEnd + 1 - valueStart );
+        }
+        return status;
+    }
+
+    /// Parses a `Content-Range` header of the form `bytes <first>-<last>/<length>`. The length may
+    /// be `*`, in which case it is left at -1.
+    static bool _parseContentRange(
+        const string&   header,
+        off_t&          first,
+        off_t&          last,
+        off_t&          length
+    ){
+        long long first_, last_;
+        char slash;
+        stringstream stream( header );
+        string unit;
+        if( !getline( stream, unit, ' ' ) || unit != "bytes" || !(stream >> first_) ||
+            stream.get() != '-' || !(stream >> last_ >> slash) || slash != '/' )
+        {
+            return false;
+        }
+        first   = first_;
+        last    = last_;
+        length  = -1;
+        long long length_;
+        if( stream >> length_ ){
+            length = length_;
+        }
+        return first <= last;
+    }
+
+    // ---------------------------------------------------------------------- //
+    // State file.
+
+    /// Loads segment progress from the sidecar file if it describes this same download of this
+    /// same version of the file. Without a validator there's no telling whether the file changed,
+    /// so the progress is never trusted.
+    bool _loadState( void ){
+        ifstream state( m_statePath.c_str() );
+        off_t length = 0;
+        size_t count = 0;
+        string validator;
+        if( !(state >> length >> count) || length != m_length || count == 0 ){
+            return false;
+        }
+        state.ignore( 1 );
+        if( !getline( state, validator ) || validator.empty() || validator != m_validator ){
+            return false;
+        }
+
+        SegmentList segments;
+        for( size_t i = 0; i < count; ++i ){
+            off_t start, end, done;
+            if( !(state >> start >> end >> done) ){
+                return false;
+            }
+            segments.push_back( SegmentPointer( new Segment( start, end, done ) ) );
+        }
+        m_segments.swap( segments );
+        return true;
+    }
+
+    /// Writes segment progress to the sidecar file. The file is replaced atomically so a crash
+    /// mid-save never leaves a truncated state behind.
+    void _saveState( void ){
+        const string temp = m_statePath + ".tmp";
+        {
+            ofstream state( temp.c_str(), ios::trunc );
+            state << m_length << " " << m_segments.size() << "\n" << m_validator << "\n";
+            for( SegmentList::iterator it = m_segments.begin(); it != m_segments.end(); ++it ){
+                state << (**it).start << " " << (**it).end << " " << (**it).done << "\n";
+                (**it).unsaved = 0;
+            }
+        }
+        rename( temp.c_str(), m_statePath.c_str() );
+    }
+
+    // ---------------------------------------------------------------------- //
+    // HEAD request.
+
+    /// Arm the HEAD request's deadline for its next phase. Any earlier deadline is cancelled.
+    void _startHeadDeadline( const char* phase, const Timeout& timeout ){
+        m_headPhase = phase;
+        if( !timeout.count() ){
+            m_headDeadline.expires_at( Clock::time_point::max() );
+            return;
+        }
+        m_headDeadline.expires_after( timeout );
+        m_headDeadline.async_wait(
+            boost::bind(
+                &SegmentedDownload::_headDeadlineHandler,
+                shared_from_this(),
+                boost::asio::placeholders::error
+            )
+        );
+    }
+
+    void _headDeadlineHandler( const Error& error ){
+        // The deadline may have moved on to the next phase after it expired but before this ran.
+        if( error || m_headDeadline.expiry() > Clock::now() ){
+            return;
+        }
+        _finish( boost::asio::error::timed_out, string( m_headPhase ) + " timeout" );
+    }
+
+    void _resolveHeadHandler( const Error& error, ResolverCache::Endpoints endpoints ){
+        if( !m_callback ){
+            // Timed out already.
+            return;
+        }
+        if( error ){
+            _finish( error, "Resolver error" );
+            return;
+        }
+
+        m_headConnector.reset(
+            new RacingConnector( m_ioService, endpoints->begin(), endpoints->end(), m_attemptDelay )
+        );
+        _startHeadDeadline( "Connect", m_timeouts.connect );
+        m_headConnector->start(
+            boost::bind( &SegmentedDownload::_connectHeadHandler, shared_from_this(), _1, _2 )
+        );
+    }
+
+    void _connectHeadHandler( const Error& error, SocketPointer socket ){
+        m_headConnector.reset();
+        if( error ){
+            _finish( error, "Connection error" );
+            return;
+        }
+        m_headSocket = socket;
+
+        boost::shared_ptr< string > request( new string( _generateRequest( "HEAD", NULL ) ) );
+        _startHeadDeadline( "Write", m_timeouts.write );
+        boost::asio::async_write(
+            *m_headSocket,
+            boost::asio::buffer( *request ),
+            boost::bind(
+                &SegmentedDownload::_writeHeadHandler,
+                shared_from_this(),
+                boost::asio::placeholders::error,
+                request
+            )
+        );
+    }
+
+    void _writeHeadHandler( const Error& error, boost::shared_ptr< string > request ){
+        if( error ){
+            _finish( error, "Write error" );
+            return;
+        }
+
+        m_headBuffer.reset( new boost::asio::streambuf );
+        _startHeadDeadline( "Read", m_timeouts.read );
+        boost::asio::async_read_until(
+            *m_headSocket,
+            *m_headBuffer,
+            "\r\n\r\n",
+            boost::bind(
+                &SegmentedDownload::_readHeadHandler,
+                shared_from_this(),
+                boost::asio::placeholders::error
+            )
+        );
+    }
+
+    void _readHeadHandler( const Error& error ){
+        if( error ){
+            _finish( error, "Read error" );
+            return;
+        }
+
+        HeaderMap headers;
+        const int status = _parseHeaders( *m_headBuffer, headers );
+        m_headDeadline.cancel();
+        m_headSocket.reset();
+        m_headBuffer.reset();
+        if( status != 200 || headers.find( "content-length" ) == headers.end() ){
+            _finish(
+                boost::system::errc::make_error_code( boost::system::errc::protocol_error ),
+                "HEAD did not return a Content-Length"
+            );
+            return;
+        }
+
+        m_length    = strtoll( headers[ "content-length" ].c_str(), NULL, 10 );
+        m_useRanges = headers[ "accept-ranges" ] == "bytes" && m_length > 0;
+
+        // Weak entity tags can't be used with `If-Range`.
+        const string& etag = headers[ "etag" ];
+        const bool strong = !etag.empty() && etag.compare( 0, 2, "W/" ) != 0;
+        m_validator = strong ? etag : headers[ "last-modified" ];
+        _startSegments();
+    }
+
+    // ---------------------------------------------------------------------- //
+    // Segments.
+
+    void _startSegments( void ){
+        // Pick up the progress of an earlier attempt if there is one, otherwise split the file up
+        // into evenly sized ranges.
+        const bool resuming = m_useRanges && _loadState();
+        if( !resuming ){
+            m_segments.clear();
+            const size_t count = m_useRanges ? max< size_t >( 1, min< off_t >( m_segmentCount, m_length ) ) : 1;
+            const off_t size = m_length / count;
+            for( size_t i = 0; i < count; ++i ){
+                const off_t start = size * i;
+                const off_t end = (i + 1 == count) ? m_length : start + size;
+                m_segments.push_back( SegmentPointer( new Segment( start, end ) ) );
+            }
+        }
+
+        // Open and preallocate the output so every segment can write straight into its own range.
+        m_file = open( m_outputPath.c_str(), O_WRONLY | O_CREAT | (resuming ? 0 : O_TRUNC), 0644 );
+        if( m_file == -1 || ftruncate( m_file, m_length ) == -1 ){
+            _finish( Error( errno, boost::system::system_category() ), "Could not create output file" );
+            return;
+        }
+        if( m_useRanges ){
+            _saveState();
+        }
+
+        m_remaining = 0;
+        for( size_t i = 0; i < m_segments.size(); ++i ){
+            if( !m_segments[ i ]->complete() ){
+                ++m_remaining;
+                _startSegment( i );
+            }
+        }
+        if( m_remaining == 0 ){
+            _finish( Error(), "" );
+        }
+    }
+
+    void _startSegment( const size_t index ){
+        _startSegmentDeadline( index, "Resolve", m_timeouts.resolve );
+        m_resolver.resolve(
+            m_hostname,
+            m_service,
+            boost::bind(
+                &SegmentedDownload::_resolveSegmentHandler,
+                shared_from_this(),
+                ResolverCache::placeholders::error,
+                ResolverCache::placeholders::endpoints,
+                index,
+                m_segments[ index ]->attempts
+            )
+        );
+    }
+
+    /// Arm a segment's deadline for its next phase. Any earlier deadline is cancelled.
+    void _startSegmentDeadline( const size_t index, const char* phase, const Timeout& timeout ){
+        Segment& segment = *m_segments[ index ];
+        segment.phase = phase;
+        if( !segment.deadline ){
+            segment.deadline.reset( new boost::asio::steady_timer( m_ioService ) );
+        }
+        if( !timeout.count() ){
+            segment.deadline->expires_at( Clock::time_point::max() );
+            return;
+        }
+        segment.deadline->expires_after( timeout );
+        segment.deadline->async_wait(
+            boost::bind(
+                &SegmentedDownload::_segmentDeadlineHandler,
+                shared_from_this(),
+                boost::asio::placeholders::error,
+                index
+            )
+        );
+    }
+
+    void _stopSegmentDeadline( Segment& segment ){
+        segment.phase = NULL;
+        if( segment.deadline ){
+            segment.deadline->expires_at( Clock::time_point::max() );
+        }
+    }
+
+    /// Stop whatever the segment is doing, so it fails and is retried.
+    void _segmentDeadlineHandler( const Error& error, const size_t index ){
+        // The deadline may have moved on to the next phase after it expired but before this ran.
+        Segment& segment = *m_segments[ index ];
+        if( error || !segment.phase || segment.deadline->expiry() > Clock::now() ){
+            return;
+        }
+
+        segment.timedOut = true;
+        if( segment.connector ){
+            segment.connector->cancel();
+        }
+        else if( segment.socket ){
+            Error ignored;
+            segment.socket->close( ignored );
+        }
+        else {
+            // Still resolving, which can't be cancelled, so the answer will be ignored instead.
+            _segmentFailed( index, boost::asio::error::timed_out );
+        }
+    }
+
+    void _resolveSegmentHandler(
+        const Error&                error,
+        ResolverCache::Endpoints    endpoints,
+        const size_t                index,
+        const size_t                attempt
+    ){
+        Segment& segment = *m_segments[ index ];
+        if( !m_callback || attempt != segment.attempts ){
+            // The resolve timed out, and the segment has moved on without it.
+            return;
+        }
+        if( error ){
+            _segmentFailed( index, error );
+            return;
+        }
+
+        segment.connector.reset(
+            new RacingConnector( m_ioService, endpoints->begin(), endpoints->end(), m_attemptDelay )
+        );
+        _startSegmentDeadline( index, "Connect", m_timeouts.connect );
+        segment.connector->start(
+            boost::bind(
+                &SegmentedDownload::_connectSegmentHandler, shared_from_this(), _1, _2, index
+            )
+        );
+    }
+
+    void _connectSegmentHandler( const Error& error, SocketPointer socket, const size_t index ){
+        Segment& segment = *m_segments[ index ];
+        segment.connector.reset();
+        if( error ){
+            _segmentFailed( index, error );
+            return;
+        }
+        segment.socket = socket;
+
+        boost::shared_ptr< string > request( new string( _generateRequest( "GET", &segment ) ) );
+        _startSegmentDeadline( index, "Write", m_timeouts.write );
+        boost::asio::async_write(
+            *segment.socket,
+            boost::asio::buffer( *request ),
+            boost::bind(
+                &SegmentedDownload::_writeSegmentHandler,
+                shared_from_this(),
+                boost::asio::placeholders::error,
+                request,
+                index
+            )
+        );
+    }
+
+    void _writeSegmentHandler( const Error& error, boost::shared_ptr< string > request, const size_t index ){
+        if( error ){
+            _segmentFailed( index, error );
+            return;
+        }
+
+        Segment& segment = *m_segments[ index ];
+        segment.headers.reset( new boost::asio::streambuf );
+        _startSegmentDeadline( index, "Read", m_timeouts.read );
+        boost::asio::async_read_until(
+            *segment.socket,
+            *segment.headers,
+            "\r\n\r\n",
+            boost::bind(
+                &SegmentedDownload::_readSegmentHeadersHandler,
+                shared_from_this(),
+                boost::asio::placeholders::error,
+                boost::asio::placeholders::bytes_transferred,
+                index
+            )
+        );
+    }
+
+    void _readSegmentHeadersHandler( const Error& error, const size_t headerSize, const size_t index ){
+        if( error ){
+            _segmentFailed( index, error );
+            return;
+        }
+
+        Segment& segment = *m_segments[ index ];
+        HeaderMap headers;
+        const int status = _parseHeaders( *segment.headers, headers );
+        const Error& protocolError =
+            boost::system::errc::make_error_code( boost::system::errc::protocol_error );
+
+        // A whole file in answer to a range request means `If-Range` didn't match, and the file
+        // has changed since the download started. The progress so far is no good any more.
+        if( m_useRanges && status == 200 && !m_validator.empty() ){
+            remove( m_statePath.c_str() );
+            _finish( protocolError, "The file changed on the server" );
+            return;
+        }
+        if( status != (m_useRanges ? 206 : 200) ){
+            _segmentFailed( index, protocolError );
+            return;
+        }
+
+        // Make sure the server is sending the range that was asked for, of the same file, before
+        // writing any of it into place.
+        if( m_useRanges ){
+            off_t first, last, length;
+            if( !_parseContentRange( headers[ "content-range" ], first, last, length ) ||
+                first != segment.start + segment.done || last >= segment.end )
+            {
+                _segmentFailed( index, protocolError );
+                return;
+            }
+            if( length != -1 && length != m_length ){
+                remove( m_statePath.c_str() );
+                _finish( protocolError, "The file changed on the server" );
+                return;
+            }
+        }
+
+        // Anything read past the headers is the start of the body.
+        segment.buffer.resize( READ_BUFFER_SIZE );
+        const size_t leftover = min( segment.headers->size(), segment.buffer.size() );
+        boost::asio::buffer_copy( boost::asio::buffer( segment.buffer ), segment.headers->data() );
+        segment.headers.reset();
+        _readSegmentHandler( Error(), leftover, index );
+    }
+
+    void _readSegment( const size_t index ){
+        _startSegmentDeadline( index, "Read", m_timeouts.read );
+        Segment& segment = *m_segments[ index ];
+        const size_t wanted = (size_t)min< off_t >( segment.buffer.size(), segment.end - segment.start - segment.done );
+        segment.socket->async_read_some(
+            boost::asio::buffer( &segment.buffer[ 0 ], wanted ),
+            boost::bind(
+                &SegmentedDownload::_readSegmentHandler,
+                shared_from_this(),
+                boost::asio::placeholders::error,
+                boost::asio::placeholders::bytes_transferred,
+                index
+            )
+        );
+    }
+
+    void _readSegmentHandler( const Error& error, const size_t bytesRead, const size_t index ){
+        Segment& segment = *m_segments[ index ];
+
+        // Never write past the end of the range, whatever the server sends.
+        const size_t size = (size_t)min< off_t >( bytesRead, segment.end - segment.start - segment.done );
+        if( size > 0 ){
+            const ssize_t written = pwrite( m_file, &segment.buffer[ 0 ], size, segment.start + segment.done );
+            if( written != (ssize_t)size ){
+                _finish( Error( errno, boost::system::system_category() ), "Write to output file failed" );
+                return;
+            }
+            segment.done    += size;
+            segment.unsaved += size;
+        }
+
+        if( segment.complete() ){
+            segment.socket.reset();
+            segment.buffer = vector< char >();
+            _stopSegmentDeadline( segment );
+            if( m_useRanges ){
+                _saveState();
+            }
+            if( --m_remaining == 0 ){
+                _finish( Error(), "" );
+            }
+            return;
+        }
+
+        if( error ){
+            _segmentFailed( index, error );
+            return;
+        }
+
+        if( m_useRanges && segment.unsaved >= STATE_SAVE_INTERVAL ){
+            _saveState();
+        }
+        _readSegment( index );
+    }
+
+    void _segmentFailed( const size_t index, const Error& error ){
+        // Anything cancelled by `_finish` ends up here after the download is already over.
+        if( !m_callback ){
+            return;
+        }
+
+        Segment& segment = *m_segments[ index ];
+        segment.socket.reset();
+        segment.headers.reset();
+        const string what = segment.timedOut && segment.phase
+            ? string( segment.phase ) + " timeout, segment failed too many times"
+            : "Segment failed too many times";
+        const Error& reason = segment.timedOut ? Error( boost::asio::error::timed_out ) : error;
+        segment.timedOut = false;
+        _stopSegmentDeadline( segment );
+
+        // Without ranges there is nothing to resume from, so the only option is to start over.
+        if( !m_useRanges ){
+            segment.done = 0;
+        }
+        else {
+            _saveState();
+        }
+
+        if( ++segment.attempts >= MAX_ATTEMPTS ){
+            _finish( reason, what );
+            return;
+        }
+
+        // Back off a little before trying again, a bit longer with each attempt.
+        segment.retryTimer.reset( new boost::asio::steady_timer( m_ioService ) );
+        segment.retryTimer->expires_after( boost::asio::chrono::milliseconds( 250 * segment.attempts ) );
+        segment.retryTimer->async_wait(
+            boost::bind(
+                &SegmentedDownload::_retryHandler,
+                shared_from_this(),
+                boost::asio::placeholders::error,
+                index
+            )
+        );
+    }
+
+    void _retryHandler( const Error& error, const size_t index ){
+        if( !error && m_callback ){
+            _startSegment( index );
+        }
+    }
+
+    void _finish( const Error& error, const string& what ){
+        if( !m_callback ){
+            return;
+        }
+
+        // Stop everything still in flight.
+        m_headDeadline.cancel();
+        if( m_headConnector ){
+            m_headConnector->cancel();
+        }
+        if( m_headSocket ){
+            Error ignored;
+            m_headSocket->close( ignored );
+        }
+        for( SegmentList::iterator it = m_segments.begin(); it != m_segments.end(); ++it ){
+            Error ignored;
+            if( (**it).connector ){
+                (**it).connector->cancel();
+            }
+            if( (**it).socket ){
+                (**it).socket->close( ignored );
+            }
+            if( (**it).retryTimer ){
+                (**it).retryTimer->cancel( ignored );
+            }
+            if( (**it).deadline ){
+                (**it).deadline->cancel( ignored );
+            }
+        }
+
+        if( m_file != -1 ){
+            close( m_file );
+            m_file = -1;
+        }
+        if( !error ){
+            remove( m_statePath.c_str() );
+        }
+
+        CompleteCallback callback;
+        callback.swap( m_callback );
+        callback( error, what );
+    }
+
+public:
+    /// Constructor.
+    ///
+    /// @param io_service
+    /// @param resolver     Shared resolver cache. All segments resolve through it.
+    /// @param hostname
+    /// @param service
+    /// @param path
+    /// @param outputPath   File to write the download to. Progress is kept in `<outputPath>.state`.
+    /// @param segments     How many ranges to split the file into.
+    /// @param attemptDelay Head start each racing connection attempt gets.
+    /// @param timeouts     How long each phase of each connection may take.
+    SegmentedDownload(
+        boost::asio::io_service&    io_service,
+        ResolverCache&              resolver,
+        const string&               hostname,
+        const string&               service,
+        const string&               path,
+        const string&               outputPath,
+        const size_t                segments,
+        const RacingConnector::Duration& attemptDelay = boost::asio::chrono::milliseconds( 250 ),
+        const Timeouts&             timeouts = Timeouts()
+    )
+        : m_ioService( io_service ),
+          m_resolver( resolver ),
+          m_hostname( hostname ),
+          m_service( service ),
+          m_path( path ),
+          m_outputPath( outputPath ),
+          m_statePath( outputPath + ".state" ),
+          m_segmentCount( segments ),
+          m_attemptDelay( attemptDelay ),
+          m_timeouts( timeouts ),
+          m_length( 0 ),
+          m_useRanges( false ),
+          m_file( -1 ),
+          m_remaining( 0 ),
+          m_headDeadline( io_service ),
+          m_headPhase( "" ){}
+
+    /// Start the download.
+    ///
+    /// @param callback Called once the whole file is on disk or the download has given up.
+    void start( CompleteCallback callback ){
+        m_callback = callback;
+        _startHeadDeadline( "Resolve", m_timeouts.resolve );
+        m_resolver.resolve(
+            m_hostname,
+            m_service,
+            boost::bind(
+                &SegmentedDownload::_resolveHeadHandler,
+                shared_from_this(),
+                ResolverCache::placeholders::error,
+                ResolverCache::placeholders::endpoints
+            )
+        );
+    }
+}; // end class SegmentedDownload
+
+#endif // TUTORIAL3_SEGMENTED_DOWNLOAD_H
@@ -1,7 +1,7 @@
 ///
 /// @file
-/// This is a simple, asychronous wget implementation. It accepts a URL as its one parameter,
-/// connects to it, downloads the page via asynchronous HTTP, and prints it to stdout.
+/// This is a simple, asychronous wget implementation. It accepts one or more URLs as parameters,
+/// connects to each in turn, downloads the page via asynchronous HTTP, and prints it to stdout.
 ///
 /// @note   The meat of this tutorial is in the requestPage method.
 ///
@@ -17,10 +17,22 @@
 #include <boost/bind.hpp>
 #include <boost/smart_ptr.hpp>
 #include <boost/system/system_error.hpp>
+#include <boost/thread.hpp>
+#include <algorithm>
 #include <exception>
 #include <iostream>
+#include <list>
 #include <sstream>
 #include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "file_download.h"
+#include "latency_stats.h"
+#include "racing_connector.h"
+#include "resolver_cache.h"
+#include "segmented_download.h"
 
 using namespace std;
 using boost::asio::ip::tcp;
@@ -31,7 +43,9 @@ enum ErrorCodes {
     RESOLVER_FAILURE,
     CONNECTION_FAILURE,
     WRITE_FAILURE,
-    READ_FAILURE
+    READ_FAILURE,
+    OUTPUT_FAILURE,
+    TIMEOUT_FAILURE
 };
 
 void parseURL( const string& url, string& service, string& hostname, string& path );
@@ -42,40 +56,159 @@ string generateRequest( const string& hostname, const string& path );
 // will be managing your application's IO.
 boost::asio::io_service io_service;
 
+// Host names are resolved through a shared cache so that fetching several pages from the same host
+// only pays for the lookup once.
+ResolverCache resolverCache( io_service );
+
+// When writing to a file the disk writes are done on their own `io_service`, run by its own thread,
+// so that the network never waits on the disk. `outputFile` is -1 when printing to stdout.
+boost::asio::io_service disk_service;
+int outputFile = -1;
+
 // We will be passing the data around between the asynchronous functions, so we will be using a
 // shared pointer to manage destruction for us when the data becomes unused.
 typedef boost::shared_ptr< tcp::socket >                socket_ptr;
 typedef boost::shared_ptr< string >                     string_ptr;
 typedef boost::shared_ptr< boost::array< char, 1024 > > array_ptr;
 
+typedef ResolverCache::Endpoints                        endpoints_ptr;
+typedef ResolverCache::EndpointList::const_iterator     endpoint_iterator;
+
+typedef boost::asio::steady_timer::clock_type           steady_clock;
+typedef boost::asio::chrono::milliseconds               milliseconds;
+
+// Every phase of a request gets its own deadline so that nothing can hang forever. A zero timeout
+// disables the deadline for that phase. The read timeout applies to each individual read, so a slow
+// but steady download is never cut off.
+struct Timeouts {
+    milliseconds resolve;
+    milliseconds connect;
+    milliseconds write;
+    milliseconds read;
+
+    Timeouts( void )
+        : resolve( 10000 ),
+          connect( 10000 ),
+          write( 10000 ),
+          read( 30000 ){}
+}; // end struct Timeouts
+Timeouts timeouts;
+
+// When hedging is enabled and the first byte of a response has not arrived within the hedge delay,
+// a duplicate request is sent to the next resolved endpoint and whichever answers first wins. The
+// delay is the given percentile of the time to first byte seen so far, or the initial delay until
+// there are enough samples to go on.
+struct HedgePolicy {
+    bool            enabled;
+    double          percentile;
+    milliseconds    initialDelay;
+    size_t          minSamples;
+
+    HedgePolicy( void )
+        : enabled( false ),
+          percentile( 95 ),
+          initialDelay( 100 ),
+          minSamples( 5 ){}
+}; // end struct HedgePolicy
+HedgePolicy hedgePolicy;
+LatencySamples firstByteTimes;
+
+// Connections race across the resolved endpoints, with each attempt getting this long before the
+// next one is started alongside it. Per-attempt timings are printed when `connectStats` is set.
+milliseconds attemptDelay( 250 );
+bool connectStats = false;
+
+// One connection trying to fetch the page. Normally there is just the one, but a hedged request
+// may race two against each other.
+struct Attempt {
+    RacingConnector::Pointer    connector;  ///< Set while connecting.
+    socket_ptr                  socket;     ///< Set once connected.
+    boost::asio::steady_timer   deadline;
+    const char*                 phase;      ///< Name of the phase the deadline is guarding.
+    bool                        timedOut;
+    tcp::endpoint               endpoint;   ///< The endpoint the socket connected to.
+    steady_clock::time_point    sent;       ///< When the request finished writing.
+
+    Attempt( void )
+        : deadline( io_service ),
+          phase( "" ),
+          timedOut( false ){}
+}; // end struct Attempt
+typedef boost::shared_ptr< Attempt > attempt_ptr;
+
+// Everything we know about fetching a single page.
+struct PageRequest {
+    string                      url;
+    string                      service;
+    string                      hostname;
+    string                      path;
+    endpoints_ptr               endpoints;
+    boost::asio::steady_timer   resolveDeadline;
+    boost::asio::steady_timer   hedgeTimer;
+    list< attempt_ptr >         attempts;   ///< Attempts still in the running.
+    bool                        answered;   ///< True once one attempt has received a byte.
+
+    PageRequest( const string& url_ )
+        : url( url_ ),
+          resolveDeadline( io_service ),
+          hedgeTimer( io_service ),
+          answered( false )
+    {
+        parseURL( url, service, hostname, path );
+    }
+}; // end struct PageRequest
+typedef boost::shared_ptr< PageRequest > request_ptr;
+
+void resolveDeadlineHandler(
+    const boost::system::error_code&    error,
+    request_ptr                         request
+);
 void resolveHandler(
     const boost::system::error_code&    error,
-    tcp::resolver::iterator             endpoints,
-    string                              url
+    endpoints_ptr                       endpoints,
+    request_ptr                         request
 );
+void startAttempt( request_ptr request, endpoint_iterator first );
 void connectHandler(
     const boost::system::error_code&    error,
-    tcp::resolver::iterator             endpoint,
     socket_ptr                          socket,
-    string                              url
+    const RacingConnector::StatsList&   stats,
+    request_ptr                         request,
+    attempt_ptr                         attempt
 );
 void writeHandler(
     const boost::system::error_code&    error,
     size_t                              bytes_transferred,
-    socket_ptr                          socket,
+    request_ptr                         request,
+    attempt_ptr                         attempt,
     string_ptr                          writeBuffer
 );
+void hedgeHandler(
+    const boost::system::error_code&    error,
+    request_ptr                         request
+);
+void firstByteHandler(
+    const boost::system::error_code&    error,
+    request_ptr                         request,
+    attempt_ptr                         attempt
+);
 void readHandler(
     const boost::system::error_code&    error,
     size_t                              bytes_transferred,
-    socket_ptr                          socket,
+    attempt_ptr                         attempt,
     array_ptr                           readBuffer
 );
+void downloadHandler(
+    const boost::system::error_code&    error,
+    size_t                              bytes_written
+);
+void segmentedHandler(
+    const boost::system::error_code&    error,
+    const string&                       what
+);
 
 void requestPage( const string& url ){
-    // Split the URL into parts.
-    string service, hostname, path;
-    parseURL( url, service, hostname, path );
+    request_ptr request( new PageRequest( url ) );
 
     // Just like tutorial 1, we start by resolving the hostname and service provided from the
     // command line. Only now we will use the asynchronous version which takes a callback function
@@ -84,15 +217,24 @@ void requestPage( const string& url ){
     // NOTE I am using the `boost::asio::placeholder`s, however you could use the normal bind
     //      placeholders. If you are using C++11's `std::bind` then you must use `std::placeholder`s
     //      instead as they are not compatible.
-    tcp::resolver           resolver( io_service );
-    tcp::resolver::query    query( hostname, service );
-    resolver.async_resolve(
-        query,
+    //
+    // NOTE The lookup goes through `resolverCache` rather than a `tcp::resolver` directly. The
+    //      cache hands back a shared list of endpoints and only queries the system resolver when
+    //      it has no live entry for the host.
+    if( timeouts.resolve.count() ){
+        request->resolveDeadline.expires_after( timeouts.resolve );
+        request->resolveDeadline.async_wait(
+            boost::bind( &resolveDeadlineHandler, boost::asio::placeholders::error, request )
+        );
+    }
+    resolverCache.resolve(
+        request->hostname,
+        request->service,
         boost::bind(
             &resolveHandler,
-            boost::asio::placeholders::error,
-            boost::asio::placeholders::iterator,
-            url
+            ResolverCache::placeholders::error,
+            ResolverCache::placeholders::endpoints,
+            request
         )
     );
 
@@ -103,13 +245,138 @@ void requestPage( const string& url ){
     // `io_service.run()` and then destroy that object when you are done. Note that you only need
     // one `io_service::work` object per `io_service` object.
     io_service.run();
+
+    // Once `run` has returned the `io_service` must be reset before it can be run again for the
+    // next page.
+    io_service.reset();
+}
+
+/// Fetch a single URL as several byte ranges over parallel connections into the output file.
+///
+/// @param url
+/// @param outputPath
+/// @param segments
+void requestSegmented( const string& url, const string& outputPath, const size_t segments ){
+    string service, hostname, path;
+    parseURL( url, service, hostname, path );
+
+    SegmentedDownload::Timeouts segmentTimeouts;
+    segmentTimeouts.resolve = timeouts.resolve;
+    segmentTimeouts.connect = timeouts.connect;
+    segmentTimeouts.write   = timeouts.write;
+    segmentTimeouts.read    = timeouts.read;
+
+    SegmentedDownload::Pointer download(
+        new SegmentedDownload(
+            io_service,
+            resolverCache,
+            hostname,
+            service,
+            path,
+            outputPath,
+            segments,
+            attemptDelay,
+            segmentTimeouts
+        )
+    );
+    download->start( boost::bind( &segmentedHandler, _1, _2 ) );
+    io_service.run();
+    io_service.reset();
+}
+
+// -------------------------------------------------------------------------- //
+// Deadlines.
+
+/// Stop whatever the attempt is doing. The operation in progress fails with `operation_aborted`.
+void cancelAttempt( attempt_ptr attempt ){
+    boost::system::error_code ignored;
+    attempt->deadline.cancel();
+    if( attempt->connector ){
+        attempt->connector->cancel();
+    }
+    if( attempt->socket ){
+        attempt->socket->close( ignored );
+    }
+}
+
+void deadlineHandler( const boost::system::error_code& error, attempt_ptr attempt ){
+    // The timer may have been moved on to the next phase after it expired but before this handler
+    // ran, so make sure it really has passed before giving up on the attempt.
+    if( error || attempt->deadline.expiry() > steady_clock::now() ){
+        return;
+    }
+    attempt->timedOut = true;
+    cancelAttempt( attempt );
+}
+
+/// Arm the attempt's deadline for the next phase. Any earlier deadline is cancelled.
+///
+/// @param attempt
+/// @param phase    Name of the phase, used when reporting a timeout.
+/// @param timeout  How long the phase may take, zero for no limit.
+void startDeadline( attempt_ptr attempt, const char* phase, const milliseconds& timeout ){
+    attempt->phase = phase;
+    if( !timeout.count() ){
+        attempt->deadline.cancel();
+        return;
+    }
+    attempt->deadline.expires_after( timeout );
+    attempt->deadline.async_wait(
+        boost::bind( &deadlineHandler, boost::asio::placeholders::error, attempt )
+    );
+}
+
+/// Drop an attempt which has failed. The application only gives up once there are no attempts
+/// left in the running.
+///
+/// @param request
+/// @param attempt
+/// @param error
+/// @param exitCode
+void attemptFailed(
+    request_ptr                         request,
+    attempt_ptr                         attempt,
+    const boost::system::error_code&    error,
+    const ErrorCodes                    exitCode
+){
+    attempt->deadline.cancel();
+    list< attempt_ptr >::iterator it = find( request->attempts.begin(), request->attempts.end(), attempt );
+    if( it == request->attempts.end() ){
+        // Already cancelled as the loser of a hedged race.
+        return;
+    }
+    request->attempts.erase( it );
+    if( !request->attempts.empty() ){
+        return;
+    }
+
+    request->hedgeTimer.cancel();
+    if( attempt->timedOut ){
+        cerr << attempt->phase << " timeout" << endl;
+        exit( TIMEOUT_FAILURE );
+    }
+    cerr << attempt->phase << " error: " << error << endl;
+    exit( exitCode );
+}
+
+// -------------------------------------------------------------------------- //
+
+void resolveDeadlineHandler(
+    const boost::system::error_code&    error,
+    request_ptr                         request
+){
+    if( !error && request->resolveDeadline.expiry() <= steady_clock::now() ){
+        cerr << "Resolve timeout" << endl;
+        exit( TIMEOUT_FAILURE );
+    }
 }
 
 void resolveHandler(
     const boost::system::error_code&    error,
-    tcp::resolver::iterator             endpoints,
-    string                              url
+    endpoints_ptr                       endpoints,
+    request_ptr                         request
 ){
+    request->resolveDeadline.cancel();
     if( error ){
         // This error can occur if there is a network issue or if the provided hostname or service
         // can not be resolved.
@@ -117,53 +384,65 @@ void resolveHandler(
         exit( RESOLVER_FAILURE );
     }
 
-    // Now that we have resolved the URL we can connect to it. Do note that we must pass along the
-    // socket to the handler ourselves, Boost ASIO only provides the error and iterator to the
-    // callback.
-    socket_ptr socket( new tcp::socket( io_service ) );
-    boost::asio::async_connect(
-        *socket,
-        endpoints,
-        boost::bind(
-            &connectHandler,
-            boost::asio::placeholders::error,
-            boost::asio::placeholders::iterator,
-            socket,
-            url
-        )
+    // Keep the endpoint list with the request so that it outlives every connect attempt.
+    request->endpoints = endpoints;
+    startAttempt( request, endpoints->begin() );
+}
+
+void startAttempt( request_ptr request, endpoint_iterator first ){
+    // Now that we have resolved the URL we can connect to it. Rather than `async_connect`, which
+    // tries one endpoint at a time, a `RacingConnector` staggers attempts across every endpoint
+    // and hands back whichever socket connects first. The list is rotated so that `first` is
+    // tried before the others.
+    ResolverCache::EndpointList order( first, request->endpoints->end() );
+    order.insert( order.end(), request->endpoints->begin(), first );
+
+    attempt_ptr attempt( new Attempt );
+    attempt->connector.reset(
+        new RacingConnector( io_service, order.begin(), order.end(), attemptDelay )
+    );
+    request->attempts.push_back( attempt );
+    startDeadline( attempt, "Connect", timeouts.connect );
+    attempt->connector->start(
+        boost::bind( &connectHandler, _1, _2, _3, request, attempt )
     );
 }
 
 void connectHandler(
     const boost::system::error_code&    error,
-    tcp::resolver::iterator             endpoint,
     socket_ptr                          socket,
-    string                              url
+    const RacingConnector::StatsList&   stats,
+    request_ptr                         request,
+    attempt_ptr                         attempt
 ){
+    attempt->connector.reset();
+    if( connectStats ){
+        cerr << "Connect attempts for " << request->hostname << ":\n" << stats;
+    }
     if( error ){
         // This error can occur if the other side doesn't accept the connection or if there is a
         // network issue.
-        cerr << "Connection error: " << error << endl;
-        exit( CONNECTION_FAILURE );
+        attemptFailed( request, attempt, error, CONNECTION_FAILURE );
+        return;
     }
-
-    // Split the URL into parts.
-    string service, hostname, path;
-    parseURL( url, service, hostname, path );
+    attempt->socket     = socket;
+    attempt->endpoint   = socket->remote_endpoint();
 
     // We are connected to the server, so we can send our HTTP request now. With asynchronous
     // reading and writing we must ensure the buffer being read from or written to exists for the
     // duration of the read or write so once more we will be using a shared pointer and passing it
-    // along with the socket's shared pointer to the handler.
-    string_ptr httpRequest( new string( generateRequest( hostname, path ) ) );
+    // along with the attempt's shared pointer to the handler.
+    string_ptr httpRequest( new string( generateRequest( request->hostname, request->path ) ) );
+    startDeadline( attempt, "Write", timeouts.write );
     boost::asio::async_write(
-        *socket,
+        *attempt->socket,
         boost::asio::buffer( *httpRequest ),
         boost::bind(
             &writeHandler,
             boost::asio::placeholders::error,
             boost::asio::placeholders::bytes_transferred,
-            socket,
+            request,
+            attempt,
             httpRequest
         )
     );
@@ -172,13 +451,106 @@ void connectHandler(
 void writeHandler(
     const boost::system::error_code&    error,
     size_t                              bytes_transferred,
-    socket_ptr                          socket,
+    request_ptr                         request,
+    attempt_ptr                         attempt,
     string_ptr                          writeBuffer
 ){
     if( error ){
         // This error can occur if there is a network issue.
-        cerr << "Write error: " << error << endl;
-        exit( WRITE_FAILURE );
+        attemptFailed( request, attempt, error, WRITE_FAILURE );
+        return;
+    }
+
+    // Wait for the first byte of the response without consuming it. Whichever attempt sees it
+    // first gets to read the response.
+    attempt->sent = steady_clock::now();
+    startDeadline( attempt, "Read", timeouts.read );
+    attempt->socket->async_wait(
+        tcp::socket::wait_read,
+        boost::bind( &firstByteHandler, boost::asio::placeholders::error, request, attempt )
+    );
+
+    // Only the original attempt may trigger a hedge.
+    if( hedgePolicy.enabled && request->attempts.size() == 1 && !request->answered ){
+        const milliseconds delay = firstByteTimes.size() >= hedgePolicy.minSamples
+            ? milliseconds( (long)firstByteTimes.percentile( hedgePolicy.percentile ) )
+            : hedgePolicy.initialDelay;
+        request->hedgeTimer.expires_after( delay );
+        request->hedgeTimer.async_wait(
+            boost::bind( &hedgeHandler, boost::asio::placeholders::error, request )
+        );
+    }
+}
+
+void hedgeHandler(
+    const boost::system::error_code&    error,
+    request_ptr                         request
+){
+    if( error || request->answered || request->attempts.size() != 1 ){
+        return;
+    }
+
+    // Send the duplicate to the next endpoint in the list, wrapping around to a fresh connection
+    // to the first one if there is nothing else to try.
+    endpoint_iterator next = find(
+        request->endpoints->begin(),
+        request->endpoints->end(),
+        request->attempts.front()->endpoint
+    );
+    if( next == request->endpoints->end() || ++next == request->endpoints->end() ){
+        next = request->endpoints->begin();
+    }
+    cerr << "Hedging request to " << *next << endl;
+    startAttempt( request, next );
+}
+
+void firstByteHandler(
+    const boost::system::error_code&    error,
+    request_ptr                         request,
+    attempt_ptr                         attempt
+){
+    if( error ){
+        attemptFailed( request, attempt, error, READ_FAILURE );
+        return;
+    }
+    if( request->answered ){
+        return;
+    }
+
+    // This attempt won. Cancel every other attempt and the hedge timer.
+    request->answered = true;
+    request->hedgeTimer.cancel();
+    firstByteTimes.add(
+        boost::asio::chrono::duration_cast< boost::asio::chrono::microseconds >(
+            steady_clock::now() - attempt->sent
+        ).count() / 1000.0
+    );
+    // Take the losers out of the running before cancelling them, so nothing they call back into
+    // can change the list while it is being walked.
+    list< attempt_ptr > losers;
+    losers.swap( request->attempts );
+    request->attempts.push_back( attempt );
+    for( list< attempt_ptr >::iterator it = losers.begin(); it != losers.end(); ++it ){
+        if( *it != attempt ){
+            cancelAttempt( *it );
+        }
+    }
+
+    // When saving to a file the response body is handed off to a `FileDownload`, which manages
+    // its own growing, double buffered reads and writes the body out on the disk thread.
+    if( outputFile != -1 ){
+        attempt->deadline.cancel();
+        FileDownload::Pointer download(
+            new FileDownload( io_service, disk_service, attempt->socket, outputFile, timeouts.read )
+        );
+        download->start(
+            boost::bind(
+                &downloadHandler,
+                boost::asio::placeholders::error,
+                boost::asio::placeholders::bytes_transferred
+            )
+        );
+        return;
     }
 
     // Now that we've sent our request, lets read our response. Because we're doing asynchronous
@@ -186,13 +558,13 @@ void writeHandler(
     // read handler to recurse into itself until it receives `eof`.
     array_ptr readBuffer( new array_ptr::element_type() );
     boost::asio::async_read(
-        *socket,
+        *attempt->socket,
         boost::asio::buffer( *readBuffer ),
         boost::bind(
             &readHandler,
             boost::asio::placeholders::error,
             boost::asio::placeholders::bytes_transferred,
-            socket,
+            attempt,
             readBuffer
         )
     );
@@ -201,10 +573,14 @@ void writeHandler(
 void readHandler(
     const boost::system::error_code&    error,
     size_t                              bytes_transferred,
-    socket_ptr                          socket,
+    attempt_ptr                         attempt,
     array_ptr                           readBuffer
 ){
     if( error && error != boost::asio::error::eof ){
+        if( attempt->timedOut ){
+            cerr << "Read timeout" << endl;
+            exit( TIMEOUT_FAILURE );
+        }
         cerr << "Read error: " << error << endl;
         exit( READ_FAILURE );
     }
@@ -213,20 +589,44 @@ void readHandler(
     cout.write( readBuffer->data(), bytes_transferred );
 
     // If we haven't reached the end of file yet, trigger another asynchronous read just like the
-    // one in the `writeHandler`.
+    // one in the `writeHandler`. Each read gets a fresh deadline.
     if( error != boost::asio::error::eof ){
+        startDeadline( attempt, "Read", timeouts.read );
         boost::asio::async_read(
-            *socket,
+            *attempt->socket,
             boost::asio::buffer( *readBuffer ),
             boost::bind(
                 &readHandler,
                 boost::asio::placeholders::error,
                 boost::asio::placeholders::bytes_transferred,
-                socket,
+                attempt,
                 readBuffer
             )
         );
     }
+    else {
+        attempt->deadline.cancel();
+    }
+}
+
+void downloadHandler(
+    const boost::system::error_code&    error,
+    size_t                              bytes_written
+){
+    if( error ){
+        cerr << "Download error: " << error.message() << endl;
+        exit( READ_FAILURE );
+    }
+}
+
+void segmentedHandler(
+    const boost::system::error_code&    error,
+    const string&                       what
+){
+    if( error ){
+        cerr << what << ": " << error.message() << endl;
+        exit( READ_FAILURE );
+    }
 }
 
 // -------------------------------------------------------------------------- //
@@ -248,6 +648,13 @@ void parseURL( const string& url, string& service, string& hostname, string& pat
         }
         hostname = url.substr( serviceEnd, hostEnd - serviceEnd );
 
+        // An explicit port takes the place of the service name when resolving.
+        size_t portStart = hostname.find( ":" );
+        if( portStart != string::npos ){
+            service  = hostname.substr( portStart + 1 );
+            hostname = hostname.substr( 0, portStart );
+        }
+
         // Path is everything else.
         path = url.substr( hostEnd );
     }
@@ -269,24 +676,144 @@ string generateRequest( const string& hostname, const string& path ){
     return stream.str();
 }
 
-/// Check that the application arguments are correct and return the only argument this application
-/// accepts.
+/// Application options parsed from the command line.
+struct Options {
+    vector< string >    urls;           ///< Pages to fetch, in order.
+    string              output;         ///< File to write the response bodies to, empty for stdout.
+    size_t              segments;       ///< Parallel ranges to fetch the file in, 0 for a plain GET.
+    Timeouts            timeouts;       ///< Deadline for each phase of a request.
+    HedgePolicy         hedge;          ///< When to send a duplicate request.
+    milliseconds        attemptDelay;   ///< Head start each connection attempt gets.
+    bool                connectStats;   ///< Print the timing of every connection attempt.
+    bool                dnsStats;       ///< Print resolver cache counters when done.
+
+    Options( void )
+        : segments( 0 ),
+          attemptDelay( 250 ),
+          connectStats( false ),
+          dnsStats( false ){}
+}; // end struct Options
+
+/// Check that the application arguments are correct and return the options they describe.
 ///
 /// @param argc The number of arguments the application received.
 /// @param argv The command line arguments.
 ///
-/// @return The first (and only) application argument.
-string checkArgs( const int argc, char* argv[] ){
-    if( argc != 2 ){
-        cerr << "Usage: " << argv[0] << " <url>" << endl;
+/// @return The parsed application options.
+Options checkArgs( const int argc, char* argv[] ){
+    Options options;
+    for( int i = 1; i < argc; ++i ){
+        const string arg = argv[i];
+        if( arg == "--dns-stats" ){
+            options.dnsStats = true;
+        }
+        else if( (arg == "-o" || arg == "--output") && i + 1 < argc ){
+            options.output = argv[ ++i ];
+        }
+        else if( arg == "--segments" && i + 1 < argc ){
+            options.segments = strtoul( argv[ ++i ], NULL, 10 );
+        }
+        else if( arg == "--resolve-timeout" && i + 1 < argc ){
+            options.timeouts.resolve = milliseconds( strtol( argv[ ++i ], NULL, 10 ) );
+        }
+        else if( arg == "--connect-timeout" && i + 1 < argc ){
+            options.timeouts.connect = milliseconds( strtol( argv[ ++i ], NULL, 10 ) );
+        }
+        else if( arg == "--write-timeout" && i + 1 < argc ){
+            options.timeouts.write = milliseconds( strtol( argv[ ++i ], NULL, 10 ) );
+        }
+        else if( arg == "--read-timeout" && i + 1 < argc ){
+            options.timeouts.read = milliseconds( strtol( argv[ ++i ], NULL, 10 ) );
+        }
+        else if( arg == "--hedge" && i + 1 < argc ){
+            options.hedge.enabled = true;
+            options.hedge.percentile = strtod( argv[ ++i ], NULL );
+        }
+        else if( arg == "--hedge-delay" && i + 1 < argc ){
+            options.hedge.initialDelay = milliseconds( strtol( argv[ ++i ], NULL, 10 ) );
+        }
+        else if( arg == "--attempt-delay" && i + 1 < argc ){
+            options.attemptDelay = milliseconds( strtol( argv[ ++i ], NULL, 10 ) );
+        }
+        else if( arg == "--connect-stats" ){
+            options.connectStats = true;
+        }
+        else {
+            options.urls.push_back( arg );
+        }
+    }
+
+    // A segmented download writes into place in a single file, so it needs exactly one URL and
+    // somewhere to put it.
+    const bool badSegments = options.segments && (options.output.empty() || options.urls.size() != 1);
+    if( options.urls.empty() || badSegments ){
+        cerr
+            << "Usage: " << argv[0] << " [options] [-o <file>] <url> [<url> ...]" << endl
+            << "       " << argv[0] << " [options] --segments <n> -o <file> <url>" << endl
+            << "Options:" << endl
+            << "  --dns-stats               Print resolver cache counters when done." << endl
+            << "  --resolve-timeout <ms>    Per-phase deadlines, 0 disables. Reads are timed" << endl
+            << "  --connect-timeout <ms>    individually." << endl
+            << "  --write-timeout <ms>" << endl
+            << "  --read-timeout <ms>" << endl
+            << "  --hedge <percentile>      Send a duplicate request to the next endpoint when the" << endl
+            << "                            first byte is slower than this percentile." << endl
+            << "  --hedge-delay <ms>        Hedge delay to use until there are enough samples." << endl
+            << "  --attempt-delay <ms>      Head start for each racing connection attempt." << endl
+            << "  --connect-stats           Print the timing of every connection attempt." << endl;
         exit( BAD_ARGUMENTS );
     }
-    return argv[1];
+    return options;
+}
+
+/// Fetch every URL in turn, writing the pages to stdout or one after another into the output file.
+///
+/// @param options
+void requestPages( const Options& options ){
+    boost::scoped_ptr< boost::asio::io_service::work > diskWork;
+    boost::thread diskThread;
+    if( !options.output.empty() ){
+        outputFile = open( options.output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+        if( outputFile == -1 ){
+            cerr << "Could not open \"" << options.output << "\" for writing." << endl;
+            exit( OUTPUT_FAILURE );
+        }
+        diskWork.reset( new boost::asio::io_service::work( disk_service ) );
+        diskThread = boost::thread( boost::bind( &boost::asio::io_service::run, &disk_service ) );
+    }
+
+    for( size_t i = 0; i < options.urls.size(); ++i ){
+        requestPage( options.urls[i] );
+    }
+
+    if( outputFile != -1 ){
+        diskWork.reset();
+        diskThread.join();
+        close( outputFile );
+    }
 }
 
 int main( int argc, char* argv[] ){
-    const string& url = checkArgs( argc, argv );
-    requestPage( url );
+    const Options& options = checkArgs( argc, argv );
+    timeouts    = options.timeouts;
+    hedgePolicy = options.hedge;
+    attemptDelay = options.attemptDelay;
+    connectStats = options.connectStats;
+    if( options.segments ){
+        requestSegmented( options.urls[0], options.output, options.segments );
+    }
+    else {
+        requestPages( options );
+    }
+
+    if( options.dnsStats ){
+        const ResolverCache::Stats& stats = resolverCache.getStats();
+        cerr
+            << "DNS cache: "
+            << stats.misses         << " misses, "
+            << stats.hits           << " hits, "
+            << stats.negativeHits   << " negative hits, "
+            << stats.coalesced      << " coalesced" << endl;
+    }
     return SUCCESS;
 }
-
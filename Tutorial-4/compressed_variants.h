@@ -0,0 +1,299 @@
+///
+/// @file
+/// Gzip and brotli compressed copies of the server's text files, made in the background and kept
+/// in memory, and the `Accept-Encoding` negotiation which picks between them.
+///
+
+#ifndef TUTORIAL4_COMPRESSED_VARIANTS_H
+#define TUTORIAL4_COMPRESSED_VARIANTS_H
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/smart_ptr.hpp>
+#include <boost/thread.hpp>
+#include <brotli/encode.h>
+#include <cctype>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <list>
+#include <map>
+#include <sstream>
+#include <string>
+#include <sys/types.h>
+#include <zlib.h>
+
+using namespace std;
+
+/// The content codings the server can send, most preferred first.
+enum Encoding {
+    BROTLI = 0,
+    GZIP,
+    IDENTITY,
+    ENCODING_COUNT
+};
+
+/// @return The coding's name, as used in `Accept-Encoding` and `Content-Encoding`.
+inline const char* encodingName( const Encoding encoding ){
+    static const char* names[ ENCODING_COUNT ] = { "br", "gzip", "identity" };
+    return names[ encoding ];
+}
+
+/// @return The extension of a precompressed sibling file, such as `app.js.br`.
+inline const char* encodingExtension( const Encoding encoding ){
+    static const char* extensions[ ENCODING_COUNT ] = { ".br", ".gz", "" };
+    return extensions[ encoding ];
+}
+
+/// Work out which codings a client accepts from its `Accept-Encoding` header.
+///
+/// Each coding may carry a `q` value, and `q=0` refuses it. A `*` covers every coding not named.
+///
+/// @param header   The header's value, empty if the client didn't send one.
+/// @param accepted Set for each coding the client will take. Identity is always accepted.
+inline void parseAcceptEncoding( const string& header, bool accepted[ ENCODING_COUNT ] ){
+    map< string, double > quality;
+    stringstream codings( header );
+    string coding;
+    while( getline( codings, coding, ',' ) ){
+        string name;
+        double q = 1;
+        const size_t semicolon = coding.find( ';' );
+        for( size_t i = 0; i < coding.size() && i < semicolon; ++i ){
+            if( !isspace( (unsigned char)coding[ i ] ) ){
+                name += (char)tolower( (unsigned char)coding[ i ] );
+            }
+        }
+        const size_t qAt = coding.find( "q=", semicolon );
+        if( semicolon != string::npos && qAt != string::npos ){
+            q = strtod( coding.c_str() + qAt + 2, NULL );
+        }
+        quality[ name ] = q;
+    }
+
+    for( size_t i = 0; i < IDENTITY; ++i ){
+        map< string, double >::const_iterator it = quality.find( encodingName( (Encoding)i ) );
+        if( it == quality.end() ){
+            it = quality.find( "*" );
+        }
+        accepted[ i ] = it != quality.end() && it->second > 0;
+    }
+    accepted[ IDENTITY ] = true;
+}
+
+// ************************************************************************** //
+
+/// Compressed copies of files, keyed by path and checked against the file's modification time and
+/// size, so an edited file is compressed again rather than served stale.
+///
+/// Compressing a large file to brotli takes far longer than serving it, so it is never done while
+/// a request waits. The first request for a file gets it uncompressed and queues it for the
+/// cache's own thread, which runs its own `io_service` just like the disk thread of the tutorial 3
+/// client. Each file is compressed once into every coding, and requests after that are served the
+/// compressed copy from memory. Copies which come out no smaller than the file are thrown away.
+///
+/// Copies are kept up to a total size, and the oldest are dropped first to make room.
+class CompressedVariants : private boost::noncopyable {
+public:
+    typedef boost::shared_ptr< const string > Variant;
+
+    /// Files smaller than this aren't worth compressing.
+    static const size_t MIN_SIZE = 256;
+
+private:
+    /// The copies of one version of one file.
+    struct Entry {
+        time_t      modified;
+        off_t       size;
+        bool        ready;                          ///< False while it is being compressed.
+        Variant     variants[ IDENTITY ];           ///< Null if that coding didn't help.
+
+        Entry( void ) : modified( 0 ), size( 0 ), ready( false ){}
+    }; // end struct Entry
+
+    typedef map< string, Entry > EntryMap;
+
+    const size_t                m_maxBytes;
+    EntryMap                    m_entries;
+    list< string >              m_order;    ///< Compressed files, oldest first.
+    size_t                      m_bytes;
+    boost::mutex                m_mutex;
+
+    boost::asio::io_service     m_ioService;
+    boost::scoped_ptr< boost::asio::io_service::work > m_work;
+    boost::thread               m_thread;
+
+    static Variant _gzip( const string& data ){
+        z_stream stream = z_stream();
+        if( deflateInit2( &stream, 9, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY ) != Z_OK ){
+            return Variant();
+        }
+        boost::shared_ptr< string > out( new string( deflateBound( &stream, data.size() ), '\0' ) );
+        stream.next_in   = (Bytef*)data.data();
+        stream.avail_in  = (uInt)data.size();
+        stream.next_out  = (Bytef*)&(*out)[ 0 ];
+        stream.avail_out = (uInt)out->size();
+        const int result = deflate( &stream, Z_FINISH );
+        out->resize( stream.total_out );
+        deflateEnd( &stream );
+        return result == Z_STREAM_END ? out : Variant();
+    }
+
+    static Variant _brotli( const string& data ){
+        size_t size = BrotliEncoderMaxCompressedSize( data.size() );
+        if( !size ){
+            return Variant();
+        }
+        boost::shared_ptr< string > out( new string( size, '\0' ) );
+        if( !BrotliEncoderCompress(
+            BROTLI_MAX_QUALITY,
+            BROTLI_DEFAULT_WINDOW,
+            BROTLI_MODE_TEXT,
+            data.size(),
+            (const uint8_t*)data.data(),
+            &size,
+            (uint8_t*)&(*out)[ 0 ]
+        ) ){
+            return Variant();
+        }
+        out->resize( size );
+        return out;
+    }
+
+    /// Runs on the cache's own thread.
+    void _compress( const string& filename, const time_t modified, const off_t size ){
+        ifstream file( filename.c_str(), ios::binary );
+        stringstream contents;
+        contents << file.rdbuf();
+        const string& data = contents.str();
+
+        Variant variants[ IDENTITY ];
+        if( file && (off_t)data.size() == size ){
+            variants[ BROTLI ]  = _brotli( data );
+            variants[ GZIP ]    = _gzip( data );
+        }
+
+        boost::mutex::scoped_lock lock( m_mutex );
+        EntryMap::iterator it = m_entries.find( filename );
+        if( it == m_entries.end() || it->second.modified != modified || it->second.size != size ){
+            // The file changed while it was being compressed, and has been queued again.
+            return;
+        }
+        Entry& entry = it->second;
+        size_t bytes = 0;
+        for( size_t i = 0; i < IDENTITY; ++i ){
+            if( variants[ i ] && variants[ i ]->size() < data.size() ){
+                entry.variants[ i ] = variants[ i ];
+                bytes += variants[ i ]->size();
+            }
+        }
+        entry.ready = true;
+
+        // Make room, oldest first.
+        while( m_bytes + bytes > m_maxBytes && !m_order.empty() ){
+            _forget( m_order.front() );
+        }
+        if( bytes > m_maxBytes ){
+            for( size_t i = 0; i < IDENTITY; ++i ){
+                entry.variants[ i ].reset();
+            }
+            return;
+        }
+        m_bytes += bytes;
+        m_order.push_back( filename );
+    }
+
+    /// Drop a file's copies. The lock must be held.
+    void _forget( const string& filename ){
+        EntryMap::iterator it = m_entries.find( filename );
+        if( it == m_entries.end() || !it->second.ready ){
+            return;
+        }
+        for( size_t i = 0; i < IDENTITY; ++i ){
+            if( it->second.variants[ i ] ){
+                m_bytes -= it->second.variants[ i ]->size();
+            }
+        }
+        m_order.remove( filename );
+        m_entries.erase( it );
+    }
+
+public:
+    /// Constructor. Starts the cache's thread.
+    ///
+    /// @param maxBytes How much memory the compressed copies may take up.
+    CompressedVariants( const size_t maxBytes )
+        : m_maxBytes( maxBytes ),
+          m_bytes( 0 ),
+          m_work( new boost::asio::io_service::work( m_ioService ) )
+    {
+        m_thread = boost::thread( boost::bind( &boost::asio::io_service::run, &m_ioService ) );
+    }
+
+    /// Stop the thread, abandoning anything still queued.
+    ~CompressedVariants( void ){
+        m_work.reset();
+        m_ioService.stop();
+        m_thread.join();
+    }
+
+    /// @return True if a path looks like a text file worth compressing.
+    static bool compressible( const string& path ){
+        static const char* extensions[] = {
+            ".html", ".htm", ".css", ".js", ".mjs", ".json", ".svg", ".txt", ".xml", ".csv", ".md"
+        };
+        const size_t dot = path.rfind( '.' );
+        if( dot == string::npos || path.find( '/', dot ) != string::npos ){
+            return false;
+        }
+        string extension = path.substr( dot );
+        for( size_t i = 0; i < extension.size(); ++i ){
+            extension[ i ] = (char)tolower( (unsigned char)extension[ i ] );
+        }
+        for( size_t i = 0; i < sizeof( extensions ) / sizeof( extensions[ 0 ] ); ++i ){
+            if( extension == extensions[ i ] ){
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /// Get a compressed copy of a file, queueing the file to be compressed if it hasn't been yet.
+    /// Never waits for compression.
+    ///
+    /// @param filename
+    /// @param modified The file's modification time, as it is now.
+    /// @param size     The file's size, as it is now.
+    /// @param encoding
+    ///
+    /// @return The copy, or null if there isn't one yet or the coding doesn't make it smaller.
+    Variant get(
+        const string& filename,
+        const time_t modified,
+        const off_t size,
+        const Encoding encoding
+    ){
+        if( size < (off_t)MIN_SIZE || (size_t)size > m_maxBytes ){
+            return Variant();
+        }
+
+        boost::mutex::scoped_lock lock( m_mutex );
+        EntryMap::iterator it = m_entries.find( filename );
+        if( it != m_entries.end() && it->second.modified == modified && it->second.size == size ){
+            return it->second.variants[ encoding ];
+        }
+
+        // Nothing for this version of the file, so compress it in the background.
+        _forget( filename );
+        Entry& entry = m_entries[ filename ];
+        entry.modified  = modified;
+        entry.size      = size;
+        m_ioService.post(
+            boost::bind( &CompressedVariants::_compress, this, filename, modified, size )
+        );
+        return Variant();
+    }
+}; // end class CompressedVariants
+
+#endif // TUTORIAL4_COMPRESSED_VARIANTS_H
@@ -0,0 +1,442 @@
+///
+/// @file
+/// A cache of upstream responses for the reverse proxy, kept in memory and on disk. How long each
+/// response stays fresh comes from its `Cache-Control` or `Expires` headers, and concurrent misses
+/// for the same path are coalesced into a single upstream fetch.
+///
+
+#ifndef TUTORIAL4_RESPONSE_CACHE_H
+#define TUTORIAL4_RESPONSE_CACHE_H
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
+#include <boost/smart_ptr.hpp>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <map>
+#include <sstream>
+#include <string>
+
+#include "resolver_cache.h"
+#include "upstream_fetch.h"
+
+using namespace std;
+
+/// An upstream response, split up so it can be sent again with fresh headers.
+struct CachedResponse {
+    typedef boost::shared_ptr< const CachedResponse > Pointer;
+
+    string  statusLine; ///< Without the line break.
+    string  headers;    ///< End to end headers only, each ending in a line break.
+    string  body;
+    time_t  stored;     ///< When the response was received, less any age the upstream gave it.
+    time_t  expires;    ///< When it stops being fresh.
+    bool    storable;   ///< False if `Cache-Control` forbids keeping it at all.
+
+    CachedResponse( void ) : stored( 0 ), expires( 0 ), storable( false ){}
+
+    /// Build the whole response to send to a client.
+    ///
+    /// @param now
+    /// @param cacheStatus  Reported in the `X-Cache` header.
+    string toHttp( const time_t now, const char* cacheStatus ) const {
+        stringstream response;
+        response
+            << statusLine << "\r\n"
+            << headers
+            << "Age: " << (now > stored ? now - stored : 0) << "\r\n"
+            << "X-Cache: " << cacheStatus << "\r\n"
+            << "Connection: close\r\n"
+            << "Content-Length: " << body.size() << "\r\n"
+            << "\r\n"
+            << body;
+        return response.str();
+    }
+
+    /// The response sent when the upstream can't be reached. It is never cached.
+    static Pointer badGateway( const time_t now ){
+        boost::shared_ptr< CachedResponse > response( new CachedResponse );
+        response->statusLine    = "HTTP/1.1 502 Bad Gateway";
+        response->stored        = now;
+        response->expires       = now;
+        return response;
+    }
+
+    /// Parse a raw HTTP/1.0 response and work out how long it stays fresh.
+    ///
+    /// Freshness follows RFC 9111 for a shared cache: `no-store` and `private` responses are not
+    /// kept, `s-maxage` beats `max-age`, which beats `Expires`, and anything else which is a 200,
+    /// 301 or 404 is kept for the default time to live. There is no revalidation, so `no-cache`
+    /// responses, which are never fresh, aren't kept either.
+    ///
+    /// @param raw
+    /// @param now
+    /// @param defaultTtl   Seconds to keep a response which says nothing about it.
+    ///
+    /// @return Null if the response can't be parsed.
+    static Pointer parse( const string& raw, const time_t now, const time_t defaultTtl ){
+        const size_t headEnd = raw.find( "\r\n\r\n" );
+        const size_t statusEnd = raw.find( "\r\n" );
+        if( headEnd == string::npos || raw.compare( 0, 5, "HTTP/" ) != 0 ){
+            return Pointer();
+        }
+
+        boost::shared_ptr< CachedResponse > response( new CachedResponse );
+        response->statusLine = raw.substr( 0, statusEnd );
+        response->body       = raw.substr( headEnd + 4 );
+        const size_t space = response->statusLine.find( ' ' );
+        const int status = space == string::npos ? 0 : atoi( response->statusLine.c_str() + space );
+
+        long maxAge = -1, sharedMaxAge = -1, age = 0;
+        time_t expires = 0, date = 0;
+        bool noStore = false, noCache = false;
+        size_t lineStart = statusEnd + 2;
+        while( lineStart < headEnd ){
+            const size_t lineEnd = raw.find( "\r\n", lineStart );
+            const string line = raw.substr( lineStart, lineEnd - lineStart );
+            lineStart = lineEnd + 2;
+            const size_t colon = line.find( ':' );
+            if( colon == string::npos ){
+                continue;
+            }
+            const size_t valueStart = line.find_first_not_of( " \t", colon + 1 );
+            const string name  = _lower( line.substr( 0, colon ) );
+            const string value = valueStart == string::npos ? "" : line.substr( valueStart );
+
+            if( name == "cache-control" ){
+                const string directives = _lower( value );
+                noStore = directives.find( "no-store" ) != string::npos
+                    || directives.find( "private" ) != string::npos;
+                noCache = directives.find( "no-cache" ) != string::npos;
+                maxAge = _directive( directives, "max-age=" );
+                sharedMaxAge = _directive( directives, "s-maxage=" );
+            }
+            else if( name == "expires" ){
+                expires = _parseDate( value );
+            }
+            else if( name == "date" ){
+                date = _parseDate( value );
+            }
+            else if( name == "age" ){
+                age = atol( value.c_str() );
+            }
+
+            // Hop by hop headers, and the ones `toHttp` writes itself, aren't kept.
+            if( name != "connection" && name != "keep-alive" && name != "transfer-encoding" &&
+                name != "content-length" && name != "age" && name != "x-cache" )
+            {
+                response->headers += line + "\r\n";
+            }
+        }
+
+        long ttl;
+        if( noCache ){
+            ttl = 0;
+        }
+        else if( sharedMaxAge >= 0 ){
+            ttl = sharedMaxAge;
+        }
+        else if( maxAge >= 0 ){
+            ttl = maxAge;
+        }
+        else if( expires ){
+            ttl = expires > (date ? date : now) ? (long)(expires - (date ? date : now)) : 0;
+        }
+        else if( status == 200 || status == 301 || status == 404 ){
+            ttl = (long)defaultTtl;
+        }
+        else {
+            ttl = 0;
+        }
+
+        response->stored    = now - age;
+        response->expires   = response->stored + ttl;
+        response->storable  = !noStore && ttl > age;
+        return response;
+    }
+
+private:
+    static string _lower( string text ){
+        for( size_t i = 0; i < text.size(); ++i ){
+            text[ i ] = (char)tolower( (unsigned char)text[ i ] );
+        }
+        return text;
+    }
+
+    /// @return The number after `name` in a lowercased `Cache-Control` value, or -1 if it isn't
+    ///         there.
+    static long _directive( const string& directives, const string& name ){
+        size_t at = directives.find( name );
+        while( at != string::npos && at > 0 && directives[ at - 1 ] != ' ' &&
+            directives[ at - 1 ] != ',' )
+        {
+            at = directives.find( name, at + 1 );
+        }
+        return at == string::npos ? -1 : atol( directives.c_str() + at + name.size() );
+    }
+
+    /// Parse an IMF-fixdate, such as `Sun, 06 Nov 1994 08:49:37 GMT`.
+    ///
+    /// @return Zero if it isn't one.
+    static time_t _parseDate( const string& value ){
+        struct tm parsed = tm();
+        const char* end = strptime( value.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &parsed );
+        return end ? timegm( &parsed ) : 0;
+    }
+}; // end struct CachedResponse
+
+// ************************************************************************** //
+
+/// Serves upstream responses from memory, then from disk, and fetches them from the upstream as a
+/// last resort.
+///
+/// Fresh responses are kept in memory up to a total size, least recently used first out, and every
+/// storable response is also written to the cache directory, so the disk holds what memory has let
+/// go of and what was cached before a restart. Like `ResolverCache`, a miss for a path which is
+/// already being fetched waits for that fetch rather than starting another one, so a burst of
+/// requests for a page nobody has asked for yet costs the upstream a single request.
+///
+/// The cache is used from the one thread running the server's `io_service`, so it does no locking
+/// of its own. Reading and writing the disk is done on that thread, just as the server reads its
+/// own files.
+class ResponseCache {
+public:
+    /// Function prototype for fetch handlers. The cache status is `HIT`, `DISK` or `MISS`.
+    typedef boost::function< void( CachedResponse::Pointer, const char* ) > FetchCallback;
+
+private:
+    typedef list< string >          LruList;
+    typedef list< FetchCallback >   CallbackList;
+
+    struct Entry {
+        CachedResponse::Pointer response;   ///< Null while nothing is cached in memory.
+        LruList::iterator       lru;        ///< Where the path is in `m_lru`, if cached.
+        bool                    fetching;   ///< True while an upstream fetch is in flight.
+        CallbackList            waiting;    ///< Callbacks waiting on the fetch.
+
+        Entry( void ) : fetching( false ){}
+    }; // end struct Entry
+
+    typedef map< string, Entry > EntryMap;
+
+    boost::asio::io_service&    m_ioService;
+    ResolverCache               m_resolver;
+    const string                m_host;
+    const string                m_service;
+    const string                m_directory;    ///< Empty to keep nothing on disk.
+    const time_t                m_defaultTtl;
+    const size_t                m_maxBytes;     ///< Memory the cached responses may take up.
+    const UpstreamFetch::Timeout m_timeout;
+    EntryMap                    m_entries;
+    LruList                     m_lru;          ///< Cached paths, most recently used first.
+    size_t                      m_bytes;
+
+    static size_t _size( const CachedResponse& response ){
+        return response.statusLine.size() + response.headers.size() + response.body.size();
+    }
+
+    /// Where a path is cached on disk: a 64 bit FNV-1a hash of it, in hex.
+    string _diskPath( const string& path ) const {
+        boost::uint64_t hash = 14695981039346656037ULL;
+        for( size_t i = 0; i < path.size(); ++i ){
+            hash = (hash ^ (unsigned char)path[ i ]) * 1099511628211ULL;
+        }
+        char name[ 17 ];
+        snprintf( name, sizeof( name ), "%016llx", (unsigned long long)hash );
+        return m_directory + "/" + name;
+    }
+
+    /// Write a response to the cache directory, by way of a temporary file so a half written one
+    /// is never read back.
+    ///
+    /// The file is the path, the stored and expiry times and the sizes of the status line and
+    /// headers, a line each, followed by the response itself.
+    void _writeDisk( const string& path, const CachedResponse& response ) const {
+        if( m_directory.empty() ){
+            return;
+        }
+        const string file = _diskPath( path );
+        const string temporary = file + ".tmp";
+        {
+            ofstream out( temporary.c_str(), ios::binary | ios::trunc );
+            out << path << "\n" << response.stored << "\n" << response.expires << "\n"
+                << response.statusLine.size() << "\n" << response.headers.size() << "\n"
+                << response.statusLine << response.headers << response.body;
+            if( !out ){
+                cerr << "Unable to write cache file " << temporary << endl;
+                return;
+            }
+        }
+        rename( temporary.c_str(), file.c_str() );
+    }
+
+    /// @return The response cached on disk for a path, or null if there is none or it's stale.
+    CachedResponse::Pointer _readDisk( const string& path, const time_t now ) const {
+        if( m_directory.empty() ){
+            return CachedResponse::Pointer();
+        }
+        const string file = _diskPath( path );
+        ifstream in( file.c_str(), ios::binary );
+        string storedPath;
+        size_t statusSize, headersSize;
+        boost::shared_ptr< CachedResponse > response( new CachedResponse );
+        if( !getline( in, storedPath ) || storedPath != path ||
+            !(in >> response->stored >> response->expires >> statusSize >> headersSize) ||
+            in.get() != '\n' )
+        {
+            return CachedResponse::Pointer();
+        }
+        if( response->expires <= now ){
+            remove( file.c_str() );
+            return CachedResponse::Pointer();
+        }
+
+        stringstream rest;
+        rest << in.rdbuf();
+        const string& data = rest.str();
+        if( data.size() < statusSize + headersSize ){
+            return CachedResponse::Pointer();
+        }
+        response->statusLine    = data.substr( 0, statusSize );
+        response->headers       = data.substr( statusSize, headersSize );
+        response->body          = data.substr( statusSize + headersSize );
+        response->storable      = true;
+        return response;
+    }
+
+    /// Keep a response in memory, dropping the least recently used ones to make room.
+    void _remember( const string& path, Entry& entry, CachedResponse::Pointer response ){
+        _forget( entry );
+        const size_t size = _size( *response );
+        if( size > m_maxBytes ){
+            return;
+        }
+        while( m_bytes + size > m_maxBytes && !m_lru.empty() ){
+            _forget( m_entries[ m_lru.back() ] );
+        }
+        entry.response = response;
+        entry.lru = m_lru.insert( m_lru.begin(), path );
+        m_bytes += size;
+    }
+
+    void _forget( Entry& entry ){
+        if( entry.response ){
+            m_bytes -= _size( *entry.response );
+            m_lru.erase( entry.lru );
+            entry.response.reset();
+        }
+    }
+
+    void _fetchHandler( const UpstreamFetch::Error& error, const string& raw, const string& path ){
+        const time_t now = time( NULL );
+        CachedResponse::Pointer response;
+        if( error ){
+            cerr << "Upstream error fetching " << path << ": " << error.message() << endl;
+        }
+        else {
+            response = CachedResponse::parse( raw, now, m_defaultTtl );
+            if( !response ){
+                cerr << "Upstream sent an unreadable response for " << path << endl;
+            }
+        }
+        if( !response ){
+            response = CachedResponse::badGateway( now );
+        }
+
+        Entry& entry = m_entries[ path ];
+        entry.fetching = false;
+        if( response->storable ){
+            _remember( path, entry, response );
+            _writeDisk( path, *response );
+        }
+
+        // Paths with nothing to show for it aren't worth an entry.
+        CallbackList waiting;
+        waiting.swap( entry.waiting );
+        if( !entry.response ){
+            m_entries.erase( path );
+        }
+        for( CallbackList::iterator it = waiting.begin(); it != waiting.end(); ++it ){
+            (*it)( response, "MISS" );
+        }
+    }
+
+public:
+    /// Constructor.
+    ///
+    /// @param io_service
+    /// @param host         Upstream host.
+    /// @param service      Upstream port or service name.
+    /// @param directory    Where to keep responses on disk, empty for nowhere. Must exist.
+    /// @param defaultTtl   Seconds to keep responses which say nothing about it.
+    /// @param maxBytes     How much memory the responses kept in memory may take up.
+    /// @param timeout      How long an upstream fetch may take, zero for no limit.
+    ResponseCache(
+        boost::asio::io_service&        io_service,
+        const string&                   host,
+        const string&                   service,
+        const string&                   directory,
+        const time_t                    defaultTtl,
+        const size_t                    maxBytes,
+        const UpstreamFetch::Timeout&   timeout
+    )
+        : m_ioService( io_service ),
+          m_resolver( io_service ),
+          m_host( host ),
+          m_service( service ),
+          m_directory( directory ),
+          m_defaultTtl( defaultTtl ),
+          m_maxBytes( maxBytes ),
+          m_timeout( timeout ),
+          m_bytes( 0 ){}
+
+    /// Get the response for a path, from the cache if there's a fresh one.
+    ///
+    /// @param path
+    /// @param callback Called with the response once there is one, which may be before `fetch`
+    ///                 returns.
+    void fetch( const string& path, FetchCallback callback ){
+        const time_t now = time( NULL );
+        Entry& entry = m_entries[ path ];
+
+        // Someone is already fetching this path, so just wait on their answer.
+        if( entry.fetching ){
+            entry.waiting.push_back( callback );
+            return;
+        }
+
+        if( entry.response && entry.response->expires > now ){
+            m_lru.splice( m_lru.begin(), m_lru, entry.lru );
+            callback( entry.response, "HIT" );
+            return;
+        }
+        _forget( entry );
+
+        const CachedResponse::Pointer stored = _readDisk( path, now );
+        if( stored ){
+            _remember( path, entry, stored );
+            callback( stored, "DISK" );
+            return;
+        }
+
+        // Otherwise fetch it and make everyone else wait on the fetch.
+        cerr << "Fetching " << path << " from upstream" << endl;
+        entry.fetching = true;
+        entry.waiting.push_back( callback );
+        UpstreamFetch::Pointer upstream(
+            new UpstreamFetch( m_ioService, m_resolver, m_host, m_service, path, m_timeout )
+        );
+        upstream->start(
+            boost::bind( &ResponseCache::_fetchHandler, this, _1, _2, path )
+        );
+    }
+}; // end class ResponseCache
+
+#endif // TUTORIAL4_RESPONSE_CACHE_H
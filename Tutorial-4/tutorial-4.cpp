@@ -11,11 +11,25 @@
 ///         boost::system::error_code& as the last parameter. In this case the error will be passed
 ///         back through that parameter instead of an exception being thrown.
 ///
+/// @note   Given an upstream with `--upstream <host>:<port>`, the server is also a caching reverse
+///         proxy. Requests for files it doesn't have are fetched from the upstream, and the
+///         responses are kept in memory and on disk for as long as their headers allow.
+///
+/// @note   Text files go out gzip or brotli compressed to clients which accept it, from a
+///         precompressed `.gz` or `.br` sibling if there is one and otherwise from a copy
+///         compressed in the background.
+///
+/// @note   Each handler is a trace point. Pass `--trace <file>` after the path and the server
+///         writes a Chrome trace of them to the file whenever it gets `SIGUSR1`.
+///
 
 #include <boost/array.hpp>
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
+#include <boost/smart_ptr.hpp>
 #include <boost/system/system_error.hpp>
+#include <cstdlib>
+#include <ctime>
 #include <exception>
 #include <iostream>
 #include <fstream>
@@ -25,6 +39,10 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "compressed_variants.h"
+#include "response_cache.h"
+#include "trace.h"
+
 using namespace std;
 using boost::asio::ip::tcp;
 
@@ -41,7 +59,36 @@ enum ErrorCodes {
 
 const unsigned short HTTP_PORT = 80;
 
-string generateResponse( const string& pathToRoot, stringstream& request );
+string parseRequest( stringstream& request );
+string parseHeader( stringstream& request, const string& name );
+bool isFile( const string& filename );
+string generateResponse(
+    const string& pathToRoot,
+    const string& path,
+    const string& acceptEncoding,
+    CompressedVariants* variants
+);
+
+/// Server options parsed from the command line.
+struct Options {
+    string          pathToRoot;
+    unsigned short  port;
+    string          trace;          ///< File to write traces to, empty for no tracing.
+    string          upstreamHost;   ///< Where missing files come from, empty for nowhere.
+    string          upstreamPort;
+    long            upstreamTimeout;    ///< Milliseconds an upstream fetch may take, 0 for ever.
+    string          cacheDir;       ///< Where to keep responses on disk, empty for nowhere.
+    time_t          cacheTtl;       ///< Seconds to keep responses which don't say how long.
+    size_t          cacheBytes;     ///< Memory the cached responses may take up.
+    size_t          compressBytes;  ///< Memory for compressed copies, 0 to only use siblings.
+
+    Options( void )
+        : port( HTTP_PORT ),
+          upstreamTimeout( 30000 ),
+          cacheTtl( 60 ),
+          cacheBytes( 64 * 1024 * 1024 ),
+          compressBytes( 32 * 1024 * 1024 ){}
+}; // end struct Options
 
 // Again we will be passing the data around between the asynchronous functions, so we will be using
 // a shared pointer to manage destruction for us when the data becomes unused.
@@ -59,6 +106,9 @@ private:
     boost::asio::io_service m_io_service;
     tcp::acceptor m_acceptor;
     const string m_pathToRoot;
+    boost::scoped_ptr< TraceDumper > m_trace;
+    boost::scoped_ptr< ResponseCache > m_cache;     ///< Set if proxying to an upstream.
+    boost::scoped_ptr< CompressedVariants > m_variants; ///< Set if compressing files.
 
     void _accept( void ){
         // The asynchronous accept method will call back once a new connection has arrived or if
@@ -76,6 +126,9 @@ private:
     }
 
     void _acceptHandler( const boost::system::error_code& error, socket_ptr socket ){
+        // Connections are told apart in traces by their socket's file descriptor.
+        TRACE_SCOPE( "accept", socket->native_handle() );
+
         // Immediately set up another acceptor. Since we are doing things asynchronously this call
         // will not block and we'll be ready to accept the next connection right away.
         _accept();
@@ -106,13 +159,42 @@ private:
         socket_ptr socket,
         streambuf_ptr readBuffer
     ){
+        TRACE_SCOPE( "read", socket->native_handle() );
+
         // Convert the buffer into a stringstream.
         istream stream( readBuffer.get() );
         stringstream request;
         stream >> request.rdbuf();
+        const string path = parseRequest( request );
+        const string acceptEncoding = parseHeader( request, "accept-encoding" );
+
+        // Files we don't have come from the upstream, if there is one. The cache calls back once
+        // it has the response, straight away if it is cached.
+        if( m_cache && !isFile( m_pathToRoot + path ) ){
+            m_cache->fetch(
+                path,
+                boost::bind( &Server::_proxyHandler, this, _1, _2, socket )
+            );
+            return;
+        }
 
         // Now send our response back to the client. Nothing new here.
-        string_ptr response( new string( generateResponse( m_pathToRoot, request ) ) );
+        string_ptr response( new string(
+            generateResponse( m_pathToRoot, path, acceptEncoding, m_variants.get() )
+        ) );
+        _writeResponse( socket, response );
+    }
+
+    void _proxyHandler(
+        CachedResponse::Pointer response,
+        const char* cacheStatus,
+        socket_ptr socket
+    ){
+        string_ptr http( new string( response->toHttp( time( NULL ), cacheStatus ) ) );
+        _writeResponse( socket, http );
+    }
+
+    void _writeResponse( socket_ptr socket, string_ptr response ){
         boost::asio::async_write(
             *socket,
             boost::asio::buffer( *response ),
@@ -133,6 +215,8 @@ private:
         socket_ptr socket,
         string_ptr response
     ){
+        TRACE_SCOPE( "write", socket->native_handle() );
+
         // Finally, shut down the socket. We aren't supporting connection: keep-alive with this
         // server.
         try {
@@ -147,10 +231,27 @@ private:
     }
 
 public:
-    Server( const string& pathToRoot )
-        : m_acceptor( m_io_service, tcp::endpoint( tcp::v4(), HTTP_PORT ) ),
-          m_pathToRoot( pathToRoot )
+    Server( const Options& options )
+        : m_acceptor( m_io_service, tcp::endpoint( tcp::v4(), options.port ) ),
+          m_pathToRoot( options.pathToRoot )
     {
+        if( !options.trace.empty() ){
+            m_trace.reset( new TraceDumper( m_io_service, options.trace ) );
+        }
+        if( options.compressBytes ){
+            m_variants.reset( new CompressedVariants( options.compressBytes ) );
+        }
+        if( !options.upstreamHost.empty() ){
+            m_cache.reset( new ResponseCache(
+                m_io_service,
+                options.upstreamHost,
+                options.upstreamPort,
+                options.cacheDir,
+                options.cacheTtl,
+                options.cacheBytes,
+                UpstreamFetch::Timeout( options.upstreamTimeout )
+            ) );
+        }
         _accept();
         m_io_service.run();
     }
@@ -181,51 +282,175 @@ string generate404Response( void ){
         "\r\n";
 }
 
-string generateResponse( const string& pathToRoot, stringstream& request ){
-    // Get the filename from the request and open it.
-    const string& filename = pathToRoot + parseRequest( request );
-    ifstream file( filename.c_str() );
-    if( !file ){
-        return generate404Response();
+/// Find a header in what's left of the request after `parseRequest`.
+///
+/// @param request
+/// @param name     In lower case.
+///
+/// @return The header's value, or an empty string if there isn't one.
+string parseHeader( stringstream& request, const string& name ){
+    string line;
+    while( getline( request, line ) && line != "\r" ){
+        const size_t colon = line.find( ':' );
+        if( colon != name.size() ){
+            continue;
+        }
+        string field = line.substr( 0, colon );
+        for( size_t i = 0; i < field.size(); ++i ){
+            field[ i ] = (char)tolower( (unsigned char)field[ i ] );
+        }
+        if( field == name ){
+            const size_t start = line.find_first_not_of( " \t", colon + 1 );
+            const size_t end = line.find_last_not_of( " \t\r" );
+            if( start == string::npos || end < start ){
+                return "";
+            }
+            return line.substr( start, end - start + 1 );
+        }
     }
-    size_t filesize = 0;
+    return "";
+}
 
-    {
-        struct stat filestatus;
-        stat( filename.c_str(), &filestatus );
-        filesize = filestatus.st_size;
-    }
+bool isFile( const string& filename ){
+    struct stat filestatus;
+    return stat( filename.c_str(), &filestatus ) == 0 && S_ISREG( filestatus.st_mode );
+}
 
-    // Now generate the header.
+/// @param body
+/// @param encoding The coding the body is in.
+/// @param vary     True if a different `Accept-Encoding` could have got a different body.
+string generateFileResponse( const string& body, const Encoding encoding, const bool vary ){
     stringstream response;
     response
         << "HTTP/1.1 200 OK\r\n"
         << "X-Powered-By: Boost ASIO\r\n"
-        << "Connection: close\r\n"
-        << "Content-Length: " << filesize << "\r\n"
-        << "\r\n";
-    file >> response.rdbuf();
+        << "Connection: close\r\n";
+    if( encoding != IDENTITY ){
+        response << "Content-Encoding: " << encodingName( encoding ) << "\r\n";
+    }
+    if( vary ){
+        response << "Vary: Accept-Encoding\r\n";
+    }
+    response
+        << "Content-Length: " << body.size() << "\r\n"
+        << "\r\n"
+        << body;
     return response.str();
 }
 
-/// Check that the application arguments are correct and return the only argument this application
-/// accepts.
+string generateResponse(
+    const string& pathToRoot,
+    const string& path,
+    const string& acceptEncoding,
+    CompressedVariants* variants
+){
+    // Open the file the request asked for.
+    const string& filename = pathToRoot + path;
+    ifstream file( filename.c_str(), ios::binary );
+    if( !file ){
+        return generate404Response();
+    }
+    struct stat filestatus;
+    stat( filename.c_str(), &filestatus );
+
+    // Text files are sent in the best coding the client accepts and we have to hand. That's a
+    // precompressed sibling at least as new as the file, or else a copy compressed in the
+    // background. Nothing is compressed here, so a file without either goes out as it is this
+    // time. Whichever it is, the response depends on `Accept-Encoding`.
+    const bool compressible = CompressedVariants::compressible( path );
+    if( compressible ){
+        bool accepted[ ENCODING_COUNT ];
+        parseAcceptEncoding( acceptEncoding, accepted );
+        for( size_t i = 0; i < IDENTITY; ++i ){
+            const string sibling = filename + encodingExtension( (Encoding)i );
+            struct stat siblingstatus;
+            if( accepted[ i ] && stat( sibling.c_str(), &siblingstatus ) == 0 &&
+                S_ISREG( siblingstatus.st_mode ) && siblingstatus.st_mtime >= filestatus.st_mtime )
+            {
+                ifstream siblingFile( sibling.c_str(), ios::binary );
+                stringstream body;
+                body << siblingFile.rdbuf();
+                return generateFileResponse( body.str(), (Encoding)i, true );
+            }
+        }
+        for( size_t i = 0; i < IDENTITY && variants; ++i ){
+            const CompressedVariants::Variant variant = accepted[ i ]
+                ? variants->get( filename, filestatus.st_mtime, filestatus.st_size, (Encoding)i )
+                : CompressedVariants::Variant();
+            if( variant ){
+                return generateFileResponse( *variant, (Encoding)i, true );
+            }
+        }
+    }
+
+    stringstream body;
+    body << file.rdbuf();
+    return generateFileResponse( body.str(), IDENTITY, compressible );
+}
+
+/// Check that the application arguments are correct and return the options they describe.
 ///
 /// @param argc The number of arguments the application received.
 /// @param argv The command line arguments.
 ///
-/// @return The first (and only) application argument.
-string checkArgs( const int argc, char* argv[] ){
-    if( argc != 2 ){
-        cerr << "Usage: " << argv[0] << " <path to root>" << endl;
+/// @return The parsed application options.
+Options checkArgs( const int argc, char* argv[] ){
+    Options options;
+    bool bad = argc < 2;
+    for( int i = 2; i < argc && !bad; ++i ){
+        const string arg = argv[i];
+        if( arg == "--port" && i + 1 < argc ){
+            options.port = (unsigned short)atoi( argv[ ++i ] );
+        }
+        else if( arg == "--trace" && i + 1 < argc ){
+            options.trace = argv[ ++i ];
+        }
+        else if( arg == "--upstream" && i + 1 < argc ){
+            const string upstream = argv[ ++i ];
+            const size_t colon = upstream.rfind( ':' );
+            bad = colon == string::npos;
+            options.upstreamHost = upstream.substr( 0, colon );
+            options.upstreamPort = bad ? "" : upstream.substr( colon + 1 );
+        }
+        else if( arg == "--upstream-timeout" && i + 1 < argc ){
+            options.upstreamTimeout = strtol( argv[ ++i ], NULL, 10 );
+        }
+        else if( arg == "--cache-dir" && i + 1 < argc ){
+            options.cacheDir = argv[ ++i ];
+        }
+        else if( arg == "--cache-ttl" && i + 1 < argc ){
+            options.cacheTtl = strtol( argv[ ++i ], NULL, 10 );
+        }
+        else if( arg == "--cache-bytes" && i + 1 < argc ){
+            options.cacheBytes = strtoul( argv[ ++i ], NULL, 10 );
+        }
+        else if( arg == "--compress-bytes" && i + 1 < argc ){
+            options.compressBytes = strtoul( argv[ ++i ], NULL, 10 );
+        }
+        else {
+            bad = true;
+        }
+    }
+
+    if( bad || options.port == 0 ){
+        cerr
+            << "Usage: " << argv[0] << " <path to root> [--port <port>] [--trace <file>]" << endl
+            << "       [--upstream <host>:<port>] [--upstream-timeout <ms>]" << endl
+            << "       [--cache-dir <directory>] [--cache-ttl <seconds>] [--cache-bytes <bytes>]"
+            << endl
+            << "       [--compress-bytes <bytes>]" << endl;
         exit( BAD_ARGUMENTS );
     }
-    return argv[1];
+    options.pathToRoot = argv[1];
+    return options;
 }
 
 int main( int argc, char* argv[] ){
-    const string& pathToRoot = checkArgs( argc, argv );
-    Server server( pathToRoot );
+    const Options& options = checkArgs( argc, argv );
+    if( !options.cacheDir.empty() ){
+        mkdir( options.cacheDir.c_str(), 0755 );
+    }
+    Server server( options );
     return SUCCESS;
 }
 
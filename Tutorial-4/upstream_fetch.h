@@ -0,0 +1,204 @@
+///
+/// @file
+/// Fetches a single page from the upstream server of a reverse proxy, using the same resolver
+/// cache and racing connector as the tutorial 3 client.
+///
+
+#ifndef TUTORIAL4_UPSTREAM_FETCH_H
+#define TUTORIAL4_UPSTREAM_FETCH_H
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/smart_ptr.hpp>
+#include <sstream>
+#include <string>
+
+#include "racing_connector.h"
+#include "resolver_cache.h"
+
+using namespace std;
+using boost::asio::ip::tcp;
+
+/// Sends one GET to the upstream and reads the whole response.
+///
+/// The request is made with HTTP/1.0, so the response is never chunked and ends when the upstream
+/// closes the connection. One deadline covers the whole fetch, from resolving the host to the last
+/// byte, and closes whatever is in progress when it passes.
+class UpstreamFetch : public boost::enable_shared_from_this< UpstreamFetch > {
+public:
+    typedef boost::shared_ptr< UpstreamFetch >      Pointer;
+    typedef boost::shared_ptr< tcp::socket >        SocketPointer;
+    typedef boost::system::error_code               Error;
+    typedef boost::asio::chrono::milliseconds       Timeout;
+
+    /// Function prototype for the completion handler. The response is the raw bytes received,
+    /// status line and headers included, and is empty unless the error is clear.
+    typedef boost::function< void( const Error&, const string& ) > CompleteCallback;
+
+private:
+    boost::asio::io_service&    m_ioService;
+    ResolverCache&              m_resolver;
+    const string                m_host;
+    const string                m_service;
+    const string                m_path;
+    CompleteCallback            m_callback;
+    boost::asio::steady_timer   m_deadline;
+    const Timeout               m_timeout;      ///< Zero for no deadline.
+    bool                        m_timedOut;
+    bool                        m_done;
+
+    RacingConnector::Pointer    m_connector;    ///< Set while connecting.
+    SocketPointer               m_socket;       ///< Set once connected.
+    string                      m_request;
+    boost::asio::streambuf      m_response;
+
+    void _finish( const Error& error ){
+        if( m_done ){
+            return;
+        }
+        m_done = true;
+        m_deadline.cancel();
+
+        string response;
+        if( !error ){
+            response.assign(
+                boost::asio::buffers_begin( m_response.data() ),
+                boost::asio::buffers_end( m_response.data() )
+            );
+        }
+        m_callback( m_timedOut ? Error( boost::asio::error::timed_out ) : error, response );
+    }
+
+    void _deadlineHandler( const Error& error ){
+        if( error || m_done ){
+            return;
+        }
+        m_timedOut = true;
+        if( m_connector ){
+            m_connector->cancel();
+        }
+        if( m_socket ){
+            boost::system::error_code ignored;
+            m_socket->close( ignored );
+        }
+    }
+
+    void _resolveHandler( const Error& error, ResolverCache::Endpoints endpoints ){
+        if( error || m_timedOut ){
+            _finish( error ? error : Error( boost::asio::error::operation_aborted ) );
+            return;
+        }
+        m_connector.reset(
+            new RacingConnector( m_ioService, endpoints->begin(), endpoints->end() )
+        );
+        m_connector->start(
+            boost::bind( &UpstreamFetch::_connectHandler, shared_from_this(), _1, _2 )
+        );
+    }
+
+    void _connectHandler( const Error& error, SocketPointer socket ){
+        m_connector.reset();
+        if( error ){
+            _finish( error );
+            return;
+        }
+        m_socket = socket;
+
+        stringstream request;
+        request
+            << "GET " << m_path << " HTTP/1.0\r\n"
+            << "Host: " << m_host << "\r\n"
+            << "Connection: close\r\n"
+            << "\r\n";
+        m_request = request.str();
+        boost::asio::async_write(
+            *m_socket,
+            boost::asio::buffer( m_request ),
+            boost::bind(
+                &UpstreamFetch::_writeHandler,
+                shared_from_this(),
+                boost::asio::placeholders::error
+            )
+        );
+    }
+
+    void _writeHandler( const Error& error ){
+        if( error ){
+            _finish( error );
+            return;
+        }
+
+        // Read until the upstream closes the connection, which is the end of the response.
+        boost::asio::async_read(
+            *m_socket,
+            m_response,
+            boost::bind(
+                &UpstreamFetch::_readHandler,
+                shared_from_this(),
+                boost::asio::placeholders::error
+            )
+        );
+    }
+
+    void _readHandler( const Error& error ){
+        _finish( error == boost::asio::error::eof ? Error() : error );
+    }
+
+public:
+    /// Constructor.
+    ///
+    /// @param io_service
+    /// @param resolver
+    /// @param host
+    /// @param service  Port number or service name.
+    /// @param path     Path and query to request.
+    /// @param timeout  How long the whole fetch may take, zero for no limit.
+    UpstreamFetch(
+        boost::asio::io_service&    io_service,
+        ResolverCache&              resolver,
+        const string&               host,
+        const string&               service,
+        const string&               path,
+        const Timeout&              timeout
+    )
+        : m_ioService( io_service ),
+          m_resolver( resolver ),
+          m_host( host ),
+          m_service( service ),
+          m_path( path ),
+          m_deadline( io_service ),
+          m_timeout( timeout ),
+          m_timedOut( false ),
+          m_done( false ){}
+
+    /// Start fetching.
+    ///
+    /// @param callback Called once with the response or the error which ended the fetch.
+    void start( CompleteCallback callback ){
+        m_callback = callback;
+        if( m_timeout.count() ){
+            m_deadline.expires_after( m_timeout );
+            m_deadline.async_wait(
+                boost::bind(
+                    &UpstreamFetch::_deadlineHandler,
+                    shared_from_this(),
+                    boost::asio::placeholders::error
+                )
+            );
+        }
+        m_resolver.resolve(
+            m_host,
+            m_service,
+            boost::bind(
+                &UpstreamFetch::_resolveHandler,
+                shared_from_this(),
+                ResolverCache::placeholders::error,
+                ResolverCache::placeholders::endpoints
+            )
+        );
+    }
+}; // end class UpstreamFetch
+
+#endif // TUTORIAL4_UPSTREAM_FETCH_H
@@ -0,0 +1,86 @@
+///
+/// @file
+/// Counts every heap allocation the process makes, by replacing the global `operator new`.
+///
+/// The replacements are only compiled in when `TUTORIAL5_COUNT_ALLOCATIONS` is defined, which the
+/// build does for `chat-alloc-server` and `chat-alloc-test`. They are definitions rather than
+/// inline functions, so the header must only be included by one source file of a program.
+///
+
+#ifndef TUTORIAL5_ALLOCATION_COUNTER_H
+#define TUTORIAL5_ALLOCATION_COUNTER_H
+
+#include <boost/atomic.hpp>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+/// The number of heap allocations made so far.
+class AllocationCounter {
+private:
+    static boost::atomic< size_t >& _count( void ){
+        static boost::atomic< size_t > count( 0 );
+        return count;
+    }
+
+public:
+    /// @return False if the counting `operator new` wasn't compiled in, in which case the count
+    ///         stays at zero.
+    static bool compiledIn( void ){
+#ifdef TUTORIAL5_COUNT_ALLOCATIONS
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    static size_t count( void ){
+        return _count().load( boost::memory_order_relaxed );
+    }
+
+    static void add( void ){
+        _count().fetch_add( 1, boost::memory_order_relaxed );
+    }
+}; // end class AllocationCounter
+
+#ifdef TUTORIAL5_COUNT_ALLOCATIONS
+void* operator new( size_t size ){
+    AllocationCounter::add();
+    void* memory = malloc( size ? size : 1 );
+    if( !memory ){
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+void* operator new[]( size_t size ){
+    return operator new( size );
+}
+
+void* operator new( size_t size, const std::nothrow_t& ) throw(){
+    AllocationCounter::add();
+    return malloc( size ? size : 1 );
+}
+
+void* operator new[]( size_t size, const std::nothrow_t& ) throw(){
+    return operator new( size, std::nothrow );
+}
+
+void operator delete( void* memory ) throw(){
+    free( memory );
+}
+
+void operator delete[]( void* memory ) throw(){
+    free( memory );
+}
+
+void operator delete( void* memory, size_t ) throw(){
+    free( memory );
+}
+
+void operator delete[]( void* memory, size_t ) throw(){
+    free( memory );
+}
+#endif // TUTORIAL5_COUNT_ALLOCATIONS
+
+#endif // TUTORIAL5_ALLOCATION_COUNTER_H
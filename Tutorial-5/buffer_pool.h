@@ -0,0 +1,186 @@
+///
+/// @file
+/// Pooled, reference counted buffers for holding received messages, and views into them which can
+/// be passed around and written back out without copying the bytes.
+///
+
+#ifndef TUTORIAL5_BUFFER_POOL_H
+#define TUTORIAL5_BUFFER_POOL_H
+
+#include <boost/asio.hpp>
+#include <boost/smart_ptr.hpp>
+#include <boost/thread.hpp>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "recycling_allocator.h"
+
+using namespace std;
+
+/// A reference counted view of part of a buffer.
+///
+/// Copying a view only copies the reference, and the buffer lives until the last view of it is
+/// gone, so a received payload can be handed to any number of writes at once.
+class BufferView {
+public:
+    typedef boost::shared_ptr< char > Block;
+
+private:
+    Block   m_block;
+    size_t  m_offset;
+    size_t  m_size;
+
+public:
+    BufferView( void ) : m_offset( 0 ), m_size( 0 ){}
+
+    /// Constructor.
+    ///
+    /// @param block    The buffer being viewed.
+    /// @param size     Bytes in view, starting from the front of the buffer.
+    BufferView( const Block& block, const size_t size )
+        : m_block( block ), m_offset( 0 ), m_size( size ){}
+
+    const char* data( void ) const {
+        return m_block.get() + m_offset;
+    }
+
+    /// Writable access, for filling a freshly allocated buffer.
+    char* mutableData( void ){
+        return m_block.get() + m_offset;
+    }
+
+    size_t size( void ) const {
+        return m_size;
+    }
+
+    bool empty( void ) const {
+        return m_size == 0;
+    }
+
+    /// @param c
+    ///
+    /// @return The offset of the first `c` in the view, or `string::npos`.
+    size_t find( const char c ) const {
+        const void* found = m_size ? memchr( data(), c, m_size ) : NULL;
+        return found ? (const char*)found - data() : string::npos;
+    }
+
+    /// A view of part of this one, sharing the same buffer.
+    ///
+    /// @param offset
+    /// @param size
+    BufferView sub( const size_t offset, const size_t size = string::npos ) const {
+        BufferView view( *this );
+        view.m_offset += min( offset, m_size );
+        view.m_size    = min( size, m_size - min( offset, m_size ) );
+        return view;
+    }
+
+    /// Copy the viewed bytes into a string.
+    string str( void ) const {
+        return string( data(), m_size );
+    }
+
+    boost::asio::const_buffer buffer( void ) const {
+        return boost::asio::buffer( data(), m_size );
+    }
+
+    const Block& getBlock( void ) const {
+        return m_block;
+    }
+}; // end class BufferView
+
+// ************************************************************************** //
+
+/// Hands out fixed size buffers and takes them back once the last view of them is released.
+///
+/// Requests that don't fit in a pooled buffer get one of their own, which is simply freed. The pool
+/// is shared by every thread and keeps at most `maxFree` idle buffers around. Once it has enough
+/// buffers for the traffic, handing one out allocates nothing.
+class BufferPool : public boost::enable_shared_from_this< BufferPool > {
+public:
+    typedef boost::shared_ptr< BufferPool > Pointer;
+
+private:
+    const size_t    m_blockSize;
+    const size_t    m_maxFree;
+    vector< char* > m_free;
+    boost::mutex    m_mutex;
+
+    /// Deleter for pooled blocks. Holding the pool keeps it alive as long as any of its buffers.
+    struct Release {
+        Pointer pool;
+
+        Release( const Pointer& pool_ ) : pool( pool_ ){}
+
+        void operator()( char* block ) const {
+            pool->_release( block );
+        }
+    }; // end struct Release
+
+    struct Delete {
+        void operator()( char* block ) const {
+            delete[] block;
+        }
+    }; // end struct Delete
+
+    void _release( char* block ){
+        {
+            boost::mutex::scoped_lock lock( m_mutex );
+            if( m_free.size() < m_maxFree ){
+                m_free.push_back( block );
+                return;
+            }
+        }
+        delete[] block;
+    }
+
+    BufferPool( const size_t blockSize, const size_t maxFree )
+        : m_blockSize( blockSize ), m_maxFree( maxFree ){}
+
+public:
+    /// Create a pool. Pools are always shared so their buffers can keep them alive.
+    ///
+    /// @param blockSize    Size of each pooled buffer.
+    /// @param maxFree      Most idle buffers to keep for reuse.
+    static Pointer create( const size_t blockSize = 4096, const size_t maxFree = 4096 ){
+        return Pointer( new BufferPool( blockSize, maxFree ) );
+    }
+
+    ~BufferPool( void ){
+        for( size_t i = 0; i < m_free.size(); ++i ){
+            delete[] m_free[ i ];
+        }
+    }
+
+    /// Get a buffer with room for at least `size` bytes.
+    ///
+    /// @param size
+    ///
+    /// @return A view of the first `size` bytes of the buffer, to be filled by the caller.
+    BufferView allocate( const size_t size ){
+        if( size > m_blockSize ){
+            return BufferView( BufferView::Block( new char[ size ], Delete() ), size );
+        }
+
+        char* block = NULL;
+        {
+            boost::mutex::scoped_lock lock( m_mutex );
+            if( !m_free.empty() ){
+                block = m_free.back();
+                m_free.pop_back();
+            }
+        }
+        if( !block ){
+            block = new char[ m_blockSize ];
+        }
+        // The block's reference count is recycled too, so a pooled buffer never allocates.
+        return BufferView(
+            BufferView::Block( block, Release( shared_from_this() ), RecyclingAllocator< char >() ),
+            size
+        );
+    }
+}; // end class BufferPool
+
+#endif // TUTORIAL5_BUFFER_POOL_H
@@ -0,0 +1,276 @@
+///
+/// @file
+/// A compact binary recording of every message clients send to the server, for replaying real
+/// traffic against it later.
+///
+
+#ifndef TUTORIAL5_CAPTURE_H
+#define TUTORIAL5_CAPTURE_H
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "mpsc_queue.h"
+#include "protocol.h"
+
+using namespace std;
+
+/// One message as a client sent it, or a connection opening or closing.
+struct CapturedFrame {
+    boost::uint64_t time;       ///< Microseconds since the capture started.
+    size_t          connection; ///< Which connection it came in on, numbered from 1.
+    unsigned char   opcode;     ///< A `Capture::Event` for events.
+    int             protocol;   ///< Protocol version the connection was using, 0 for events.
+    string          payload;    ///< Exactly as received.
+
+    CapturedFrame( void ) : time( 0 ), connection( 0 ), opcode( 0 ), protocol( 1 ){}
+
+    bool isEvent( void ) const {
+        return protocol == 0;
+    }
+}; // end struct CapturedFrame
+
+// ************************************************************************** //
+
+/// The capture file format.
+///
+/// A file starts with `magic()` and is followed by one record per frame, in the order they arrived:
+///
+///  - varint: microseconds since the previous record, or since the capture started
+///  - varint: connection number
+///  - byte: opcode
+///  - byte: protocol version
+///  - varint: payload size, then the payload
+///
+/// A connection opening or closing is recorded the same way, with a protocol version of 0, the
+/// event in place of the opcode and no payload.
+///
+/// Varints are the protocol's own, so a busy capture costs a handful of bytes per frame on top of
+/// the payloads. A gap of over an hour between two frames is shortened to the longest a varint
+/// holds.
+struct Capture {
+    enum Event {
+        OPENED = 0,
+        CLOSED
+    };
+
+    static const char* magic( void ){
+        return "CHATCAP1";
+    }
+
+    static const size_t MAGIC_SIZE = 8;
+    static const boost::uint64_t MAX_GAP = 0xffffffff;
+}; // end struct Capture
+
+// ************************************************************************** //
+
+/// Writes a capture file from any number of threads without making them wait for the disk.
+///
+/// Like the chat log, frames are queued without locking and written by the capture's own thread,
+/// which takes everything queued at once and writes it in one go. Frames are timed as they are
+/// queued, so frames from two threads racing each other may be written a few microseconds out of
+/// order, in which case the later one is recorded as arriving at the same time.
+class CaptureWriter : private boost::noncopyable {
+private:
+    typedef boost::asio::chrono::steady_clock Clock;
+
+    struct Queued {
+        boost::uint64_t time;
+        string          record; ///< Everything after the time.
+    }; // end struct Queued
+
+    ofstream                    m_file;
+    const Clock::time_point     m_start;
+    boost::uint64_t             m_last;     ///< Time of the last frame written. Writer only.
+
+    MpscQueue< Queued >         m_queue;
+    boost::mutex                m_wakeMutex;
+    boost::condition_variable   m_wake;
+    bool                        m_pending;
+    bool                        m_stopping;
+    boost::thread               m_thread;
+
+    void _write( const vector< Queued >& frames ){
+        string out;
+        for( vector< Queued >::const_iterator it = frames.begin(); it != frames.end(); ++it ){
+            const boost::uint64_t time = it->time > m_last ? it->time : m_last;
+            const boost::uint64_t gap = time - m_last;
+            Protocol::appendVarint(
+                out, gap > Capture::MAX_GAP ? (size_t)Capture::MAX_GAP : (size_t)gap
+            );
+            out += it->record;
+            m_last = time;
+        }
+        m_file.write( out.data(), out.size() );
+        m_file.flush();
+    }
+
+    void _run( void ){
+        vector< Queued > frames;
+        for( ;; ){
+            bool stopping;
+            {
+                boost::mutex::scoped_lock lock( m_wakeMutex );
+                while( !m_pending && !m_stopping ){
+                    m_wake.wait( lock );
+                }
+                m_pending = false;
+                stopping  = m_stopping;
+            }
+
+            frames.clear();
+            m_queue.popAll( frames );
+            _write( frames );
+            if( stopping ){
+                return;
+            }
+        }
+    }
+
+public:
+    /// Create the file, replacing anything already there, and start the capture's thread.
+    ///
+    /// @param path
+    ///
+    /// @throws std::exception if the file can't be created.
+    CaptureWriter( const string& path )
+        : m_file( path.c_str(), ios::binary | ios::trunc ),
+          m_start( Clock::now() ),
+          m_last( 0 ),
+          m_pending( false ),
+          m_stopping( false )
+    {
+        if( !m_file ){
+            throw runtime_error( "can't create " + path );
+        }
+        m_file.write( Capture::magic(), Capture::MAGIC_SIZE );
+        m_file.flush();
+        m_thread = boost::thread( boost::bind( &CaptureWriter::_run, this ) );
+    }
+
+    /// Write out anything still queued and stop the capture's thread.
+    ~CaptureWriter( void ){
+        {
+            boost::mutex::scoped_lock lock( m_wakeMutex );
+            m_stopping = true;
+        }
+        m_wake.notify_one();
+        m_thread.join();
+    }
+
+    /// Record a connection opening or closing now. Safe to call from any thread.
+    ///
+    /// @param connection
+    /// @param event
+    void record( const size_t connection, const Capture::Event event ){
+        record( connection, (unsigned char)event, 0, NULL, 0 );
+    }
+
+    /// Record a frame as arriving now. Safe to call from any thread.
+    ///
+    /// @param connection
+    /// @param opcode
+    /// @param protocol
+    /// @param payload
+    /// @param size
+    void record(
+        const size_t connection,
+        const unsigned char opcode,
+        const int protocol,
+        const char* payload,
+        const size_t size
+    ){
+        Queued frame;
+        frame.time = boost::asio::chrono::duration_cast< boost::asio::chrono::microseconds >(
+            Clock::now() - m_start
+        ).count();
+        frame.record.reserve( 2 * Protocol::MAX_VARINT_SIZE + 2 + size );
+        Protocol::appendVarint( frame.record, connection );
+        frame.record += (char)opcode;
+        frame.record += (char)protocol;
+        Protocol::appendVarint( frame.record, size );
+        if( size ){
+            frame.record.append( payload, size );
+        }
+
+        // Only the first frame queued since the thread last looked needs to wake it.
+        if( m_queue.push( frame ) ){
+            {
+                boost::mutex::scoped_lock lock( m_wakeMutex );
+                m_pending = true;
+            }
+            m_wake.notify_one();
+        }
+    }
+}; // end class CaptureWriter
+
+// ************************************************************************** //
+
+/// Reads a capture file back one frame at a time.
+class CaptureReader : private boost::noncopyable {
+private:
+    ifstream        m_file;
+    boost::uint64_t m_time;
+
+    /// Read a varint straight from the file.
+    bool _readVarint( size_t& value ){
+        char bytes[ Protocol::MAX_VARINT_SIZE ];
+        size_t size = 0;
+        do {
+            if( size == sizeof( bytes ) || !m_file.get( bytes[ size ] ) ){
+                return false;
+            }
+        } while( bytes[ size++ ] & 0x80 );
+        const char* data = bytes;
+        return Protocol::readVarint( data, bytes + size, value );
+    }
+
+public:
+    /// Open a capture file.
+    ///
+    /// @param path
+    ///
+    /// @throws std::exception if the file can't be read or isn't a capture.
+    CaptureReader( const string& path ) : m_file( path.c_str(), ios::binary ), m_time( 0 ){
+        char magic[ Capture::MAGIC_SIZE ];
+        if( !m_file.read( magic, sizeof( magic ) ) ||
+            memcmp( magic, Capture::magic(), sizeof( magic ) ) != 0 )
+        {
+            throw runtime_error( path + " is not a capture file" );
+        }
+    }
+
+    /// Read the next frame.
+    ///
+    /// @param frame
+    ///
+    /// @return False at the end of the file, or at a frame which was never completely written.
+    bool next( CapturedFrame& frame ){
+        size_t gap, size;
+        char opcode, protocol;
+        if( !_readVarint( gap ) || !_readVarint( frame.connection ) ||
+            !m_file.get( opcode ) || !m_file.get( protocol ) || !_readVarint( size ) )
+        {
+            return false;
+        }
+        frame.payload.resize( size );
+        if( size && !m_file.read( &frame.payload[ 0 ], size ) ){
+            return false;
+        }
+        m_time         += gap;
+        frame.time      = m_time;
+        frame.opcode    = (unsigned char)opcode;
+        frame.protocol  = protocol;
+        return true;
+    }
+}; // end class CaptureReader
+
+#endif // TUTORIAL5_CAPTURE_H
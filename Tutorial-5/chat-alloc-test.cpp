@@ -0,0 +1,152 @@
+///
+/// @file
+/// Checks that the chat server's message loop doesn't allocate once it has warmed up.
+///
+/// The server is built into the test, along with the counting `operator new` from
+/// `allocation_counter.h`, and run on its own thread. A handful of clients on blocking sockets take
+/// turns sending a message to the lobby and reading it back from everyone else, first to warm up
+/// the server's pools and then while the allocations are counted. The clients' frames are built up
+/// front and read into fixed buffers, so anything counted was allocated by the server.
+///
+/// Exits with `ALLOCATED` if the counted rounds allocated anything at all.
+///
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/smart_ptr.hpp>
+#include <boost/thread.hpp>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "server.cpp"
+
+using namespace std;
+using boost::asio::ip::tcp;
+
+enum TestResult {
+    PASSED = 0,
+    ALLOCATED,
+    PROTOCOL_FAILURE
+};
+
+static const size_t CLIENTS         = 8;
+static const size_t WARMUP_ROUNDS   = 200;
+static const size_t COUNTED_ROUNDS  = 500;
+
+// ************************************************************************** //
+
+/// A client on a blocking socket, which speaks version 2 of the protocol.
+class TestClient {
+private:
+    tcp::socket m_socket;
+    char        m_payload[ 256 ];   ///< The payload of the last frame read.
+
+    void _fail( const string& what ){
+        cerr << what << endl;
+        exit( PROTOCOL_FAILURE );
+    }
+
+public:
+    TestClient( boost::asio::io_service& io_service, const unsigned short port )
+        : m_socket( io_service )
+    {
+        m_socket.connect( tcp::endpoint( boost::asio::ip::address_v4::loopback(), port ) );
+        m_socket.set_option( tcp::no_delay( true ) );
+    }
+
+    /// Ask for version 2 and wait for the server to agree.
+    void negotiate( void ){
+        send( Protocol::encodeV1( Protocol::command( Protocol::VERSION ), "2" ) );
+        string line;
+        char c = 0;
+        while( c != '\n' ){
+            boost::asio::read( m_socket, boost::asio::buffer( &c, 1 ) );
+            line += c;
+        }
+        if( line != "protocol 2\n" ){
+            _fail( "Unexpected answer to the version request: " + line );
+        }
+    }
+
+    void send( const string& frame ){
+        boost::asio::write( m_socket, boost::asio::buffer( frame ) );
+    }
+
+    /// Read frames until a chat message arrives.
+    void receive( void ){
+        for( ;; ){
+            unsigned char opcode = 0;
+            boost::asio::read( m_socket, boost::asio::buffer( &opcode, 1 ) );
+
+            size_t size = 0;
+            char byte = (char)0x80;
+            for( size_t i = 0; byte & 0x80; ++i ){
+                if( i == Protocol::MAX_VARINT_SIZE ){
+                    _fail( "Bad frame size" );
+                }
+                boost::asio::read( m_socket, boost::asio::buffer( &byte, 1 ) );
+                size |= (size_t)(byte & 0x7f) << (7 * i);
+            }
+            if( size > sizeof( m_payload ) ){
+                _fail( "Frame too big" );
+            }
+            boost::asio::read( m_socket, boost::asio::buffer( m_payload, size ) );
+            if( opcode == Protocol::MESSAGE ){
+                return;
+            }
+        }
+    }
+}; // end class TestClient
+
+// ************************************************************************** //
+
+/// Every client sends in turn, and every other client reads what it sent.
+///
+/// @param clients
+/// @param frame    The chat message, already encoded.
+/// @param rounds
+void chat( vector< boost::shared_ptr< TestClient > >& clients, const string& frame, size_t rounds ){
+    for( size_t round = 0; round < rounds; ++round ){
+        const size_t sender = round % clients.size();
+        clients[ sender ]->send( frame );
+        for( size_t i = 0; i < clients.size(); ++i ){
+            if( i != sender ){
+                clients[ i ]->receive();
+            }
+        }
+    }
+}
+
+int main( void ){
+    Server server( 0, 1, 0 );
+    boost::thread serverThread( boost::bind( &Server::start, &server ) );
+
+    boost::asio::io_service io_service;
+    vector< boost::shared_ptr< TestClient > > clients;
+    for( size_t i = 0; i < CLIENTS; ++i ){
+        clients.push_back(
+            boost::shared_ptr< TestClient >( new TestClient( io_service, server.getPort() ) )
+        );
+        clients.back()->negotiate();
+    }
+
+    // Give the last client time to be put in the lobby.
+    boost::this_thread::sleep( boost::posix_time::milliseconds( 200 ) );
+
+    const string& frame = Protocol::encodeV2( Protocol::CHAT, "hello, is anyone there?" );
+    chat( clients, frame, WARMUP_ROUNDS );
+
+    const size_t before = AllocationCounter::count();
+    chat( clients, frame, COUNTED_ROUNDS );
+    const size_t allocations = AllocationCounter::count() - before;
+
+    const size_t delivered = COUNTED_ROUNDS * (CLIENTS - 1);
+    cout << allocations << " allocations for " << delivered << " messages delivered" << endl;
+
+    clients.clear();
+    server.stop();
+    serverThread.join();
+    return allocations ? ALLOCATED : PASSED;
+}
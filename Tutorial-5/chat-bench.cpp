@@ -0,0 +1,545 @@
+///
+/// @file
+/// A load generator for the chat server. It connects a number of simulated clients, has some of
+/// them send chat messages as fast as the server will take them, and measures how quickly the
+/// server fans those messages out to everyone else.
+///
+/// Run it against `tutorial-5-server --threads 1` and then against a multi-threaded server to
+/// compare their fan-out throughput, or with `--protocol 1` and `--protocol 2` to compare the two
+/// wire protocols.
+///
+/// Every message carries the time it was sent, and every client that receives one records how
+/// long it took to arrive. With `--rate` the senders send at a fixed rate instead of as fast as
+/// they can, which shows latency under a given load rather than at saturation. Each message is
+/// stamped with the time it was due to be sent, so a sender that falls behind shows up as latency
+/// too. Give `--server-pid` to also report how much memory the server used.
+///
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/smart_ptr.hpp>
+#include <boost/thread.hpp>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+
+#include "connection.h"
+#include "latency_stats.h"
+#include "server_connection.h"
+
+using namespace std;
+using boost::asio::ip::tcp;
+
+enum ErrorCode {
+    SUCCESS = 0,
+    BAD_ARGUMENTS,
+    RESOLVER_FAILURE,
+    CONNECTION_FAILURE,
+    TIMEOUT_FAILURE
+};
+
+typedef boost::asio::chrono::steady_clock steady_clock;
+
+/// Benchmark options parsed from the command line.
+struct Options {
+    string  host;
+    string  port;
+    size_t  clients;    ///< Simulated clients to connect.
+    size_t  senders;    ///< How many of those clients send messages.
+    size_t  messages;   ///< Messages each sender sends.
+    size_t  size;       ///< Payload size of each message in bytes.
+    size_t  batch;      ///< Messages written to the socket at a time.
+    size_t  threads;    ///< Threads running the benchmark's own `io_service`.
+    int     protocol;   ///< Wire protocol version for the clients to ask for.
+    double  rate;       ///< Messages per second from each sender, 0 for as fast as possible.
+    string  serverPid;  ///< Server process to report the memory use of, if it is local.
+
+    Options( void )
+        : host( "localhost" ),
+          port( "8888" ),
+          clients( 100 ),
+          senders( 1 ),
+          messages( 1000 ),
+          size( 32 ),
+          batch( 100 ),
+          threads( 1 ),
+          protocol( 1 ),
+          rate( 0 ){}
+}; // end struct Options
+
+// ************************************************************************** //
+
+/// One simulated chat client.
+class BenchClient : public boost::enable_shared_from_this< BenchClient > {
+public:
+    typedef boost::shared_ptr< BenchClient > Pointer;
+
+private:
+    ServerConnection::Pointer   m_server;
+    boost::atomic< size_t >&    m_delivered;    ///< Shared count of benchmark lines received.
+    boost::atomic< size_t >     m_warmups;      ///< Warm up lines this client has received.
+    boost::atomic< int >        m_protocol;     ///< Negotiated protocol version, 0 until known.
+    size_t                      m_batchSize;    ///< Messages written to the socket at a time.
+    size_t                      m_batchesLeft;
+    size_t                      m_payloadSize;
+    LatencySamples              m_latencies;    ///< Microseconds. Only touched on the strand.
+
+    // Sending at a fixed rate.
+    boost::asio::steady_timer   m_timer;
+    steady_clock::time_point    m_start;
+    double                      m_rate;
+    size_t                      m_sent;
+    size_t                      m_messages;
+
+    static long long _microseconds( const steady_clock::time_point& time ){
+        return boost::asio::chrono::duration_cast< boost::asio::chrono::microseconds >(
+            time.time_since_epoch()
+        ).count();
+    }
+
+    /// Encode a message stamped with the time it was sent, padded to the payload size.
+    string _encode( const steady_clock::time_point& sent ) const {
+        ostringstream stamp;
+        stamp << "t" << _microseconds( sent ) << " ";
+        string payload = stamp.str();
+        if( payload.size() < m_payloadSize ){
+            payload.append( m_payloadSize - payload.size(), 'x' );
+        }
+        return m_server->encodeMessage( "chat", payload );
+    }
+
+    void _versionHandler( const int version ){
+        m_protocol = version;
+    }
+
+    void _readMessage( void ){
+        m_server->readMessage(
+            boost::bind(
+                &BenchClient::_messageHandler,
+                shared_from_this(),
+                ServerConnection::placeholders::error,
+                ServerConnection::placeholders::message
+            )
+        );
+    }
+
+    void _messageHandler( const ServerConnection::error_code& error, const string& message ){
+        if( error ){
+            return;
+        }
+
+        if( message.find( "warmup" ) != string::npos ){
+            ++m_warmups;
+        }
+        else {
+            const size_t stamp = message.find( ": t" );
+            if( stamp != string::npos ){
+                const long long sent = strtoll( message.c_str() + stamp + 3, NULL, 10 );
+                m_latencies.add( (double)(_microseconds( steady_clock::now() ) - sent) );
+            }
+            ++m_delivered;
+        }
+        _readMessage();
+    }
+
+    void _sendBatch( void ){
+        if( m_batchesLeft == 0 ){
+            return;
+        }
+        --m_batchesLeft;
+
+        const string& message = _encode( steady_clock::now() );
+        string batch;
+        batch.reserve( message.size() * m_batchSize );
+        for( size_t i = 0; i < m_batchSize; ++i ){
+            batch += message;
+        }
+        m_server->getConnection()->write(
+            batch,
+            boost::bind( &BenchClient::_batchHandler, shared_from_this(), _1, _2 )
+        );
+    }
+
+    /// When the `n`th message is due to be sent.
+    steady_clock::time_point _due( const size_t n ) const {
+        return m_start + boost::asio::chrono::microseconds( (long long)(n * 1000000.0 / m_rate) );
+    }
+
+    /// Send every message which is due, in one write, then wait for the next one.
+    void _paceHandler( const boost::system::error_code& error ){
+        if( error ){
+            return;
+        }
+
+        const steady_clock::time_point now = steady_clock::now();
+        string batch;
+        for( ; m_sent < m_messages && _due( m_sent ) <= now; ++m_sent ){
+            batch += _encode( _due( m_sent ) );
+        }
+        if( !batch.empty() ){
+            m_server->getConnection()->write( batch, NULL );
+        }
+
+        if( m_sent < m_messages ){
+            m_timer.expires_at( _due( m_sent ) );
+            m_timer.async_wait(
+                boost::bind(
+                    &BenchClient::_paceHandler,
+                    shared_from_this(),
+                    boost::asio::placeholders::error
+                )
+            );
+        }
+    }
+
+    void _batchHandler( const Connection::Error& error, const size_t bytesWritten ){
+        if( !error ){
+            _sendBatch();
+        }
+    }
+
+public:
+    BenchClient( Connection::Pointer connection, boost::atomic< size_t >& delivered )
+        : m_server( new ServerConnection( connection ) ),
+          m_delivered( delivered ),
+          m_warmups( 0 ),
+          m_protocol( 0 ),
+          m_batchSize( 1 ),
+          m_batchesLeft( 0 ),
+          m_payloadSize( 0 ),
+          m_timer( connection->getSocket().get_executor() ),
+          m_rate( 0 ),
+          m_sent( 0 ),
+          m_messages( 0 ){}
+
+    /// Start reading messages, after asking for version 2 of the protocol if `protocol` is 2.
+    ///
+    /// @param protocol
+    void start( const int protocol ){
+        if( protocol == 2 ){
+            m_server->negotiate(
+                boost::bind(
+                    &BenchClient::_versionHandler,
+                    shared_from_this(),
+                    ServerConnection::placeholders::version
+                )
+            );
+        }
+        else {
+            m_protocol = 1;
+        }
+        _readMessage();
+    }
+
+    int getProtocol( void ) const {
+        return m_protocol;
+    }
+
+    size_t getBytesReceived( void ) const {
+        return m_server->getBytesReceived();
+    }
+
+    size_t getWarmups( void ) const {
+        return m_warmups;
+    }
+
+    void sendWarmup( void ){
+        m_server->sendMessage( "chat", "warmup" );
+    }
+
+    /// Send `messages` chat messages, written `batch` at a time. Each batch is only written once
+    /// the previous one has gone out, so the server's receive buffer is the only thing limiting us.
+    ///
+    /// @return The number of bytes that will be sent.
+    size_t sendMessages( const size_t messages, const size_t batch, const size_t payloadSize ){
+        m_payloadSize = payloadSize;
+        m_batchSize = batch;
+        m_batchesLeft = messages / batch;
+        const size_t bytes = _encode( steady_clock::now() ).size() * batch * m_batchesLeft;
+        _sendBatch();
+        return bytes;
+    }
+
+    /// Send `messages` chat messages, `rate` a second, starting now.
+    ///
+    /// @return The number of bytes that will be sent.
+    size_t sendMessagesAt( const size_t messages, const double rate, const size_t payloadSize ){
+        m_payloadSize = payloadSize;
+        m_rate = rate;
+        m_messages = messages;
+        m_sent = 0;
+        m_start = steady_clock::now();
+        const size_t bytes = _encode( m_start ).size() * messages;
+        m_timer.expires_at( m_start );
+        m_timer.async_wait(
+            boost::bind(
+                &BenchClient::_paceHandler,
+                shared_from_this(),
+                boost::asio::placeholders::error
+            )
+        );
+        return bytes;
+    }
+
+    const LatencySamples& getLatencies( void ) const {
+        return m_latencies;
+    }
+
+    void close( void ){
+        m_server->getConnection()->close();
+    }
+}; // end class BenchClient
+
+// ************************************************************************** //
+
+Options checkArgs( const int argc, char* argv[] ){
+    Options options;
+    for( int i = 1; i < argc; ++i ){
+        const string arg = argv[ i ];
+        if( i + 1 >= argc ){
+            options.clients = 0;
+            break;
+        }
+        const char* value = argv[ ++i ];
+        if( arg == "--host" ){
+            options.host = value;
+        }
+        else if( arg == "--port" ){
+            options.port = value;
+        }
+        else if( arg == "--clients" ){
+            options.clients = strtoul( value, NULL, 10 );
+        }
+        else if( arg == "--senders" ){
+            options.senders = strtoul( value, NULL, 10 );
+        }
+        else if( arg == "--messages" ){
+            options.messages = strtoul( value, NULL, 10 );
+        }
+        else if( arg == "--size" ){
+            options.size = strtoul( value, NULL, 10 );
+        }
+        else if( arg == "--batch" ){
+            options.batch = strtoul( value, NULL, 10 );
+        }
+        else if( arg == "--threads" ){
+            options.threads = strtoul( value, NULL, 10 );
+        }
+        else if( arg == "--protocol" ){
+            options.protocol = atoi( value );
+        }
+        else if( arg == "--rate" ){
+            options.rate = strtod( value, NULL );
+        }
+        else if( arg == "--server-pid" ){
+            options.serverPid = value;
+        }
+        else {
+            options.clients = 0;
+            break;
+        }
+    }
+
+    if( options.clients < 2 || options.senders == 0 || options.senders > options.clients ||
+        options.batch == 0 || options.threads == 0 || options.protocol < 1 ||
+        options.protocol > 2 || options.rate < 0 )
+    {
+        cerr
+            << "Usage: " << argv[ 0 ] << " [--host <host>] [--port <port>] [--clients <n>]" << endl
+            << "       [--senders <n>] [--messages <n>] [--size <bytes>] [--batch <n>]" << endl
+            << "       [--threads <n>] [--protocol 1|2] [--rate <messages/s>] [--server-pid <pid>]"
+            << endl;
+        exit( BAD_ARGUMENTS );
+    }
+    if( options.rate == 0 ){
+        options.messages -= options.messages % options.batch;
+    }
+    return options;
+}
+
+/// Read one of the memory figures, in kB, out of /proc/<pid>/status.
+///
+/// @param pid
+/// @param field    The name of the figure, such as "VmRSS".
+///
+/// @return The figure, or 0 if the process can't be found.
+size_t processMemory( const string& pid, const string& field ){
+    ifstream status( ("/proc/" + pid + "/status").c_str() );
+    string line;
+    while( getline( status, line ) ){
+        if( line.compare( 0, field.size() + 1, field + ":" ) == 0 ){
+            return strtoul( line.c_str() + field.size() + 1, NULL, 10 );
+        }
+    }
+    return 0;
+}
+
+/// CPU time used by this process so far, user and system, in seconds.
+double cpuSeconds( void ){
+    rusage usage;
+    getrusage( RUSAGE_SELF, &usage );
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+        + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0;
+}
+
+size_t bytesReceived( const vector< BenchClient::Pointer >& clients ){
+    size_t bytes = 0;
+    for( size_t i = 0; i < clients.size(); ++i ){
+        bytes += clients[ i ]->getBytesReceived();
+    }
+    return bytes;
+}
+
+double secondsSince( const steady_clock::time_point& start ){
+    return boost::asio::chrono::duration_cast< boost::asio::chrono::microseconds >(
+        steady_clock::now() - start
+    ).count() / 1000000.0;
+}
+
+int main( int argc, char* argv[] ){
+    const Options& options = checkArgs( argc, argv );
+
+    boost::asio::io_service io_service;
+    boost::scoped_ptr< boost::asio::io_service::work > work( new boost::asio::io_service::work( io_service ) );
+    boost::thread_group threads;
+    for( size_t i = 0; i < options.threads; ++i ){
+        threads.create_thread( boost::bind( &boost::asio::io_service::run, &io_service ) );
+    }
+
+    tcp::resolver::iterator endpoints;
+    try {
+        tcp::resolver resolver( io_service );
+        endpoints = resolver.resolve( tcp::resolver::query( options.host, options.port ) );
+    }
+    catch( const boost::system::system_error& error ){
+        cerr << "Resolver error: " << error.what() << endl;
+        exit( RESOLVER_FAILURE );
+    }
+
+    // Connect every client up front.
+    boost::atomic< size_t > delivered( 0 );
+    vector< BenchClient::Pointer > clients;
+    for( size_t i = 0; i < options.clients; ++i ){
+        Connection::Pointer connection( new Connection( io_service ) );
+        try {
+            boost::asio::connect( connection->getSocket(), endpoints );
+        }
+        catch( const boost::system::system_error& error ){
+            cerr << "Connection error after " << i << " clients: " << error.what() << endl;
+            exit( CONNECTION_FAILURE );
+        }
+        clients.push_back( BenchClient::Pointer( new BenchClient( connection, delivered ) ) );
+        clients.back()->start( options.protocol );
+    }
+
+    // Wait for every client to settle on a protocol.
+    const steady_clock::time_point warmupStart = steady_clock::now();
+    for( size_t i = 0; i < clients.size(); ++i ){
+        while( clients[ i ]->getProtocol() == 0 ){
+            boost::this_thread::sleep( boost::posix_time::milliseconds( 5 ) );
+        }
+        if( clients[ i ]->getProtocol() != options.protocol ){
+            cerr << "The server doesn't support protocol " << options.protocol << "." << endl;
+            exit( BAD_ARGUMENTS );
+        }
+    }
+
+    // A connected socket doesn't mean the server has accepted it yet, so keep sending a warm up
+    // message until every other client has seen one.
+    for( bool ready = false; !ready; ){
+        if( secondsSince( warmupStart ) > 10 ){
+            cerr << "Timed out waiting for the server to accept every client." << endl;
+            exit( TIMEOUT_FAILURE );
+        }
+        clients[ 0 ]->sendWarmup();
+        boost::this_thread::sleep( boost::posix_time::milliseconds( 50 ) );
+        ready = true;
+        for( size_t i = 1; i < clients.size() && ready; ++i ){
+            ready = clients[ i ]->getWarmups() > 0;
+        }
+    }
+    boost::this_thread::sleep( boost::posix_time::milliseconds( 100 ) );
+
+    // Every message a sender sends goes to every other client.
+    const size_t expected = options.senders * options.messages * (options.clients - 1);
+    const size_t receivedBefore = bytesReceived( clients );
+    const double cpuBefore = cpuSeconds();
+    const size_t rssBefore = options.serverPid.empty()
+        ? 0 : processMemory( options.serverPid, "VmRSS" );
+    const steady_clock::time_point start = steady_clock::now();
+    size_t bytesSent = 0;
+    for( size_t i = 0; i < options.senders; ++i ){
+        bytesSent += options.rate > 0
+            ? clients[ i ]->sendMessagesAt( options.messages, options.rate, options.size )
+            : clients[ i ]->sendMessages( options.messages, options.batch, options.size );
+    }
+
+    size_t last = 0;
+    steady_clock::time_point lastProgress = steady_clock::now();
+    while( delivered < expected ){
+        boost::this_thread::sleep( boost::posix_time::milliseconds( 5 ) );
+        if( delivered != last ){
+            last = delivered;
+            lastProgress = steady_clock::now();
+        }
+        else if( secondsSince( lastProgress ) > 10 ){
+            break;
+        }
+    }
+    const double elapsed = secondsSince( start );
+    const double cpu = cpuSeconds() - cpuBefore;
+    const size_t received = bytesReceived( clients ) - receivedBefore;
+    const size_t sent = options.senders * options.messages;
+    const size_t rssAfter = options.serverPid.empty()
+        ? 0 : processMemory( options.serverPid, "VmRSS" );
+    const size_t rssPeak = options.serverPid.empty()
+        ? 0 : processMemory( options.serverPid, "VmHWM" );
+
+    for( size_t i = 0; i < clients.size(); ++i ){
+        clients[ i ]->close();
+    }
+    work.reset();
+    io_service.stop();
+    threads.join_all();
+
+    // Latency is from the time a message was (or was due to be) sent to the time each receiver
+    // parsed it, so it includes the server's fan-out and both ends' socket buffers.
+    LatencySamples latencies;
+    for( size_t i = 0; i < clients.size(); ++i ){
+        latencies.add( clients[ i ]->getLatencies() );
+    }
+
+    // The bench's own CPU time is mostly spent receiving, so per delivered message it shows what
+    // each protocol costs a client to parse.
+    cout
+        << "protocol:   " << options.protocol << endl
+        << "clients:    " << options.clients << endl
+        << "senders:    " << options.senders;
+    if( options.rate > 0 ){
+        cout << ", " << options.rate << " messages/s each";
+    }
+    cout << endl
+        << "sent:       " << sent << " messages, "
+        << (double)bytesSent / sent << " bytes each" << endl
+        << "delivered:  " << delivered << " of " << expected << " messages, "
+        << (double)received / max< size_t >( delivered, 1 ) << " bytes each" << endl
+        << "elapsed:    " << elapsed << " s" << endl
+        << "throughput: " << (size_t)(delivered / elapsed) << " messages/s delivered" << endl
+        << "bench cpu:  " << cpu * 1000000 / max< size_t >( delivered, 1 )
+        << " us per delivered message" << endl
+        << "latency:    p50 " << latencies.median() / 1000 << " ms, p99 "
+        << latencies.percentile( 99 ) / 1000 << " ms, max " << latencies.max() / 1000 << " ms"
+        << endl;
+    if( !options.serverPid.empty() ){
+        cout
+            << "server rss: " << rssBefore / 1024.0 << " MiB before, " << rssAfter / 1024.0
+            << " MiB after, " << rssPeak / 1024.0 << " MiB peak" << endl;
+    }
+    return delivered == expected ? SUCCESS : TIMEOUT_FAILURE;
+}
@@ -0,0 +1,167 @@
+///
+/// @file
+/// Measures how fast the chat log can take messages. A number of threads append records to a log
+/// as fast as it will queue them, and the benchmark reports how long it took for all of them to be
+/// flushed to disk and how many records each flush covered.
+///
+/// Point `--dir` at an empty directory on the disk to be measured. The log is left there, so a
+/// second run with the same directory also shows how long opening an existing log takes.
+///
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/smart_ptr.hpp>
+#include <boost/thread.hpp>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "chat_log.h"
+#include "protocol.h"
+
+using namespace std;
+
+enum ErrorCode {
+    SUCCESS = 0,
+    BAD_ARGUMENTS,
+    LOG_FAILURE,
+    TIMEOUT_FAILURE
+};
+
+typedef boost::asio::chrono::steady_clock steady_clock;
+
+/// Benchmark options parsed from the command line.
+struct Options {
+    string  directory;
+    size_t  messages;       ///< Records each producer appends.
+    size_t  size;           ///< Size of the text in each record.
+    size_t  producers;      ///< Threads appending at once.
+    size_t  segmentBytes;
+
+    Options( void )
+        : directory( "chat-log-bench" ),
+          messages( 100000 ),
+          size( 32 ),
+          producers( 1 ),
+          segmentBytes( 16 * 1024 * 1024 ){}
+}; // end struct Options
+
+// ************************************************************************** //
+
+Options checkArgs( const int argc, char* argv[] ){
+    Options options;
+    for( int i = 1; i < argc; ++i ){
+        const string arg = argv[ i ];
+        if( i + 1 >= argc ){
+            options.producers = 0;
+            break;
+        }
+        const char* value = argv[ ++i ];
+        if( arg == "--dir" ){
+            options.directory = value;
+        }
+        else if( arg == "--messages" ){
+            options.messages = strtoul( value, NULL, 10 );
+        }
+        else if( arg == "--size" ){
+            options.size = strtoul( value, NULL, 10 );
+        }
+        else if( arg == "--producers" ){
+            options.producers = strtoul( value, NULL, 10 );
+        }
+        else if( arg == "--segment-bytes" ){
+            options.segmentBytes = strtoul( value, NULL, 10 );
+        }
+        else {
+            options.producers = 0;
+            break;
+        }
+    }
+
+    if( options.producers == 0 || options.messages == 0 ){
+        cerr
+            << "Usage: " << argv[ 0 ] << " [--dir <directory>] [--messages <n>] [--size <bytes>]"
+            << endl
+            << "       [--producers <n>] [--segment-bytes <bytes>]" << endl;
+        exit( BAD_ARGUMENTS );
+    }
+    return options;
+}
+
+double secondsSince( const steady_clock::time_point& start ){
+    return boost::asio::chrono::duration_cast< boost::asio::chrono::microseconds >(
+        steady_clock::now() - start
+    ).count() / 1000000.0;
+}
+
+/// Append `messages` copies of a record, as a server thread would for each chat message.
+void produce( ChatLog& log, const string& record, const size_t messages ){
+    for( size_t i = 0; i < messages; ++i ){
+        log.append( record );
+    }
+}
+
+int main( int argc, char* argv[] ){
+    const Options& options = checkArgs( argc, argv );
+
+    const steady_clock::time_point openStart = steady_clock::now();
+    boost::scoped_ptr< ChatLog > log;
+    try {
+        log.reset( new ChatLog( options.directory, options.segmentBytes ) );
+    }
+    catch( const std::exception& e ){
+        cerr << "Unable to open the log: " << e.what() << endl;
+        exit( LOG_FAILURE );
+    }
+    const double openTime = secondsSince( openStart );
+    const ChatLog::Stats& before = log->getStats();
+
+    // Records look like the server's: the room and sender's name, then the text.
+    const string& record =
+        Protocol::encodeMessageFields( "", "bench" ) + string( options.size, 'x' );
+    const size_t expected = options.messages * options.producers;
+
+    const steady_clock::time_point start = steady_clock::now();
+    boost::thread_group producers;
+    for( size_t i = 0; i < options.producers; ++i ){
+        producers.create_thread(
+            boost::bind( &produce, boost::ref( *log ), boost::cref( record ), options.messages )
+        );
+    }
+    producers.join_all();
+    const double queueTime = secondsSince( start );
+
+    // Wait for the log thread to catch up.
+    size_t last = 0;
+    steady_clock::time_point lastProgress = steady_clock::now();
+    ChatLog::Stats stats = log->getStats();
+    while( stats.appended < expected ){
+        boost::this_thread::sleep( boost::posix_time::milliseconds( 1 ) );
+        stats = log->getStats();
+        if( stats.appended != last ){
+            last = stats.appended;
+            lastProgress = steady_clock::now();
+        }
+        else if( secondsSince( lastProgress ) > 10 ){
+            break;
+        }
+    }
+    const double elapsed = secondsSince( start );
+    const size_t bytes = stats.appended * record.size();
+
+    cout
+        << "opened:     " << before.next - before.first << " existing records in "
+        << openTime * 1000 << " ms" << endl
+        << "producers:  " << options.producers << endl
+        << "appended:   " << stats.appended << " of " << expected << " records, "
+        << record.size() << " bytes each" << endl
+        << "queued in:  " << queueTime << " s" << endl
+        << "flushed in: " << elapsed << " s" << endl
+        << "throughput: " << (size_t)(stats.appended / elapsed) << " records/s, "
+        << bytes / elapsed / (1024 * 1024) << " MiB/s" << endl
+        << "commits:    " << stats.commits << ", "
+        << (double)stats.appended / max< size_t >( stats.commits, 1 ) << " records each" << endl
+        << "segments:   " << stats.segments << endl;
+
+    return stats.appended == expected ? SUCCESS : TIMEOUT_FAILURE;
+}
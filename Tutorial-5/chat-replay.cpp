@@ -0,0 +1,517 @@
+///
+/// @file
+/// Plays traffic captured by `tutorial-5-server --capture` back against a server. It opens and
+/// closes a connection for every connection in the capture, sends each of them the same messages,
+/// all at the same points in time or `--speed` times faster, and measures how quickly the server
+/// delivers them.
+///
+/// Chat messages long enough to hold one have the start of their text replaced by the time they
+/// were due to be sent, which keeps every message the size it was. Each client that receives one
+/// records how long it took to arrive, as `chat-bench` does. The rest are sent exactly as captured.
+///
+/// Heartbeats are answered by the replay's own clients, so the captured answers are skipped.
+///
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/smart_ptr.hpp>
+#include <boost/thread.hpp>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "capture.h"
+#include "connection.h"
+#include "latency_stats.h"
+#include "protocol.h"
+#include "server_connection.h"
+
+using namespace std;
+using boost::asio::ip::tcp;
+
+enum ErrorCode {
+    SUCCESS = 0,
+    BAD_ARGUMENTS,
+    CAPTURE_FAILURE,
+    RESOLVER_FAILURE
+};
+
+typedef boost::asio::chrono::steady_clock steady_clock;
+
+/// Replay options parsed from the command line.
+struct Options {
+    string  capture;
+    string  host;
+    string  port;
+    double  speed;      ///< How many times faster than it was captured to play the traffic.
+    size_t  threads;    ///< Threads running the replay's own `io_service`.
+
+    Options( void )
+        : host( "localhost" ),
+          port( "8888" ),
+          speed( 1 ),
+          threads( 1 ){}
+}; // end struct Options
+
+long long microsecondsSince( const steady_clock::time_point& start ){
+    return boost::asio::chrono::duration_cast< boost::asio::chrono::microseconds >(
+        steady_clock::now() - start
+    ).count();
+}
+
+// ************************************************************************** //
+
+/// One of the captured connections.
+class ReplayClient : public boost::enable_shared_from_this< ReplayClient > {
+public:
+    typedef boost::shared_ptr< ReplayClient > Pointer;
+
+private:
+    typedef pair< const CapturedFrame*, long long > PendingFrame;
+
+    ServerConnection::Pointer   m_server;
+    const steady_clock::time_point& m_start;    ///< What the stamps count from.
+    boost::atomic< size_t >&    m_received;     ///< Shared count of messages received.
+
+    // Only touched on the strand.
+    LatencySamples              m_latencies;    ///< Microseconds.
+    bool                        m_connected;
+    bool                        m_closing;      ///< Closed before it had even connected.
+    vector< PendingFrame >      m_pending;      ///< Frames due before it had connected.
+
+    void _connectHandler( const boost::system::error_code& error ){
+        if( error ){
+            cerr << "Connection error: " << error.message() << endl;
+            return;
+        }
+
+        m_connected = true;
+        _readMessage();
+        for( size_t i = 0; i < m_pending.size(); ++i ){
+            _send( m_pending[ i ].first, m_pending[ i ].second );
+        }
+        m_pending.clear();
+        if( m_closing ){
+            _close();
+        }
+    }
+
+    void _close( void ){
+        m_closing = true;
+        if( m_connected ){
+            m_server->getConnection()->close();
+        }
+    }
+
+    void _readMessage( void ){
+        m_server->readMessage(
+            boost::bind(
+                &ReplayClient::_messageHandler,
+                shared_from_this(),
+                ServerConnection::placeholders::error,
+                ServerConnection::placeholders::message
+            )
+        );
+    }
+
+    void _messageHandler( const ServerConnection::error_code& error, const string& message ){
+        if( error ){
+            return;
+        }
+
+        const size_t stamp = message.find( ": t" );
+        if( stamp != string::npos ){
+            char* end;
+            const long long sent = strtoll( message.c_str() + stamp + 3, &end, 10 );
+            if( *end == ' ' ){
+                m_latencies.add( (double)(microsecondsSince( m_start ) - sent) );
+            }
+        }
+        ++m_received;
+        _readMessage();
+    }
+
+    /// Overwrite the start of a message's text with the time it was due, if the text is long
+    /// enough to hold it.
+    static void _stamp( string& data, const size_t text, const long long due ){
+        ostringstream stamp;
+        stamp << "t" << due << " ";
+        if( text <= data.size() && data.size() - text >= stamp.str().size() ){
+            data.replace( text, stamp.str().size(), stamp.str() );
+        }
+    }
+
+    /// Send a frame, or hold on to it until the connection is made.
+    void _send( const CapturedFrame* frame, const long long due ){
+        if( !m_connected ){
+            m_pending.push_back( PendingFrame( frame, due ) );
+            return;
+        }
+
+        // The connection has to know which version it is speaking, so it negotiates for itself.
+        const unsigned char opcode = frame->opcode;
+        if( opcode == Protocol::VERSION && frame->payload == "2" ){
+            m_server->negotiate( NULL );
+            return;
+        }
+
+        // Messages are sent in their version 1 form, and put back into whichever version the
+        // connection is using as they go out.
+        string data = frame->payload;
+        if( opcode == Protocol::TALK && frame->protocol == 2 ){
+            const char* begin = data.data();
+            size_t offset, size;
+            if( !Protocol::readString( begin, data.data() + data.size(), offset, size ) ){
+                return;
+            }
+            data = data.substr( offset, size ) + " " + data.substr( offset + size );
+        }
+        if( opcode == Protocol::CHAT ){
+            _stamp( data, 0, due );
+        }
+        else if( opcode == Protocol::TALK ){
+            _stamp( data, data.find( ' ' ) + 1, due );
+        }
+        m_server->sendMessage( Protocol::command( opcode ), data );
+    }
+
+public:
+    ReplayClient(
+        Connection::Pointer connection,
+        const steady_clock::time_point& start,
+        boost::atomic< size_t >& received
+    )
+        : m_server( new ServerConnection( connection ) ),
+          m_start( start ),
+          m_received( received ),
+          m_connected( false ),
+          m_closing( false ){}
+
+    /// Start connecting, and start reading once connected.
+    ///
+    /// @param endpoints
+    void open( const tcp::resolver::iterator& endpoints ){
+        Connection::Pointer& connection = m_server->getConnection();
+        boost::asio::async_connect(
+            connection->getSocket(),
+            endpoints,
+            connection->getStrand().wrap(
+                boost::bind(
+                    &ReplayClient::_connectHandler,
+                    shared_from_this(),
+                    boost::asio::placeholders::error
+                )
+            )
+        );
+    }
+
+    /// Send a captured frame. Safe to call from any thread.
+    ///
+    /// @param frame    Must stay valid until the replay is over.
+    /// @param due      When it was due to be sent, in microseconds since the replay started.
+    ///
+    /// @return False if the frame is skipped.
+    bool send( const CapturedFrame& frame, const long long due ){
+        const unsigned char opcode = frame.opcode;
+        if( opcode == Protocol::INVALID || opcode >= Protocol::CLIENT_OPCODE_COUNT ||
+            opcode == Protocol::PONG )
+        {
+            return false;
+        }
+        m_server->getConnection()->getStrand().dispatch(
+            boost::bind( &ReplayClient::_send, shared_from_this(), &frame, due )
+        );
+        return true;
+    }
+
+    const LatencySamples& getLatencies( void ) const {
+        return m_latencies;
+    }
+
+    /// Close the connection, once it has been made if it is still being made. Safe to call from
+    /// any thread.
+    void close( void ){
+        m_server->getConnection()->getStrand().dispatch(
+            boost::bind( &ReplayClient::_close, shared_from_this() )
+        );
+    }
+}; // end class ReplayClient
+
+// ************************************************************************** //
+
+/// Sends every captured frame when it is due, on the clients it was captured from.
+class Replay : public boost::enable_shared_from_this< Replay > {
+public:
+    typedef boost::shared_ptr< Replay > Pointer;
+
+private:
+    const vector< CapturedFrame >&      m_frames;
+    const vector< size_t >&             m_senders;  ///< Client to send each frame on.
+    const vector< ReplayClient::Pointer >& m_clients;
+    const tcp::resolver::iterator       m_endpoints;
+    const double                        m_speed;
+    boost::asio::steady_timer           m_timer;
+    steady_clock::time_point            m_start;
+    size_t                              m_next;     ///< Next frame to send.
+    size_t                              m_sent;
+    long long                           m_maxLag;   ///< Microseconds the latest frame was late by.
+    boost::atomic< bool >               m_done;
+
+    /// When the `n`th frame is due, in microseconds since the replay started.
+    long long _due( const size_t n ) const {
+        return (long long)(m_frames[ n ].time / m_speed);
+    }
+
+    /// Send every frame which is due, then wait for the next one.
+    void _paceHandler( const boost::system::error_code& error ){
+        if( error ){
+            m_done = true;
+            return;
+        }
+
+        const long long now = microsecondsSince( m_start );
+        if( m_next < m_frames.size() ){
+            m_maxLag = max( m_maxLag, now - _due( m_next ) );
+        }
+        for( ; m_next < m_frames.size() && _due( m_next ) <= now; ++m_next ){
+            const CapturedFrame& frame = m_frames[ m_next ];
+            const ReplayClient::Pointer& client = m_clients[ m_senders[ m_next ] ];
+            if( !frame.isEvent() ){
+                if( client->send( frame, _due( m_next ) ) ){
+                    ++m_sent;
+                }
+            }
+            else if( frame.opcode == Capture::OPENED ){
+                client->open( m_endpoints );
+            }
+            else if( frame.opcode == Capture::CLOSED ){
+                client->close();
+            }
+        }
+
+        if( m_next == m_frames.size() ){
+            m_done = true;
+            return;
+        }
+        m_timer.expires_at( m_start + boost::asio::chrono::microseconds( _due( m_next ) ) );
+        m_timer.async_wait(
+            boost::bind(
+                &Replay::_paceHandler,
+                shared_from_this(),
+                boost::asio::placeholders::error
+            )
+        );
+    }
+
+public:
+    Replay(
+        boost::asio::io_service& io_service,
+        const vector< CapturedFrame >& frames,
+        const vector< size_t >& senders,
+        const vector< ReplayClient::Pointer >& clients,
+        const tcp::resolver::iterator& endpoints,
+        const double speed
+    )
+        : m_frames( frames ),
+          m_senders( senders ),
+          m_clients( clients ),
+          m_endpoints( endpoints ),
+          m_speed( speed ),
+          m_timer( io_service ),
+          m_next( 0 ),
+          m_sent( 0 ),
+          m_maxLag( 0 ),
+          m_done( false ){}
+
+    /// Start sending. Connections already open when the capture started are opened now, and the
+    /// rest when they were opened in the capture.
+    ///
+    /// @param start    What frame times count from. Must be the time the clients' stamps count
+    ///                 from too.
+    /// @param opened   Clients whose opening was captured.
+    void start( const steady_clock::time_point& start, const vector< bool >& opened ){
+        for( size_t i = 0; i < m_clients.size(); ++i ){
+            if( !opened[ i ] ){
+                m_clients[ i ]->open( m_endpoints );
+            }
+        }
+        m_start = start;
+        m_timer.expires_at( m_start );
+        m_timer.async_wait(
+            boost::bind(
+                &Replay::_paceHandler,
+                shared_from_this(),
+                boost::asio::placeholders::error
+            )
+        );
+    }
+
+    bool isDone( void ) const {
+        return m_done;
+    }
+
+    /// @return Frames sent, not counting those skipped or the connections opening and closing.
+    size_t getSent( void ) const {
+        return m_sent;
+    }
+
+    long long getMaxLag( void ) const {
+        return m_maxLag;
+    }
+}; // end class Replay
+
+// ************************************************************************** //
+
+Options checkArgs( const int argc, char* argv[] ){
+    Options options;
+    bool valid = true;
+    for( int i = 1; i < argc && valid; ++i ){
+        const string arg = argv[ i ];
+        if( i + 1 >= argc ){
+            valid = false;
+            break;
+        }
+        const char* value = argv[ ++i ];
+        if( arg == "--capture" ){
+            options.capture = value;
+        }
+        else if( arg == "--host" ){
+            options.host = value;
+        }
+        else if( arg == "--port" ){
+            options.port = value;
+        }
+        else if( arg == "--speed" ){
+            options.speed = strtod( value, NULL );
+        }
+        else if( arg == "--threads" ){
+            options.threads = strtoul( value, NULL, 10 );
+        }
+        else {
+            valid = false;
+        }
+    }
+
+    if( !valid || options.capture.empty() || options.speed <= 0 || options.threads == 0 ){
+        cerr
+            << "Usage: " << argv[ 0 ] << " --capture <file> [--host <host>] [--port <port>]"
+            << endl
+            << "       [--speed <times>] [--threads <n>]" << endl;
+        exit( BAD_ARGUMENTS );
+    }
+    return options;
+}
+
+int main( int argc, char* argv[] ){
+    const Options& options = checkArgs( argc, argv );
+
+    // Number the captured connections in the order they first show up.
+    vector< CapturedFrame > frames;
+    vector< size_t > senders;
+    map< size_t, size_t > connections;
+    vector< bool > opened;
+    size_t events = 0;
+    try {
+        CaptureReader reader( options.capture );
+        CapturedFrame frame;
+        while( reader.next( frame ) ){
+            const size_t client = connections.insert(
+                make_pair( frame.connection, connections.size() )
+            ).first->second;
+            if( client == opened.size() ){
+                opened.push_back( frame.isEvent() && frame.opcode == Capture::OPENED );
+            }
+            if( frame.isEvent() ){
+                ++events;
+            }
+            frames.push_back( frame );
+            senders.push_back( client );
+        }
+    }
+    catch( const std::exception& e ){
+        cerr << "Unable to read the capture: " << e.what() << endl;
+        exit( CAPTURE_FAILURE );
+    }
+    if( frames.empty() ){
+        cerr << "The capture is empty." << endl;
+        exit( CAPTURE_FAILURE );
+    }
+
+    boost::asio::io_service io_service;
+    boost::scoped_ptr< boost::asio::io_service::work > work(
+        new boost::asio::io_service::work( io_service )
+    );
+    boost::thread_group threads;
+    for( size_t i = 0; i < options.threads; ++i ){
+        threads.create_thread( boost::bind( &boost::asio::io_service::run, &io_service ) );
+    }
+
+    tcp::resolver::iterator endpoints;
+    try {
+        tcp::resolver resolver( io_service );
+        endpoints = resolver.resolve( tcp::resolver::query( options.host, options.port ) );
+    }
+    catch( const boost::system::system_error& error ){
+        cerr << "Resolver error: " << error.what() << endl;
+        exit( RESOLVER_FAILURE );
+    }
+
+    steady_clock::time_point start;
+    boost::atomic< size_t > received( 0 );
+    vector< ReplayClient::Pointer > clients;
+    for( size_t i = 0; i < connections.size(); ++i ){
+        Connection::Pointer connection( new Connection( io_service ) );
+        clients.push_back( ReplayClient::Pointer(
+            new ReplayClient( connection, start, received )
+        ) );
+    }
+
+    start = steady_clock::now();
+    Replay::Pointer replay(
+        new Replay( io_service, frames, senders, clients, endpoints, options.speed )
+    );
+    replay->start( start, opened );
+    while( !replay->isDone() ){
+        boost::this_thread::sleep( boost::posix_time::milliseconds( 5 ) );
+    }
+    const double sendTime = microsecondsSince( start ) / 1000000.0;
+
+    // Wait for deliveries to stop.
+    size_t last = received;
+    do {
+        last = received;
+        boost::this_thread::sleep( boost::posix_time::milliseconds( 1000 ) );
+    } while( received != last );
+    const double elapsed = microsecondsSince( start ) / 1000000.0 - 1;
+
+    for( size_t i = 0; i < clients.size(); ++i ){
+        clients[ i ]->close();
+    }
+    work.reset();
+    io_service.stop();
+    threads.join_all();
+
+    LatencySamples latencies;
+    for( size_t i = 0; i < clients.size(); ++i ){
+        latencies.add( clients[ i ]->getLatencies() );
+    }
+
+    const double span = frames.back().time / 1000000.0;
+    cout
+        << "connections: " << clients.size() << endl
+        << "frames:      " << replay->getSent() << " sent, "
+        << frames.size() - events - replay->getSent() << " skipped" << endl
+        << "captured:    " << span << " s" << endl
+        << "replayed:    " << sendTime << " s at " << options.speed << "x, at most "
+        << replay->getMaxLag() / 1000.0 << " ms behind" << endl
+        << "received:    " << received << " messages in " << elapsed << " s" << endl
+        << "latency:     p50 " << latencies.median() / 1000 << " ms, p99 "
+        << latencies.percentile( 99 ) / 1000 << " ms, max " << latencies.max() / 1000
+        << " ms, over " << latencies.size() << " timed messages" << endl;
+    return SUCCESS;
+}
@@ -0,0 +1,401 @@
+///
+/// @file
+/// An append-only log of chat messages on disk, so they survive the server being restarted.
+///
+
+#ifndef TUTORIAL5_CHAT_LOG_H
+#define TUTORIAL5_CHAT_LOG_H
+
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/crc.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/function.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/smart_ptr.hpp>
+#include <boost/thread.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "mpsc_queue.h"
+
+using namespace std;
+
+/// A log of records, each given a sequence number counting up from 1.
+///
+/// The log is a directory of segment files, each a fixed size and named after the sequence number
+/// of its first record. Segments are memory mapped, and records are copied into the newest one
+/// back to back until it is full, when another is started. A record on disk is its size, a
+/// checksum, its sequence number, and then its bytes.
+///
+/// `append` never waits for the disk. Records are queued and written by the log's own thread,
+/// which takes everything queued at once, copies it into the segment and then flushes it to disk
+/// with a single `msync`. The more records arrive while one flush is in progress, the more the next
+/// one covers. Records can be read back once they have been flushed.
+///
+/// Each segment keeps the offset of every record in it, so reading from any sequence number starts
+/// without searching. Opening a log reads every segment to rebuild these, and stops at the first
+/// record that is incomplete or fails its checksum, which is where appending carries on.
+class ChatLog : private boost::noncopyable {
+public:
+    typedef boost::uint64_t Sequence;
+
+    /// Called with each record read: its sequence number, bytes and size.
+    typedef boost::function< void( const Sequence, const char*, const size_t ) > Visitor;
+
+    /// Counters for the log, since it was opened.
+    struct Stats {
+        size_t      appended;   ///< Records written and flushed.
+        size_t      commits;    ///< Flushes, each covering a batch of records.
+        size_t      dropped;    ///< Records too big to fit in a segment.
+        size_t      segments;
+        Sequence    first;      ///< Oldest record in the log.
+        Sequence    next;       ///< Number the next record will get.
+    }; // end struct Stats
+
+private:
+    struct RecordHeader {
+        boost::uint32_t size;
+        boost::uint32_t checksum;   ///< CRC-32 of the sequence number and the record.
+        Sequence        sequence;
+    }; // end struct RecordHeader
+
+    static const size_t HEADER_SIZE = sizeof( RecordHeader );
+
+    struct Segment : private boost::noncopyable {
+        const Sequence                      first;
+        boost::interprocess::file_mapping   file;
+        boost::interprocess::mapped_region  region;
+        vector< boost::uint32_t >           offsets;    ///< Where each flushed record starts.
+        size_t                              end;        ///< Bytes written. Log thread only.
+
+        Segment( const Sequence first_, const string& path )
+            : first( first_ ),
+              file( path.c_str(), boost::interprocess::read_write ),
+              region( file, boost::interprocess::read_write ),
+              end( 0 ){}
+
+        char* data( void ){
+            return (char*)region.get_address();
+        }
+
+        size_t capacity( void ) const {
+            return region.get_size();
+        }
+    }; // end struct Segment
+
+    typedef boost::shared_ptr< Segment > SegmentPointer;
+
+    const string                m_directory;
+    const size_t                m_segmentSize;
+
+    // Guarded by `m_mutex`. Only the log thread adds to them.
+    vector< SegmentPointer >    m_segments;
+    Sequence                    m_next;         ///< One past the last flushed record.
+    boost::mutex                m_mutex;
+
+    // Records waiting for the log thread, which sleeps on `m_wake` while there are none.
+    MpscQueue< string >         m_queue;
+    boost::mutex                m_wakeMutex;
+    boost::condition_variable   m_wake;
+    bool                        m_pending;
+    bool                        m_stopping;
+    boost::thread               m_thread;
+
+    boost::atomic< size_t >     m_appended;
+    boost::atomic< size_t >     m_commits;
+    boost::atomic< size_t >     m_dropped;
+
+    static boost::uint32_t _checksum(
+        const Sequence sequence,
+        const char* data,
+        const size_t size
+    ){
+        boost::crc_32_type crc;
+        crc.process_bytes( &sequence, sizeof( sequence ) );
+        crc.process_bytes( data, size );
+        return crc.checksum();
+    }
+
+    string _path( const Sequence first ) const {
+        char name[ 32 ];
+        snprintf( name, sizeof( name ), "%020llu.log", (unsigned long long)first );
+        return (boost::filesystem::path( m_directory ) / name).string();
+    }
+
+    /// Create and map a new, zero filled, segment. Zeros read as the end of the segment.
+    SegmentPointer _createSegment( const Sequence first ){
+        const string& path = _path( first );
+        {
+            ofstream file( path.c_str(), ios::binary | ios::trunc );
+            file.seekp( m_segmentSize - 1 );
+            file.put( '\0' );
+            if( !file ){
+                throw runtime_error( "Unable to create log segment " + path );
+            }
+        }
+        return SegmentPointer( new Segment( first, path ) );
+    }
+
+    /// Find every record in a segment, up to the first which is missing or damaged.
+    ///
+    /// @param segment
+    /// @param sequence The number the first record should have. Advanced past the last one.
+    static void _scan( Segment& segment, Sequence& sequence ){
+        size_t offset = 0;
+        while( offset + HEADER_SIZE <= segment.capacity() ){
+            RecordHeader header;
+            memcpy( &header, segment.data() + offset, HEADER_SIZE );
+            const char* data = segment.data() + offset + HEADER_SIZE;
+            if( header.size == 0 ||
+                header.sequence != sequence ||
+                header.size > segment.capacity() - offset - HEADER_SIZE ||
+                header.checksum != _checksum( sequence, data, header.size ) )
+            {
+                break;
+            }
+            segment.offsets.push_back( (boost::uint32_t)offset );
+            offset += HEADER_SIZE + header.size;
+            ++sequence;
+        }
+        segment.end = offset;
+    }
+
+    void _open( void ){
+        boost::filesystem::create_directories( m_directory );
+
+        vector< pair< Sequence, string > > files;
+        boost::filesystem::directory_iterator end;
+        for( boost::filesystem::directory_iterator it( m_directory ); it != end; ++it ){
+            const boost::filesystem::path& path = it->path();
+            if( path.extension() == ".log" ){
+                const Sequence first = strtoull( path.stem().string().c_str(), NULL, 10 );
+                files.push_back( make_pair( first, path.string() ) );
+            }
+        }
+        sort( files.begin(), files.end() );
+
+        m_next = files.empty() ? 1 : files.front().first;
+        for( size_t i = 0; i < files.size(); ++i ){
+            // A segment starting past where the last one ended means records are missing. Carry
+            // on from the segment rather than refusing to start.
+            SegmentPointer segment( new Segment( files[ i ].first, files[ i ].second ) );
+            m_next = segment->first;
+            _scan( *segment, m_next );
+            m_segments.push_back( segment );
+        }
+
+        if( m_segments.empty() ){
+            m_segments.push_back( _createSegment( m_next ) );
+        }
+        else {
+            // Anything after the last good record was never completely written, so clear it.
+            Segment& last = *m_segments.back();
+            memset( last.data() + last.end, 0, last.capacity() - last.end );
+        }
+    }
+
+    /// Flush what has been written to a segment since `from`, then make those records readable.
+    void _commit( Segment& segment, const size_t from, const vector< boost::uint32_t >& offsets ){
+        if( offsets.empty() ){
+            return;
+        }
+
+        segment.region.flush( from, segment.end - from, false );
+        {
+            boost::mutex::scoped_lock lock( m_mutex );
+            segment.offsets.insert( segment.offsets.end(), offsets.begin(), offsets.end() );
+            m_next += offsets.size();
+        }
+        ++m_commits;
+        m_appended += offsets.size();
+    }
+
+    /// Write a batch of records, starting new segments as they fill up.
+    void _write( const vector< string >& records ){
+        Segment* segment = m_segments.back().get();
+        size_t from = segment->end;
+        Sequence sequence = m_next;
+        vector< boost::uint32_t > offsets;
+
+        for( vector< string >::const_iterator it = records.begin(); it != records.end(); ++it ){
+            const size_t size = HEADER_SIZE + it->size();
+            if( it->empty() || size > m_segmentSize ){
+                ++m_dropped;
+                continue;
+            }
+
+            if( segment->end + size > segment->capacity() ){
+                _commit( *segment, from, offsets );
+                offsets.clear();
+                const SegmentPointer& next = _createSegment( sequence );
+                {
+                    boost::mutex::scoped_lock lock( m_mutex );
+                    m_segments.push_back( next );
+                }
+                segment = next.get();
+                from = 0;
+            }
+
+            RecordHeader header;
+            header.size     = (boost::uint32_t)it->size();
+            header.checksum = _checksum( sequence, it->data(), it->size() );
+            header.sequence = sequence;
+            memcpy( segment->data() + segment->end, &header, HEADER_SIZE );
+            memcpy( segment->data() + segment->end + HEADER_SIZE, it->data(), it->size() );
+            offsets.push_back( (boost::uint32_t)segment->end );
+            segment->end += size;
+            ++sequence;
+        }
+        _commit( *segment, from, offsets );
+    }
+
+    void _run( void ){
+        vector< string > records;
+        for( ;; ){
+            bool stopping;
+            {
+                boost::mutex::scoped_lock lock( m_wakeMutex );
+                while( !m_pending && !m_stopping ){
+                    m_wake.wait( lock );
+                }
+                m_pending = false;
+                stopping  = m_stopping;
+            }
+
+            records.clear();
+            m_queue.popAll( records );
+            _write( records );
+            if( stopping ){
+                return;
+            }
+        }
+    }
+
+public:
+    /// Open the log in `directory`, creating it if need be, and start the log thread.
+    ///
+    /// @param directory
+    /// @param segmentSize  Size of each segment file. Also the limit on the size of a record.
+    ///
+    /// @throws std::exception if the log can't be opened.
+    ChatLog( const string& directory, const size_t segmentSize )
+        : m_directory( directory ),
+          m_segmentSize( max< size_t >( segmentSize, 4096 ) ),
+          m_next( 1 ),
+          m_pending( false ),
+          m_stopping( false ),
+          m_appended( 0 ),
+          m_commits( 0 ),
+          m_dropped( 0 )
+    {
+        _open();
+        m_thread = boost::thread( boost::bind( &ChatLog::_run, this ) );
+    }
+
+    /// Write out anything still queued and stop the log thread.
+    ~ChatLog( void ){
+        {
+            boost::mutex::scoped_lock lock( m_wakeMutex );
+            m_stopping = true;
+        }
+        m_wake.notify_one();
+        m_thread.join();
+    }
+
+    /// Queue a record to be written. Safe to call from any thread, and never waits for the disk.
+    ///
+    /// @param record
+    void append( const string& record ){
+        // Only the first record queued since the log thread last looked needs to wake it.
+        if( m_queue.push( record ) ){
+            {
+                boost::mutex::scoped_lock lock( m_wakeMutex );
+                m_pending = true;
+            }
+            m_wake.notify_one();
+        }
+    }
+
+    /// Read flushed records in order.
+    ///
+    /// @param from     Sequence number to start at. Records older than the log are skipped.
+    /// @param visitor  Called with each record.
+    /// @param limit    Most records to read.
+    ///
+    /// @return The number of records read.
+    size_t read( Sequence from, const Visitor& visitor, const size_t limit = (size_t)-1 ){
+        // Flushed records never change, so they are read without holding the lock. How many of
+        // each segment's records have been flushed, and where the first one to read starts, are
+        // taken while it is held, since a commit can reallocate a segment's offsets.
+        vector< SegmentPointer > segments;
+        vector< size_t > counts;
+        size_t position;
+        size_t offset;
+        {
+            boost::mutex::scoped_lock lock( m_mutex );
+            from = max( from, m_segments.front()->first );
+            if( from >= m_next ){
+                return 0;
+            }
+
+            size_t index = m_segments.size() - 1;
+            while( m_segments[ index ]->first > from ){
+                --index;
+            }
+            segments.assign( m_segments.begin() + index, m_segments.end() );
+            for( size_t i = 0; i < segments.size(); ++i ){
+                counts.push_back( segments[ i ]->offsets.size() );
+            }
+            position = from - segments.front()->first;
+            offset = position < counts.front() ? segments.front()->offsets[ position ] : 0;
+        }
+
+        size_t count = 0;
+        size_t index = 0;
+        while( count < limit ){
+            if( position >= counts[ index ] ){
+                if( ++index == segments.size() ){
+                    break;
+                }
+                position = 0;
+                offset = 0;
+                continue;
+            }
+
+            Segment& segment = *segments[ index ];
+            RecordHeader header;
+            memcpy( &header, segment.data() + offset, HEADER_SIZE );
+            visitor( header.sequence, segment.data() + offset + HEADER_SIZE, header.size );
+            offset += HEADER_SIZE + header.size;
+            ++position;
+            ++count;
+        }
+        return count;
+    }
+
+    Stats getStats( void ){
+        Stats stats;
+        stats.appended  = m_appended;
+        stats.commits   = m_commits;
+        stats.dropped   = m_dropped;
+
+        boost::mutex::scoped_lock lock( m_mutex );
+        stats.segments  = m_segments.size();
+        stats.first     = m_segments.front()->first;
+        stats.next      = m_next;
+        return stats;
+    }
+}; // end class ChatLog
+
+#endif // TUTORIAL5_CHAT_LOG_H
@@ -11,6 +11,9 @@
 #include <iostream>
 #include <string>
 #include "connection.h"
+#include "racing_connector.h"
+#include "resolver_cache.h"
+#include "server_connection.h"
 
 using namespace std;
 using boost::asio::ip::tcp;
@@ -19,144 +22,89 @@ enum ErrorCode {
     SUCCESS = 0,
     BAD_ARGUMENTS,
     RESOLVER_FAILURE,
-    READ_FAILURE
+    READ_FAILURE,
+    CONNECTION_FAILURE
 };
 
 // ************************************************************************** //
 
-class CharLimit {
-private:
-    const char m_limitChar;
-
-public:
-    CharLimit( const char c ) : m_limitChar( c ){}
-
-    template< typename Iterator >
-    pair< Iterator, bool > operator()( Iterator begin, Iterator end ) const {
-        Iterator mvr = begin;
-        for( ; mvr != end; ++mvr ){
-            if( *mvr == m_limitChar ){
-                return make_pair( ++mvr, true );
-            }
-        }
-        return make_pair( mvr, false );
-    }
-}; // end class CharLimit
-
-namespace boost {
-    namespace asio {
-        template<> struct is_match_condition< CharLimit > : boost::true_type {};
-    }
-}
-
-// ************************************************************************** //
-
-class ServerConnection : public boost::enable_shared_from_this< ServerConnection > {
-public:
-    typedef boost::shared_ptr< ServerConnection >   Pointer;
-    typedef boost::system::error_code               error_code;
-
-    typedef boost::function< void( const error_code&, const string& ) > MessageHandler;
-
-    struct placeholders {
-        static boost::arg< 1 > error;
-        static boost::arg< 2 > message;
-    };
-
-private:
-    Connection::Pointer m_connection;
-
-    void _messageHandler( const error_code& error, istream& stream, MessageHandler handler ){
-        string data;
-        getline( stream, data );
-        handler( error, data );
-    }
-
-public:
-    ServerConnection( Connection::Pointer& connection ) : m_connection( connection ){}
-
-    void readMessage( MessageHandler handler ){
-        m_connection->readUntil(
-            CharLimit( '\n' ),
-            boost::bind(
-                &ServerConnection::_messageHandler,
-                shared_from_this(),
-                Connection::placeholders::error,
-                Connection::placeholders::data,
-                handler
-            )
-        );
-    }
-
-    void sendMessage( const string& command, const string& data ){
-        // Construct the message string.
-        string message = command;
-        unsigned int dataSize = (unsigned int)htonl( data.size() );
-        message.append( (char *)&dataSize, 4 );
-        message.append( data );
-
-        // Send it over the socket.
-        m_connection->write( message, NULL );
-    }
-
-}; // end class ServerConnection
-
-// ************************************************************************** //
-
 class Client {
 public:
     static const string& CHAT_PORT;
 
 private:
     boost::asio::io_service m_ioService;
-    tcp::resolver m_resolver;
+    ResolverCache m_resolver;
     ServerConnection::Pointer m_server;
+    boost::mutex m_serverMutex;
+    boost::condition_variable m_serverReady;   ///< Signalled once `m_server` is connected.
+    bool m_closing;     ///< Set once stdin is done. Guarded by `m_serverMutex`.
+    bool m_closed;      ///< Set once everything typed has been sent. Guarded by `m_serverMutex`.
+    boost::condition_variable m_serverClosed;  ///< Signalled once `m_closed` is set.
     boost::thread m_thread;
 
     void _connectToServer( const string& host ){
         cout << "Connecting...";
-        tcp::resolver::query query( host, CHAT_PORT );
-        m_resolver.async_resolve(
-            query,
+        m_resolver.resolve(
+            host,
+            CHAT_PORT,
             boost::bind(
                 &Client::_resolveHandler,
                 this,
-                boost::asio::placeholders::error,
-                boost::asio::placeholders::iterator
+                ResolverCache::placeholders::error,
+                ResolverCache::placeholders::endpoints
             )
         );
     }
 
     void _resolveHandler(
         const   boost::system::error_code&  error,
-                tcp::resolver::iterator     endpoints
+                ResolverCache::Endpoints    endpoints
     ){
         if( error ){
             cerr << "Resolver error: " << error.message() << endl;
             exit( RESOLVER_FAILURE );
         }
 
-        Connection::Pointer connection( new Connection( m_ioService ) );
-        boost::asio::async_connect(
-            connection->getSocket(),
-            endpoints,
-            boost::bind(
-                &Client::_connectionHandler,
-                this,
-                boost::asio::placeholders::error,
-                boost::asio::placeholders::iterator,
-                connection
-            )
+        // Race connection attempts across every resolved address rather than waiting out a full
+        // connect timeout on each dead one in turn.
+        RacingConnector::Pointer connector(
+            new RacingConnector( m_ioService, endpoints->begin(), endpoints->end() )
+        );
+        connector->start(
+            boost::bind( &Client::_connectionHandler, this, _1, _2, _3 )
         );
     }
 
     void _connectionHandler(
-        const   boost::system::error_code&  error,
-                tcp::resolver::iterator     endpoint,
-                Connection::Pointer&        connection
+        const   boost::system::error_code&          error,
+                RacingConnector::SocketPointer      socket,
+        const   RacingConnector::StatsList&         stats
     ){
-        m_server = ServerConnection::Pointer( new ServerConnection( connection ) );
+        // Only bother the user with the individual attempts when something went wrong.
+        if( error || stats.size() > 1 ){
+            cerr << endl << "Connection attempts:" << endl << stats;
+        }
+        if( error ){
+            cerr << "Connection error: " << error.message() << endl;
+            exit( CONNECTION_FAILURE );
+        }
+
+        // Hand the winning socket over to our own connection object.
+        const tcp protocol = socket->remote_endpoint().protocol();
+        Connection::Pointer connection( new Connection( m_ioService ) );
+        connection->getSocket().assign( protocol, socket->release() );
+
+        ServerConnection::Pointer server( new ServerConnection( connection ) );
         cout << "done." << endl;
+
+        // Ask for the binary protocol. Anything typed before the server answers is held back.
+        server->negotiate( NULL );
+        {
+            boost::mutex::scoped_lock lock( m_serverMutex );
+            m_server = server;
+        }
+        m_serverReady.notify_all();
         _readMessage();
     }
 
@@ -173,6 +121,13 @@ private:
 
     void _messageHandler( const ServerConnection::error_code& error, const string& message ){
         if( error ){
+            {
+                // Closing the connection ends the read too.
+                boost::mutex::scoped_lock lock( m_serverMutex );
+                if( m_closing ){
+                    return;
+                }
+            }
             cerr << "Message read error: " << error.message() << endl;
             exit( READ_FAILURE );
         }
@@ -192,6 +147,36 @@ private:
         }
     }
     
+    /// Wait for everything read from stdin to be sent, then stop. Lines go out from the
+    /// connection's queue on the `io_service` thread, so a piped file can reach its end well before
+    /// the last of it has been written.
+    void _close( void ){
+        {
+            boost::mutex::scoped_lock lock( m_serverMutex );
+            while( !m_server ){
+                m_serverReady.wait( lock );
+            }
+            m_closing = true;
+        }
+        m_server->close( boost::bind( &Client::_closeHandler, this ) );
+        {
+            boost::mutex::scoped_lock lock( m_serverMutex );
+            while( !m_closed ){
+                m_serverClosed.wait( lock );
+            }
+        }
+        m_ioService.stop();
+        m_thread.join();
+    }
+
+    void _closeHandler( void ){
+        {
+            boost::mutex::scoped_lock lock( m_serverMutex );
+            m_closed = true;
+        }
+        m_serverClosed.notify_all();
+    }
+
     void _parseLine( const string& line ){
         string command;
         string data = "";
@@ -205,17 +190,26 @@ private:
             command = "chat";
             data = line;
         }
+
+        // Lines typed while still connecting wait for the connection.
+        boost::mutex::scoped_lock lock( m_serverMutex );
+        while( !m_server ){
+            m_serverReady.wait( lock );
+        }
         m_server->sendMessage( command, data );
     }
 
 public:
-    explicit Client( const string& host ) : m_resolver( m_ioService ){
+    explicit Client( const string& host )
+        : m_resolver( m_ioService ), m_closing( false ), m_closed( false )
+    {
         _connectToServer( host );
     }
 
     void start( void ){
         m_thread = boost::thread( boost::bind( &Client::_runIOService, this ) );
         _readLine();
+        _close();
     }
 }; // end Client
 
@@ -4,25 +4,143 @@
 /// ease the use of asynchronous reading and writing.
 ///
 
+#ifndef TUTORIAL5_CONNECTION_H
+#define TUTORIAL5_CONNECTION_H
+
 #include <boost/asio.hpp>
+#include <boost/atomic.hpp>
 #include <boost/bind.hpp>
+#include <boost/container/small_vector.hpp>
 #include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
 #include <boost/smart_ptr.hpp>
+#include <deque>
 #include <exception>
+#include <iostream>
 #include <string>
+#include <utility>
+#include <vector>
+
+#include "handler_allocator.h"
 
 using namespace std;
 using boost::asio::ip::tcp;
 
+/// A message to be written to a socket, made up of any number of pieces of memory which are sent
+/// together in one gather write.
+///
+/// The message holds a reference to whatever owns each piece, so it can be shared by many writes at
+/// once without copying anything.
+///
+/// The first few pieces and their owners are kept inside the message, along with one short piece
+/// copied in with `addCopy`, so a message built per broadcast needs no memory beyond its own.
+class Message : private boost::noncopyable {
+public:
+    typedef boost::shared_ptr< const void > Owner;
+
+    /// Pieces kept inside the message before it has to allocate.
+    static const size_t INLINE_PIECES = 3;
+
+    /// Bytes of `addCopy` kept inside the message. Longer copies go on the heap.
+    static const size_t INLINE_COPY = 64;
+
+    typedef boost::container::small_vector< boost::asio::const_buffer, INLINE_PIECES > BufferList;
+
+private:
+    BufferList                                              m_buffers;
+    boost::container::small_vector< Owner, INLINE_PIECES >  m_owners;
+    char                                                    m_inlineCopy[ INLINE_COPY ];
+    string                                                  m_copy; ///< Too long to be inline.
+    size_t                                                  m_size;
+
+public:
+    Message( void ) : m_size( 0 ){}
+
+    /// Make room for `pieces` pieces up front, for messages built on a hot path.
+    ///
+    /// @param pieces
+    void reserve( const size_t pieces ){
+        m_buffers.reserve( pieces );
+        m_owners.reserve( pieces );
+    }
+
+    /// Append a piece of memory which the message keeps alive through `owner`.
+    ///
+    /// @param buffer
+    /// @param owner    Whatever owns the memory. Null if it outlives the message anyway.
+    void add( const boost::asio::const_buffer& buffer, const Owner& owner = Owner() ){
+        m_buffers.push_back( buffer );
+        m_size += boost::asio::buffer_size( buffer );
+        if( owner ){
+            m_owners.push_back( owner );
+        }
+    }
+
+    /// Append a string, sharing ownership of it.
+    ///
+    /// @param data
+    void add( const boost::shared_ptr< const string >& data ){
+        add( boost::asio::buffer( *data ), data );
+    }
+
+    /// Append a piece kept in the message itself, to be filled in before the message is written.
+    /// Meant for short headers, which then cost no allocation at all. Only one piece can be added
+    /// this way.
+    ///
+    /// @param size
+    ///
+    /// @return Where to write the piece.
+    char* addCopy( const size_t size ){
+        char* data = m_inlineCopy;
+        if( size > INLINE_COPY ){
+            m_copy.resize( size );
+            data = &m_copy[ 0 ];
+        }
+        add( boost::asio::buffer( data, size ) );
+        return data;
+    }
+
+    const BufferList& getBuffers( void ) const {
+        return m_buffers;
+    }
+
+    size_t size( void ) const {
+        return m_size;
+    }
+}; // end class Message
+
+// ************************************************************************** //
+
 /// A network connection providing a simplified API for reading and writing on a socket.
 ///
 /// All the read/write methods are asynchronous and require a callback that will be called upon
 /// completion.
+///
+/// Every operation on the socket, and every callback, runs through the connection's strand. This
+/// makes it safe to call `write` and `close` from any thread while the `io_service` is being run by
+/// a pool of threads, and means the callbacks for one connection never run concurrently.
+///
+/// Outgoing messages are queued and only one write is ever in flight on the socket. Everything that
+/// queues up while a write is in progress goes out together in a single gather write once it
+/// completes, so a burst of messages costs a handful of system calls rather than one per message.
+///
+/// The queue can be bounded, per connection with `setOutboundLimits` and across every connection
+/// with `setOutboundBudget`, so a client that stops reading cannot make the process grow without
+/// bound. What happens to a message that does not fit is decided by the connection's overflow
+/// policy, and dropped messages report `no_buffer_space` to their callbacks.
+///
+/// Since there is never more than one read and one write in flight, each keeps its handler in a
+/// block of memory owned by the connection rather than on the heap. Calls made from the strand,
+/// which is where a connection's reads and writes are usually started, skip the dispatch and so
+/// don't copy their callbacks either.
 class Connection : public boost::enable_shared_from_this< Connection > {
 public:
     /// Buffer for holding a message to be written to the socket.
     typedef boost::shared_ptr< string > WriteBuffer;
 
+    /// A message made of several buffers, which can be shared by many connections.
+    typedef boost::shared_ptr< const Message > MessagePointer;
+
     /// Pointer to Connection type.
     typedef boost::shared_ptr< Connection > Pointer;
 
@@ -35,74 +153,363 @@ public:
     /// Function prototype for write handlers.
     typedef boost::function< void( const Error&, const size_t ) > WriteCallback;
 
+    /// Function prototype for exact read handlers, given the number of bytes read.
+    typedef boost::function< void( const Error&, const size_t ) > ExactReadCallback;
+
+    typedef boost::asio::chrono::steady_clock Clock;
+
+    /// Function prototype for write observers, given the bytes written and how long the oldest
+    /// message in the write had been waiting.
+    typedef boost::function< void( const Error&, const size_t, const Clock::duration& ) >
+        WriteObserver;
+
     struct placeholders {
         static boost::arg< 1 > error;
         static boost::arg< 2 > data;
         static boost::arg< 2 > bytesWritten;
     }; // end struct placeholders
 
+    /// What to do with a message that would take the outbound queue over its limits.
+    enum OverflowPolicy {
+        DROP_OLDEST = 0,    ///< Make room by dropping the oldest messages still waiting.
+        DROP_NEWEST,        ///< Drop the new message.
+        DISCONNECT          ///< Give up on the client and close the connection.
+    };
+
+    /// Limits on one connection's outbound queue. A limit of zero means no limit.
+    struct OutboundLimits {
+        size_t          maxBytes;       ///< Bytes queued or being written.
+        size_t          maxMessages;    ///< Messages queued or being written.
+        OverflowPolicy  policy;
+
+        OutboundLimits( void ) : maxBytes( 0 ), maxMessages( 0 ), policy( DROP_OLDEST ){}
+    }; // end struct OutboundLimits
+
+    /// Process wide write counters, summed over every connection.
+    struct WriteStats {
+        size_t messages;        ///< Messages handed to `write`.
+        size_t writes;          ///< Write operations started on sockets.
+        size_t queuedBytes;     ///< Bytes currently queued or being written.
+        size_t droppedOldest;   ///< Queued messages dropped to make room for newer ones.
+        size_t droppedNewest;   ///< New messages dropped because there was no room.
+        size_t disconnects;     ///< Connections closed for falling too far behind.
+        size_t overBudget;      ///< Overflows caused by the global budget, not per client limits.
+    }; // end struct WriteStats
+
 private:
-    tcp::socket             m_socket;       ///< Boost::ASIO socket handle.
-    boost::asio::streambuf  m_readBuffer;   ///< Read buffer.
+    typedef pair< MessagePointer, WriteCallback > QueuedWrite;
+    typedef deque< QueuedWrite >                WriteQueue;
+    typedef vector< boost::asio::const_buffer > BufferList;
+
+    /// Hands asio the buffers of the write in progress by reference, as copying the list into the
+    /// write operation would cost an allocation per write.
+    struct BufferSequence {
+        typedef boost::asio::const_buffer   value_type;
+        typedef BufferList::const_iterator  const_iterator;
+
+        const BufferList* buffers;
+
+        BufferSequence( const BufferList& buffers_ ) : buffers( &buffers_ ){}
+
+        const_iterator begin( void ) const {
+            return buffers->begin();
+        }
+
+        const_iterator end( void ) const {
+            return buffers->end();
+        }
+    }; // end struct BufferSequence
+
+    enum Counter {
+        MESSAGES = 0,
+        WRITES,
+        QUEUED_BYTES,
+        DROPPED_OLDEST,
+        DROPPED_NEWEST,
+        DISCONNECTS,
+        OVER_BUDGET,
+        BUDGET,         ///< Not a counter, the global limit on `QUEUED_BYTES`.
+        COUNTER_COUNT
+    };
+
+    boost::asio::io_service::strand m_strand;       ///< Serializes everything on this connection.
+    tcp::socket                     m_socket;       ///< Boost::ASIO socket handle.
+    boost::asio::streambuf          m_readBuffer;   ///< Read buffer.
+    WriteQueue                      m_writeQueue;   ///< Messages waiting for the next write.
+    WriteQueue                      m_inFlight;     ///< Messages in the write in progress.
+    WriteQueue                      m_written;      ///< Messages whose callbacks are being run.
+    BufferList                      m_buffers;      ///< Buffers of the write in progress.
+    bool                            m_writing;
+    ReadCallback                    m_readCallback;         ///< Callback of the read in progress.
+    ExactReadCallback               m_exactReadCallback;    ///< Callback of the read in progress.
+    HandlerMemory                   m_readMemory;   ///< Holds the handler of the read in progress.
+    HandlerMemory                   m_writeMemory;  ///< Holds the handler of the write in progress.
+    OutboundLimits                  m_limits;
+    boost::atomic< size_t >         m_queuedBytes;  ///< Size of `m_writeQueue` and `m_inFlight`.
+    Clock::time_point               m_queuedAt;     ///< When `m_writeQueue` stopped being empty.
+    Clock::time_point               m_flushedAt;    ///< `m_queuedAt` of the write in progress.
+
+    static boost::atomic< size_t >& _counter( const Counter counter ){
+        static boost::atomic< size_t > counters[ COUNTER_COUNT ];
+        return counters[ counter ];
+    }
+
+    static WriteObserver& _observer( void ){
+        static WriteObserver observer;
+        return observer;
+    }
 
     /// Internal read complete handler.
     ///
     /// @param error
     /// @param bytesRead
-    /// @param buffer
-    /// @param callback
-    void _readHandler(
-        const Error& error,
-        size_t bytesRead,
-        ReadCallback& callback
-    ){
+    void _readHandler( const Error& error, size_t bytesRead ){
+        ReadCallback callback;
+        callback.swap( m_readCallback );
         if( callback != NULL ){
             istream stream( &m_readBuffer );
             callback( error, stream );
         }
     }
 
-    /// Internal write complete handler.
+    /// Internal exact read complete handler.
     ///
     /// @param error
-    /// @param bytesWritten
-    /// @param buffer
-    /// @param callback
-    void _writeHandler(
+    /// @param bytesRead    Bytes read from the socket.
+    /// @param buffered     Bytes that were already in the read buffer.
+    void _exactReadHandler(
         const Error& error,
-        size_t bytesWritten,
-        WriteBuffer& buffer,
-        WriteCallback& callback
+        size_t bytesRead,
+        const size_t buffered
     ){
+        ExactReadCallback callback;
+        callback.swap( m_exactReadCallback );
         if( callback != NULL ){
-            callback( error, bytesWritten );
+            callback( error, buffered + bytesRead );
+        }
+    }
+
+    /// Internal write complete handler. Every message in the write is reported to its own callback.
+    ///
+    /// @param error
+    /// @param bytesWritten
+    void _writeHandler( const Error& error, size_t bytesWritten ){
+        // The queues only ever swap storage, so once they have grown to fit the traffic none of
+        // this allocates.
+        m_written.swap( m_inFlight );
+        m_writing = false;
+        if( _observer() != NULL ){
+            _observer()( error, bytesWritten, Clock::now() - m_flushedAt );
+        }
+
+        // Once the socket has failed there is no point trying the rest of the queue.
+        if( error ){
+            m_written.insert( m_written.end(), m_writeQueue.begin(), m_writeQueue.end() );
+            m_writeQueue.clear();
+        }
+        else {
+            _flush();
+        }
+
+        for( WriteQueue::iterator it = m_written.begin(); it != m_written.end(); ++it ){
+            _release( it->first->size() );
+            if( it->second != NULL ){
+                it->second( error, error ? 0 : it->first->size() );
+            }
+        }
+        m_written.clear();
+    }
+
+    void _write( MessagePointer message, WriteCallback& callback ){
+        ++_counter( MESSAGES );
+        if( !m_socket.is_open() ){
+            if( callback != NULL ){
+                callback( boost::asio::error::bad_descriptor, 0 );
+            }
+            return;
+        }
+
+        const size_t size = message->size();
+        bool overBudget = false;
+        if( m_limits.policy == DROP_OLDEST ){
+            while( !m_writeQueue.empty() && _overflows( size, overBudget ) ){
+                const QueuedWrite oldest = m_writeQueue.front();
+                m_writeQueue.pop_front();
+                _release( oldest.first->size() );
+                _overflowed( DROPPED_OLDEST, overBudget );
+                if( oldest.second != NULL ){
+                    oldest.second( boost::asio::error::no_buffer_space, 0 );
+                }
+            }
+        }
+
+        // Dropping old messages was not enough, or not allowed.
+        if( _overflows( size, overBudget ) ){
+            if( m_limits.policy == DISCONNECT ){
+                _overflowed( DISCONNECTS, overBudget );
+                _close();
+            }
+            else {
+                _overflowed( DROPPED_NEWEST, overBudget );
+            }
+            if( callback != NULL ){
+                callback( boost::asio::error::no_buffer_space, 0 );
+            }
+            return;
+        }
+
+        m_queuedBytes.store( m_queuedBytes.load( boost::memory_order_relaxed ) + size,
+            boost::memory_order_relaxed );
+        _counter( QUEUED_BYTES ) += size;
+        if( m_writeQueue.empty() && _observer() != NULL ){
+            m_queuedAt = Clock::now();
+        }
+        m_writeQueue.push_back( QueuedWrite( message, callback ) );
+        if( !m_writing ){
+            _flush();
+        }
+    }
+
+    /// Check whether another message would take the queue over its limits.
+    ///
+    /// @param size         Size of the new message.
+    /// @param overBudget   Set to true when only the global budget is exceeded.
+    ///
+    /// @return True if the message does not fit.
+    bool _overflows( const size_t size, bool& overBudget ) const {
+        const size_t messages = m_writeQueue.size() + m_inFlight.size();
+        if( (m_limits.maxBytes && m_queuedBytes + size > m_limits.maxBytes) ||
+            (m_limits.maxMessages && messages + 1 > m_limits.maxMessages) )
+        {
+            overBudget = false;
+            return true;
         }
+
+        // The budget is shared by every connection and checked without a lock, so a few writes
+        // racing each other can overshoot it slightly.
+        const size_t budget = _counter( BUDGET );
+        overBudget = budget && _counter( QUEUED_BYTES ) + size > budget;
+        return overBudget;
     }
 
-    void _write( WriteBuffer buffer, WriteCallback& callback ){
+    void _overflowed( const Counter counter, const bool overBudget ){
+        ++_counter( counter );
+        if( overBudget ){
+            ++_counter( OVER_BUDGET );
+        }
+    }
+
+    void _release( const size_t size ){
+        m_queuedBytes.store( m_queuedBytes.load( boost::memory_order_relaxed ) - size,
+            boost::memory_order_relaxed );
+        _counter( QUEUED_BYTES ) -= size;
+    }
+
+    /// Send everything in the queue with a single gather write.
+    void _flush( void ){
+        if( m_writeQueue.empty() ){
+            return;
+        }
+
+        m_writing = true;
+        m_flushedAt = m_queuedAt;
+        m_inFlight.swap( m_writeQueue );
+        m_buffers.clear();
+        for( WriteQueue::const_iterator it = m_inFlight.begin(); it != m_inFlight.end(); ++it ){
+            const Message::BufferList& parts = it->first->getBuffers();
+            m_buffers.insert( m_buffers.end(), parts.begin(), parts.end() );
+        }
+
+        ++_counter( WRITES );
         boost::asio::async_write(
             m_socket,
-            boost::asio::buffer( *buffer ),
-            boost::bind(
-                &Connection::_writeHandler,
-                shared_from_this(),
-                boost::asio::placeholders::error,
-                boost::asio::placeholders::bytes_transferred,
-                buffer,
-                callback
+            BufferSequence( m_buffers ),
+            m_strand.wrap(
+                makeAllocHandler(
+                    m_writeMemory,
+                    boost::bind(
+                        &Connection::_writeHandler,
+                        shared_from_this(),
+                        boost::asio::placeholders::error,
+                        boost::asio::placeholders::bytes_transferred
+                    )
+                )
+            )
+        );
+    }
+
+    template< typename Condition >
+    void _readUntil( Condition condition, ReadCallback& callback ){
+        m_readCallback.swap( callback );
+        boost::asio::async_read_until(
+            m_socket,
+            m_readBuffer,
+            condition,
+            m_strand.wrap(
+                makeAllocHandler(
+                    m_readMemory,
+                    boost::bind(
+                        &Connection::_readHandler,
+                        shared_from_this(),
+                        boost::asio::placeholders::error,
+                        boost::asio::placeholders::bytes_transferred
+                    )
+                )
             )
         );
     }
 
+    void _readExactly( const boost::asio::mutable_buffer& buffer, ExactReadCallback& callback ){
+        // Anything left over from an earlier `readUntil` comes first.
+        const size_t buffered = boost::asio::buffer_copy( buffer, m_readBuffer.data() );
+        m_readBuffer.consume( buffered );
+        m_exactReadCallback.swap( callback );
+
+        boost::asio::async_read(
+            m_socket,
+            buffer + buffered,
+            m_strand.wrap(
+                makeAllocHandler(
+                    m_readMemory,
+                    boost::bind(
+                        &Connection::_exactReadHandler,
+                        shared_from_this(),
+                        boost::asio::placeholders::error,
+                        boost::asio::placeholders::bytes_transferred,
+                        buffered
+                    )
+                )
+            )
+        );
+    }
+
+    void _close( void ){
+        if( m_socket.is_open() ){
+            try {
+                m_socket.shutdown( tcp::socket::shutdown_both );
+                m_socket.close();
+            }
+            catch( const std::exception& e ){
+                cerr << "Exception while closing socket: " << e.what() << endl;
+            }
+        }
+    }
+
 public:
     /// Constructor.
     ///
     /// @param io_service
-    Connection( boost::asio::io_service& io_service )
-        : m_socket( io_service ){}
+    /// @param maxReadBuffer    Most bytes `readUntil` may buffer. A read which finds no match
+    ///                         within them fails.
+    Connection( boost::asio::io_service& io_service, const size_t maxReadBuffer = (size_t)-1 )
+        : m_strand( io_service ),
+          m_socket( io_service ),
+          m_readBuffer( maxReadBuffer ),
+          m_writing( false ),
+          m_queuedBytes( 0 ){}
 
     ~Connection( void ){
-        close();
+        _close();
     }
 
     /// Read from the socket until the given condition is true.
@@ -113,29 +520,64 @@ public:
     /// @param callback
     template< typename Condition >
     void readUntil( Condition condition, ReadCallback callback ){
-        boost::asio::async_read_until(
-            m_socket,
-            m_readBuffer,
-            condition,
+        if( m_strand.running_in_this_thread() ){
+            _readUntil( condition, callback );
+            return;
+        }
+        m_strand.dispatch(
             boost::bind(
-                &Connection::_readHandler,
+                &Connection::_readUntil< Condition >,
                 shared_from_this(),
-                boost::asio::placeholders::error,
-                boost::asio::placeholders::bytes_transferred,
+                condition,
                 callback
             )
         );
     }
 
+    /// Read exactly as many bytes as fit in the buffer, straight into the buffer.
+    ///
+    /// The buffer must stay valid until the callback is called.
+    ///
+    /// @param buffer
+    /// @param callback
+    void readExactly( const boost::asio::mutable_buffer& buffer, ExactReadCallback callback ){
+        if( m_strand.running_in_this_thread() ){
+            _readExactly( buffer, callback );
+            return;
+        }
+        m_strand.dispatch(
+            boost::bind( &Connection::_readExactly, shared_from_this(), buffer, callback )
+        );
+    }
+
+    /// Write a message to the socket.
+    ///
+    /// Nothing is copied. The message, and so everything it holds, is kept alive until the write
+    /// completes, and the same message may be written to any number of connections at once.
+    ///
+    /// @param message
+    /// @param callback
+    void write( MessagePointer message, WriteCallback callback ){
+        if( m_strand.running_in_this_thread() ){
+            _write( message, callback );
+            return;
+        }
+        m_strand.dispatch(
+            boost::bind( &Connection::_write, shared_from_this(), message, callback )
+        );
+    }
+
     /// Write the data buffer to the socket.
     ///
     /// No copy of the data will be made, but a reference will be held internally by the connection
-    /// until the write completes.
+    /// until the write completes. Writes go out in the order they were made.
     ///
     /// @param data
     /// @param callback
     void write( WriteBuffer data, WriteCallback callback ){
-        _write( data, callback );
+        boost::shared_ptr< Message > message( new Message );
+        message->add( data );
+        write( message, callback );
     }
 
     /// Write the data string to the socket.
@@ -146,23 +588,62 @@ public:
     /// @param data
     /// @param callback
     void write( const string& data, WriteCallback callback ){
-        _write( WriteBuffer( new string( data ) ), callback );
+        write( WriteBuffer( new string( data ) ), callback );
     }
 
     tcp::socket& getSocket( void ){
         return m_socket;
     }
 
+    boost::asio::io_service::strand& getStrand( void ){
+        return m_strand;
+    }
+
+    /// Totals for every connection in the process. Comparing the two shows how well writes are
+    /// being coalesced.
+    static WriteStats getWriteStats( void ){
+        WriteStats stats;
+        stats.messages      = _counter( MESSAGES );
+        stats.writes        = _counter( WRITES );
+        stats.queuedBytes   = _counter( QUEUED_BYTES );
+        stats.droppedOldest = _counter( DROPPED_OLDEST );
+        stats.droppedNewest = _counter( DROPPED_NEWEST );
+        stats.disconnects   = _counter( DISCONNECTS );
+        stats.overBudget    = _counter( OVER_BUDGET );
+        return stats;
+    }
+
+    /// Watch every write completed by any connection in the process, such as to time them. Set it
+    /// before any connection writes, as it is read without a lock.
+    ///
+    /// @param observer Called on the connection's strand as each write completes.
+    static void setWriteObserver( const WriteObserver& observer ){
+        _observer() = observer;
+    }
+
+    /// Limit how many bytes may be waiting to be written across every connection in the process.
+    ///
+    /// @param bytes    The budget, zero for none.
+    static void setOutboundBudget( const size_t bytes ){
+        _counter( BUDGET ) = bytes;
+    }
+
+    /// Bound this connection's outbound queue. Call before the first write.
+    ///
+    /// @param limits
+    void setOutboundLimits( const OutboundLimits& limits ){
+        m_limits = limits;
+    }
+
+    /// @return Bytes queued or being written on this connection. Safe to call from any thread.
+    size_t getQueuedBytes( void ) const {
+        return m_queuedBytes.load( boost::memory_order_relaxed );
+    }
+
+    /// Shut down and close the socket. Any operations in progress complete with an error.
     void close( void ){
-        if( m_socket.is_open() ){
-            try {
-                m_socket.shutdown( tcp::socket::shutdown_both );
-                m_socket.close();
-            }
-            catch( const std::exception& e ){
-                cerr << "Exception while closing socket: " << e.what() << endl;
-            }
-        }
+        m_strand.dispatch( boost::bind( &Connection::_close, shared_from_this() ) );
     }
 };
 
+#endif // TUTORIAL5_CONNECTION_H
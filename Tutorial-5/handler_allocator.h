@@ -0,0 +1,122 @@
+///
+/// @file
+/// Recycled memory for asynchronous operation handlers.
+///
+/// Every asynchronous operation needs somewhere to keep its handler until it completes, and asio
+/// asks the handler for that memory through `asio_handler_allocate`. Wrapping a handler with
+/// `makeAllocHandler` gives it a fixed block to use instead of the heap. A connection only ever has
+/// one read and one write in flight, so one block for each is enough for it never to allocate.
+///
+
+#ifndef TUTORIAL5_HANDLER_ALLOCATOR_H
+#define TUTORIAL5_HANDLER_ALLOCATOR_H
+
+#include <boost/aligned_storage.hpp>
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <cstddef>
+#include <new>
+
+/// A single block of handler memory, handed out to one handler at a time.
+///
+/// Requests which are too big, or which arrive while the block is already in use, fall back to the
+/// heap. Both cases are counted so the block size can be checked against real use.
+class HandlerMemory : private boost::noncopyable {
+public:
+    static const size_t BLOCK_SIZE = 1024;
+
+    /// Process wide allocation counters, summed over every block.
+    struct Stats {
+        size_t recycled;    ///< Allocations served from a block.
+        size_t heap;        ///< Allocations which had to go to the heap.
+    }; // end struct Stats
+
+private:
+    boost::aligned_storage< BLOCK_SIZE > m_storage;
+    bool m_inUse;
+
+    static boost::atomic< size_t >& _recycled( void ){
+        static boost::atomic< size_t > count( 0 );
+        return count;
+    }
+
+    static boost::atomic< size_t >& _heap( void ){
+        static boost::atomic< size_t > count( 0 );
+        return count;
+    }
+
+public:
+    HandlerMemory( void ) : m_inUse( false ){}
+
+    void* allocate( const size_t size ){
+        if( !m_inUse && size <= BLOCK_SIZE ){
+            m_inUse = true;
+            ++_recycled();
+            return m_storage.address();
+        }
+        ++_heap();
+        return ::operator new( size );
+    }
+
+    void deallocate( void* pointer ){
+        if( pointer == m_storage.address() ){
+            m_inUse = false;
+        }
+        else {
+            ::operator delete( pointer );
+        }
+    }
+
+    static Stats getStats( void ){
+        Stats stats;
+        stats.recycled  = _recycled();
+        stats.heap      = _heap();
+        return stats;
+    }
+}; // end class HandlerMemory
+
+// ************************************************************************** //
+
+/// A handler which asks asio to keep it, and anything asio wraps around it, in a `HandlerMemory`.
+///
+/// @tparam Handler
+template< typename Handler >
+class AllocHandler {
+private:
+    HandlerMemory&  m_memory;
+    Handler         m_handler;
+
+public:
+    AllocHandler( HandlerMemory& memory, const Handler& handler )
+        : m_memory( memory ), m_handler( handler ){}
+
+    template< typename Arg1 >
+    void operator()( const Arg1& arg1 ){
+        m_handler( arg1 );
+    }
+
+    template< typename Arg1, typename Arg2 >
+    void operator()( const Arg1& arg1, const Arg2& arg2 ){
+        m_handler( arg1, arg2 );
+    }
+
+    friend void* asio_handler_allocate( const size_t size, AllocHandler< Handler >* handler ){
+        return handler->m_memory.allocate( size );
+    }
+
+    friend void asio_handler_deallocate( void* pointer, size_t, AllocHandler< Handler >* handler ){
+        handler->m_memory.deallocate( pointer );
+    }
+}; // end class AllocHandler
+
+/// Wrap a handler so that asio keeps it in `memory`. The memory must outlive the operation.
+///
+/// @param memory
+/// @param handler
+template< typename Handler >
+inline AllocHandler< Handler > makeAllocHandler( HandlerMemory& memory, const Handler& handler ){
+    return AllocHandler< Handler >( memory, handler );
+}
+
+#endif // TUTORIAL5_HANDLER_ALLOCATOR_H
@@ -0,0 +1,118 @@
+///
+/// @file
+/// A bounded record of the most recent messages sent to a room, kept in their encoded form so they
+/// can be replayed to a new member without being built again.
+///
+
+#ifndef TUTORIAL5_HISTORY_H
+#define TUTORIAL5_HISTORY_H
+
+#include <boost/asio.hpp>
+#include <boost/smart_ptr.hpp>
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/// A ring buffer of encoded messages.
+///
+/// The bytes live back to back in one buffer allocated up front, wrapping around its end, and a
+/// second ring holds the size of each message so the oldest can be dropped to make room. Nothing is
+/// allocated as messages are added, and since the messages are contiguous the whole history can be
+/// copied out with at most two `memcpy`s.
+///
+/// The ring does no locking of its own.
+class History {
+private:
+    vector< char >      m_data;     ///< The encoded messages.
+    vector< size_t >    m_sizes;    ///< Size of each message, oldest at `m_first`.
+    size_t              m_start;    ///< Offset of the oldest byte in `m_data`.
+    size_t              m_bytes;    ///< Bytes in use.
+    size_t              m_first;    ///< Index of the oldest size in `m_sizes`.
+    size_t              m_count;    ///< Messages held.
+
+    void _dropOldest( void ){
+        const size_t size = m_sizes[ m_first ];
+        m_start = (m_start + size) % m_data.size();
+        m_bytes -= size;
+        m_first = (m_first + 1) % m_sizes.size();
+        --m_count;
+    }
+
+    /// Copy `size` bytes in at `offset`, wrapping around the end of the buffer.
+    void _copyIn( const size_t offset, const char* data, const size_t size ){
+        const size_t first = min( size, m_data.size() - offset );
+        memcpy( &m_data[ offset ], data, first );
+        memcpy( &m_data[ 0 ], data + first, size - first );
+    }
+
+public:
+    /// Constructor. A history with no room for messages or bytes keeps nothing.
+    ///
+    /// @param maxMessages  Most messages kept.
+    /// @param maxBytes     Most bytes kept, all of which is allocated now.
+    History( const size_t maxMessages, const size_t maxBytes )
+        : m_data( maxMessages ? maxBytes : 0 ),
+          m_sizes( maxBytes ? maxMessages : 0 ),
+          m_start( 0 ),
+          m_bytes( 0 ),
+          m_first( 0 ),
+          m_count( 0 ){}
+
+    bool enabled( void ) const {
+        return !m_sizes.empty();
+    }
+
+    bool empty( void ) const {
+        return m_count == 0;
+    }
+
+    /// Record a message, dropping the oldest ones as needed to fit it. A message bigger than the
+    /// whole buffer is not kept.
+    ///
+    /// @param buffers  The pieces of the encoded message, any sequence of `const_buffer`s.
+    template< typename BufferList >
+    void add( const BufferList& buffers ){
+        const size_t size = boost::asio::buffer_size( buffers );
+        if( !enabled() || size == 0 || size > m_data.size() ){
+            return;
+        }
+
+        while( m_count == m_sizes.size() || m_bytes + size > m_data.size() ){
+            _dropOldest();
+        }
+
+        size_t offset = (m_start + m_bytes) % m_data.size();
+        for( typename BufferList::const_iterator it = buffers.begin(); it != buffers.end(); ++it ){
+            const size_t pieceSize = boost::asio::buffer_size( *it );
+            _copyIn( offset, boost::asio::buffer_cast< const char* >( *it ), pieceSize );
+            offset = (offset + pieceSize) % m_data.size();
+        }
+
+        m_sizes[ (m_first + m_count) % m_sizes.size() ] = size;
+        m_bytes += size;
+        ++m_count;
+    }
+
+    /// Copy out every message held, oldest first.
+    ///
+    /// The copy is what gets written, as the ring itself may be overwritten while the write is
+    /// still in progress. It is a single allocation however many messages it holds.
+    ///
+    /// @return The messages back to back, or null if there are none.
+    boost::shared_ptr< string > copy( void ) const {
+        if( empty() ){
+            return boost::shared_ptr< string >();
+        }
+
+        boost::shared_ptr< string > messages( new string( m_bytes, '\0' ) );
+        const size_t first = min( m_bytes, m_data.size() - m_start );
+        memcpy( &(*messages)[ 0 ], &m_data[ m_start ], first );
+        memcpy( &(*messages)[ first ], &m_data[ 0 ], m_bytes - first );
+        return messages;
+    }
+}; // end class History
+
+#endif // TUTORIAL5_HISTORY_H
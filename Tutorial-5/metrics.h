@@ -0,0 +1,225 @@
+///
+/// @file
+/// Counters kept per thread and summed when read, and a writer for the Prometheus text format they
+/// are served in.
+///
+
+#ifndef TUTORIAL5_METRICS_H
+#define TUTORIAL5_METRICS_H
+
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/smart_ptr.hpp>
+#include <boost/thread.hpp>
+#include <cstddef>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/// A fixed set of counters which any thread can bump without contending with the others.
+///
+/// Each thread that touches the counters gets a block of its own, found through a thread local
+/// pointer, so bumping a counter is a plain load and store to memory that no other thread writes.
+/// There is no lock and no cache line bouncing between cores on the hot path. Reading adds up every
+/// block, which only has to be done when the counters are scraped.
+///
+/// Blocks are kept until the counters are destroyed, so nothing counted by a thread which has since
+/// exited is lost.
+class ThreadCounters : private boost::noncopyable {
+private:
+    static const size_t CACHE_LINE = 64;
+
+    /// One thread's counters. The array is allocated with a cache line to spare at either end, so
+    /// whatever the heap puts next to it, another thread's counters included, can't share a line
+    /// with the counters themselves.
+    struct Block {
+        typedef boost::atomic< size_t > Counter;
+
+        static const size_t PADDING = (CACHE_LINE + sizeof( Counter ) - 1) / sizeof( Counter );
+
+        boost::scoped_array< Counter >  storage;
+        Counter*                        counters;   ///< Within `storage`, past the padding.
+
+        Block( const size_t size )
+            : storage( new Counter[ size + 2 * PADDING ] ),
+              counters( storage.get() + PADDING )
+        {
+            for( size_t i = 0; i < size; ++i ){
+                counters[ i ] = 0;
+            }
+        }
+    }; // end struct Block
+
+    const size_t                            m_size;
+    boost::thread_specific_ptr< Block >     m_local;    ///< Each thread's own block.
+    vector< boost::shared_ptr< Block > >    m_blocks;   ///< Every block, which owns them.
+    mutable boost::mutex                    m_mutex;
+
+    /// The blocks belong to `m_blocks`, so a thread exiting leaves its block alone.
+    static void _keep( Block* ){}
+
+    Block& _local( void ){
+        Block* block = m_local.get();
+        if( !block ){
+            boost::shared_ptr< Block > created( new Block( m_size ) );
+            {
+                boost::mutex::scoped_lock lock( m_mutex );
+                m_blocks.push_back( created );
+            }
+            block = created.get();
+            m_local.reset( block );
+        }
+        return *block;
+    }
+
+public:
+    /// Constructor.
+    ///
+    /// @param size The number of counters.
+    ThreadCounters( const size_t size ) : m_size( size ), m_local( &ThreadCounters::_keep ){}
+
+    /// Add to one of the calling thread's counters.
+    ///
+    /// @param counter
+    /// @param amount
+    void add( const size_t counter, const size_t amount = 1 ){
+        // Only this thread ever writes the counter, so it needs no atomic read-modify-write.
+        boost::atomic< size_t >& value = _local().counters[ counter ];
+        value.store(
+            value.load( boost::memory_order_relaxed ) + amount,
+            boost::memory_order_relaxed
+        );
+    }
+
+    /// @return Every counter, summed over all threads.
+    vector< size_t > sum( void ) const {
+        vector< size_t > totals( m_size, 0 );
+        boost::mutex::scoped_lock lock( m_mutex );
+        for( size_t i = 0; i < m_blocks.size(); ++i ){
+            for( size_t counter = 0; counter < m_size; ++counter ){
+                totals[ counter ] += m_blocks[ i ]->counters[ counter ].load(
+                    boost::memory_order_relaxed
+                );
+            }
+        }
+        return totals;
+    }
+}; // end class ThreadCounters
+
+// ************************************************************************** //
+
+/// A histogram of durations kept as a run of `ThreadCounters` counters: one per bucket, one for
+/// everything past the last bucket, and the sum of every duration in microseconds.
+class LatencyHistogram {
+public:
+    static const size_t BUCKETS = 14;
+    static const size_t COUNTERS = BUCKETS + 2;
+
+private:
+    ThreadCounters& m_counters;
+    const size_t    m_first;    ///< Index of the histogram's first counter.
+
+public:
+    /// Upper bound of each bucket, in microseconds.
+    static size_t bound( const size_t bucket ){
+        static const size_t bounds[ BUCKETS ] = {
+            100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000,
+            2500000
+        };
+        return bounds[ bucket ];
+    }
+
+    /// Constructor.
+    ///
+    /// @param counters Where the histogram is kept.
+    /// @param first    Index of the first of the `COUNTERS` counters set aside for it.
+    LatencyHistogram( ThreadCounters& counters, const size_t first )
+        : m_counters( counters ), m_first( first ){}
+
+    /// @param microseconds
+    void record( const size_t microseconds ){
+        size_t bucket = 0;
+        while( bucket < BUCKETS && microseconds > bound( bucket ) ){
+            ++bucket;
+        }
+        m_counters.add( m_first + bucket );
+        m_counters.add( m_first + BUCKETS + 1, microseconds );
+    }
+
+    size_t getFirst( void ) const {
+        return m_first;
+    }
+}; // end class LatencyHistogram
+
+// ************************************************************************** //
+
+/// Writes metrics in the Prometheus text exposition format.
+class MetricsWriter {
+private:
+    ostream& m_out;
+
+public:
+    MetricsWriter( ostream& out ) : m_out( out ){}
+
+    /// Start a metric family, which its samples must follow.
+    ///
+    /// @param name
+    /// @param type "counter", "gauge" or "histogram".
+    /// @param help
+    void family( const string& name, const string& type, const string& help ){
+        m_out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+    }
+
+    /// Write one sample of the current family.
+    ///
+    /// @param name
+    /// @param labels   Such as `command="chat"`, or empty for none.
+    /// @param value
+    template< typename T >
+    void sample( const string& name, const string& labels, const T& value ){
+        m_out << name;
+        if( !labels.empty() ){
+            m_out << "{" << labels << "}";
+        }
+        m_out << " " << value << "\n";
+    }
+
+    /// Write a family with a single unlabelled sample.
+    template< typename T >
+    void single( const string& name, const string& type, const string& help, const T& value ){
+        family( name, type, help );
+        sample( name, "", value );
+    }
+
+    /// Write a histogram, in seconds, from the summed counters of a `LatencyHistogram`.
+    ///
+    /// @param name
+    /// @param help
+    /// @param histogram
+    /// @param totals       Summed counters, from `ThreadCounters::sum`.
+    void histogram(
+        const string& name,
+        const string& help,
+        const LatencyHistogram& histogram,
+        const vector< size_t >& totals
+    ){
+        family( name, "histogram", help );
+        const size_t first = histogram.getFirst();
+        size_t count = 0;
+        for( size_t bucket = 0; bucket < LatencyHistogram::BUCKETS; ++bucket ){
+            count += totals[ first + bucket ];
+            ostringstream bound;
+            bound << "le=\"" << LatencyHistogram::bound( bucket ) / 1000000.0 << "\"";
+            sample( name + "_bucket", bound.str(), count );
+        }
+        count += totals[ first + LatencyHistogram::BUCKETS ];
+        sample( name + "_bucket", "le=\"+Inf\"", count );
+        sample( name + "_sum", "", totals[ first + LatencyHistogram::BUCKETS + 1 ] / 1000000.0 );
+        sample( name + "_count", "", count );
+    }
+}; // end class MetricsWriter
+
+#endif // TUTORIAL5_METRICS_H
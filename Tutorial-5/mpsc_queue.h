@@ -0,0 +1,99 @@
+///
+/// @file
+/// A lock-free queue for handing values from any number of threads to a single consumer.
+///
+
+#ifndef TUTORIAL5_MPSC_QUEUE_H
+#define TUTORIAL5_MPSC_QUEUE_H
+
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <cstddef>
+#include <vector>
+
+using namespace std;
+
+/// Multiple producer, single consumer queue.
+///
+/// Producers push onto the front of a linked list with a single compare-and-swap and never wait on
+/// each other or on the consumer. The consumer takes the whole list in one atomic exchange and
+/// reverses it, so values come out in the order they were pushed.
+///
+/// `push` reports whether the queue was empty beforehand. Only that producer needs to wake the
+/// consumer, which is how a single drain can be scheduled for any number of pushes: everything
+/// pushed before the drain runs is picked up by it, and the first push after it finds the queue
+/// empty again.
+///
+/// @tparam T
+template< typename T >
+class MpscQueue : private boost::noncopyable {
+private:
+    struct Node {
+        T       value;
+        Node*   next;
+
+        Node( const T& value_ ) : value( value_ ), next( NULL ){}
+    }; // end struct Node
+
+    boost::atomic< Node* > m_head;  ///< The most recently pushed value.
+
+public:
+    MpscQueue( void ) : m_head( NULL ){}
+
+    ~MpscQueue( void ){
+        Node* node = m_head.exchange( NULL, boost::memory_order_acquire );
+        while( node ){
+            Node* next = node->next;
+            delete node;
+            node = next;
+        }
+    }
+
+    /// Add a value to the queue. Safe to call from any thread.
+    ///
+    /// @param value
+    ///
+    /// @return True if the queue was empty, meaning the consumer needs to be told about it.
+    bool push( const T& value ){
+        Node* node = new Node( value );
+        Node* head = m_head.load( boost::memory_order_relaxed );
+        do {
+            node->next = head;
+        } while( !m_head.compare_exchange_weak(
+            head,
+            node,
+            boost::memory_order_release,
+            boost::memory_order_relaxed
+        ) );
+        return head == NULL;
+    }
+
+    /// Take everything in the queue. Only one thread may call this at a time.
+    ///
+    /// @param values   The values are appended to this, oldest first.
+    ///
+    /// @return The number of values taken.
+    size_t popAll( vector< T >& values ){
+        // Reverse the list as it is taken, so the oldest value ends up first.
+        Node* node = m_head.exchange( NULL, boost::memory_order_acquire );
+        Node* oldest = NULL;
+        while( node ){
+            Node* next = node->next;
+            node->next = oldest;
+            oldest = node;
+            node = next;
+        }
+
+        size_t count = 0;
+        while( oldest ){
+            Node* next = oldest->next;
+            values.push_back( oldest->value );
+            delete oldest;
+            oldest = next;
+            ++count;
+        }
+        return count;
+    }
+}; // end class MpscQueue
+
+#endif // TUTORIAL5_MPSC_QUEUE_H
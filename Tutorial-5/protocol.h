@@ -0,0 +1,254 @@
+///
+/// @file
+/// Definitions shared by the chat server and its clients for both versions of the wire protocol.
+///
+/// Version 1 frames are a 4 character command, the payload size as a 4 byte integer in network byte
+/// order, and then the payload. The server replies with newline terminated lines of text.
+///
+/// Version 2 frames, in both directions, are a single byte opcode, the payload size as a varint,
+/// and then the payload. A client asks for version 2 by sending the version 1 `prot` command with a
+/// payload of "2". A server which understands it replies with the line "protocol 2" and uses
+/// version 2 for everything after that line. An older server ignores the command, so the client
+/// carries on with version 1.
+///
+/// The server checks on clients it hasn't heard from in a while with a `PING`, which is the line
+/// "ping" in version 1, and expects a `PONG` back.
+///
+/// Federated servers use version 2 framing on the links between them, with their own opcodes.
+///
+
+#ifndef TUTORIAL5_PROTOCOL_H
+#define TUTORIAL5_PROTOCOL_H
+
+#include <boost/asio.hpp>
+#include <cstring>
+#include <string>
+
+using namespace std;
+
+struct Protocol {
+    /// Message types. Opcodes from 0x80 up are sent by the server.
+    enum Opcode {
+        INVALID = 0,
+        NAME,       ///< Payload: the client's new name.
+        CHAT,       ///< Payload: a message for the lobby.
+        JOIN,       ///< Payload: a room name.
+        PART,       ///< Payload: a room name.
+        TALK,       ///< Payload: a room name and a message, see `encodeTalk`.
+        QUIT,       ///< No payload.
+        VERSION,    ///< Version 1 only. Payload: the version the client wants.
+        RESUME,     ///< Payload: a log sequence number, in decimal, to replay messages from.
+        PONG,       ///< No payload. The answer to a `PING`.
+        CLIENT_OPCODE_COUNT,
+
+        MESSAGE = 0x80, ///< Payload: room, sender's name and message, see `encodeMessageHeader`.
+        PING,           ///< No payload. Sent to idle clients, which must answer with a `PONG`.
+
+        PEER_HELLO = 0x90,  ///< Server to server. Payload: the sending server's ID.
+        PEER_JOIN,          ///< Payload: a room the sending server now has members in.
+        PEER_PART,          ///< Payload: a room the sending server no longer has members in.
+        PEER_MESSAGE,       ///< Payload: as for `MESSAGE`, sent by one of the server's clients.
+
+        OPCODE_COUNT = 0x100
+    };
+
+    static const size_t COMMAND_LENGTH  = 4;
+    static const size_t V1_HEADER_SIZE  = COMMAND_LENGTH + sizeof( int );
+    static const size_t MAX_VARINT_SIZE = 5;    ///< Enough for any 32 bit value.
+
+    /// The largest payload a server will read. A frame declaring more ends the connection, rather
+    /// than having the server allocate whatever size the peer asks for.
+    static const size_t MAX_PAYLOAD_SIZE = 1 << 20;
+
+    /// The version 1 command for each client opcode.
+    static const char* command( const unsigned char opcode ){
+        static const char* commands[ CLIENT_OPCODE_COUNT ] = {
+            "", "name", "chat", "join", "part", "talk", "quit", "prot", "rsum", "pong"
+        };
+        return opcode < CLIENT_OPCODE_COUNT ? commands[ opcode ] : "";
+    }
+
+    /// @param command  A version 1 command.
+    ///
+    /// @return The command's opcode, or `INVALID` if there isn't one.
+    static unsigned char opcode( const string& command ){
+        for( unsigned char opcode = INVALID + 1; opcode < CLIENT_OPCODE_COUNT; ++opcode ){
+            if( command == Protocol::command( opcode ) ){
+                return opcode;
+            }
+        }
+        return INVALID;
+    }
+
+    /// Append a varint: seven bits at a time, least significant first, with the top bit of each
+    /// byte set when another byte follows.
+    ///
+    /// @param out
+    /// @param value
+    static void appendVarint( string& out, size_t value ){
+        while( value >= 0x80 ){
+            out += (char)((value & 0x7f) | 0x80);
+            value >>= 7;
+        }
+        out += (char)value;
+    }
+
+    /// Decode a varint.
+    ///
+    /// @param data     Advanced past the varint on success.
+    /// @param end
+    /// @param value
+    ///
+    /// @return False if the data ends before the varint does or the value is too big.
+    static bool readVarint( const char*& data, const char* end, size_t& value ){
+        value = 0;
+        for( size_t i = 0; i < MAX_VARINT_SIZE && data < end; ++i ){
+            const unsigned char byte = (unsigned char)*data++;
+            value |= (size_t)(byte & 0x7f) << (7 * i);
+            if( !(byte & 0x80) ){
+                return value <= 0xffffffff;
+            }
+        }
+        return false;
+    }
+
+    /// Read a varint length followed by that many bytes.
+    ///
+    /// @param data     Advanced past the string on success.
+    /// @param end
+    /// @param offset   Set to the offset of the string from where `data` started.
+    /// @param size
+    ///
+    /// @return False if the data is too short.
+    static bool readString( const char*& data, const char* end, size_t& offset, size_t& size ){
+        const char* start = data;
+        if( !readVarint( data, end, size ) || size > (size_t)(end - data) ){
+            return false;
+        }
+        offset = data - start;
+        data  += size;
+        return true;
+    }
+
+    /// @return How many bytes `value` takes up as a varint.
+    static size_t varintSize( size_t value ){
+        size_t size = 1;
+        while( value >= 0x80 ){
+            value >>= 7;
+            ++size;
+        }
+        return size;
+    }
+
+    /// Write a varint into memory with room for it, as `appendVarint` does to a string.
+    ///
+    /// @param out
+    /// @param value
+    ///
+    /// @return Just past the varint.
+    static char* writeVarint( char* out, size_t value ){
+        while( value >= 0x80 ){
+            *out++ = (char)((value & 0x7f) | 0x80);
+            value >>= 7;
+        }
+        *out++ = (char)value;
+        return out;
+    }
+
+    /// Encode a whole version 1 frame.
+    static string encodeV1( const string& command, const string& data ){
+        string frame = command;
+        unsigned int dataSize = (unsigned int)htonl( data.size() );
+        frame.append( (char*)&dataSize, sizeof( dataSize ) );
+        frame.append( data );
+        return frame;
+    }
+
+    /// Encode the header of a version 2 frame, to be followed by `size` bytes of payload.
+    static string encodeV2Header( const unsigned char opcode, const size_t size ){
+        string header( 1, (char)opcode );
+        appendVarint( header, size );
+        return header;
+    }
+
+    /// Encode a whole version 2 frame.
+    static string encodeV2( const unsigned char opcode, const string& data ){
+        return encodeV2Header( opcode, data.size() ) + data;
+    }
+
+    /// Encode the payload of a version 2 `TALK`. The version 1 form is the room, a space, and the
+    /// message.
+    static string encodeTalk( const string& room, const string& message ){
+        string payload;
+        appendVarint( payload, room.size() );
+        return payload + room + message;
+    }
+
+    /// Encode the room and sender's name which start a `MESSAGE` payload.
+    ///
+    /// @param room     Empty for the lobby.
+    /// @param name     Sender's name.
+    static string encodeMessageFields( const string& room, const string& name ){
+        string fields;
+        appendVarint( fields, room.size() );
+        fields += room;
+        appendVarint( fields, name.size() );
+        fields += name;
+        return fields;
+    }
+
+    /// @return The size of what `writeMessageHeader` writes.
+    static size_t messageHeaderSize(
+        const string& room,
+        const string& name,
+        const size_t textSize
+    ){
+        const size_t fields = _messageFieldsSize( room, name );
+        return 1 + varintSize( fields + textSize ) + fields;
+    }
+
+    /// Write everything in a version 2 `MESSAGE` frame up to the message text itself, which is the
+    /// rest of the payload, into memory with room for `messageHeaderSize` bytes.
+    ///
+    /// @param out
+    /// @param room         Empty for the lobby.
+    /// @param name         Sender's name.
+    /// @param textSize     Size of the text which will follow.
+    static void writeMessageHeader(
+        char* out,
+        const string& room,
+        const string& name,
+        const size_t textSize
+    ){
+        *out++ = (char)MESSAGE;
+        out = writeVarint( out, _messageFieldsSize( room, name ) + textSize );
+        out = writeVarint( out, room.size() );
+        memcpy( out, room.data(), room.size() );
+        out = writeVarint( out + room.size(), name.size() );
+        memcpy( out, name.data(), name.size() );
+    }
+
+    /// Encode everything in a version 2 `MESSAGE` frame up to the message text itself, as
+    /// `writeMessageHeader` does.
+    ///
+    /// @param room         Empty for the lobby.
+    /// @param name         Sender's name.
+    /// @param textSize     Size of the text which will follow.
+    static string encodeMessageHeader(
+        const string& room,
+        const string& name,
+        const size_t textSize
+    ){
+        string header( messageHeaderSize( room, name, textSize ), '\0' );
+        writeMessageHeader( &header[ 0 ], room, name, textSize );
+        return header;
+    }
+
+private:
+    /// @return The size of what `encodeMessageFields` returns.
+    static size_t _messageFieldsSize( const string& room, const string& name ){
+        return varintSize( room.size() ) + room.size() + varintSize( name.size() ) + name.size();
+    }
+}; // end struct Protocol
+
+#endif // TUTORIAL5_PROTOCOL_H
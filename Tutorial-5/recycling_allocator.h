@@ -0,0 +1,139 @@
+///
+/// @file
+/// An allocator which keeps freed objects' memory for reuse, for things made and dropped once per
+/// message: the messages built for each broadcast and the reference counts of pooled buffers.
+///
+
+#ifndef TUTORIAL5_RECYCLING_ALLOCATOR_H
+#define TUTORIAL5_RECYCLING_ALLOCATOR_H
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+#include <cstddef>
+#include <new>
+#include <vector>
+
+using namespace std;
+
+/// Freed chunks of one size, kept for reuse by every thread.
+///
+/// Things made once per message are usually freed on a different thread from the one which made
+/// them, by whichever write finishes last, so the chunks go back to a single locked list rather
+/// than a cache per thread. The list is allocated up front, so neither taking nor returning a chunk
+/// ever allocates.
+///
+/// @tparam SIZE    Bytes in each chunk.
+template< size_t SIZE >
+class ChunkPool : private boost::noncopyable {
+public:
+    /// Most idle chunks kept. Any more are given back to the heap.
+    static const size_t MAX_FREE = 4096;
+
+private:
+    vector< void* > m_free;
+    boost::mutex    m_mutex;
+
+    ChunkPool( void ){
+        m_free.reserve( MAX_FREE );
+    }
+
+public:
+    /// The pool is never destroyed, since chunks can be freed by static destructors.
+    static ChunkPool& instance( void ){
+        static ChunkPool* pool = new ChunkPool;
+        return *pool;
+    }
+
+    void* allocate( void ){
+        {
+            boost::mutex::scoped_lock lock( m_mutex );
+            if( !m_free.empty() ){
+                void* chunk = m_free.back();
+                m_free.pop_back();
+                return chunk;
+            }
+        }
+        return ::operator new( SIZE );
+    }
+
+    void deallocate( void* chunk ){
+        {
+            boost::mutex::scoped_lock lock( m_mutex );
+            if( m_free.size() < MAX_FREE ){
+                m_free.push_back( chunk );
+                return;
+            }
+        }
+        ::operator delete( chunk );
+    }
+}; // end class ChunkPool
+
+// ************************************************************************** //
+
+/// Allocates single objects from the `ChunkPool` of their size, and anything else from the heap.
+///
+/// Meant for `boost::allocate_shared` and the allocator argument of `boost::shared_ptr`, which
+/// rebind it to their own control block types, so the object and its reference count both come
+/// from a pool.
+///
+/// @tparam T
+template< typename T >
+class RecyclingAllocator {
+public:
+    typedef T           value_type;
+    typedef T*          pointer;
+    typedef const T*    const_pointer;
+    typedef T&          reference;
+    typedef const T&    const_reference;
+    typedef size_t      size_type;
+    typedef ptrdiff_t   difference_type;
+
+    template< typename U >
+    struct rebind {
+        typedef RecyclingAllocator< U > other;
+    }; // end struct rebind
+
+    RecyclingAllocator( void ){}
+
+    template< typename U >
+    RecyclingAllocator( const RecyclingAllocator< U >& ){}
+
+    T* allocate( const size_t count, const void* = NULL ){
+        if( count == 1 ){
+            return static_cast< T* >( ChunkPool< sizeof( T ) >::instance().allocate() );
+        }
+        return static_cast< T* >( ::operator new( count * sizeof( T ) ) );
+    }
+
+    void deallocate( T* object, const size_t count ){
+        if( count == 1 ){
+            ChunkPool< sizeof( T ) >::instance().deallocate( object );
+            return;
+        }
+        ::operator delete( object );
+    }
+
+    size_t max_size( void ) const {
+        return (size_t)-1 / sizeof( T );
+    }
+
+    void construct( T* object, const T& value ){
+        new( object ) T( value );
+    }
+
+    void destroy( T* object ){
+        object->~T();
+    }
+
+    template< typename U >
+    bool operator==( const RecyclingAllocator< U >& ) const {
+        return true;
+    }
+
+    template< typename U >
+    bool operator!=( const RecyclingAllocator< U >& ) const {
+        return false;
+    }
+}; // end class RecyclingAllocator
+
+#endif // TUTORIAL5_RECYCLING_ALLOCATOR_H
@@ -3,147 +3,469 @@
 /// This is a simple asynchronous chat server. Clients can connect to it, change their names, send
 /// messages, and disconnect.
 ///
+/// The `io_service` is run by a pool of threads. Each client's connection has its own strand, so
+/// the handlers for one client never run concurrently while different clients are served in
+/// parallel.
+///
+/// Clients talk in named rooms. Everyone starts out in the lobby, which is where plain `chat`
+/// messages go, and can `join` and `part` any number of other rooms and `talk` in them. Each room
+/// keeps its own member list, so a message costs as much as the room it is sent to rather than the
+/// whole server.
+///
+/// Clients which go quiet can be sent a heartbeat, and any which don't answer it disconnected, so
+/// a client which vanished without closing its connection doesn't linger. Every client's heartbeat
+/// runs off a single timing wheel rather than a timer of its own.
+///
+/// Each client can be held to a rate of messages and bytes per second. A client over its limit is
+/// simply not read from until it is back within it, which leaves TCP to slow the sender down, and
+/// one that keeps going over can be disconnected.
+///
+/// With `--capture` every message clients send is recorded, along with when it arrived and which
+/// connection it came in on, so `chat-replay` can play the same traffic back later.
+///
+/// Each step of reading a message is a trace point. With `--trace` the server keeps the latest of
+/// them for every thread and writes them out as a Chrome trace whenever it gets `SIGUSR1`.
+///
+/// An optional admin port serves the server's metrics to Prometheus. Everything counted on the hot
+/// path is counted per thread and only added up when the metrics are scraped.
+///
+/// Several servers can be federated into one chat space. Each listens for its peers on a second
+/// port and keeps a link open to every other server, and tells each peer which rooms it has members
+/// in. A message is forwarded only to the peers with members in its room, and only by the server
+/// its sender is connected to, so the servers must be fully meshed but a message can never loop.
+///
 
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/atomic.hpp>
 #include <boost/bind.hpp>
 #include <boost/smart_ptr.hpp>
+#include <boost/thread.hpp>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
-#include <list>
+#include <map>
+#include <set>
 #include <sstream>
 #include <string>
+#include <vector>
 
+#include "allocation_counter.h"
+#include "buffer_pool.h"
+#include "capture.h"
+#include "chat_log.h"
 #include "connection.h"
+#include "history.h"
+#include "metrics.h"
+#include "mpsc_queue.h"
+#include "protocol.h"
+#include "racing_connector.h"
+#include "recycling_allocator.h"
+#include "resolver_cache.h"
+#include "slot_map.h"
+#include "timer_wheel.h"
+#include "token_bucket.h"
+#include "trace.h"
 
 using namespace std;
 using boost::asio::ip::tcp;
 
 enum ErrorCodes {
     SUCCESS = 0,
-    BAD_ARGUMENTS
+    BAD_ARGUMENTS,
+    LOG_FAILURE,
+    PEER_FAILURE,
+    ADMIN_FAILURE,
+    CAPTURE_FAILURE
 };
 
-void getBytes( istream& stream, const size_t count, string& out ){
-    for( size_t i = 0; i < count && stream.good(); ++i ){
-        out += (char)stream.get();
-    }
-}
-
 // ************************************************************************** //
 
-class ByteLimit {
-private:
-    const size_t m_limit;
-
-public:
-    template< typename Iterator >
-    pair< Iterator, bool > operator()( Iterator begin, Iterator end ) const {
-        return make_pair( begin, (end - begin) >= m_limit );
-    }
-
-    explicit ByteLimit( const size_t limit, const size_t preRead = 0 )
-        : m_limit( limit ){}
-    ByteLimit( const ByteLimit& other )
-        : m_limit( other.m_limit ){}
-    ~ByteLimit( void ){}
-}; // end class ByteLimit
-
-// Required to convince Boost ASIO that our match condition is valid.
-namespace boost {
-    namespace asio {
-        template<> struct is_match_condition< ByteLimit > : boost::true_type {};
-    }
-}
-
-// ************************************************************************** //
+class Room;
 
 class ClientConnection : public boost::enable_shared_from_this< ClientConnection > {
 public:
     typedef boost::shared_ptr< ClientConnection >   Pointer;
+    typedef boost::weak_ptr< ClientConnection >     WeakPointer;
     typedef boost::system::error_code               error_code;
+    typedef SlotMap< Pointer >::Handle              Handle;
+    typedef map< string, boost::shared_ptr< Room > > room_map;
 
-    typedef boost::function< void( const error_code&, const string&, const string& ) > MessageHandler;
+    typedef boost::function<
+        void( const error_code&, const unsigned char, const BufferView& )
+    > MessageHandler;
 
     struct placeholders {
         static boost::arg< 1 > error;
-        static boost::arg< 2 > command;
+        static boost::arg< 2 > opcode;
         static boost::arg< 3 > data;
     };
 
 private:
-    static const size_t COMMAND_LENGTH  = 4;
-    static const size_t HEADER_SIZE     = (COMMAND_LENGTH * sizeof( char )) + sizeof( int );
-
     Connection::Pointer m_connection;
+    BufferPool::Pointer m_pool;     ///< Where payloads are read into.
+    int m_protocol;                 ///< Protocol version. Only touched on the connection's strand.
+    char m_header[ Protocol::V1_HEADER_SIZE ];  ///< The header of the message being read.
+    size_t m_headerSize;
+    unsigned char m_opcode;         ///< The opcode of the message being read.
+    BufferView m_payload;           ///< Where the payload of the message being read is going.
+    MessageHandler m_handler;       ///< Called with each message, kept here so reads don't copy it.
     string m_clientName;
+    Handle m_handle;    ///< The client's entry in the server's client table.
+    size_t m_id;        ///< Numbers the client's connection in captures.
+    room_map m_rooms;   ///< Rooms the client is in. Only touched from the client's own handlers.
+    set< string > m_joining;    ///< See `getJoining`.
+    bool m_readHeld;    ///< See `holdRead`. Only touched from the client's own handlers.
+    boost::atomic< TimerWheel::Tick > m_lastActive;    ///< When the client last sent anything.
+
+    // Rate limiting. Only touched from the client's own handlers.
+    TokenBucket m_messageBucket;
+    TokenBucket m_byteBucket;
+    size_t m_strikes;   ///< Messages in a row which took the client over its limits.
+    boost::asio::steady_timer m_resumeTimer;    ///< Resumes reading once the client is in limits.
+    bool m_stopped;     ///< Set by `stop`. Only touched from the client's own handlers.
+
+    // Writes held until the protocol is settled, see `holdWrites`. Only touched on the strand.
+    bool m_writesHeld;
+    vector< pair< Connection::MessagePointer, Connection::MessagePointer > > m_heldWrites;
+    boost::asio::steady_timer m_releaseTimer;
+
+    /// A read callback which calls one of the client's read handlers. A message takes two reads,
+    /// and a `boost::bind` of a member function and the client is too big for `boost::function` to
+    /// keep inline, so the handler is picked by a plain function pointer instead, which leaves the
+    /// callback small enough that starting a read allocates nothing.
+    struct ReadStep {
+        typedef void (*Handler)( ClientConnection&, const error_code& );
+
+        Pointer client;
+        Handler handler;
+
+        ReadStep( const Pointer& client_, const Handler handler_ )
+            : client( client_ ), handler( handler_ ){}
+
+        void operator()( const error_code& error, const size_t ) const {
+            handler( *client, error );
+        }
+    }; // end struct ReadStep
+
+    template< void (ClientConnection::*HANDLER)( const error_code& ) >
+    static void _callReadHandler( ClientConnection& client, const error_code& error ){
+        (client.*HANDLER)( error );
+    }
+
+    template< void (ClientConnection::*HANDLER)( const error_code& ) >
+    ReadStep _readStep( void ){
+        return ReadStep( shared_from_this(), &ClientConnection::_callReadHandler< HANDLER > );
+    }
 
-    void _headerHandler( const error_code& error, istream& data, MessageHandler handler ){
+    void _v1HeaderHandler( const error_code& error ){
+        TRACE_SCOPE( "v1 header", m_id );
         if( error ){
-            handler( error, "", "" );
+            _finish( error, Protocol::INVALID, BufferView() );
+            return;
         }
 
         // The first 4 bytes contains the name of the command. This is followed by an integer which
         // gives the size of the data to follow.
-        string command;
-        string dataSizeStr;
-        getBytes( data, COMMAND_LENGTH, command );
-        getBytes( data, sizeof( int ), dataSizeStr );
-        unsigned int dataSize = (unsigned int)ntohl( *(int*)dataSizeStr.data() );
+        const string command( m_header, Protocol::COMMAND_LENGTH );
+        const unsigned char opcode = Protocol::opcode( command );
+        if( opcode == Protocol::INVALID ){
+            cerr << "Unknown command \"" << command << "\" issued by " << m_clientName << endl;
+        }
+
+        unsigned int dataSize;
+        memcpy( &dataSize, m_header + Protocol::COMMAND_LENGTH, sizeof( int ) );
+        _readPayload( opcode, ntohl( dataSize ) );
+    }
+
+    void _v2HeaderHandler( const error_code& error ){
+        TRACE_SCOPE( "v2 header", m_id );
+        if( error ){
+            _finish( error, Protocol::INVALID, BufferView() );
+            return;
+        }
+
+        // One byte of opcode, then a varint which is usually a single byte but may need more.
+        const char* data = m_header + 1;
+        size_t dataSize;
+        if( Protocol::readVarint( data, m_header + m_headerSize, dataSize ) ){
+            _readPayload( (unsigned char)m_header[ 0 ], dataSize );
+        }
+        else if( m_headerSize <= Protocol::MAX_VARINT_SIZE && (m_header[ m_headerSize - 1 ] & 0x80) ){
+            m_connection->readExactly(
+                boost::asio::buffer( m_header + m_headerSize++, 1 ),
+                _readStep< &ClientConnection::_v2HeaderHandler >()
+            );
+        }
+        else {
+            _finish( boost::asio::error::invalid_argument, Protocol::INVALID, BufferView() );
+        }
+    }
 
-        // If we have more data to read, do that next.
+    void _readPayload( const unsigned char opcode, const size_t dataSize ){
+        // Both header handlers come through here, so this is where an oversized frame is refused.
+        if( dataSize > Protocol::MAX_PAYLOAD_SIZE ){
+            cerr << "Refusing a " << dataSize << " byte payload from " << m_clientName << endl;
+            _finish( boost::asio::error::message_size, Protocol::INVALID, BufferView() );
+            return;
+        }
+
+        // If we have more data to read, read exactly that much straight into a pooled buffer.
         if( dataSize ){
-            m_connection->readUntil(
-                ByteLimit( dataSize ),
-                boost::bind(
-                    &ClientConnection::_dataHandler,
-                    shared_from_this(),
-                    Connection::placeholders::error,
-                    Connection::placeholders::data,
-                    command,
-                    dataSize,
-                    handler
-                )
+            m_opcode  = opcode;
+            m_payload = m_pool->allocate( dataSize );
+            m_connection->readExactly(
+                boost::asio::buffer( m_payload.mutableData(), m_payload.size() ),
+                _readStep< &ClientConnection::_dataHandler >()
             );
         }
 
         // Otherwise call the handler now.
         else {
-            handler( error, command, "" );
+            _finish( error_code(), opcode, BufferView() );
         }
     }
 
-    void _dataHandler(
-        const error_code& error,
-              istream& stream,
-        const string& command, 
-        const size_t dataSize,
-        MessageHandler handler
-    ){
-        // Nothing more to do but callback.
-        string data( dataSize, ' ' );
-        stream.get( &data.at( 0 ), dataSize + 1 );
-        handler( error, command, data );
+    void _dataHandler( const error_code& error ){
+        TRACE_SCOPE( "data", m_id );
+        // Let go of the payload here so the buffer goes back to the pool as soon as the handler is
+        // done with it.
+        const BufferView data = m_payload;
+        m_payload = BufferView();
+        _finish( error, m_opcode, data );
+    }
+
+    /// Pass a message, or the error which ended the reads, to the handler.
+    void _finish( const error_code& error, const unsigned char opcode, const BufferView& data ){
+        // The handler will usually hold a pointer to this client, so it is let go of once there
+        // will be no more reads.
+        if( error ){
+            _dropHeldWrites();
+            MessageHandler handler;
+            handler.swap( m_handler );
+            handler( error, opcode, data );
+            return;
+        }
+        m_handler( error, opcode, data );
+
+        // The handler can't be let go of while it is running, so one which stopped the client is
+        // dropped here instead.
+        if( m_stopped ){
+            m_handler.clear();
+        }
+    }
+
+    void _resumeHandler( const error_code& error ){
+        if( !error && !m_stopped ){
+            readMessage();
+        }
+    }
+
+    void _releaseTimeoutHandler( const error_code& error ){
+        if( !error && !m_stopped ){
+            releaseWrites();
+        }
+    }
+
+    void _dropHeldWrites( void ){
+        m_writesHeld = false;
+        m_releaseTimer.cancel();
+        vector< pair< Connection::MessagePointer, Connection::MessagePointer > >().swap(
+            m_heldWrites
+        );
+    }
+
+    /// Runs on the connection's strand, so the protocol can't change underneath it.
+    void _writeMessage( Connection::MessagePointer v1, Connection::MessagePointer v2 ){
+        if( m_writesHeld ){
+            m_heldWrites.push_back( make_pair( v1, v2 ) );
+            return;
+        }
+        m_connection->write( m_protocol == 2 ? v2 : v1, NULL );
     }
 
 public:
-    ClientConnection( Connection::Pointer& connection, const string& clientName )
+    /// Constructor.
+    ///
+    /// @param connection
+    /// @param pool         Where payloads are read into.
+    /// @param clientName
+    /// @param protocol     Version to start out with. Clients start with 1 and may ask for 2.
+    ClientConnection(
+        Connection::Pointer& connection,
+        const BufferPool::Pointer& pool,
+        const string& clientName,
+        const int protocol = 1
+    )
         : m_connection( connection ),
-          m_clientName( clientName ){}
+          m_pool( pool ),
+          m_protocol( protocol ),
+          m_headerSize( 0 ),
+          m_opcode( Protocol::INVALID ),
+          m_clientName( clientName ),
+          m_id( 0 ),
+          m_readHeld( false ),
+          m_lastActive( 0 ),
+          m_strikes( 0 ),
+          m_resumeTimer( connection->getSocket().get_executor() ),
+          m_stopped( false ),
+          m_writesHeld( false ),
+          m_releaseTimer( connection->getSocket().get_executor() ){}
 
+    /// Read messages, passing each one to `handler`. After the first, each read is started by
+    /// calling `readMessage( void )` from the handler.
+    ///
+    /// @param handler
     void readMessage( MessageHandler handler ){
-        m_connection->readUntil(
-            ByteLimit( HEADER_SIZE ),
-            boost::bind(
-                &ClientConnection::_headerHandler,
-                shared_from_this(),
-                Connection::placeholders::error,
-                Connection::placeholders::data,
-                handler
+        m_handler.swap( handler );
+        readMessage();
+    }
+
+    /// Set the handler without starting a read, for a first read which is held back.
+    ///
+    /// @param handler
+    void setHandler( MessageHandler handler ){
+        m_handler.swap( handler );
+    }
+
+    /// Read the next message, passing it to the handler given to the first read.
+    void readMessage( void ){
+        if( m_protocol == 2 ){
+            m_headerSize = 2;
+            m_connection->readExactly(
+                boost::asio::buffer( m_header, m_headerSize ),
+                _readStep< &ClientConnection::_v2HeaderHandler >()
+            );
+            return;
+        }
+
+        m_connection->readExactly(
+            boost::asio::buffer( m_header ),
+            _readStep< &ClientConnection::_v1HeaderHandler >()
+        );
+    }
+
+    /// Read the next message once `delay` has passed. Until then nothing is read from the socket,
+    /// so once the socket's buffers fill TCP flow control stops the client from sending any more.
+    ///
+    /// @param delay
+    void readMessageAfter( const TokenBucket::Duration& delay ){
+        m_resumeTimer.expires_after( delay );
+        m_resumeTimer.async_wait(
+            m_connection->getStrand().wrap(
+                boost::bind(
+                    &ClientConnection::_resumeHandler,
+                    shared_from_this(),
+                    boost::asio::placeholders::error
+                )
             )
         );
     }
 
-    void writeMessage( Connection::WriteBuffer message ){
-        m_connection->write( message, NULL );
+    /// Hold back the messages sent to the client, in both versions, until `releaseWrites` is
+    /// called or `delay` has passed, whichever comes first. Must be called before the client is
+    /// added to any room.
+    ///
+    /// A new client may be about to ask for version 2, and a version 1 chat line can hold any text,
+    /// including what looks like the answer. So nothing is sent until the client's first message
+    /// has settled which version it gets.
+    ///
+    /// @param delay
+    void holdWrites( const boost::asio::steady_timer::duration& delay ){
+        m_writesHeld = true;
+        m_releaseTimer.expires_after( delay );
+        m_releaseTimer.async_wait(
+            m_connection->getStrand().wrap(
+                boost::bind(
+                    &ClientConnection::_releaseTimeoutHandler,
+                    shared_from_this(),
+                    boost::asio::placeholders::error
+                )
+            )
+        );
+    }
+
+    /// @return True until the client's protocol is settled. Must be called from one of the
+    /// client's own handlers.
+    bool isHoldingWrites( void ) const {
+        return m_writesHeld;
+    }
+
+    /// Send whatever was held back, in the version the client is now using. Must be called from
+    /// one of the client's own handlers.
+    void releaseWrites( void ){
+        if( !m_writesHeld ){
+            return;
+        }
+        m_writesHeld = false;
+        m_releaseTimer.cancel();
+        for( size_t i = 0; i < m_heldWrites.size(); ++i ){
+            _writeMessage( m_heldWrites[ i ].first, m_heldWrites[ i ].second );
+        }
+        vector< pair< Connection::MessagePointer, Connection::MessagePointer > >().swap(
+            m_heldWrites
+        );
+    }
+
+    /// Limit how fast the client may send. Each limit allows a burst of a second's worth.
+    ///
+    /// @param messages Messages per second, 0 for no limit.
+    /// @param bytes    Bytes of payload per second, 0 for no limit.
+    void setRateLimits( const double messages, const double bytes ){
+        m_messageBucket = TokenBucket( messages, max( messages, 1.0 ) );
+        m_byteBucket    = TokenBucket( bytes, bytes );
+    }
+
+    /// Charge the client for a message it has sent. Must be called from one of its own handlers.
+    ///
+    /// @param size     Size of the message's payload.
+    ///
+    /// @return How long to wait before reading from the client again, zero to carry on now.
+    TokenBucket::Duration charge( const size_t size ){
+        const TokenBucket::Clock::time_point& now = TokenBucket::Clock::now();
+        m_messageBucket.take( 1, now );
+        m_byteBucket.take( size, now );
+        const TokenBucket::Duration wait = max( m_messageBucket.wait(), m_byteBucket.wait() );
+        if( wait == TokenBucket::Duration::zero() ){
+            m_strikes = 0;
+        }
+        else {
+            ++m_strikes;
+        }
+        return wait;
+    }
+
+    bool isRateLimited( void ) const {
+        return m_messageBucket.enabled() || m_byteBucket.enabled();
+    }
+
+    /// @return How many messages in a row have taken the client over its limits.
+    size_t getStrikes( void ) const {
+        return m_strikes;
+    }
+
+    /// Send a message in whichever protocol the client is using.
+    ///
+    /// @param v1   The message in version 1 form.
+    /// @param v2   The same message in version 2 form.
+    void writeMessage( Connection::MessagePointer v1, Connection::MessagePointer v2 ){
+        m_connection->getStrand().dispatch(
+            boost::bind( &ClientConnection::_writeMessage, shared_from_this(), v1, v2 )
+        );
+    }
+
+    /// Answer a version request, switching to the version if it is supported. Must be called from
+    /// one of the client's own handlers.
+    ///
+    /// @param version
+    void setProtocol( const int version ){
+        m_protocol = (version == 2) ? 2 : 1;
+        m_connection->write( m_protocol == 2 ? "protocol 2\n" : "protocol 1\n", NULL );
+    }
+
+    int getProtocol( void ) const {
+        return m_protocol;
     }
 
     void setName( const string& name ){
@@ -154,137 +476,2176 @@ public:
         return m_clientName;
     }
 
+    void setHandle( const Handle& handle ){
+        m_handle = handle;
+    }
+
+    const Handle& getHandle( void ) const {
+        return m_handle;
+    }
+
+    void setId( const size_t id ){
+        m_id = id;
+    }
+
+    size_t getId( void ) const {
+        return m_id;
+    }
+
+    room_map& getRooms( void ){
+        return m_rooms;
+    }
+
+    /// Rooms the client has asked to join which are still being made. Only touched from the
+    /// client's own handlers.
+    set< string >& getJoining( void ){
+        return m_joining;
+    }
+
+    /// Note that the next read is being held back, rather than started. Must be called from one
+    /// of the client's own handlers.
+    void holdRead( void ){
+        m_readHeld = true;
+    }
+
+    /// @return True if a read was being held back, which the caller must now start.
+    bool releaseRead( void ){
+        const bool held = m_readHeld;
+        m_readHeld = false;
+        return held;
+    }
+
+    /// Run a handler on the client's strand, as one of its own handlers. Safe to call from any
+    /// thread.
+    ///
+    /// @param handler
+    void post( const boost::function< void( void ) >& handler ){
+        m_connection->getStrand().post( handler );
+    }
+
+    /// @return Bytes waiting to be written to the client. Safe to call from any thread.
+    size_t getQueuedBytes( void ) const {
+        return m_connection->getQueuedBytes();
+    }
+
+    void setLastActive( const TimerWheel::Tick tick ){
+        m_lastActive.store( tick, boost::memory_order_relaxed );
+    }
+
+    TimerWheel::Tick getLastActive( void ) const {
+        return m_lastActive.load( boost::memory_order_relaxed );
+    }
+
     void close( void ){
         m_connection->close();
     }
 
+    /// Close the connection and give up reading, when there is no read in progress to fail and
+    /// let go of the handler. Must be called from one of the client's own handlers.
+    void stop( void ){
+        m_stopped = true;
+        m_resumeTimer.cancel();
+        _dropHeldWrites();
+        m_connection->close();
+    }
+
 }; // end class ClientConnection
 
 // ************************************************************************** //
 
-class Server {
+/// A persistent link to another chat server.
+///
+/// Servers frame everything they send each other in protocol version 2, using the peer opcodes, so
+/// a link reads with the same code as a client connection does. What it sends can come from any
+/// thread, as it is mostly messages from local clients. Those are pushed onto a lock-free queue,
+/// and only a push onto an empty queue schedules a drain on the link's strand. The drain sends
+/// everything queued by then as one write, so under load a single system call carries many
+/// messages.
+class PeerLink : public boost::enable_shared_from_this< PeerLink > {
 public:
-    static const unsigned short CHAT_PORT = 8888;
-    static const string&        DEFAULT_NAME;
+    typedef boost::shared_ptr< PeerLink >       Pointer;
+    typedef boost::shared_ptr< const string >   Frame;
 
 private:
-    typedef boost::system::error_code           error_code;
-    typedef list< ClientConnection::Pointer >   client_list;
+    Connection::Pointer         m_connection;
+    ClientConnection::Pointer   m_reader;       ///< Reads the peer's frames.
+    MpscQueue< Frame >          m_outbox;       ///< Frames waiting for the next drain.
+    vector< Frame >             m_draining;     ///< Only touched on the strand.
+    const string                m_host;
+    const string                m_port;
+    const bool                  m_outbound;     ///< True if this end made the connection.
+    string                      m_peerId;       ///< Set once the peer has said who it is.
+    bool                        m_redundant;    ///< Closed in favour of another link to the peer.
 
-    boost::asio::io_service m_ioService;
-    tcp::acceptor           m_acceptor;
-    client_list             m_clientList;
+    void _drain( void ){
+        m_outbox.popAll( m_draining );
+        boost::shared_ptr< Message > message( new Message );
+        message->reserve( m_draining.size() );
+        for( size_t i = 0; i < m_draining.size(); ++i ){
+            message->add( m_draining[ i ] );
+        }
+        m_draining.clear();
+        m_connection->write( message, NULL );
+    }
 
-    void _accept( void ){
-        Connection::Pointer connection( new Connection( m_ioService ) );
-        m_acceptor.async_accept(
-            connection->getSocket(),
-            boost::bind(
-                &Server::_acceptHandler,
-                this,
-                boost::asio::placeholders::error,
-                connection
-            )
-        );
+public:
+    /// Constructor.
+    ///
+    /// @param connection
+    /// @param pool     Where payloads are read into.
+    /// @param host     Where the peer is, and for an outbound link where to reconnect to.
+    /// @param port
+    /// @param outbound True if this end made the connection.
+    PeerLink(
+        Connection::Pointer& connection,
+        const BufferPool::Pointer& pool,
+        const string& host,
+        const string& port,
+        const bool outbound
+    )
+        : m_connection( connection ),
+          m_reader( new ClientConnection( connection, pool, host + ":" + port, 2 ) ),
+          m_host( host ),
+          m_port( port ),
+          m_outbound( outbound ),
+          m_redundant( false ){}
+
+    /// Read frames from the peer, see `ClientConnection::readMessage`.
+    ///
+    /// @param handler
+    void readMessage( ClientConnection::MessageHandler handler ){
+        m_reader->readMessage( handler );
     }
 
-    void _acceptHandler( const error_code& error, Connection::Pointer connection ){
-        _accept();
+    void readMessage( void ){
+        m_reader->readMessage();
+    }
 
-        if( error ){
-            cerr << "Client error on accept: " << error.message() << endl;
-        }
-        else {
-            ClientConnection::Pointer client( new ClientConnection( connection, DEFAULT_NAME ) );
-            m_clientList.push_front( client );
-            _readMessage( client );
+    /// Queue a frame for the peer. Safe to call from any thread.
+    ///
+    /// @param frame
+    void send( const Frame& frame ){
+        if( m_outbox.push( frame ) ){
+            m_connection->getStrand().post( boost::bind( &PeerLink::_drain, shared_from_this() ) );
         }
     }
 
-    void _readMessage( ClientConnection::Pointer client ){
-        client->readMessage(
-            boost::bind(
-                &Server::_commandHandler,
-                this,
-                client,
-                ClientConnection::placeholders::error,
-                ClientConnection::placeholders::command,
-                ClientConnection::placeholders::data
-            )
+    const string& getHost( void ) const {
+        return m_host;
+    }
+
+    const string& getPort( void ) const {
+        return m_port;
+    }
+
+    string getAddress( void ) const {
+        return m_host + ":" + m_port;
+    }
+
+    bool isOutbound( void ) const {
+        return m_outbound;
+    }
+
+    void setPeerId( const string& id ){
+        m_peerId = id;
+    }
+
+    const string& getPeerId( void ) const {
+        return m_peerId;
+    }
+
+    /// Mark the link as one that should not be reconnected once it closes.
+    void setRedundant( void ){
+        m_redundant = true;
+    }
+
+    bool isRedundant( void ) const {
+        return m_redundant;
+    }
+
+    void close( void ){
+        m_connection->close();
+    }
+
+    /// Build a frame to send to peers.
+    ///
+    /// @param opcode   One of the peer opcodes.
+    /// @param payload
+    static Frame frame( const unsigned char opcode, const string& payload ){
+        return Frame( new string( Protocol::encodeV2( opcode, payload ) ) );
+    }
+}; // end class PeerLink
+
+// ************************************************************************** //
+
+/// A named chat room and its members.
+///
+/// The member list is copy-on-write. Sending to the room atomically loads the current snapshot and
+/// walks it without taking any lock, while joining and parting copy the list, change the copy, and
+/// atomically publish it. Joins and parts are serialized by the server.
+///
+/// The room also keeps its most recent messages, in both protocol versions, and a new member is
+/// sent the ones for its version in a single write as it joins. Recording a message and joining
+/// both take the history lock, so every message is either replayed to a new member or sent to it
+/// live, never both or neither.
+///
+/// When the server is federated, the room also knows which peers have members of their own in it,
+/// in a copy-on-write list kept up to date by the server.
+class Room {
+public:
+    typedef boost::shared_ptr< Room >                   Pointer;
+    typedef vector< ClientConnection::Pointer >         member_list;
+    typedef boost::shared_ptr< const member_list >      member_list_ptr;
+    typedef vector< PeerLink::Pointer >                 peer_list;
+    typedef boost::shared_ptr< const peer_list >        peer_list_ptr;
+
+private:
+    const string    m_name;
+    const string    m_prefix;   ///< Put in front of every version 1 message sent to the room.
+    const string    m_wireName; ///< The room's name in version 2 messages.
+    member_list_ptr m_members;
+    peer_list_ptr   m_peers;    ///< Peers with members in the room.
+    History         m_v1History;
+    History         m_v2History;
+    boost::mutex    m_historyMutex;
+
+    /// Build a message in both protocol versions, referring to the text rather than copying it.
+    ///
+    /// @param name     Sender's name.
+    /// @param text
+    /// @param owner    Keeps the text alive.
+    /// @param v1
+    /// @param v2
+    void _encode(
+        const string& name,
+        const boost::asio::const_buffer& text,
+        const Message::Owner& owner,
+        Connection::MessagePointer& v1,
+        Connection::MessagePointer& v2
+    ) const {
+        static const char newline = '\n';
+        const size_t textSize = boost::asio::buffer_size( text );
+
+        // The headers are written into the messages, which come from recycled memory, so building
+        // them allocates nothing.
+        boost::shared_ptr< Message > v1Message(
+            boost::allocate_shared< Message >( RecyclingAllocator< Message >() )
+        );
+        char* v1Header = v1Message->addCopy( m_prefix.size() + name.size() + 2 );
+        memcpy( v1Header, m_prefix.data(), m_prefix.size() );
+        memcpy( v1Header + m_prefix.size(), name.data(), name.size() );
+        memcpy( v1Header + m_prefix.size() + name.size(), ": ", 2 );
+        v1Message->add( text, owner );
+        v1Message->add( boost::asio::buffer( &newline, 1 ) );
+        v1 = v1Message;
+
+        boost::shared_ptr< Message > v2Message(
+            boost::allocate_shared< Message >( RecyclingAllocator< Message >() )
+        );
+        Protocol::writeMessageHeader(
+            v2Message->addCopy( Protocol::messageHeaderSize( m_wireName, name, textSize ) ),
+            m_wireName,
+            name,
+            textSize
         );
+        v2Message->add( text, owner );
+        v2 = v2Message;
     }
 
-    void _commandHandler(
-        ClientConnection::Pointer client,
-        const error_code& error,
-        const string& command,
-        const string& data
-    ){
-        if( error ){
-            cerr << "Read command error: " << error.message() << endl;
-            client->close();
-            m_clientList.remove( client );
-            return;
-        }
+    static Connection::MessagePointer _replayMessage( const boost::shared_ptr< string >& replay ){
+        boost::shared_ptr< Message > message( new Message );
+        message->add( boost::shared_ptr< const string >( replay ) );
+        return message;
+    }
 
-        // Handle the command we just received.
-        if( command == "name" ){
-            _nameHandler( client, data );
-        }
-        else if( command == "chat" ){
-            _chatHandler( client, data );
-        }
-        else if( command == "quit" ){
-            _quitHandler( client );
-        }
-        else {
-            _unknownCommandHandler( client, command );
+    /// Record a message in the history.
+    ///
+    /// @return The members to send it to.
+    member_list_ptr _record( const Message& v1, const Message& v2 ){
+        if( !m_v1History.enabled() ){
+            return boost::atomic_load( &m_members );
         }
 
-        // Then set up the next read.
-        _readMessage( client );
+        boost::mutex::scoped_lock lock( m_historyMutex );
+        m_v1History.add( v1.getBuffers() );
+        m_v2History.add( v2.getBuffers() );
+        return boost::atomic_load( &m_members );
     }
 
-    void _nameHandler( ClientConnection::Pointer client, const string& data ){
-        client->setName( data );
-    }
+    /// Send a message to every member but the sender.
+    ///
+    /// @param sender   Null if the message came from another server.
+    /// @param name     Sender's name.
+    /// @param data     The message as it was received, which is sent on without being copied.
+    ///
+    /// @return The number of members it was sent to.
+    size_t _send(
+        const ClientConnection::Pointer& sender,
+        const string& name,
+        const BufferView& data
+    ){
+        // NOTE We only need one message per protocol version to share with all of the members.
+        //      Both refer to the received payload rather than copying it, and the shared pointers
+        //      will handle deallocating everything once the last write has finished.
+        Connection::MessagePointer v1, v2;
+        _encode( name, data.buffer(), data.getBlock(), v1, v2 );
 
-    void _chatHandler( ClientConnection::Pointer client, const string& data ){
-        // NOTE We only need one message to share with all of the clients. The shared pointer will
-        //      handle deallocating it for us once the last write has finished.
-        Connection::WriteBuffer message( new string( client->getName() + ": " + data + "\n" ) );
-        for( client_list::iterator it = m_clientList.begin(); it != m_clientList.end(); ++it ){
-            // Don't broadcast the message to the one who sent it.
-            if( *it != client ){
-                (**it).writeMessage( message );
+        member_list_ptr members = _record( *v1, *v2 );
+        size_t sent = 0;
+        for( member_list::const_iterator it = members->begin(); it != members->end(); ++it ){
+            // Don't send the message back to the one who sent it.
+            if( *it != sender ){
+                (**it).writeMessage( v1, v2 );
+                ++sent;
             }
         }
+        return sent;
     }
 
-    void _quitHandler( ClientConnection::Pointer client ){
-        client->close();
-        m_clientList.remove( client );
+public:
+    /// Constructor.
+    ///
+    /// @param name
+    /// @param lobby        True for the lobby, whose messages don't name the room.
+    /// @param maxMessages  Most messages to keep for replaying to new members, 0 to keep none.
+    /// @param maxBytes     Most bytes of messages to keep, for each protocol version.
+    Room( const string& name, const bool lobby, const size_t maxMessages, const size_t maxBytes )
+        : m_name( name ),
+          m_prefix( prefix( lobby ? "" : name ) ),
+          m_wireName( lobby ? "" : name ),
+          m_members( new member_list ),
+          m_peers( new peer_list ),
+          m_v1History( maxMessages, maxBytes ),
+          m_v2History( maxMessages, maxBytes ){}
+
+    /// Add a member and replay the history to it. Must be called from one of the client's own
+    /// handlers, so its protocol version can't change meanwhile.
+    ///
+    /// @param client
+    ///
+    /// @return True if there was any history to replay.
+    bool add( ClientConnection::Pointer client ){
+        boost::mutex::scoped_lock lock( m_historyMutex );
+        boost::shared_ptr< member_list > members( new member_list( *m_members ) );
+        members->push_back( client );
+        boost::atomic_store( &m_members, member_list_ptr( members ) );
+
+        // The replay is queued before the lock is released, so it goes out ahead of anything sent
+        // to the room after the client joined.
+        // A client whose version isn't settled yet is given both, like any other message.
+        const int protocol = client->isHoldingWrites() ? 0 : client->getProtocol();
+        const boost::shared_ptr< string >& v1Replay =
+            protocol != 2 ? m_v1History.copy() : boost::shared_ptr< string >();
+        const boost::shared_ptr< string >& v2Replay =
+            protocol != 1 ? m_v2History.copy() : boost::shared_ptr< string >();
+        if( !v1Replay && !v2Replay ){
+            return false;
+        }
+        client->writeMessage(
+            _replayMessage( v1Replay ? v1Replay : v2Replay ),
+            _replayMessage( v2Replay ? v2Replay : v1Replay )
+        );
+        return true;
     }
 
-    void _unknownCommandHandler( ClientConnection::Pointer client, const string& command ){
-        cerr << "Unknown command \"" << command << "\" issued by " << client->getName() << endl;
+    void remove( ClientConnection::Pointer client ){
+        member_list::const_iterator it = find( m_members->begin(), m_members->end(), client );
+        if( it == m_members->end() ){
+            return;
+        }
+        boost::shared_ptr< member_list > members( new member_list( *m_members ) );
+        members->erase( members->begin() + (it - m_members->begin()) );
+        boost::atomic_store( &m_members, member_list_ptr( members ) );
     }
 
-public:
-    Server( void ) : m_acceptor( m_ioService, tcp::endpoint( tcp::v4(), CHAT_PORT ) ){
+    bool empty( void ) const {
+        return m_members->empty();
     }
 
-    void start( void ){
-        _accept();
-        m_ioService.run();
+    const string& getName( void ) const {
+        return m_name;
     }
-};
-const string& Server::DEFAULT_NAME = "<unknown>";
 
+    const string& getWireName( void ) const {
+        return m_wireName;
+    }
 
+    /// Send a message from one member to all the others.
+    ///
+    /// @param sender
+    /// @param data     The message as it was received, which is sent on without being copied.
+    ///
+    /// @return The number of members it was sent to.
+    size_t send( ClientConnection::Pointer sender, const BufferView& data ){
+        return _send( sender, sender->getName(), data );
+    }
 
-int main( void ){
-    Server server;
-    server.start();
+    /// Send a message from a member on another server to every member here.
+    ///
+    /// @param name     Sender's name.
+    /// @param data     The message text.
+    ///
+    /// @return The number of members it was sent to.
+    size_t deliver( const string& name, const BufferView& data ){
+        return _send( ClientConnection::Pointer(), name, data );
+    }
+
+    /// Replace the list of peers with members in the room. Serialized by the server.
+    ///
+    /// @param peers
+    void setPeers( const peer_list& peers ){
+        boost::atomic_store( &m_peers, peer_list_ptr( new peer_list( peers ) ) );
+    }
+
+    /// @return The peers to forward messages sent to the room to.
+    peer_list_ptr getPeers( void ) const {
+        return boost::atomic_load( &m_peers );
+    }
+
+    /// Add a message to the history without sending it to anyone.
+    ///
+    /// @param name     Sender's name.
+    /// @param text
+    void remember( const string& name, const boost::shared_ptr< const string >& text ){
+        Connection::MessagePointer v1, v2;
+        _encode( name, boost::asio::buffer( *text ), text, v1, v2 );
+        _record( *v1, *v2 );
+    }
+
+    /// Encode a whole message sent to a room.
+    ///
+    /// @param protocol Version to encode it in.
+    /// @param room     The room's name in version 2 messages, empty for the lobby.
+    /// @param name     Sender's name.
+    /// @param text
+    static string encode(
+        const int protocol,
+        const string& room,
+        const string& name,
+        const string& text
+    ){
+        if( protocol == 2 ){
+            return Protocol::encodeMessageHeader( room, name, text.size() ) + text;
+        }
+        return prefix( room ) + name + ": " + text + "\n";
+    }
+
+    /// What goes in front of version 1 messages sent to a room.
+    ///
+    /// @param room     The room's name in version 2 messages, empty for the lobby.
+    static string prefix( const string& room ){
+        return room.empty() ? "" : "[" + room + "] ";
+    }
+}; // end class Room
+
+// ************************************************************************** //
+
+class Server {
+public:
+    static const unsigned short CHAT_PORT = 8888;
+    static const string&        DEFAULT_NAME;
+    static const string&        LOBBY;          ///< The room every client starts out in.
+    static const size_t         RESUME_LIMIT = 10000;   ///< Most messages sent for one resume.
+    static const size_t         HISTORY_SCAN = 10000;   ///< Log records searched to fill a room.
+    static const size_t         PEER_RETRY = 2;         ///< Seconds between tries to reach a peer.
+    static const size_t         WHEEL_TICK = 100;       ///< Milliseconds per heartbeat wheel tick.
+    static const size_t         SETTLE_DELAY = 1000;    ///< Milliseconds to wait for a first message.
+    static const size_t         ADMIN_REQUEST_BYTES = 8192; ///< Most bytes in an admin request.
+    static const size_t         ADMIN_TIMEOUT = 5;      ///< Seconds allowed for an admin request.
+
+private:
+    typedef boost::system::error_code                   error_code;
+    typedef SlotMap< ClientConnection::Pointer >        client_table;
+    typedef map< string, Room::Pointer >                room_map;
+    typedef map< string, PeerLink::Pointer >            peer_map;
+    typedef map< string, Room::peer_list >              interest_map;
+    typedef pair< string, string >                      address;
+
+    /// Kinds of message sent to clients, as counted in `m_metrics`.
+    enum SentKind {
+        SENT_CHAT = 0,  ///< A message sent to a room, counted once per member it went to.
+        SENT_HISTORY,   ///< A room's history, replayed to a new member.
+        SENT_RESUME,    ///< Messages replayed from the log.
+        SENT_PING,
+        SENT_VERSION,   ///< The answer to a version request.
+        SENT_KIND_COUNT
+    };
+
+    /// Everything counted in `m_metrics`. Runs of counters are indexed by opcode or kind.
+    enum Metric {
+        RECEIVED        = 0,    ///< Messages from clients, by client opcode. Unknown ones as 0.
+        RECEIVED_BYTES  = RECEIVED + Protocol::CLIENT_OPCODE_COUNT,         ///< Payload bytes.
+        SENT            = RECEIVED_BYTES + Protocol::CLIENT_OPCODE_COUNT,   ///< By `SentKind`.
+        WRITTEN_BYTES   = SENT + SENT_KIND_COUNT,
+        WRITE_ERRORS,
+        CLIENT_EOF,         ///< Clients which closed their connection.
+        SERVER_CLOSED,      ///< Reads ended by the server closing the connection.
+        READ_ERRORS,        ///< Reads which failed for any other reason.
+        UNKNOWN_COMMANDS,
+        WRITE_LATENCY,      ///< The first of the write latency histogram's counters.
+        METRIC_COUNT    = WRITE_LATENCY + LatencyHistogram::COUNTERS
+    };
+
+    boost::asio::io_service     m_ioService;
+    tcp::acceptor               m_acceptor;
+    const size_t                m_threadCount;
+    boost::asio::steady_timer   m_statsTimer;
+    const size_t                m_statsInterval;    ///< Seconds between stats reports, 0 for none.
+    size_t                      m_statsAllocations; ///< Heap allocations at the last report.
+    size_t                      m_statsMessages;    ///< Messages written at the last report.
+    Connection::OutboundLimits  m_outboundLimits;   ///< Applied to every client's connection.
+    BufferPool::Pointer         m_bufferPool;       ///< Received payloads, shared by every client.
+    size_t                      m_historyMessages;  ///< Messages each new room keeps for replay.
+    size_t                      m_historyBytes;     ///< Bytes of history per room and version.
+    boost::scoped_ptr< ChatLog > m_log;             ///< Every message sent, if logging.
+
+    // Resumes read the log on a thread of their own, so a long one doesn't hold up an io thread.
+    boost::asio::io_service     m_logService;
+    boost::scoped_ptr< boost::asio::io_service::work > m_logWork;
+    boost::thread               m_logThread;
+    boost::scoped_ptr< CaptureWriter > m_capture;   ///< Every message received, if capturing.
+    boost::atomic< size_t >     m_connections;      ///< Clients accepted so far.
+    boost::scoped_ptr< TraceDumper > m_trace;       ///< Set if tracing.
+    string                      m_serverId;         ///< How peers tell this server apart.
+    boost::scoped_ptr< tcp::acceptor > m_peerAcceptor;  ///< Set if listening for peers.
+    vector< address >           m_peerAddresses;    ///< Peers to keep a link open to.
+    ResolverCache               m_resolver;
+    boost::atomic< size_t >     m_forwarded;        ///< Messages sent to peers, counted once each.
+    boost::atomic< size_t >     m_fromPeers;        ///< Messages delivered for peers.
+    TimerWheel                  m_wheel;            ///< Every client's heartbeat.
+    TimerWheel::Tick            m_heartbeatIdle;    ///< Ticks of silence before a ping, 0 for none.
+    TimerWheel::Tick            m_heartbeatTimeout; ///< Ticks to wait for an answer.
+    Connection::MessagePointer  m_pingV1;
+    Connection::MessagePointer  m_pingV2;
+    boost::atomic< size_t >     m_evicted;          ///< Clients disconnected for not answering.
+    double                      m_messageRate;      ///< Messages per second per client, 0 for any.
+    double                      m_byteRate;         ///< Bytes per second per client, 0 for any.
+    size_t                      m_maxStrikes;       ///< Throttles in a row allowed, 0 for any.
+    boost::atomic< size_t >     m_throttled;        ///< Times a client's reads were paused.
+    boost::atomic< size_t >     m_flooders;         ///< Clients disconnected for flooding.
+    ThreadCounters              m_metrics;          ///< Counted per thread, indexed by `Metric`.
+    LatencyHistogram            m_writeLatency;     ///< From queueing a message to writing it.
+    boost::scoped_ptr< tcp::acceptor > m_adminAcceptor; ///< Set if serving metrics.
+
+    /// Handles one kind of message from a client.
+    typedef void (Server::*CommandHandler)( ClientConnection::Pointer, const BufferView& );
+
+    /// Handles one kind of message from a peer.
+    typedef void (Server::*PeerHandler)( const PeerLink::Pointer&, const BufferView& );
+
+    /// The handler for every opcode, so dispatching a message is a single lookup.
+    CommandHandler              m_handlers[ Protocol::OPCODE_COUNT ];
+    PeerHandler                 m_peerHandlers[ Protocol::OPCODE_COUNT ];
+
+    // Every connected client has a slot in the client table, so removing one never searches.
+    // Rooms hold their own member lists and each client remembers which rooms it is in, so nothing
+    // ever needs to walk every client. `m_roomsMutex` serializes joins and parts along with every
+    // change to the peers and their interests, and is never held while writing to a socket.
+    client_table                m_clients;
+    boost::mutex                m_clientsMutex;
+    room_map                    m_rooms;
+    peer_map                    m_peers;            ///< Links which have said who they are.
+    interest_map                m_interest;         ///< Peers with members in each room.
+    boost::mutex                m_roomsMutex;
+
+    /// Add a client to the table, then to the lobby on the client's strand.
+    void _addClient( ClientConnection::Pointer client ){
+        {
+            boost::mutex::scoped_lock lock( m_clientsMutex );
+            client->setHandle( m_clients.insert( client ) );
+        }
+        client->post( boost::bind( &Server::_enterLobby, this, client ) );
+    }
+
+    /// Put a new client in the lobby straight away and start reading from it. What it is sent is
+    /// held back until its protocol is settled, see `_commandHandler`. Runs on the client's strand.
+    void _enterLobby( ClientConnection::Pointer client ){
+        client->holdWrites( boost::asio::chrono::milliseconds( (long)SETTLE_DELAY ) );
+        _join( client, LOBBY );
+        _readMessage( client );
+    }
+
+    void _removeClient( ClientConnection::Pointer client ){
+        {
+            boost::mutex::scoped_lock lock( m_clientsMutex );
+            if( !m_clients.erase( client->getHandle() ) ){
+                return;
+            }
+        }
+        if( m_capture ){
+            m_capture->record( client->getId(), Capture::CLOSED );
+        }
+
+        client->getJoining().clear();
+        ClientConnection::room_map& rooms = client->getRooms();
+        while( !rooms.empty() ){
+            _part( client, rooms.begin()->first );
+        }
+    }
+
+    void _join( ClientConnection::Pointer client, const string& name ){
+        if( client->getRooms().count( name ) || client->getJoining().count( name ) ){
+            return;
+        }
+
+        // A room made while logging starts out with its recent history, which takes a scan of the
+        // log. That is done on the log thread, and the client joins once it is done.
+        if( m_log && m_historyMessages ){
+            bool exists;
+            {
+                boost::mutex::scoped_lock lock( m_roomsMutex );
+                exists = m_rooms.count( name ) > 0;
+            }
+            if( !exists ){
+                client->getJoining().insert( name );
+                Room::Pointer room(
+                    new Room( name, name == LOBBY, m_historyMessages, m_historyBytes )
+                );
+                m_logService.post( boost::bind( &Server::_loadRoom, this, client, name, room ) );
+                return;
+            }
+        }
+        _addMember( client, name, Room::Pointer() );
+    }
+
+    /// Fill a new room's history from the log, then finish the join on the client's strand. Runs
+    /// on the log thread.
+    void _loadRoom( ClientConnection::Pointer client, const string& name, Room::Pointer room ){
+        _loadHistory( *room );
+        client->post( boost::bind( &Server::_joinLoaded, this, client, name, room ) );
+    }
+
+    void _joinLoaded( ClientConnection::Pointer client, const string& name, Room::Pointer room ){
+        // Nothing left to do if the client disconnected while the room was being made.
+        if( client->getJoining().erase( name ) ){
+            _addMember( client, name, room );
+        }
+        if( client->getJoining().empty() && client->releaseRead() ){
+            _readNext( client, 0 );
+        }
+    }
+
+    /// Put a client in a room, making the room if it doesn't exist.
+    ///
+    /// @param client
+    /// @param name
+    /// @param created  The room to add if there isn't one by that name by now, null to make one.
+    ///                 Should another client have made the room first, theirs wins.
+    void _addMember( ClientConnection::Pointer client, const string& name, Room::Pointer created ){
+        boost::mutex::scoped_lock lock( m_roomsMutex );
+        Room::Pointer& room = m_rooms[ name ];
+        if( !room ){
+            if( !created ){
+                created.reset( new Room( name, name == LOBBY, m_historyMessages, m_historyBytes ) );
+            }
+            room = created;
+
+            interest_map::const_iterator interest = m_interest.find( name );
+            if( interest != m_interest.end() ){
+                room->setPeers( interest->second );
+            }
+            _announce( Protocol::PEER_JOIN, name );
+        }
+        if( room->add( client ) ){
+            m_metrics.add( SENT + SENT_HISTORY );
+        }
+        client->getRooms()[ name ] = room;
+    }
+
+    void _part( ClientConnection::Pointer client, const string& name ){
+        ClientConnection::room_map& rooms = client->getRooms();
+        ClientConnection::room_map::iterator it = rooms.find( name );
+        if( it == rooms.end() ){
+            client->getJoining().erase( name );
+            return;
+        }
+
+        Room::Pointer room = it->second;
+        rooms.erase( it );
+
+        // Joins happen under the same lock, so an empty room can't be gaining a member meanwhile.
+        boost::mutex::scoped_lock lock( m_roomsMutex );
+        room->remove( client );
+        if( room->empty() ){
+            m_rooms.erase( name );
+            _announce( Protocol::PEER_PART, name );
+        }
+    }
+
+    /// Tell every peer about a room gaining its first member or losing its last. Must be called
+    /// with `m_roomsMutex` held, so peers hear about the changes in the order they happen.
+    void _announce( const unsigned char opcode, const string& name ){
+        if( m_peers.empty() ){
+            return;
+        }
+        const PeerLink::Frame& frame = PeerLink::frame( opcode, name );
+        for( peer_map::const_iterator it = m_peers.begin(); it != m_peers.end(); ++it ){
+            it->second->send( frame );
+        }
+    }
+
+    void _scheduleStats( void ){
+        m_statsTimer.expires_after( boost::asio::chrono::seconds( m_statsInterval ) );
+        m_statsTimer.async_wait(
+            boost::bind( &Server::_statsHandler, this, boost::asio::placeholders::error )
+        );
+    }
+
+    size_t _clientCount( void ){
+        boost::mutex::scoped_lock lock( m_clientsMutex );
+        return m_clients.size();
+    }
+
+    size_t _roomCount( void ){
+        boost::mutex::scoped_lock lock( m_roomsMutex );
+        return m_rooms.size();
+    }
+
+    size_t _peerCount( void ){
+        boost::mutex::scoped_lock lock( m_roomsMutex );
+        return m_peers.size();
+    }
+
+    void _statsHandler( const error_code& error ){
+        if( error ){
+            return;
+        }
+
+        const Connection::WriteStats& stats = Connection::getWriteStats();
+        cerr
+            << "clients: " << _clientCount()
+            << ", rooms: " << _roomCount()
+            << ", messages written: " << stats.messages
+            << ", socket writes: " << stats.writes;
+        if( stats.writes ){
+            cerr << " (" << (double)stats.messages / stats.writes << " messages per write)";
+        }
+        cerr
+            << ", queued bytes: " << stats.queuedBytes
+            << ", dropped oldest: " << stats.droppedOldest
+            << ", dropped newest: " << stats.droppedNewest
+            << ", disconnects: " << stats.disconnects
+            << ", over budget: " << stats.overBudget;
+
+        const HandlerMemory::Stats& handlers = HandlerMemory::getStats();
+        cerr
+            << ", handler allocations: " << handlers.recycled << " recycled, "
+            << handlers.heap << " from the heap";
+        if( AllocationCounter::compiledIn() ){
+            // Only counts what happened since the last report, so start up doesn't skew it.
+            const size_t allocations = AllocationCounter::count() - m_statsAllocations;
+            const size_t messages = stats.messages - m_statsMessages;
+            cerr << ", heap allocations: " << allocations;
+            if( messages ){
+                cerr << " (" << (double)allocations / messages << " per message written)";
+            }
+            m_statsAllocations += allocations;
+            m_statsMessages += messages;
+        }
+        if( m_log ){
+            const ChatLog::Stats& log = m_log->getStats();
+            cerr
+                << ", logged: " << log.appended << " in " << log.commits << " commits"
+                << ", next sequence: " << log.next;
+        }
+        if( m_messageRate || m_byteRate ){
+            cerr << ", throttled: " << m_throttled << ", disconnected for flooding: " << m_flooders;
+        }
+        if( m_heartbeatIdle ){
+            cerr << ", heartbeats waiting: " << m_wheel.size() << ", evicted: " << m_evicted;
+        }
+        if( m_peerAcceptor || !m_peerAddresses.empty() ){
+            cerr
+                << ", peers: " << _peerCount()
+                << ", forwarded: " << m_forwarded
+                << ", from peers: " << m_fromPeers;
+        }
+        cerr << endl;
+        _scheduleStats();
+    }
+
+    void _accept( void ){
+        Connection::Pointer connection( new Connection( m_ioService ) );
+        m_acceptor.async_accept(
+            connection->getSocket(),
+            boost::bind(
+                &Server::_acceptHandler,
+                this,
+                boost::asio::placeholders::error,
+                connection
+            )
+        );
+    }
+
+    void _acceptHandler( const error_code& error, Connection::Pointer connection ){
+        _accept();
+
+        if( error ){
+            cerr << "Client error on accept: " << error.message() << endl;
+        }
+        else {
+            connection->setOutboundLimits( m_outboundLimits );
+            ClientConnection::Pointer client(
+                new ClientConnection( connection, m_bufferPool, DEFAULT_NAME )
+            );
+            client->setRateLimits( m_messageRate, m_byteRate );
+            client->setId( ++m_connections );
+            if( m_capture ){
+                m_capture->record( client->getId(), Capture::OPENED );
+            }
+            _addClient( client );
+            if( m_heartbeatIdle ){
+                client->setLastActive( m_wheel.now() );
+                _scheduleHeartbeat( client, m_heartbeatIdle );
+            }
+        }
+    }
+
+    void _scheduleHeartbeat(
+        const ClientConnection::Pointer& client,
+        const TimerWheel::Tick delay
+    ){
+        m_wheel.schedule(
+            delay,
+            boost::bind( &Server::_heartbeatHandler, this, ClientConnection::WeakPointer( client ) )
+        );
+    }
+
+    /// Check on a client. A client that has been heard from lately is checked again once it could
+    /// have been idle for long enough, so a busy client costs one wheel entry per idle period
+    /// rather than one per message. One that has been idle for too long is pinged, and one that
+    /// is still silent when the ping's answer is due is disconnected.
+    ///
+    /// Only holds on to the client weakly, so a client which has gone away is simply forgotten.
+    void _heartbeatHandler( const ClientConnection::WeakPointer& weak ){
+        const ClientConnection::Pointer client = weak.lock();
+        if( !client ){
+            return;
+        }
+
+        const TimerWheel::Tick idle = m_wheel.now() - client->getLastActive();
+        if( idle < m_heartbeatIdle ){
+            _scheduleHeartbeat( client, m_heartbeatIdle - idle );
+        }
+        else if( idle < m_heartbeatIdle + m_heartbeatTimeout ){
+            client->writeMessage( m_pingV1, m_pingV2 );
+            m_metrics.add( SENT + SENT_PING );
+            _scheduleHeartbeat( client, m_heartbeatIdle + m_heartbeatTimeout - idle );
+        }
+        else {
+            // Closing the connection fails the read in progress, which removes the client.
+            cerr << "Disconnecting " << client->getName() << " for not answering a ping" << endl;
+            ++m_evicted;
+            client->close();
+        }
+    }
+
+    void _readMessage( ClientConnection::Pointer client ){
+        client->setHandler(
+            boost::bind(
+                &Server::_commandHandler,
+                this,
+                client,
+                ClientConnection::placeholders::error,
+                ClientConnection::placeholders::opcode,
+                ClientConnection::placeholders::data
+            )
+        );
+
+        // Anything the client sends first may be meant for the lobby, so nothing is read until the
+        // lobby has been made.
+        if( !client->getJoining().empty() ){
+            client->holdRead();
+            return;
+        }
+        client->readMessage();
+    }
+
+    void _commandHandler(
+        ClientConnection::Pointer client,
+        const error_code& error,
+        const unsigned char opcode,
+        const BufferView& data
+    ){
+        TRACE_SCOPE( "command", client->getId() );
+        if( error ){
+            cerr << "Read command error: " << error.message() << endl;
+            if( error == boost::asio::error::eof ){
+                m_metrics.add( CLIENT_EOF );
+            }
+            else if( error == boost::asio::error::operation_aborted ||
+                error == boost::asio::error::bad_descriptor )
+            {
+                m_metrics.add( SERVER_CLOSED );
+            }
+            else {
+                m_metrics.add( READ_ERRORS );
+            }
+            client->close();
+            _removeClient( client );
+            return;
+        }
+
+        // Handle the command we just received, then set up the next read. The capture notes the
+        // protocol the message was read in, before a version request gets to change it.
+        if( m_capture ){
+            m_capture->record(
+                client->getId(), opcode, client->getProtocol(), data.data(), data.size()
+            );
+        }
+        const size_t counted =
+            opcode < Protocol::CLIENT_OPCODE_COUNT ? (size_t)opcode : (size_t)Protocol::INVALID;
+        m_metrics.add( RECEIVED + counted );
+        m_metrics.add( RECEIVED_BYTES + counted, data.size() );
+        if( m_heartbeatIdle ){
+            client->setLastActive( m_wheel.now() );
+        }
+
+        // A client which asks for a version does so first, so its first message settles the
+        // protocol, and what was held back since it joined the lobby goes out after the answer.
+        (this->*m_handlers[ opcode ])( client, data );
+        client->releaseWrites();
+
+        // Whatever the client sends after a join may be meant for the room, so nothing more is
+        // read until it is in every room it asked for.
+        if( !client->getJoining().empty() ){
+            client->holdRead();
+            return;
+        }
+        _readNext( client, data.size() );
+    }
+
+    /// Read the client's next message, once it is back within its rate limits.
+    ///
+    /// @param client
+    /// @param size     Size of the payload of the message just handled.
+    void _readNext( const ClientConnection::Pointer& client, const size_t size ){
+        if( !client->isRateLimited() ){
+            client->readMessage();
+            return;
+        }
+
+        const TokenBucket::Duration wait = client->charge( size );
+        if( wait == TokenBucket::Duration::zero() ){
+            client->readMessage();
+            return;
+        }
+
+        ++m_throttled;
+        if( m_maxStrikes && client->getStrikes() > m_maxStrikes ){
+            // There is no read in progress to fail, so the client is stopped and removed here.
+            cerr << "Disconnecting " << client->getName() << " for flooding" << endl;
+            ++m_flooders;
+            client->stop();
+            _removeClient( client );
+            return;
+        }
+        client->readMessageAfter( wait );
+    }
+
+    void _nameHandler( ClientConnection::Pointer client, const BufferView& data ){
+        client->setName( data.str() );
+    }
+
+    void _chatHandler( ClientConnection::Pointer client, const BufferView& data ){
+        _talk( client, LOBBY, data );
+    }
+
+    void _joinHandler( ClientConnection::Pointer client, const BufferView& data ){
+        _join( client, data.str() );
+    }
+
+    void _partHandler( ClientConnection::Pointer client, const BufferView& data ){
+        _part( client, data.str() );
+    }
+
+    void _talkHandler( ClientConnection::Pointer client, const BufferView& data ){
+        // Version 1 puts a space between the room name and the message, version 2 gives the length
+        // of the room name.
+        if( client->getProtocol() == 1 ){
+            const size_t split = data.find( ' ' );
+            const BufferView message = split == string::npos ? BufferView() : data.sub( split + 1 );
+            _talk( client, data.sub( 0, split ).str(), message );
+            return;
+        }
+
+        const char* begin   = data.data();
+        const char* end     = begin + data.size();
+        size_t offset, size;
+        if( Protocol::readString( begin, end, offset, size ) ){
+            _talk( client, data.sub( offset, size ).str(), data.sub( offset + size ) );
+        }
+    }
+
+    void _quitHandler( ClientConnection::Pointer client, const BufferView& data ){
+        client->close();
+        _removeClient( client );
+    }
+
+    void _versionHandler( ClientConnection::Pointer client, const BufferView& data ){
+        client->setProtocol( atoi( data.str().c_str() ) );
+        m_metrics.add( SENT + SENT_VERSION );
+    }
+
+    void _pongHandler( ClientConnection::Pointer client, const BufferView& data ){
+        // Hearing from the client at all is what counts, which has already been noted.
+    }
+
+    void _resumeHandler( ClientConnection::Pointer client, const BufferView& data ){
+        if( !m_log ){
+            return;
+        }
+
+        // The log is read on the log thread, which only gets a copy of the rooms the client is in
+        // as they are now, since the client's own handlers are the only ones which may look at
+        // them.
+        boost::shared_ptr< set< string > > rooms( new set< string > );
+        typedef ClientConnection::room_map::const_iterator room_iterator;
+        const ClientConnection::room_map& joined = client->getRooms();
+        for( room_iterator it = joined.begin(); it != joined.end(); ++it ){
+            rooms->insert( it->first );
+        }
+        m_logService.post(
+            boost::bind(
+                &Server::_resume,
+                this,
+                client,
+                strtoull( data.str().c_str(), NULL, 10 ),
+                rooms,
+                client->getProtocol()
+            )
+        );
+    }
+
+    /// Send a client everything logged since a sequence number, in the rooms it is in, in one
+    /// write. Runs on the log thread.
+    void _resume(
+        const ClientConnection::Pointer&            client,
+        const ChatLog::Sequence                     from,
+        const boost::shared_ptr< set< string > >&   rooms,
+        const int                                   protocol
+    ){
+        string messages;
+        m_log->read(
+            from,
+            boost::bind(
+                &Server::_resumeVisitor,
+                boost::cref( *rooms ),
+                protocol,
+                boost::ref( messages ),
+                _2,
+                _3
+            ),
+            RESUME_LIMIT
+        );
+        if( !messages.empty() ){
+            boost::shared_ptr< Message > message( new Message );
+            message->add( boost::shared_ptr< const string >( new string( messages ) ) );
+            client->writeMessage( message, message );
+            m_metrics.add( SENT + SENT_RESUME );
+        }
+    }
+
+    static void _resumeVisitor(
+        const set< string >& rooms,
+        const int protocol,
+        string& messages,
+        const char* data,
+        const size_t size
+    ){
+        string room, name, text;
+        if( !_parseRecord( data, size, room, name, text ) ){
+            return;
+        }
+        if( rooms.count( room.empty() ? LOBBY : room ) ){
+            messages += Room::encode( protocol, room, name, text );
+        }
+    }
+
+    void _unknownCommandHandler( ClientConnection::Pointer client, const BufferView& data ){
+        m_metrics.add( UNKNOWN_COMMANDS );
+        // Unknown version 1 commands have already been reported by name.
+        if( client->getProtocol() != 1 ){
+            cerr << "Unknown opcode issued by " << client->getName() << endl;
+        }
+    }
+
+    void _talk( ClientConnection::Pointer client, const string& name, const BufferView& data ){
+        ClientConnection::room_map& rooms = client->getRooms();
+        ClientConnection::room_map::const_iterator it = rooms.find( name );
+        if( it == rooms.end() ){
+            cerr
+                << client->getName() << " tried to talk in \"" << name << "\" without joining it"
+                << endl;
+            return;
+        }
+        const Room& room = *it->second;
+        m_metrics.add( SENT + SENT_CHAT, it->second->send( client, data ) );
+
+        // The log record is also what peers are sent, so it is only built once.
+        const Room::peer_list_ptr& peers = room.getPeers();
+        if( !m_log && peers->empty() ){
+            return;
+        }
+        const string& record =
+            Protocol::encodeMessageFields( room.getWireName(), client->getName() ) + data.str();
+        if( m_log ){
+            m_log->append( record );
+        }
+        if( !peers->empty() ){
+            const PeerLink::Frame& frame = PeerLink::frame( Protocol::PEER_MESSAGE, record );
+            for( size_t i = 0; i < peers->size(); ++i ){
+                (*peers)[ i ]->send( frame );
+            }
+            ++m_forwarded;
+        }
+    }
+
+    /// Fill a new room's history from the most recent part of the log.
+    void _loadHistory( Room& room ){
+        if( !m_log || !m_historyMessages ){
+            return;
+        }
+
+        const ChatLog::Stats& stats = m_log->getStats();
+        const ChatLog::Sequence scan = stats.next < HISTORY_SCAN ? stats.next : HISTORY_SCAN;
+        m_log->read(
+            stats.next - scan,
+            boost::bind( &Server::_historyVisitor, this, boost::ref( room ), _2, _3 )
+        );
+    }
+
+    void _historyVisitor( Room& room, const char* data, const size_t size ){
+        string wireName, name, text;
+        if( _parseRecord( data, size, wireName, name, text ) && wireName == room.getWireName() ){
+            boost::shared_ptr< string > shared( new string );
+            shared->swap( text );
+            room.remember( name, shared );
+        }
+    }
+
+    /// Split a logged message into its room, sender's name and text.
+    static bool _parseRecord(
+        const char* data,
+        const size_t size,
+        string& room,
+        string& name,
+        string& text
+    ){
+        const char* end = data + size;
+        size_t roomOffset, roomSize, nameOffset, nameSize;
+        if( !Protocol::readString( data, end, roomOffset, roomSize ) ){
+            return false;
+        }
+        room.assign( data - roomSize, roomSize );
+        if( !Protocol::readString( data, end, nameOffset, nameSize ) ){
+            return false;
+        }
+        name.assign( data - nameSize, nameSize );
+        text.assign( data, end - data );
+        return true;
+    }
+
+    void _acceptPeer( void ){
+        Connection::Pointer connection( new Connection( m_ioService ) );
+        m_peerAcceptor->async_accept(
+            connection->getSocket(),
+            boost::bind(
+                &Server::_acceptPeerHandler,
+                this,
+                boost::asio::placeholders::error,
+                connection
+            )
+        );
+    }
+
+    void _acceptPeerHandler( const error_code& error, Connection::Pointer connection ){
+        _acceptPeer();
+
+        if( error ){
+            cerr << "Peer error on accept: " << error.message() << endl;
+            return;
+        }
+
+        error_code ignored;
+        const tcp::endpoint& endpoint = connection->getSocket().remote_endpoint( ignored );
+        ostringstream port;
+        port << endpoint.port();
+        const string& host = endpoint.address().to_string();
+        _startPeer( PeerLink::Pointer(
+            new PeerLink( connection, m_bufferPool, host, port.str(), false )
+        ) );
+    }
+
+    void _connectPeer( const address& peer ){
+        m_resolver.resolve(
+            peer.first,
+            peer.second,
+            boost::bind(
+                &Server::_peerResolveHandler,
+                this,
+                ResolverCache::placeholders::error,
+                ResolverCache::placeholders::endpoints,
+                peer
+            )
+        );
+    }
+
+    void _peerResolveHandler(
+        const error_code& error,
+        ResolverCache::Endpoints endpoints,
+        const address& peer
+    ){
+        if( error ){
+            cerr << "Unable to resolve peer " << peer.first << ": " << error.message() << endl;
+            _retryPeer( peer );
+            return;
+        }
+
+        RacingConnector::Pointer connector(
+            new RacingConnector( m_ioService, endpoints->begin(), endpoints->end() )
+        );
+        connector->start( boost::bind( &Server::_peerConnectHandler, this, _1, _2, peer ) );
+    }
+
+    void _peerConnectHandler(
+        const error_code& error,
+        RacingConnector::SocketPointer socket,
+        const address& peer
+    ){
+        if( error ){
+            cerr
+                << "Unable to connect to peer " << peer.first << ":" << peer.second << ": "
+                << error.message() << endl;
+            _retryPeer( peer );
+            return;
+        }
+
+        const tcp protocol = socket->remote_endpoint().protocol();
+        Connection::Pointer connection( new Connection( m_ioService ) );
+        connection->getSocket().assign( protocol, socket->release() );
+        _startPeer( PeerLink::Pointer(
+            new PeerLink( connection, m_bufferPool, peer.first, peer.second, true )
+        ) );
+    }
+
+    /// Try to reach a peer again after a pause.
+    void _retryPeer( const address& peer ){
+        boost::shared_ptr< boost::asio::steady_timer > timer(
+            new boost::asio::steady_timer( m_ioService )
+        );
+        timer->expires_after( boost::asio::chrono::seconds( (long)PEER_RETRY ) );
+        timer->async_wait(
+            boost::bind(
+                &Server::_retryHandler,
+                this,
+                boost::asio::placeholders::error,
+                timer,
+                peer
+            )
+        );
+    }
+
+    void _retryHandler(
+        const error_code& error,
+        boost::shared_ptr< boost::asio::steady_timer > timer,
+        const address& peer
+    ){
+        if( !error ){
+            _connectPeer( peer );
+        }
+    }
+
+    /// Say who we are, then listen. Links on either side are treated the same from here on.
+    void _startPeer( const PeerLink::Pointer& link ){
+        link->send( PeerLink::frame( Protocol::PEER_HELLO, m_serverId ) );
+        link->readMessage(
+            boost::bind(
+                &Server::_peerCommandHandler,
+                this,
+                link,
+                ClientConnection::placeholders::error,
+                ClientConnection::placeholders::opcode,
+                ClientConnection::placeholders::data
+            )
+        );
+    }
+
+    void _peerCommandHandler(
+        const PeerLink::Pointer& link,
+        const error_code& error,
+        const unsigned char opcode,
+        const BufferView& data
+    ){
+        if( error ){
+            link->close();
+            _removePeer( link );
+            return;
+        }
+
+        (this->*m_peerHandlers[ opcode ])( link, data );
+        link->readMessage();
+    }
+
+    void _removePeer( const PeerLink::Pointer& link ){
+        {
+            boost::mutex::scoped_lock lock( m_roomsMutex );
+            if( _isLinked( link ) ){
+                cerr << "Lost peer " << link->getPeerId() << " at " << link->getAddress() << endl;
+                m_peers.erase( link->getPeerId() );
+                _dropInterest( link );
+            }
+        }
+
+        // Whichever end made the link is the one that makes it again.
+        if( link->isOutbound() && !link->isRedundant() ){
+            _retryPeer( address( link->getHost(), link->getPort() ) );
+        }
+    }
+
+    /// Must be called with `m_roomsMutex` held.
+    bool _isLinked( const PeerLink::Pointer& link ) const {
+        peer_map::const_iterator it = m_peers.find( link->getPeerId() );
+        return it != m_peers.end() && it->second == link;
+    }
+
+    /// The ID of the server which made a link. Both ends work out the same answer.
+    const string& _initiator( const PeerLink& link, const string& peerId ) const {
+        return link.isOutbound() ? m_serverId : peerId;
+    }
+
+    /// Forget every room a peer has members in. Must be called with `m_roomsMutex` held.
+    void _dropInterest( const PeerLink::Pointer& link ){
+        for( interest_map::iterator it = m_interest.begin(); it != m_interest.end(); ){
+            Room::peer_list& peers = it->second;
+            const Room::peer_list::iterator peer = find( peers.begin(), peers.end(), link );
+            if( peer == peers.end() ){
+                ++it;
+                continue;
+            }
+            peers.erase( peer );
+            _updatePeers( it->first, peers );
+            if( peers.empty() ){
+                m_interest.erase( it++ );
+            }
+            else {
+                ++it;
+            }
+        }
+    }
+
+    /// Pass a room's new list of interested peers on to the room, if it has members here.
+    void _updatePeers( const string& name, const Room::peer_list& peers ){
+        room_map::const_iterator room = m_rooms.find( name );
+        if( room != m_rooms.end() ){
+            room->second->setPeers( peers );
+        }
+    }
+
+    void _peerHelloHandler( const PeerLink::Pointer& link, const BufferView& data ){
+        const string id = data.str();
+        if( id == m_serverId ){
+            cerr << "Peer " << link->getAddress() << " is this server" << endl;
+            link->setRedundant();
+            link->close();
+            return;
+        }
+
+        boost::mutex::scoped_lock lock( m_roomsMutex );
+        PeerLink::Pointer& current = m_peers[ id ];
+        if( current ){
+            // Two servers which list each other make two links at once. Both ends keep the one
+            // made by the server with the lower ID, and the server that made the other one leaves
+            // it closed.
+            if( _initiator( *current, id ) <= _initiator( *link, id ) ){
+                link->setRedundant();
+                link->close();
+                return;
+            }
+            current->setRedundant();
+            current->close();
+            _dropInterest( current );
+        }
+
+        link->setPeerId( id );
+        current = link;
+        cerr << "Linked to peer " << id << " at " << link->getAddress() << endl;
+
+        // Everything from here on reaches the peer through `_announce`.
+        for( room_map::const_iterator it = m_rooms.begin(); it != m_rooms.end(); ++it ){
+            link->send( PeerLink::frame( Protocol::PEER_JOIN, it->first ) );
+        }
+    }
+
+    void _peerJoinHandler( const PeerLink::Pointer& link, const BufferView& data ){
+        const string name = data.str();
+        boost::mutex::scoped_lock lock( m_roomsMutex );
+        if( !_isLinked( link ) ){
+            return;
+        }
+
+        Room::peer_list& peers = m_interest[ name ];
+        if( find( peers.begin(), peers.end(), link ) == peers.end() ){
+            peers.push_back( link );
+            _updatePeers( name, peers );
+        }
+    }
+
+    void _peerPartHandler( const PeerLink::Pointer& link, const BufferView& data ){
+        const string name = data.str();
+        boost::mutex::scoped_lock lock( m_roomsMutex );
+        interest_map::iterator it = m_interest.find( name );
+        if( it == m_interest.end() ){
+            return;
+        }
+
+        Room::peer_list& peers = it->second;
+        const Room::peer_list::iterator peer = find( peers.begin(), peers.end(), link );
+        if( peer != peers.end() ){
+            peers.erase( peer );
+            _updatePeers( name, peers );
+            if( peers.empty() ){
+                m_interest.erase( it );
+            }
+        }
+    }
+
+    /// Deliver a message sent by one of a peer's clients to the members here. It goes no further,
+    /// as the server it came from sends it to every other peer itself.
+    void _peerMessageHandler( const PeerLink::Pointer& link, const BufferView& data ){
+        // The payload is the room, the sender's name and the text, just as they are logged.
+        const char* begin   = data.data();
+        const char* end     = begin + data.size();
+        size_t offset, roomSize, nameSize;
+        if( !Protocol::readString( begin, end, offset, roomSize ) ){
+            return;
+        }
+        const string wireName( begin - roomSize, roomSize );
+        if( !Protocol::readString( begin, end, offset, nameSize ) ){
+            return;
+        }
+        const string name( begin - nameSize, nameSize );
+
+        Room::Pointer room;
+        {
+            boost::mutex::scoped_lock lock( m_roomsMutex );
+            room_map::const_iterator it = m_rooms.find( wireName.empty() ? LOBBY : wireName );
+            if( it == m_rooms.end() || !_isLinked( link ) ){
+                return;
+            }
+            room = it->second;
+        }
+
+        m_metrics.add( SENT + SENT_CHAT, room->deliver( name, data.sub( begin - data.data() ) ) );
+        ++m_fromPeers;
+        if( m_log ){
+            m_log->append( data.str() );
+        }
+    }
+
+    void _unknownPeerCommandHandler( const PeerLink::Pointer& link, const BufferView& data ){
+        cerr << "Unknown opcode sent by peer " << link->getAddress() << endl;
+    }
+
+    void _acceptAdmin( void ){
+        Connection::Pointer connection( new Connection( m_ioService, ADMIN_REQUEST_BYTES ) );
+        m_adminAcceptor->async_accept(
+            connection->getSocket(),
+            boost::bind(
+                &Server::_acceptAdminHandler,
+                this,
+                boost::asio::placeholders::error,
+                connection
+            )
+        );
+    }
+
+    void _acceptAdminHandler( const error_code& error, Connection::Pointer connection ){
+        _acceptAdmin();
+
+        if( error ){
+            cerr << "Admin error on accept: " << error.message() << endl;
+            return;
+        }
+
+        // The request has to fit in the read buffer and arrive in time, so a client which sends
+        // too much or too slowly is cut off rather than holding on to memory and a socket.
+        boost::shared_ptr< boost::asio::steady_timer > timer(
+            new boost::asio::steady_timer( m_ioService )
+        );
+        timer->expires_after( boost::asio::chrono::seconds( (long)ADMIN_TIMEOUT ) );
+        timer->async_wait(
+            boost::bind(
+                &Server::_adminTimeoutHandler,
+                this,
+                boost::asio::placeholders::error,
+                connection
+            )
+        );
+        connection->readUntil(
+            string( "\r\n\r\n" ),
+            boost::bind(
+                &Server::_adminRequestHandler,
+                this,
+                connection,
+                timer,
+                Connection::placeholders::error,
+                Connection::placeholders::data
+            )
+        );
+    }
+
+    void _adminTimeoutHandler( const error_code& error, Connection::Pointer connection ){
+        if( !error ){
+            connection->close();
+        }
+    }
+
+    /// Answer a single HTTP request on the admin port, then close the connection. Only
+    /// `GET /metrics` is served.
+    void _adminRequestHandler(
+        Connection::Pointer connection,
+        boost::shared_ptr< boost::asio::steady_timer > timer,
+        const error_code& error,
+        istream& request
+    ){
+        timer->cancel();
+        if( error ){
+            connection->close();
+            return;
+        }
+
+        string method, path;
+        request >> method >> path;
+        ostringstream body;
+        string status = "200 OK";
+        if( method == "GET" && (path == "/metrics" || path.compare( 0, 9, "/metrics?" ) == 0) ){
+            _writeMetrics( body );
+        }
+        else {
+            status = "404 Not Found";
+            body << "Not found, try /metrics\n";
+        }
+
+        ostringstream response;
+        response
+            << "HTTP/1.0 " << status << "\r\n"
+            << "Content-Type: text/plain; version=0.0.4\r\n"
+            << "Content-Length: " << body.str().size() << "\r\n"
+            << "Connection: close\r\n\r\n"
+            << body.str();
+        connection->write( response.str(), boost::bind( &Connection::close, connection ) );
+    }
+
+    /// Counts every write made by any connection, peers' included.
+    void _writeObserver(
+        const error_code& error,
+        const size_t bytes,
+        const Connection::Clock::duration& latency
+    ){
+        if( error ){
+            m_metrics.add( WRITE_ERRORS );
+            return;
+        }
+        m_metrics.add( WRITTEN_BYTES, bytes );
+        m_writeLatency.record(
+            boost::asio::chrono::duration_cast< boost::asio::chrono::microseconds >( latency )
+                .count()
+        );
+    }
+
+    static void _queueVisitor(
+        const ClientConnection::Pointer& client,
+        size_t& deepest,
+        size_t& backlogged
+    ){
+        const size_t bytes = client->getQueuedBytes();
+        deepest = max( deepest, bytes );
+        if( bytes ){
+            ++backlogged;
+        }
+    }
+
+    static string _commandLabel( const size_t opcode ){
+        return string( "command=\"" ) + (opcode ? Protocol::command( opcode ) : "unknown") + "\"";
+    }
+
+    static string _sentLabel( const size_t kind ){
+        static const char* kinds[ SENT_KIND_COUNT ] = {
+            "chat", "history", "resume", "ping", "version"
+        };
+        return string( "kind=\"" ) + kinds[ kind ] + "\"";
+    }
+
+    /// Write every metric in the Prometheus text format. Counters kept per thread are summed here,
+    /// and the client table is walked once for the outbound queues.
+    void _writeMetrics( ostream& out ){
+        const vector< size_t >& totals = m_metrics.sum();
+        const Connection::WriteStats& stats = Connection::getWriteStats();
+        MetricsWriter metrics( out );
+
+        size_t clients, deepest = 0, backlogged = 0;
+        {
+            boost::mutex::scoped_lock lock( m_clientsMutex );
+            clients = m_clients.size();
+            m_clients.forEach( boost::bind(
+                &Server::_queueVisitor, _1, boost::ref( deepest ), boost::ref( backlogged )
+            ) );
+        }
+        metrics.single( "chat_clients", "gauge", "Clients connected.", clients );
+        metrics.single( "chat_rooms", "gauge", "Rooms with members.", _roomCount() );
+
+        metrics.family(
+            "chat_received_messages_total", "counter", "Messages received from clients, by command."
+        );
+        for( size_t opcode = 0; opcode < Protocol::CLIENT_OPCODE_COUNT; ++opcode ){
+            metrics.sample(
+                "chat_received_messages_total", _commandLabel( opcode ), totals[ RECEIVED + opcode ]
+            );
+        }
+        metrics.family(
+            "chat_received_bytes_total", "counter",
+            "Payload bytes received from clients, by command."
+        );
+        for( size_t opcode = 0; opcode < Protocol::CLIENT_OPCODE_COUNT; ++opcode ){
+            metrics.sample(
+                "chat_received_bytes_total", _commandLabel( opcode ),
+                totals[ RECEIVED_BYTES + opcode ]
+            );
+        }
+        metrics.family(
+            "chat_sent_messages_total", "counter", "Messages sent to clients, by kind."
+        );
+        for( size_t kind = 0; kind < SENT_KIND_COUNT; ++kind ){
+            metrics.sample( "chat_sent_messages_total", _sentLabel( kind ), totals[ SENT + kind ] );
+        }
+        metrics.single(
+            "chat_socket_writes_total", "counter",
+            "Writes started on sockets, each carrying any number of messages.", stats.writes
+        );
+        metrics.single(
+            "chat_written_bytes_total", "counter", "Bytes written to sockets.",
+            totals[ WRITTEN_BYTES ]
+        );
+        metrics.histogram(
+            "chat_write_latency_seconds",
+            "Time from a message being queued on an idle connection to its write completing.",
+            m_writeLatency, totals
+        );
+
+        metrics.single(
+            "chat_outbound_queued_bytes", "gauge",
+            "Bytes queued or being written, across every connection.", stats.queuedBytes
+        );
+        metrics.single(
+            "chat_outbound_queue_max_bytes", "gauge",
+            "Bytes queued for the client furthest behind.", deepest
+        );
+        metrics.single(
+            "chat_outbound_backlogged_clients", "gauge",
+            "Clients with anything queued or being written.", backlogged
+        );
+        metrics.family(
+            "chat_outbound_dropped_total", "counter",
+            "Messages dropped for not fitting in a client's queue, by which one went."
+        );
+        metrics.sample( "chat_outbound_dropped_total", "dropped=\"oldest\"", stats.droppedOldest );
+        metrics.sample( "chat_outbound_dropped_total", "dropped=\"newest\"", stats.droppedNewest );
+
+        metrics.family(
+            "chat_read_ends_total", "counter",
+            "Client connections whose reads ended: closed by the client, by the server, or failed."
+        );
+        metrics.sample( "chat_read_ends_total", "reason=\"eof\"", totals[ CLIENT_EOF ] );
+        metrics.sample( "chat_read_ends_total", "reason=\"closed\"", totals[ SERVER_CLOSED ] );
+        metrics.sample( "chat_read_ends_total", "reason=\"error\"", totals[ READ_ERRORS ] );
+        metrics.single(
+            "chat_unknown_commands_total", "counter",
+            "Messages from clients with unknown commands.", totals[ UNKNOWN_COMMANDS ]
+        );
+        metrics.single(
+            "chat_write_errors_total", "counter", "Writes which failed.", totals[ WRITE_ERRORS ]
+        );
+        metrics.family(
+            "chat_disconnects_total", "counter", "Clients disconnected by the server, by why."
+        );
+        metrics.sample( "chat_disconnects_total", "reason=\"slow\"", stats.disconnects );
+        metrics.sample( "chat_disconnects_total", "reason=\"flooding\"", m_flooders.load() );
+        metrics.sample( "chat_disconnects_total", "reason=\"heartbeat\"", m_evicted.load() );
+        metrics.single(
+            "chat_throttled_total", "counter",
+            "Times a client's reads were paused for going over its rate limits.", m_throttled.load()
+        );
+        metrics.single(
+            "chat_heartbeats_waiting", "gauge", "Heartbeat checks scheduled.", m_wheel.size()
+        );
+
+        if( m_peerAcceptor || !m_peerAddresses.empty() ){
+            metrics.single( "chat_peers", "gauge", "Peers linked to.", _peerCount() );
+            metrics.single(
+                "chat_forwarded_messages_total", "counter",
+                "Messages forwarded to peers, counted once each.", m_forwarded.load()
+            );
+            metrics.single(
+                "chat_peer_messages_total", "counter", "Messages delivered for peers.",
+                m_fromPeers.load()
+            );
+        }
+        if( m_log ){
+            metrics.single(
+                "chat_log_appended_total", "counter", "Messages logged.", m_log->getStats().appended
+            );
+        }
+    }
+
+public:
+    /// Constructor.
+    ///
+    /// @param port     Port to listen for clients on.
+    /// @param threads  How many threads to run the `io_service` with.
+    /// @param stats    Seconds between write statistics reports on `stderr`, 0 for none.
+    Server( const unsigned short port = CHAT_PORT, const size_t threads = 1, const size_t stats = 0 )
+        : m_acceptor( m_ioService, tcp::endpoint( tcp::v4(), port ) ),
+          m_threadCount( max< size_t >( threads, 1 ) ),
+          m_statsTimer( m_ioService ),
+          m_statsInterval( stats ),
+          m_statsAllocations( 0 ),
+          m_statsMessages( 0 ),
+          m_bufferPool( BufferPool::create() ),
+          m_historyMessages( 0 ),
+          m_historyBytes( 0 ),
+          m_connections( 0 ),
+          m_resolver( m_ioService ),
+          m_forwarded( 0 ),
+          m_fromPeers( 0 ),
+          m_wheel( m_ioService, boost::asio::chrono::milliseconds( (long)WHEEL_TICK ) ),
+          m_heartbeatIdle( 0 ),
+          m_heartbeatTimeout( 0 ),
+          m_evicted( 0 ),
+          m_messageRate( 0 ),
+          m_byteRate( 0 ),
+          m_maxStrikes( 0 ),
+          m_throttled( 0 ),
+          m_flooders( 0 ),
+          m_metrics( METRIC_COUNT ),
+          m_writeLatency( m_metrics, WRITE_LATENCY )
+    {
+        ostringstream id;
+        id << boost::asio::ip::host_name() << ":" << port;
+        m_serverId = id.str();
+
+        // Every ping is the same, so they all share one message.
+        boost::shared_ptr< Message > v1( new Message );
+        v1->add( boost::shared_ptr< const string >( new string( "ping\n" ) ) );
+        m_pingV1 = v1;
+        boost::shared_ptr< Message > v2( new Message );
+        v2->add( boost::shared_ptr< const string >(
+            new string( Protocol::encodeV2( Protocol::PING, "" ) )
+        ) );
+        m_pingV2 = v2;
+
+        for( size_t i = 0; i < Protocol::OPCODE_COUNT; ++i ){
+            m_handlers[ i ] = &Server::_unknownCommandHandler;
+            m_peerHandlers[ i ] = &Server::_unknownPeerCommandHandler;
+        }
+        m_handlers[ Protocol::NAME ]    = &Server::_nameHandler;
+        m_handlers[ Protocol::CHAT ]    = &Server::_chatHandler;
+        m_handlers[ Protocol::JOIN ]    = &Server::_joinHandler;
+        m_handlers[ Protocol::PART ]    = &Server::_partHandler;
+        m_handlers[ Protocol::TALK ]    = &Server::_talkHandler;
+        m_handlers[ Protocol::QUIT ]    = &Server::_quitHandler;
+        m_handlers[ Protocol::VERSION ] = &Server::_versionHandler;
+        m_handlers[ Protocol::RESUME ]  = &Server::_resumeHandler;
+        m_handlers[ Protocol::PONG ]    = &Server::_pongHandler;
+
+        m_peerHandlers[ Protocol::PEER_HELLO ]      = &Server::_peerHelloHandler;
+        m_peerHandlers[ Protocol::PEER_JOIN ]       = &Server::_peerJoinHandler;
+        m_peerHandlers[ Protocol::PEER_PART ]       = &Server::_peerPartHandler;
+        m_peerHandlers[ Protocol::PEER_MESSAGE ]    = &Server::_peerMessageHandler;
+    }
+
+    /// Stop the log thread, abandoning any resumes still queued.
+    ~Server( void ){
+        m_logWork.reset();
+        m_logService.stop();
+        if( m_logThread.joinable() ){
+            m_logThread.join();
+        }
+    }
+
+    /// Bound the outbound queue of every client connected from now on.
+    ///
+    /// @param limits
+    void setOutboundLimits( const Connection::OutboundLimits& limits ){
+        m_outboundLimits = limits;
+    }
+
+    /// Keep the most recent messages in every room created from now on, to replay to new members.
+    ///
+    /// @param messages Most messages to keep, 0 for none.
+    /// @param bytes    Most bytes to keep for each protocol version. Allocated when a room is made.
+    void setHistoryLimits( const size_t messages, const size_t bytes ){
+        m_historyMessages   = messages;
+        m_historyBytes      = bytes;
+    }
+
+    /// Log every message to `directory`, and fill rooms' histories from what is already there.
+    ///
+    /// @param directory
+    /// @param segmentSize  Size of each log file.
+    ///
+    /// @throws std::exception if the log can't be opened.
+    void openLog( const string& directory, const size_t segmentSize ){
+        m_log.reset( new ChatLog( directory, segmentSize ) );
+        m_logWork.reset( new boost::asio::io_service::work( m_logService ) );
+        m_logThread = boost::thread( boost::bind( &boost::asio::io_service::run, &m_logService ) );
+        const ChatLog::Stats& stats = m_log->getStats();
+        cerr
+            << "Opened log " << directory << ": " << stats.next - stats.first << " messages in "
+            << stats.segments << " segments" << endl;
+    }
+
+    /// Record every message clients send from now on, for `chat-replay`.
+    ///
+    /// @param path Capture file to create, replacing any already there.
+    ///
+    /// @throws std::exception if the file can't be created.
+    void captureTo( const string& path ){
+        m_capture.reset( new CaptureWriter( path ) );
+    }
+
+    /// Record trace points from now on, and write them out whenever the server gets `SIGUSR1`.
+    ///
+    /// @param path Where to write the trace, replacing the last one.
+    void traceTo( const string& path ){
+        m_trace.reset( new TraceDumper( m_ioService, path ) );
+    }
+
+    /// Ping clients which have been quiet for a while, and disconnect any which don't answer.
+    ///
+    /// @param idle     Seconds of silence before a client is pinged, 0 to never ping.
+    /// @param timeout  Seconds to wait for an answer.
+    void setHeartbeat( const size_t idle, const size_t timeout ){
+        m_heartbeatIdle     = m_wheel.ticks( boost::asio::chrono::seconds( (long)idle ) );
+        m_heartbeatTimeout  = max< TimerWheel::Tick >(
+            m_wheel.ticks( boost::asio::chrono::seconds( (long)timeout ) ),
+            1
+        );
+    }
+
+    /// Limit how fast each client connected from now on may send.
+    ///
+    /// @param messages Messages per second, 0 for no limit.
+    /// @param bytes    Bytes of payload per second, 0 for no limit.
+    /// @param strikes  Disconnect a client once this many messages in a row take it over a limit,
+    ///                 0 to never disconnect.
+    void setRateLimits( const double messages, const double bytes, const size_t strikes ){
+        m_messageRate   = messages;
+        m_byteRate      = bytes;
+        m_maxStrikes    = strikes;
+    }
+
+    /// Name this server to its peers. Every server in a federation needs a different ID, and by
+    /// default it is the host name and client port.
+    ///
+    /// @param id
+    void setServerId( const string& id ){
+        m_serverId = id;
+    }
+
+    /// Accept links from other servers.
+    ///
+    /// @param port
+    ///
+    /// @throws boost::system::system_error if the port can't be listened on.
+    void listenForPeers( const unsigned short port ){
+        m_peerAcceptor.reset( new tcp::acceptor( m_ioService, tcp::endpoint( tcp::v4(), port ) ) );
+    }
+
+    /// Keep a link open to another server, starting once the server starts and reconnecting
+    /// whenever it drops.
+    ///
+    /// @param host
+    /// @param port The port the peer listens for other servers on.
+    void addPeer( const string& host, const string& port ){
+        m_peerAddresses.push_back( address( host, port ) );
+    }
+
+    /// Serve metrics over HTTP, at `/metrics`, in the Prometheus text format.
+    ///
+    /// @param port
+    ///
+    /// @throws boost::system::system_error if the port can't be listened on.
+    void listenForAdmin( const unsigned short port ){
+        m_adminAcceptor.reset( new tcp::acceptor( m_ioService, tcp::endpoint( tcp::v4(), port ) ) );
+        Connection::setWriteObserver(
+            boost::bind( &Server::_writeObserver, this, _1, _2, _3 )
+        );
+    }
+
+    /// @return The port clients connect to, which the system picks if the server was given 0.
+    unsigned short getPort( void ) const {
+        return m_acceptor.local_endpoint().port();
+    }
+
+    /// Stop serving. `start` returns once every thread of the pool has finished.
+    void stop( void ){
+        m_ioService.stop();
+    }
+
+    void start( void ){
+        _accept();
+        if( m_adminAcceptor ){
+            _acceptAdmin();
+        }
+        if( m_statsInterval ){
+            _scheduleStats();
+        }
+        if( m_peerAcceptor ){
+            _acceptPeer();
+        }
+        if( m_heartbeatIdle ){
+            m_wheel.start();
+        }
+        for( vector< address >::const_iterator it = m_peerAddresses.begin();
+            it != m_peerAddresses.end(); ++it )
+        {
+            _connectPeer( *it );
+        }
+
+        // The calling thread makes up one of the pool.
+        boost::thread_group threads;
+        for( size_t i = 1; i < m_threadCount; ++i ){
+            threads.create_thread( boost::bind( &boost::asio::io_service::run, &m_ioService ) );
+        }
+        m_ioService.run();
+        threads.join_all();
+    }
+};
+const string& Server::DEFAULT_NAME = "<unknown>";
+const string& Server::LOBBY = "lobby";
+
+// ************************************************************************** //
+
+/// Application options parsed from the command line.
+struct Options {
+    unsigned short  port;
+    size_t          threads;
+    size_t          stats;      ///< Seconds between write statistics reports, 0 for none.
+    size_t          budget;     ///< Bytes that may be queued across all clients, 0 for no limit.
+    size_t          history;        ///< Messages kept by each room, 0 for none.
+    size_t          historyBytes;   ///< Bytes kept by each room for each protocol version.
+    string          log;            ///< Directory to log messages to, empty for none.
+    size_t          logSegmentBytes;
+    double          messageRate;        ///< Messages per second per client, 0 for no limit.
+    double          byteRate;           ///< Bytes per second per client, 0 for no limit.
+    size_t          strikes;            ///< Throttles in a row before a disconnect, 0 for never.
+    size_t          heartbeat;          ///< Seconds a client may be idle before a ping, 0 for none.
+    size_t          heartbeatTimeout;   ///< Seconds a client has to answer a ping.
+    string          serverId;       ///< Empty for the default.
+    unsigned short  peerPort;       ///< Port to accept peers on, 0 for none.
+    vector< pair< string, string > > peers;    ///< Host and peer port of each peer to link to.
+    unsigned short  adminPort;      ///< Port to serve metrics on, 0 for none.
+    string          capture;        ///< File to capture client traffic to, empty for none.
+    string          trace;          ///< File to write traces to, empty for no tracing.
+    Connection::OutboundLimits limits;
+
+    Options( void )
+        : port( Server::CHAT_PORT ),
+          threads( max< unsigned >( boost::thread::hardware_concurrency(), 1 ) ),
+          stats( 0 ),
+          budget( 0 ),
+          history( 100 ),
+          historyBytes( 64 * 1024 ),
+          logSegmentBytes( 16 * 1024 * 1024 ),
+          messageRate( 0 ),
+          byteRate( 0 ),
+          strikes( 0 ),
+          heartbeat( 0 ),
+          heartbeatTimeout( 10 ),
+          peerPort( 0 ),
+          adminPort( 0 ){}
+}; // end struct Options
+
+bool parsePolicy( const string& name, Connection::OverflowPolicy& policy ){
+    if( name == "drop-oldest" ){
+        policy = Connection::DROP_OLDEST;
+    }
+    else if( name == "drop-newest" ){
+        policy = Connection::DROP_NEWEST;
+    }
+    else if( name == "disconnect" ){
+        policy = Connection::DISCONNECT;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+Options checkArgs( const int argc, char* argv[] ){
+    Options options;
+    for( int i = 1; i < argc; ++i ){
+        const string arg = argv[ i ];
+        if( arg == "--port" && i + 1 < argc ){
+            options.port = (unsigned short)atoi( argv[ ++i ] );
+        }
+        else if( arg == "--threads" && i + 1 < argc ){
+            options.threads = strtoul( argv[ ++i ], NULL, 10 );
+        }
+        else if( arg == "--stats" && i + 1 < argc ){
+            options.stats = strtoul( argv[ ++i ], NULL, 10 );
+        }
+        else if( arg == "--max-queue-bytes" && i + 1 < argc ){
+            options.limits.maxBytes = strtoul( argv[ ++i ], NULL, 10 );
+        }
+        else if( arg == "--max-queue-messages" && i + 1 < argc ){
+            options.limits.maxMessages = strtoul( argv[ ++i ], NULL, 10 );
+        }
+        else if( arg == "--memory-budget" && i + 1 < argc ){
+            options.budget = strtoul( argv[ ++i ], NULL, 10 );
+        }
+        else if( arg == "--history" && i + 1 < argc ){
+            options.history = strtoul( argv[ ++i ], NULL, 10 );
+        }
+        else if( arg == "--history-bytes" && i + 1 < argc ){
+            options.historyBytes = strtoul( argv[ ++i ], NULL, 10 );
+        }
+        else if( arg == "--log" && i + 1 < argc ){
+            options.log = argv[ ++i ];
+        }
+        else if( arg == "--log-segment-bytes" && i + 1 < argc ){
+            options.logSegmentBytes = strtoul( argv[ ++i ], NULL, 10 );
+        }
+        else if( arg == "--max-messages-per-second" && i + 1 < argc ){
+            options.messageRate = strtod( argv[ ++i ], NULL );
+        }
+        else if( arg == "--max-bytes-per-second" && i + 1 < argc ){
+            options.byteRate = strtod( argv[ ++i ], NULL );
+        }
+        else if( arg == "--max-strikes" && i + 1 < argc ){
+            options.strikes = strtoul( argv[ ++i ], NULL, 10 );
+        }
+        else if( arg == "--heartbeat" && i + 1 < argc ){
+            options.heartbeat = strtoul( argv[ ++i ], NULL, 10 );
+        }
+        else if( arg == "--heartbeat-timeout" && i + 1 < argc ){
+            options.heartbeatTimeout = strtoul( argv[ ++i ], NULL, 10 );
+        }
+        else if( arg == "--server-id" && i + 1 < argc ){
+            options.serverId = argv[ ++i ];
+        }
+        else if( arg == "--peer-port" && i + 1 < argc ){
+            options.peerPort = (unsigned short)atoi( argv[ ++i ] );
+        }
+        else if( arg == "--peer" && i + 1 < argc ){
+            const string peer = argv[ ++i ];
+            const size_t colon = peer.rfind( ':' );
+            if( colon == string::npos ){
+                options.port = 0;
+                break;
+            }
+            options.peers.push_back(
+                make_pair( peer.substr( 0, colon ), peer.substr( colon + 1 ) )
+            );
+        }
+        else if( arg == "--capture" && i + 1 < argc ){
+            options.capture = argv[ ++i ];
+        }
+        else if( arg == "--trace" && i + 1 < argc ){
+            options.trace = argv[ ++i ];
+        }
+        else if( arg == "--admin-port" && i + 1 < argc ){
+            options.adminPort = (unsigned short)atoi( argv[ ++i ] );
+        }
+        else if( arg == "--overflow" && i + 1 < argc ){
+            if( !parsePolicy( argv[ ++i ], options.limits.policy ) ){
+                options.port = 0;
+                break;
+            }
+        }
+        else {
+            options.port = 0;
+            break;
+        }
+    }
+
+    if( options.port == 0 ){
+        cerr
+            << "Usage: " << argv[ 0 ] << " [--port <port>] [--threads <count>]"
+            << " [--stats <seconds>]" << endl
+            << "       [--max-queue-bytes <bytes>] [--max-queue-messages <count>]"
+            << " [--memory-budget <bytes>]" << endl
+            << "       [--overflow drop-oldest|drop-newest|disconnect]"
+            << " [--history <messages>] [--history-bytes <bytes>]" << endl
+            << "       [--log <directory>] [--log-segment-bytes <bytes>]" << endl
+            << "       [--max-messages-per-second <n>] [--max-bytes-per-second <bytes>]"
+            << " [--max-strikes <n>]" << endl
+            << "       [--heartbeat <seconds>] [--heartbeat-timeout <seconds>]" << endl
+            << "       [--server-id <id>] [--peer-port <port>] [--peer <host>:<peer port>]..."
+            << endl
+            << "       [--admin-port <port>] [--capture <file>] [--trace <file>]" << endl;
+        exit( BAD_ARGUMENTS );
+    }
+    return options;
 }
 
+// The allocation test builds the server into itself, and has a main of its own.
+#ifndef TUTORIAL5_NO_MAIN
+int main( int argc, char* argv[] ){
+    const Options& options = checkArgs( argc, argv );
+    Connection::setOutboundBudget( options.budget );
+    Server server( options.port, options.threads, options.stats );
+    server.setOutboundLimits( options.limits );
+    server.setHistoryLimits( options.history, options.historyBytes );
+    server.setHeartbeat( options.heartbeat, options.heartbeatTimeout );
+    server.setRateLimits( options.messageRate, options.byteRate, options.strikes );
+    if( !options.log.empty() ){
+        try {
+            server.openLog( options.log, options.logSegmentBytes );
+        }
+        catch( const std::exception& e ){
+            cerr << "Unable to open the log: " << e.what() << endl;
+            exit( LOG_FAILURE );
+        }
+    }
+    if( !options.serverId.empty() ){
+        server.setServerId( options.serverId );
+    }
+    if( options.peerPort ){
+        try {
+            server.listenForPeers( options.peerPort );
+        }
+        catch( const std::exception& e ){
+            cerr << "Unable to listen for peers: " << e.what() << endl;
+            exit( PEER_FAILURE );
+        }
+    }
+    for( size_t i = 0; i < options.peers.size(); ++i ){
+        server.addPeer( options.peers[ i ].first, options.peers[ i ].second );
+    }
+    if( !options.capture.empty() ){
+        try {
+            server.captureTo( options.capture );
+        }
+        catch( const std::exception& e ){
+            cerr << "Unable to start the capture: " << e.what() << endl;
+            exit( CAPTURE_FAILURE );
+        }
+    }
+    if( !options.trace.empty() ){
+        server.traceTo( options.trace );
+    }
+    if( options.adminPort ){
+        try {
+            server.listenForAdmin( options.adminPort );
+        }
+        catch( const std::exception& e ){
+            cerr << "Unable to listen for admin requests: " << e.what() << endl;
+            exit( ADMIN_FAILURE );
+        }
+    }
+    server.start();
+    return SUCCESS;
+}
+#endif // TUTORIAL5_NO_MAIN
@@ -0,0 +1,422 @@
+///
+/// @file
+/// The client side of the chat protocol. Messages are sent to the server as a 4 character command
+/// and a length prefixed payload, and the server replies with newline terminated lines of text.
+/// Both sides can instead switch to the binary version 2 protocol described in `protocol.h`.
+///
+
+#ifndef TUTORIAL5_SERVER_CONNECTION_H
+#define TUTORIAL5_SERVER_CONNECTION_H
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/smart_ptr.hpp>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "connection.h"
+#include "mpsc_queue.h"
+#include "protocol.h"
+
+using namespace std;
+using boost::asio::ip::tcp;
+
+class CharLimit {
+private:
+    const char m_limitChar;
+
+public:
+    CharLimit( const char c ) : m_limitChar( c ){}
+
+    template< typename Iterator >
+    pair< Iterator, bool > operator()( Iterator begin, Iterator end ) const {
+        Iterator mvr = begin;
+        for( ; mvr != end; ++mvr ){
+            if( *mvr == m_limitChar ){
+                return make_pair( ++mvr, true );
+            }
+        }
+        return make_pair( mvr, false );
+    }
+}; // end class CharLimit
+
+/// Matches one whole version 2 frame. Only the opcode and length are looked at, the payload is
+/// skipped over rather than scanned.
+class FrameLimit {
+public:
+    template< typename Iterator >
+    pair< Iterator, bool > operator()( Iterator begin, Iterator end ) const {
+        Iterator mvr = begin;
+        if( mvr == end ){
+            return make_pair( end, false );
+        }
+
+        ++mvr;
+        size_t size = 0;
+        for( size_t i = 0; i < Protocol::MAX_VARINT_SIZE; ++i ){
+            if( mvr == end ){
+                return make_pair( begin, false );
+            }
+            const unsigned char byte = (unsigned char)*mvr++;
+            size |= (size_t)(byte & 0x7f) << (7 * i);
+            if( !(byte & 0x80) ){
+                if( (size_t)(end - mvr) < size ){
+                    return make_pair( begin, false );
+                }
+                return make_pair( mvr + size, true );
+            }
+        }
+
+        // An overlong length. Stop here and let the frame fail to parse.
+        return make_pair( mvr, true );
+    }
+}; // end class FrameLimit
+
+namespace boost {
+    namespace asio {
+        template<> struct is_match_condition< CharLimit > : boost::true_type {};
+        template<> struct is_match_condition< FrameLimit > : boost::true_type {};
+    }
+}
+
+// ************************************************************************** //
+
+class ServerConnection : public boost::enable_shared_from_this< ServerConnection > {
+public:
+    typedef boost::shared_ptr< ServerConnection >   Pointer;
+    typedef boost::system::error_code               error_code;
+
+    typedef boost::function< void( const error_code&, const string& ) > MessageHandler;
+
+    /// Function prototype for negotiation handlers, given the protocol version agreed on.
+    typedef boost::function< void( const int ) > VersionHandler;
+
+    /// Function prototype for close handlers.
+    typedef boost::function< void( void ) > CloseHandler;
+
+    struct placeholders {
+        static boost::arg< 1 > error;
+        static boost::arg< 2 > message;
+        static boost::arg< 1 > version;
+    };
+
+private:
+    typedef pair< string, string >  OutgoingMessage;    ///< A command and its data.
+    typedef vector< OutgoingMessage > message_list;
+
+    Connection::Pointer m_connection;
+    int m_protocol;
+    boost::atomic< size_t > m_bytesReceived;
+
+    string m_payload;   ///< Payload of the version 2 frame being parsed.
+
+    // Negotiation. Messages sent meanwhile wait until the protocol is settled.
+    bool m_negotiating;
+    boost::asio::steady_timer m_negotiateTimer;
+    VersionHandler m_versionHandler;
+    message_list m_pending;
+
+    // Messages from `sendMessage`, which may be on any thread, wait here for `_drain` to batch them.
+    MpscQueue< OutgoingMessage > m_outbox;
+    message_list m_drained;
+
+    CloseHandler m_closeHandler;    ///< Set by `close` while negotiating, which holds it up.
+
+    void _messageHandler( const error_code& error, istream& stream, MessageHandler handler ){
+        string data;
+        getline( stream, data );
+        m_bytesReceived += data.size() + 1;
+
+        // The server's answer to a version request is not a chat message. The server holds chat
+        // back until it has answered, so nothing that could be mistaken for it arrives first.
+        if( !error && m_negotiating && data.compare( 0, 9, "protocol " ) == 0 ){
+            _negotiated( atoi( data.c_str() + 9 ) );
+            readMessage( handler );
+            return;
+        }
+
+        // Nor is a heartbeat. Chat messages always have a name and a colon, so can't look like one.
+        if( !error && data == "ping" ){
+            _pong();
+            readMessage( handler );
+            return;
+        }
+        handler( error, data );
+    }
+
+    void _v2MessageHandler( const error_code& error, istream& stream, MessageHandler handler ){
+        if( error ){
+            handler( error, "" );
+            return;
+        }
+
+        // The frame is all in the buffer already.
+        char header[ 1 + Protocol::MAX_VARINT_SIZE ];
+        size_t headerSize = 0;
+        size_t size = 0;
+        header[ headerSize++ ] = (char)stream.get();
+        do {
+            header[ headerSize++ ] = (char)stream.get();
+            const char* data = header + 1;
+            if( Protocol::readVarint( data, header + headerSize, size ) ){
+                break;
+            }
+        } while( headerSize < sizeof( header ) && (header[ headerSize - 1 ] & 0x80) );
+        if( headerSize == sizeof( header ) && (header[ headerSize - 1 ] & 0x80) ){
+            handler( boost::asio::error::invalid_argument, "" );
+            return;
+        }
+
+        const unsigned char opcode = (unsigned char)header[ 0 ];
+        m_bytesReceived += headerSize + size;
+        m_payload.resize( size );
+        if( size ){
+            stream.read( &m_payload[ 0 ], size );
+        }
+        if( opcode == Protocol::PING ){
+            _pong();
+        }
+
+        // Render chat messages the same way the server does for version 1 clients, so the handler
+        // can't tell the difference. Nothing else is meant for the handler.
+        const char* data = m_payload.data();
+        const char* end  = data + m_payload.size();
+        size_t roomOffset, roomSize, nameOffset, nameSize;
+        if( opcode != Protocol::MESSAGE ||
+            !Protocol::readString( data, end, roomOffset, roomSize ) ||
+            !Protocol::readString( data, end, nameOffset, nameSize ) )
+        {
+            readMessage( handler );
+            return;
+        }
+
+        string message;
+        if( roomSize ){
+            message = "[" + m_payload.substr( roomOffset, roomSize ) + "] ";
+        }
+        message.append( m_payload, roomOffset + roomSize + nameOffset, nameSize );
+        message.append( ": " );
+        message.append( data, end - data );
+        handler( error, message );
+    }
+
+    /// Answer the server's heartbeat, so it knows we are still here.
+    void _pong( void ){
+        sendMessage( Protocol::command( Protocol::PONG ), "" );
+    }
+
+    /// Runs on the strand, once for however many messages were sent since it was posted.
+    void _drain( void ){
+        m_drained.clear();
+        m_outbox.popAll( m_drained );
+        if( m_negotiating ){
+            m_pending.insert( m_pending.end(), m_drained.begin(), m_drained.end() );
+        }
+        else {
+            _sendMessages( m_drained );
+        }
+    }
+
+    /// Encode the messages back to back and send them with a single write.
+    void _sendMessages( const message_list& messages ){
+        if( messages.empty() ){
+            return;
+        }
+
+        string batch;
+        for( message_list::const_iterator it = messages.begin(); it != messages.end(); ++it ){
+            batch += encodeMessage( it->first, it->second );
+        }
+        m_connection->write( batch, NULL );
+    }
+
+    /// Runs on the strand. Everything sent before it was posted has been queued by now, so once
+    /// the queue is written the connection can go.
+    void _close( CloseHandler handler ){
+        _drain();
+        if( m_negotiating ){
+            m_closeHandler.swap( handler );
+            return;
+        }
+
+        // Writes complete in order, so an empty one completes after everything before it.
+        m_connection->write(
+            string(),
+            boost::bind( &ServerConnection::_closeHandler, shared_from_this(), handler )
+        );
+    }
+
+    void _closeHandler( CloseHandler handler ){
+        m_connection->close();
+        if( handler ){
+            handler();
+        }
+    }
+
+    void _negotiate( VersionHandler handler, const boost::asio::chrono::milliseconds& timeout ){
+        const string& request = Protocol::encodeV1( Protocol::command( Protocol::VERSION ), "2" );
+        m_connection->write( request, NULL );
+        m_negotiating       = true;
+        m_versionHandler    = handler;
+        m_negotiateTimer.expires_after( timeout );
+        m_negotiateTimer.async_wait(
+            m_connection->getStrand().wrap(
+                boost::bind(
+                    &ServerConnection::_negotiateTimeoutHandler,
+                    shared_from_this(),
+                    boost::asio::placeholders::error
+                )
+            )
+        );
+    }
+
+    void _negotiateTimeoutHandler( const error_code& error ){
+        if( !error && m_negotiating ){
+            _negotiated( 1 );
+        }
+    }
+
+    void _negotiated( const int version ){
+        m_negotiating = false;
+        m_protocol = version == 2 ? 2 : 1;
+        m_negotiateTimer.cancel();
+
+        message_list pending;
+        pending.swap( m_pending );
+        _sendMessages( pending );
+
+        VersionHandler handler;
+        handler.swap( m_versionHandler );
+        if( handler ){
+            handler( m_protocol );
+        }
+
+        if( m_closeHandler ){
+            CloseHandler closeHandler;
+            closeHandler.swap( m_closeHandler );
+            _close( closeHandler );
+        }
+    }
+
+public:
+    ServerConnection( Connection::Pointer& connection )
+        : m_connection( connection ),
+          m_protocol( 1 ),
+          m_bytesReceived( 0 ),
+          m_negotiating( false ),
+          m_negotiateTimer( connection->getSocket().get_executor() ){}
+
+    /// Ask the server to switch to version 2 of the protocol. Anything sent before the server has
+    /// answered is held back and sent in whichever version is agreed on. Servers which don't know
+    /// about version 2 never answer, so after `timeout` version 1 is assumed.
+    ///
+    /// @param handler  Called with the version agreed on.
+    /// @param timeout
+    void negotiate(
+        VersionHandler handler,
+        const boost::asio::chrono::milliseconds& timeout = boost::asio::chrono::milliseconds( 1000 )
+    ){
+        m_connection->getStrand().dispatch(
+            boost::bind( &ServerConnection::_negotiate, shared_from_this(), handler, timeout )
+        );
+    }
+
+    void readMessage( MessageHandler handler ){
+        if( m_protocol == 2 ){
+            m_connection->readUntil(
+                FrameLimit(),
+                boost::bind(
+                    &ServerConnection::_v2MessageHandler,
+                    shared_from_this(),
+                    Connection::placeholders::error,
+                    Connection::placeholders::data,
+                    handler
+                )
+            );
+            return;
+        }
+
+        m_connection->readUntil(
+            CharLimit( '\n' ),
+            boost::bind(
+                &ServerConnection::_messageHandler,
+                shared_from_this(),
+                Connection::placeholders::error,
+                Connection::placeholders::data,
+                handler
+            )
+        );
+    }
+
+    /// Build the wire form of a message in the protocol version currently in use.
+    ///
+    /// In version 1 this is the command followed by the size of the data, in network byte order,
+    /// and then the data itself. Version 2 uses the command's opcode and a varint size instead.
+    ///
+    /// @param command
+    /// @param data
+    ///
+    /// @return The encoded message.
+    string encodeMessage( const string& command, const string& data ) const {
+        if( m_protocol == 1 ){
+            return Protocol::encodeV1( command, data );
+        }
+
+        const unsigned char opcode = Protocol::opcode( command );
+        if( opcode == Protocol::TALK ){
+            const size_t split = data.find( ' ' );
+            const string room  = data.substr( 0, split );
+            return Protocol::encodeV2(
+                opcode,
+                Protocol::encodeTalk( room, split == string::npos ? "" : data.substr( split + 1 ) )
+            );
+        }
+        return Protocol::encodeV2( opcode, data );
+    }
+
+    /// Send a message to the server. Safe to call from any thread.
+    ///
+    /// Messages are queued without locking and a single handler is posted to the strand to send
+    /// them, so a burst of messages from another thread goes out in one write rather than one each.
+    ///
+    /// @param command
+    /// @param data
+    void sendMessage( const string& command, const string& data ){
+        if( m_outbox.push( make_pair( command, data ) ) ){
+            m_connection->getStrand().post(
+                boost::bind( &ServerConnection::_drain, shared_from_this() )
+            );
+        }
+    }
+
+    /// Close the connection once everything sent so far has been written. Safe to call from any
+    /// thread.
+    ///
+    /// @param handler  Called once the last write has finished and the connection is closed.
+    void close( CloseHandler handler ){
+        m_connection->getStrand().post(
+            boost::bind( &ServerConnection::_close, shared_from_this(), handler )
+        );
+    }
+
+    /// The protocol version in use. Only settled once negotiation has finished.
+    int getProtocol( void ) const {
+        return m_protocol;
+    }
+
+    /// Bytes of messages received from the server, framing included.
+    size_t getBytesReceived( void ) const {
+        return m_bytesReceived;
+    }
+
+    Connection::Pointer& getConnection( void ){
+        return m_connection;
+    }
+
+}; // end class ServerConnection
+
+#endif // TUTORIAL5_SERVER_CONNECTION_H
@@ -0,0 +1,135 @@
+///
+/// @file
+/// A slot map: a table of values addressed by small handles, with constant time insertion, lookup,
+/// and removal.
+///
+
+#ifndef TUTORIAL5_SLOT_MAP_H
+#define TUTORIAL5_SLOT_MAP_H
+
+#include <cstddef>
+#include <vector>
+
+using namespace std;
+
+/// Stores values in a vector of slots and hands out handles to them.
+///
+/// A handle is the index of its slot plus the generation the slot was in when the value was added.
+/// Removing a value bumps the slot's generation and puts the slot on a free list, so the slot is
+/// reused by the next insertion while old handles to it simply stop resolving. Nothing ever moves,
+/// so unlike erasing from a list or vector nothing needs to be searched for or shuffled down.
+///
+/// The map does no locking of its own.
+///
+/// @tparam T
+template< typename T >
+class SlotMap {
+public:
+    /// Identifies one value in the map.
+    struct Handle {
+        size_t index;
+        size_t generation;
+
+        Handle( void ) : index( (size_t)-1 ), generation( 0 ){}
+        Handle( const size_t index_, const size_t generation_ )
+            : index( index_ ), generation( generation_ ){}
+
+        bool operator==( const Handle& other ) const {
+            return index == other.index && generation == other.generation;
+        }
+    }; // end struct Handle
+
+private:
+    struct Slot {
+        T       value;
+        size_t  generation;
+        bool    used;
+
+        Slot( void ) : generation( 0 ), used( false ){}
+    }; // end struct Slot
+
+    vector< Slot >      m_slots;
+    vector< size_t >    m_freeSlots;    ///< Indices of unused slots, most recently freed last.
+    size_t              m_size;
+
+public:
+    SlotMap( void ) : m_size( 0 ){}
+
+    /// Add a value to the map.
+    ///
+    /// @param value
+    ///
+    /// @return The value's handle.
+    Handle insert( const T& value ){
+        size_t index;
+        if( m_freeSlots.empty() ){
+            index = m_slots.size();
+            m_slots.push_back( Slot() );
+        }
+        else {
+            index = m_freeSlots.back();
+            m_freeSlots.pop_back();
+        }
+
+        Slot& slot  = m_slots[ index ];
+        slot.value  = value;
+        slot.used   = true;
+        ++m_size;
+        return Handle( index, slot.generation );
+    }
+
+    /// Remove a value from the map.
+    ///
+    /// @param handle
+    ///
+    /// @return True if the handle referred to a value, false if it was stale.
+    bool erase( const Handle& handle ){
+        if( !contains( handle ) ){
+            return false;
+        }
+
+        Slot& slot = m_slots[ handle.index ];
+        slot.value = T();
+        slot.used  = false;
+        ++slot.generation;
+        m_freeSlots.push_back( handle.index );
+        --m_size;
+        return true;
+    }
+
+    bool contains( const Handle& handle ) const {
+        return handle.index < m_slots.size()
+            && m_slots[ handle.index ].used
+            && m_slots[ handle.index ].generation == handle.generation;
+    }
+
+    /// Look up a value.
+    ///
+    /// @param handle
+    ///
+    /// @return A pointer to the value, or null if the handle is stale.
+    T* get( const Handle& handle ){
+        return contains( handle ) ? &m_slots[ handle.index ].value : NULL;
+    }
+
+    /// Call a function with every value in the map, in slot order.
+    ///
+    /// @tparam Visitor Callable with a `const T&`.
+    ///
+    /// @param visit
+    template< typename Visitor >
+    void forEach( Visitor visit ) const {
+        typedef typename vector< Slot >::const_iterator iterator;
+        for( iterator it = m_slots.begin(); it != m_slots.end(); ++it ){
+            if( it->used ){
+                visit( it->value );
+            }
+        }
+    }
+
+    size_t size( void ) const {
+        return m_size;
+    }
+}; // end class SlotMap
+
+#endif // TUTORIAL5_SLOT_MAP_H
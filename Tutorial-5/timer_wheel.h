@@ -0,0 +1,187 @@
+///
+/// @file
+/// A hierarchical timing wheel, for keeping very many coarse timeouts on a single asio timer.
+///
+
+#ifndef TUTORIAL5_TIMER_WHEEL_H
+#define TUTORIAL5_TIMER_WHEEL_H
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+#include <cstddef>
+#include <vector>
+
+using namespace std;
+
+/// Runs callbacks after a delay, measured in ticks of a fixed length.
+///
+/// An asio timer per timeout costs an entry in the `io_service`'s timer heap, so every timeout set,
+/// moved or cancelled is a logarithmic heap operation under the service's lock. The wheel instead
+/// drives all of its timeouts off one timer which fires once a tick. Timeouts sit in rings of
+/// slots, one ring per level, with each slot of a level covering a whole turn of the level below.
+/// Scheduling drops a timeout into the slot for its expiry on the lowest level which reaches that
+/// far, and each tick runs everything in the current slot of the lowest level. Whenever a level
+/// wraps around, the next slot up is emptied into the levels below, so a timeout is handled at
+/// most once per level whatever the number of timeouts.
+///
+/// Timeouts are only as precise as the tick, which suits things like idle timeouts that fire long
+/// after they were set and are usually put off again before they do. Safe to use from any thread.
+/// Callbacks are run on the timer's handler, outside the wheel's lock, so they may schedule again.
+class TimerWheel : private boost::noncopyable {
+public:
+    typedef boost::function< void( void ) >         Callback;
+    typedef boost::asio::steady_timer::clock_type   Clock;
+    typedef Clock::duration                         Duration;
+    typedef unsigned long long                      Tick;
+
+    static const size_t SLOT_BITS   = 6;
+    static const size_t SLOTS       = 1 << SLOT_BITS;   ///< Slots on each level.
+    static const size_t LEVELS      = 4;                ///< Enough for 16.7 million ticks.
+
+private:
+    struct Entry {
+        Tick        expiry;
+        Callback    callback;
+
+        Entry( const Tick expiry_, const Callback& callback_ )
+            : expiry( expiry_ ), callback( callback_ ){}
+    }; // end struct Entry
+
+    typedef vector< Entry > Slot;
+
+    boost::asio::steady_timer   m_timer;
+    const Duration              m_tick;
+    Clock::time_point           m_start;
+    boost::atomic< Tick >       m_now;      ///< Ticks handled so far.
+    Slot                        m_slots[ LEVELS ][ SLOTS ];
+    size_t                      m_size;     ///< Timeouts waiting.
+    boost::mutex                m_mutex;
+    Slot                        m_due;      ///< Only touched by the tick handler.
+
+    /// @return The number of ticks covered by a whole turn of the lowest `levels` levels.
+    static Tick _span( const size_t levels ){
+        return (Tick)1 << (SLOT_BITS * levels);
+    }
+
+    /// Put an entry in the slot for its expiry, on the lowest level which reaches that far. Must be
+    /// called with the lock held.
+    void _insert( const Entry& entry ){
+        const Tick now = m_now;
+        const Tick delta = entry.expiry > now ? entry.expiry - now : 0;
+        size_t level = 0;
+        while( level + 1 < LEVELS && delta >= _span( level + 1 ) ){
+            ++level;
+        }
+        m_slots[ level ][ (entry.expiry >> (SLOT_BITS * level)) & (SLOTS - 1) ].push_back( entry );
+    }
+
+    /// Advance one tick, moving everything now due into `m_due`. Must be called with the lock held.
+    void _advance( void ){
+        const Tick now = ++m_now;
+
+        // Each level that has just wrapped around empties the next slot of the level above into
+        // the levels below, highest first so an entry can fall more than one level in one go.
+        size_t wrapped = 0;
+        while( wrapped + 1 < LEVELS && now % _span( wrapped + 1 ) == 0 ){
+            ++wrapped;
+        }
+        for( size_t level = wrapped; level > 0; --level ){
+            Slot entries;
+            entries.swap( m_slots[ level ][ (now >> (SLOT_BITS * level)) & (SLOTS - 1) ] );
+            for( Slot::const_iterator it = entries.begin(); it != entries.end(); ++it ){
+                _insert( *it );
+            }
+        }
+
+        Slot& slot = m_slots[ 0 ][ now & (SLOTS - 1) ];
+        m_size -= slot.size();
+        m_due.insert( m_due.end(), slot.begin(), slot.end() );
+        slot.clear();
+    }
+
+    void _schedule( void ){
+        m_timer.expires_at( m_start + m_tick * (m_now + 1) );
+        m_timer.async_wait(
+            boost::bind( &TimerWheel::_tickHandler, this, boost::asio::placeholders::error )
+        );
+    }
+
+    void _tickHandler( const boost::system::error_code& error ){
+        if( error ){
+            return;
+        }
+
+        // Catch up on every tick that has passed, in case this handler ran late.
+        const Tick target = (Clock::now() - m_start) / m_tick;
+        {
+            boost::mutex::scoped_lock lock( m_mutex );
+            while( m_now < target ){
+                _advance();
+            }
+        }
+
+        for( Slot::iterator it = m_due.begin(); it != m_due.end(); ++it ){
+            it->callback();
+        }
+        m_due.clear();
+        _schedule();
+    }
+
+public:
+    /// Constructor.
+    ///
+    /// @param io_service   Where the tick handler, and so every callback, runs.
+    /// @param tick         Length of a tick.
+    TimerWheel( boost::asio::io_service& io_service, const Duration& tick )
+        : m_timer( io_service ),
+          m_tick( tick ),
+          m_start( Clock::now() ),
+          m_now( 0 ),
+          m_size( 0 ){}
+
+    /// Start ticking. Time starts from when the wheel was made, so nothing scheduled beforehand is
+    /// put off.
+    void start( void ){
+        _schedule();
+    }
+
+    /// Stop ticking. Nothing else is run, but timeouts are kept in case it is started again.
+    void stop( void ){
+        m_timer.cancel();
+    }
+
+    /// Run a callback after `delay` ticks, or one tick if that is sooner.
+    ///
+    /// @param delay
+    /// @param callback
+    void schedule( const Tick delay, const Callback& callback ){
+        // Delays longer than the whole wheel are cut down to fit it.
+        const Tick limit = _span( LEVELS ) - 1;
+        boost::mutex::scoped_lock lock( m_mutex );
+        _insert( Entry( m_now + (delay < 1 ? 1 : delay > limit ? limit : delay), callback ) );
+        ++m_size;
+    }
+
+    /// @return The number of ticks in `duration`, rounded up.
+    Tick ticks( const Duration& duration ) const {
+        return (duration + m_tick - Duration( 1 )) / m_tick;
+    }
+
+    /// Ticks handled so far. Cheap enough to read on every message.
+    Tick now( void ) const {
+        return m_now;
+    }
+
+    /// @return The number of callbacks waiting to run.
+    size_t size( void ){
+        boost::mutex::scoped_lock lock( m_mutex );
+        return m_size;
+    }
+}; // end class TimerWheel
+
+#endif // TUTORIAL5_TIMER_WHEEL_H
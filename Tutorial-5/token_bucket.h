@@ -0,0 +1,79 @@
+///
+/// @file
+/// A token bucket, for limiting how fast something may happen on average while still allowing short
+/// bursts.
+///
+
+#ifndef TUTORIAL5_TOKEN_BUCKET_H
+#define TUTORIAL5_TOKEN_BUCKET_H
+
+#include <boost/asio/steady_timer.hpp>
+#include <algorithm>
+
+using namespace std;
+
+/// Tokens drip into the bucket at a fixed rate until it is full, and each use takes some out.
+///
+/// Taking never fails. A use bigger than what is in the bucket puts it into debt, and `wait` says
+/// how long it will be until the debt is paid off. That way something which has already happened,
+/// like a message which has already been read, can still be charged for, and a single use bigger
+/// than the whole bucket is slowed down rather than refused forever.
+///
+/// The bucket does no locking of its own.
+class TokenBucket {
+public:
+    typedef boost::asio::steady_timer::clock_type   Clock;
+    typedef Clock::duration                         Duration;
+
+private:
+    double              m_rate;     ///< Tokens added per second, 0 for no limit.
+    double              m_size;     ///< Most tokens the bucket holds.
+    double              m_tokens;   ///< Negative when in debt.
+    Clock::time_point   m_updated;  ///< When `m_tokens` was last brought up to date.
+
+    void _refill( const Clock::time_point& now ){
+        const double seconds = boost::asio::chrono::duration_cast<
+            boost::asio::chrono::duration< double >
+        >( now - m_updated ).count();
+        m_tokens = min( m_size, m_tokens + seconds * m_rate );
+        m_updated = now;
+    }
+
+public:
+    /// Constructor. The bucket starts out full.
+    ///
+    /// @param rate     Tokens added per second, 0 for no limit.
+    /// @param size     Most tokens the bucket holds, which is the biggest burst allowed.
+    TokenBucket( const double rate = 0, const double size = 0 )
+        : m_rate( rate ),
+          m_size( size ),
+          m_tokens( size ),
+          m_updated( Clock::now() ){}
+
+    bool enabled( void ) const {
+        return m_rate > 0;
+    }
+
+    /// Take tokens out of the bucket, going into debt if there aren't enough.
+    ///
+    /// @param tokens
+    /// @param now
+    void take( const double tokens, const Clock::time_point& now = Clock::now() ){
+        if( enabled() ){
+            _refill( now );
+            m_tokens -= tokens;
+        }
+    }
+
+    /// @return How long until the bucket is out of debt, zero if it isn't in debt.
+    Duration wait( void ) const {
+        if( m_tokens >= 0 ){
+            return Duration::zero();
+        }
+        return boost::asio::chrono::duration_cast< Duration >(
+            boost::asio::chrono::duration< double >( -m_tokens / m_rate )
+        );
+    }
+}; // end class TokenBucket
+
+#endif // TUTORIAL5_TOKEN_BUCKET_H